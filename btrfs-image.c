@@ -26,7 +26,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/uio.h>
 #include <zlib.h>
+#ifdef BTRFS_IMAGE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
 #include "kerncompat.h"
 #include "crc32c.h"
 #include "ctree.h"
@@ -38,11 +46,18 @@
 
 #define HEADER_MAGIC		0xbd5c25e27295668bULL
 #define MAX_PENDING_SIZE	(256 * 1024)
+#define RESTORE_BATCH		16
+#define RESTORE_DEV_QUEUE	(64 * 1024 * 1024)
 #define BLOCK_SIZE		1024
 #define BLOCK_MASK		(BLOCK_SIZE - 1)
 
 #define COMPRESS_NONE		0
 #define COMPRESS_ZLIB		1
+#define COMPRESS_ZSTD		2
+#define COMPRESS_LZ4		3
+
+/* upper bound for a decompressed item, anything bigger is corruption */
+#define MAX_DECOMPRESSED_SIZE	(1024 * 1024 * 1024)
 
 struct meta_cluster_item {
 	__le64 bytenr;
@@ -65,6 +80,58 @@ struct meta_cluster {
 #define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
 			   sizeof(struct meta_cluster_item))
 
+/*
+ * Images end with a run of index blocks mapping every item to its offset
+ * in the file.  Each one is a valid cluster with no items, so restores
+ * that don't know about the index just step over it, and the index lives
+ * in the otherwise unused item area.  The last block of the image is
+ * always the final index block, so the index can be found with one seek.
+ */
+#define INDEX_MAGIC		0x5844494d47414d49ULL
+
+struct meta_index_item {
+	__le64 bytenr;
+	__le64 offset;
+	__le32 size;
+	__le32 len;
+} __attribute__ ((__packed__));
+
+struct meta_index_header {
+	__le64 magic;
+	__le64 first;
+	/* for incremental images, generation of the image we're based on */
+	__le64 base_generation;
+	__le32 nritems;
+	u8 compress;
+	u8 last;
+} __attribute__ ((__packed__));
+
+struct meta_index {
+	struct meta_cluster_header header;
+	struct meta_index_header index;
+	struct meta_index_item items[];
+} __attribute__ ((__packed__));
+
+#define ITEMS_PER_INDEX ((BLOCK_SIZE - sizeof(struct meta_index)) / \
+			 sizeof(struct meta_index_item))
+
+/* in memory copy of an index item */
+struct index_entry {
+	u64 bytenr;
+	u64 offset;
+	u32 size;
+	u32 len;
+};
+
+struct metadump_index {
+	struct index_entry *entries;
+	size_t nr;
+	u64 base_generation;
+	int compress;
+};
+
+#define MAX_BASE_IMAGES		32
+
 struct async_work {
 	struct list_head list;
 	struct list_head ordered;
@@ -72,6 +139,7 @@ struct async_work {
 	u64 size;
 	u8 *buffer;
 	size_t bufsize;
+	int data;
 	int error;
 };
 
@@ -95,6 +163,15 @@ struct metadump_struct {
 	u64 pending_start;
 	u64 pending_size;
 
+	struct index_entry *index;
+	size_t index_nr;
+	size_t index_alloc;
+
+	/* blocks already in the base images of an incremental dump */
+	struct metadump_index base;
+	u64 base_generation;
+
+	int compress_method;
 	int compress_level;
 	int done;
 	int data;
@@ -108,14 +185,57 @@ struct name {
 	u32 len;
 };
 
+/* a chunk of the original fs, with its stripes mapped to restore targets */
+struct restore_chunk {
+	struct cache_extent cache;
+	u64 type;
+	u64 stripe_len;
+	int num_stripes;
+	int sub_stripes;
+	struct {
+		int dev;
+		u64 physical;
+	} stripes[0];
+};
+
+struct restore_write {
+	struct list_head list;
+	u64 physical;
+	size_t len;
+	u8 data[0];
+};
+
+/* one target device of a multi device restore, with its writer thread */
+struct restore_dev {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct list_head list;
+	size_t queued;
+	int done;
+	int error;
+	int fd;
+	const char *name;
+	struct btrfs_dev_item dev_item;
+};
+
+struct restore_devs {
+	struct cache_tree chunks;
+	struct restore_dev *devs;
+	int nr_devs;
+};
+
 struct mdrestore_struct {
 	FILE *in;
 	FILE *out;
+	struct restore_devs *devs;
 
 	pthread_t *threads;
 	size_t num_threads;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	/* signalled when the workers have drained the list */
+	pthread_cond_t idle;
 
 	struct list_head list;
 	size_t num_items;
@@ -131,6 +251,8 @@ struct mdrestore_struct {
 };
 
 static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size);
+static int load_base_images(struct metadump_struct *md, char **bases,
+			    int nr_bases);
 
 static void csum_block(u8 *buf, size_t len)
 {
@@ -189,6 +311,8 @@ static void tree_insert(struct rb_root *root, struct name *ins)
 
 		len = min(ins->len, entry->len);
 		dir = memcmp(ins->val, entry->val, len);
+		if (!dir)
+			dir = ins->len - entry->len;
 
 		if (dir < 0)
 			p = &(*p)->rb_left;
@@ -215,6 +339,8 @@ static struct name *name_search(struct rb_root *root, char *name, u32 name_len)
 		len = min(entry->len, name_len);
 
 		dir = memcmp(name, entry->val, len);
+		if (!dir)
+			dir = name_len - entry->len;
 		if (dir < 0)
 			n = n->rb_left;
 		else if (dir > 0)
@@ -226,15 +352,122 @@ static struct name *name_search(struct rb_root *root, char *name, u32 name_len)
 	return NULL;
 }
 
+/*
+ * crc32c is affine over GF(2): for a fixed length and seed,
+ * crc(seed, a ^ b) == crc(seed, a) ^ crc(0, b).  So instead of searching
+ * for a collision we pick a random printable name and solve for the bits
+ * to flip to give it the crc we want.
+ *
+ * Only the low 5 bits of the last COLLISION_BYTES bytes are flipped, with
+ * the top 3 bits picked from 0x20, 0x40 and 0x60, so every byte stays
+ * printable except for '/' and DEL, which get another try.  Names of 4
+ * bytes or less can't collide since crc32c is a bijection on them.
+ */
+#define COLLISION_BYTES		12
+#define COLLISION_BITS		(COLLISION_BYTES * 5)
+#define COLLISION_TRIES		4096
+
+struct collision_basis {
+	u32 vec[32];
+	u64 mask[32];
+};
+
+static void collision_basis_init(struct collision_basis *basis, u32 name_len)
+{
+	u32 nr_bytes = min_t(u32, name_len, COLLISION_BYTES);
+	u32 col[5];
+	u8 zero = 0;
+	u8 byte;
+	u32 v;
+	u64 m;
+	int bit;
+	int i;
+	int b;
+
+	memset(basis, 0, sizeof(*basis));
+	for (b = 0; b < 5; b++) {
+		byte = 1 << b;
+		col[b] = crc32c(0, &byte, 1);
+	}
+
+	/* walk back from the last byte, each step is one more zero after it */
+	for (i = 0; i < nr_bytes; i++) {
+		for (b = 0; b < 5; b++) {
+			v = col[b];
+			m = 1ULL << (i * 5 + b);
+			for (bit = 31; bit >= 0 && v; bit--) {
+				if (!(v & (1U << bit)))
+					continue;
+				if (!basis->vec[bit]) {
+					basis->vec[bit] = v;
+					basis->mask[bit] = m;
+					break;
+				}
+				v ^= basis->vec[bit];
+				m ^= basis->mask[bit];
+			}
+			col[b] = crc32c(col[b], &zero, 1);
+		}
+	}
+}
+
+static int solve_collision(struct collision_basis *basis, char *name,
+			   char *sub, u32 name_len)
+{
+	static const u8 high[3] = { 0x20, 0x40, 0x60 };
+	u32 nr_bytes = min_t(u32, name_len, COLLISION_BYTES);
+	u32 target = crc32c(~1, name, name_len);
+	u32 diff;
+	u64 flip;
+	int tries;
+	int bit;
+	int i;
+
+	if (name_len <= 4)
+		return 0;
+
+	for (tries = 0; tries < COLLISION_TRIES; tries++) {
+		for (i = 0; i < name_len; i++)
+			sub[i] = high[rand() % 3] | (rand() & 0x1f);
+
+		diff = crc32c(~1, sub, name_len) ^ target;
+		flip = 0;
+		for (bit = 31; bit >= 0; bit--) {
+			if (!(diff & (1U << bit)))
+				continue;
+			if (!basis->vec[bit])
+				break;
+			diff ^= basis->vec[bit];
+			flip ^= basis->mask[bit];
+		}
+		if (diff)
+			continue;
+
+		for (i = 0; i < nr_bytes; i++)
+			sub[name_len - 1 - i] ^= (flip >> (i * 5)) & 0x1f;
+		for (i = 0; i < name_len; i++) {
+			if (sub[i] == '/' || sub[i] == 0x7f)
+				break;
+		}
+		if (i < name_len || !memcmp(sub, name, name_len))
+			continue;
+		return 1;
+	}
+	return 0;
+}
+
 static char *find_collision(struct metadump_struct *md, char *name,
 			    u32 name_len)
 {
+	struct collision_basis basis;
 	struct name *val;
-	unsigned long checksum;
-	int found = 0;
+	struct name *dup;
+	int found;
 	int i;
 
+	pthread_mutex_lock(&md->mutex);
 	val = name_search(&md->name_tree, name, name_len);
+	pthread_mutex_unlock(&md->mutex);
 	if (val) {
 		free(name);
 		return val->sub;
@@ -257,37 +490,8 @@ static char *find_collision(struct metadump_struct *md, char *name,
 		return NULL;
 	}
 
-	checksum = crc32c(~1, val->val, name_len);
-	memset(val->sub, ' ', name_len);
-	i = 0;
-	while (1) {
-		if (crc32c(~1, val->sub, name_len) == checksum &&
-		    memcmp(val->sub, val->val, val->len)) {
-			found = 1;
-			break;
-		}
-
-		if (val->sub[i] == 127) {
-			do {
-				i++;
-				if (i > name_len)
-					break;
-			} while (val->sub[i] == 127);
-
-			if (i > name_len)
-				break;
-			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
-			memset(val->sub, ' ', i);
-			i = 0;
-			continue;
-		} else {
-			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
-		}
-	}
+	collision_basis_init(&basis, name_len);
+	found = solve_collision(&basis, val->val, val->sub, name_len);
 
 	if (!found) {
 		fprintf(stderr, "Couldn't find a collision for '%.*s', "
@@ -302,7 +506,18 @@ static char *find_collision(struct metadump_struct *md, char *name,
 		}
 	}
 
+	/* another worker may have sanitized the same name meanwhile */
+	pthread_mutex_lock(&md->mutex);
+	dup = name_search(&md->name_tree, val->val, val->len);
+	if (dup) {
+		pthread_mutex_unlock(&md->mutex);
+		free(val->val);
+		free(val->sub);
+		free(val);
+		return dup->sub;
+	}
 	tree_insert(&md->name_tree, val);
+	pthread_mutex_unlock(&md->mutex);
 	return val->sub;
 }
 
@@ -516,134 +731,460 @@ static void copy_buffer(struct metadump_struct *md, u8 *dst,
 	csum_block(dst, src->len);
 }
 
-static void *dump_worker(void *data)
+static int write_index(struct metadump_struct *md)
 {
-	struct metadump_struct *md = (struct metadump_struct *)data;
-	struct async_work *async;
-	int ret;
-
-	while (1) {
-		pthread_mutex_lock(&md->mutex);
-		while (list_empty(&md->list)) {
-			if (md->done) {
-				pthread_mutex_unlock(&md->mutex);
-				goto out;
-			}
-			pthread_cond_wait(&md->cond, &md->mutex);
-		}
-		async = list_entry(md->list.next, struct async_work, list);
-		list_del_init(&async->list);
-		pthread_mutex_unlock(&md->mutex);
-
-		if (md->compress_level > 0) {
-			u8 *orig = async->buffer;
-
-			async->bufsize = compressBound(async->size);
-			async->buffer = malloc(async->bufsize);
+	struct meta_index *index;
+	struct meta_index_item *item;
+	struct index_entry *entry;
+	u64 first = le64_to_cpu(md->cluster->header.bytenr);
+	u64 bytenr = first;
+	size_t i = 0;
+	u32 nritems;
+	int ret = 0;
 
-			ret = compress2(async->buffer,
-					 (unsigned long *)&async->bufsize,
-					 orig, async->size, md->compress_level);
+	index = calloc(1, BLOCK_SIZE);
+	if (!index)
+		return -ENOMEM;
 
-			if (ret != Z_OK)
-				async->error = 1;
+	do {
+		memset(index, 0, BLOCK_SIZE);
+		index->header.magic = cpu_to_le64(HEADER_MAGIC);
+		index->header.bytenr = cpu_to_le64(bytenr);
+		index->header.compress = md->compress_level > 0 ?
+					 md->compress_method : COMPRESS_NONE;
+		index->index.magic = cpu_to_le64(INDEX_MAGIC);
+		index->index.first = cpu_to_le64(first);
+		index->index.base_generation =
+			cpu_to_le64(md->base_generation);
+		index->index.compress = index->header.compress;
+
+		for (nritems = 0; nritems < ITEMS_PER_INDEX &&
+		     i < md->index_nr; nritems++, i++) {
+			entry = md->index + i;
+			item = index->items + nritems;
+			item->bytenr = cpu_to_le64(entry->bytenr);
+			item->offset = cpu_to_le64(entry->offset);
+			item->size = cpu_to_le32(entry->size);
+			item->len = cpu_to_le32(entry->len);
+		}
+		index->index.nritems = cpu_to_le32(nritems);
+		index->index.last = (i == md->index_nr);
 
-			free(orig);
+		if (fwrite(index, BLOCK_SIZE, 1, md->out) != 1) {
+			fprintf(stderr, "Error writing out index: %d\n", errno);
+			ret = -EIO;
+			break;
 		}
+		bytenr += BLOCK_SIZE;
+	} while (i < md->index_nr);
 
-		pthread_mutex_lock(&md->mutex);
-		md->num_ready++;
-		pthread_mutex_unlock(&md->mutex);
-	}
-out:
-	pthread_exit(NULL);
+	free(index);
+	return ret;
 }
 
-static void meta_cluster_init(struct metadump_struct *md, u64 start)
+static int cmp_index_entry(const void *a, const void *b)
 {
-	struct meta_cluster_header *header;
+	const struct index_entry *ea = a;
+	const struct index_entry *eb = b;
 
-	md->num_items = 0;
-	md->num_ready = 0;
-	header = &md->cluster->header;
-	header->magic = cpu_to_le64(HEADER_MAGIC);
-	header->bytenr = cpu_to_le64(start);
-	header->nritems = cpu_to_le32(0);
-	header->compress = md->compress_level > 0 ?
-			   COMPRESS_ZLIB : COMPRESS_NONE;
+	if (ea->bytenr < eb->bytenr)
+		return -1;
+	if (ea->bytenr > eb->bytenr)
+		return 1;
+	return 0;
 }
 
-static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level,
-			 int sanitize_names)
+static struct index_entry *find_index_entry(struct metadump_index *mi,
+					    u64 bytenr)
 {
-	int i, ret = 0;
-
-	memset(md, 0, sizeof(*md));
-	pthread_cond_init(&md->cond, NULL);
-	pthread_mutex_init(&md->mutex, NULL);
-	INIT_LIST_HEAD(&md->list);
-	INIT_LIST_HEAD(&md->ordered);
-	md->root = root;
-	md->out = out;
-	md->pending_start = (u64)-1;
-	md->compress_level = compress_level;
-	md->cluster = calloc(1, BLOCK_SIZE);
-	md->sanitize_names = sanitize_names;
-	if (sanitize_names > 1)
-		crc32c_optimization_init();
-
-	if (!md->cluster) {
-		pthread_cond_destroy(&md->cond);
-		pthread_mutex_destroy(&md->mutex);
-		return -ENOMEM;
+	struct index_entry *index = mi->entries;
+	size_t lo = 0;
+	size_t hi = mi->nr;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (index[mid].bytenr + index[mid].len <= bytenr)
+			lo = mid + 1;
+		else if (index[mid].bytenr > bytenr)
+			hi = mid;
+		else
+			return index + mid;
 	}
+	return NULL;
+}
 
-	meta_cluster_init(md, 0);
-	if (!num_threads)
+/*
+ * true if the base images already hold this tree block.  A block that
+ * isn't newer than the base can't have been rewritten since, so the copy
+ * in the base is still good.
+ */
+static int in_base_image(struct metadump_struct *md, u64 bytenr, u64 size,
+			 u64 generation)
+{
+	struct index_entry *entry;
+
+	if (!md->base_generation || generation > md->base_generation)
 		return 0;
+	entry = find_index_entry(&md->base, bytenr);
+	return entry && bytenr + size <= entry->bytenr + entry->len;
+}
 
-	md->name_tree.rb_node = NULL;
-	md->num_threads = num_threads;
-	md->threads = calloc(num_threads, sizeof(pthread_t));
-	if (!md->threads) {
-		free(md->cluster);
-		pthread_cond_destroy(&md->cond);
-		pthread_mutex_destroy(&md->mutex);
-		return -ENOMEM;
-	}
+static int read_data_extent(struct metadump_struct *md,
+			    struct async_work *async)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	u64 bytes_left = async->size;
+	u64 logical = async->start;
+	u64 offset = 0;
+	u64 bytenr;
+	u64 read_len;
+	ssize_t done;
+	int fd;
+	int ret;
 
-	for (i = 0; i < num_threads; i++) {
-		ret = pthread_create(md->threads + i, NULL, dump_worker, md);
-		if (ret)
-			break;
-	}
+	while (bytes_left) {
+		read_len = bytes_left;
+		ret = btrfs_map_block(&md->root->fs_info->mapping_tree, READ,
+				      logical, &read_len, &multi, 0, NULL);
+		if (ret) {
+			fprintf(stderr, "Couldn't map data block %d\n", ret);
+			return ret;
+		}
 
-	if (ret) {
-		pthread_mutex_lock(&md->mutex);
-		md->done = 1;
-		pthread_cond_broadcast(&md->cond);
-		pthread_mutex_unlock(&md->mutex);
+		device = multi->stripes[0].dev;
 
-		for (i--; i >= 0; i--)
-			pthread_join(md->threads[i], NULL);
+		if (device->fd == 0) {
+			fprintf(stderr, "Device we need to read from is not "
+				"open\n");
+			free(multi);
+			return -EIO;
+		}
+		fd = device->fd;
+		bytenr = multi->stripes[0].physical;
+		free(multi);
 
-		pthread_cond_destroy(&md->cond);
-		pthread_mutex_destroy(&md->mutex);
-		free(md->cluster);
-		free(md->threads);
+		read_len = min(read_len, bytes_left);
+		done = pread64(fd, async->buffer+offset, read_len, bytenr);
+		if (done < read_len) {
+			if (done < 0)
+				fprintf(stderr, "Error reading extent %d\n",
+					errno);
+			else
+				fprintf(stderr, "Short read\n");
+			return -EIO;
+		}
+
+		bytes_left -= done;
+		offset += done;
+		logical += done;
 	}
 
-	return ret;
+	return 0;
 }
 
-static void metadump_destroy(struct metadump_struct *md)
+/*
+ * read a tree block straight from the devices, trying every mirror.  The
+ * extent buffer cache in fs_info is not thread safe, so the workers read
+ * into private buffers instead of going through read_tree_block()
+ */
+static int read_tree_block_raw(struct metadump_struct *md,
+			       struct extent_buffer *eb)
 {
-	int i;
-	struct rb_node *n;
+	struct btrfs_fs_info *info = md->root->fs_info;
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_multi_bio *multi = NULL;
+	char result[BTRFS_CRC32_SIZE];
+	u64 read_len;
+	u32 crc;
+	ssize_t done;
+	int num_copies;
+	int mirror;
+	int ret;
 
-	pthread_mutex_lock(&md->mutex);
-	md->done = 1;
+	num_copies = btrfs_num_copies(&info->mapping_tree, eb->start, eb->len);
+	for (mirror = 1; mirror <= num_copies; mirror++) {
+		read_len = eb->len;
+		ret = btrfs_map_block(&info->mapping_tree, READ, eb->start,
+				      &read_len, &multi, mirror, NULL);
+		if (ret)
+			continue;
+		if (multi->stripes[0].dev->fd == 0 || read_len < eb->len) {
+			free(multi);
+			continue;
+		}
+		done = pread64(multi->stripes[0].dev->fd, eb->data, eb->len,
+			       multi->stripes[0].physical);
+		free(multi);
+		if (done < eb->len)
+			continue;
+
+		if (btrfs_header_bytenr(eb) != eb->start)
+			continue;
+		fs_devices = info->fs_devices;
+		while (fs_devices) {
+			if (!memcmp_extent_buffer(eb, fs_devices->fsid,
+					(unsigned long)btrfs_header_fsid(eb),
+					BTRFS_FSID_SIZE))
+				break;
+			fs_devices = fs_devices->seed;
+		}
+		if (!fs_devices)
+			continue;
+
+		/* the super block is copied as is, only check its location */
+		if (eb->start == BTRFS_SUPER_INFO_OFFSET)
+			return 0;
+		crc = crc32c(~(u32)0, eb->data + BTRFS_CSUM_SIZE,
+			     eb->len - BTRFS_CSUM_SIZE);
+		btrfs_csum_final(crc, result);
+		if (!memcmp(eb->data, result, BTRFS_CRC32_SIZE))
+			return 0;
+	}
+	return -EIO;
+}
+
+static int compress_async_work(struct metadump_struct *md,
+			       struct async_work *async)
+{
+	u8 *orig = async->buffer;
+	unsigned long zsize;
+	int ret = 0;
+#ifdef BTRFS_IMAGE_ZSTD
+	size_t zret;
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+	int len;
+#endif
+
+	switch (md->compress_method) {
+	case COMPRESS_ZLIB:
+		zsize = compressBound(async->size);
+		async->buffer = malloc(zsize);
+		if (!async->buffer)
+			break;
+		ret = compress2(async->buffer, &zsize, orig, async->size,
+				md->compress_level);
+		ret = ret == Z_OK ? 0 : -EIO;
+		async->bufsize = zsize;
+		break;
+#ifdef BTRFS_IMAGE_ZSTD
+	case COMPRESS_ZSTD:
+		async->bufsize = ZSTD_compressBound(async->size);
+		async->buffer = malloc(async->bufsize);
+		if (!async->buffer)
+			break;
+		zret = ZSTD_compress(async->buffer, async->bufsize, orig,
+				     async->size, md->compress_level);
+		if (ZSTD_isError(zret))
+			ret = -EIO;
+		else
+			async->bufsize = zret;
+		break;
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+	case COMPRESS_LZ4:
+		/* lz4 blocks don't record their size, keep it in front */
+		async->bufsize = sizeof(__le32) + LZ4_compressBound(async->size);
+		async->buffer = malloc(async->bufsize);
+		if (!async->buffer)
+			break;
+		if (md->compress_level > 1)
+			len = LZ4_compress_HC((char *)orig,
+					      (char *)async->buffer + sizeof(__le32),
+					      async->size,
+					      async->bufsize - sizeof(__le32),
+					      md->compress_level);
+		else
+			len = LZ4_compress_default((char *)orig,
+					(char *)async->buffer + sizeof(__le32),
+					async->size,
+					async->bufsize - sizeof(__le32));
+		if (len <= 0) {
+			ret = -EIO;
+			break;
+		}
+		*(__le32 *)async->buffer = cpu_to_le32(async->size);
+		async->bufsize = sizeof(__le32) + len;
+		break;
+#endif
+	default:
+		return -EINVAL;
+	}
+
+	if (!async->buffer) {
+		async->buffer = orig;
+		return -ENOMEM;
+	}
+	free(orig);
+	return ret;
+}
+
+/*
+ * read, sanitize and compress one pending range.  Runs in the workers, or
+ * inline when we don't have any.
+ */
+static int fill_async_work(struct metadump_struct *md,
+			   struct async_work *async)
+{
+	struct extent_buffer *eb;
+	u64 blocksize = md->root->nodesize;
+	u64 start = async->start;
+	u64 size = async->size;
+	size_t offset = 0;
+	u32 len;
+	int ret;
+
+	if (async->data) {
+		ret = read_data_extent(md, async);
+		if (ret)
+			return ret;
+	}
+
+	while (!async->data && size > 0) {
+		len = blocksize;
+		if (start == BTRFS_SUPER_INFO_OFFSET)
+			len = BTRFS_SUPER_INFO_SIZE;
+		eb = alloc_dummy_eb(start, len);
+		if (!eb)
+			return -ENOMEM;
+		ret = read_tree_block_raw(md, eb);
+		if (ret) {
+			fprintf(stderr, "Error reading metadata block %llu\n",
+				(unsigned long long)start);
+			free(eb);
+			return ret;
+		}
+		copy_buffer(md, async->buffer + offset, eb);
+		free(eb);
+		start += len;
+		offset += len;
+		size -= len;
+	}
+
+	if (md->compress_level > 0)
+		return compress_async_work(md, async);
+	return 0;
+}
+
+static void *dump_worker(void *data)
+{
+	struct metadump_struct *md = (struct metadump_struct *)data;
+	struct async_work *async;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&md->mutex);
+		while (list_empty(&md->list)) {
+			if (md->done) {
+				pthread_mutex_unlock(&md->mutex);
+				goto out;
+			}
+			pthread_cond_wait(&md->cond, &md->mutex);
+		}
+		async = list_entry(md->list.next, struct async_work, list);
+		list_del_init(&async->list);
+		pthread_mutex_unlock(&md->mutex);
+
+		ret = fill_async_work(md, async);
+		if (ret)
+			async->error = 1;
+
+		pthread_mutex_lock(&md->mutex);
+		md->num_ready++;
+		pthread_mutex_unlock(&md->mutex);
+	}
+out:
+	pthread_exit(NULL);
+}
+
+static void meta_cluster_init(struct metadump_struct *md, u64 start)
+{
+	struct meta_cluster_header *header;
+
+	md->num_items = 0;
+	md->num_ready = 0;
+	header = &md->cluster->header;
+	header->magic = cpu_to_le64(HEADER_MAGIC);
+	header->bytenr = cpu_to_le64(start);
+	header->nritems = cpu_to_le32(0);
+	header->compress = md->compress_level > 0 ?
+			   md->compress_method : COMPRESS_NONE;
+}
+
+static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
+			 FILE *out, int num_threads, int compress_method,
+			 int compress_level, int sanitize_names)
+{
+	int i, ret = 0;
+
+	memset(md, 0, sizeof(*md));
+	pthread_cond_init(&md->cond, NULL);
+	pthread_mutex_init(&md->mutex, NULL);
+	INIT_LIST_HEAD(&md->list);
+	INIT_LIST_HEAD(&md->ordered);
+	md->root = root;
+	md->out = out;
+	md->pending_start = (u64)-1;
+	md->compress_method = compress_method;
+	md->compress_level = compress_level;
+	md->cluster = calloc(1, BLOCK_SIZE);
+	md->sanitize_names = sanitize_names;
+	if (sanitize_names > 1)
+		crc32c_optimization_init();
+
+	if (!md->cluster) {
+		pthread_cond_destroy(&md->cond);
+		pthread_mutex_destroy(&md->mutex);
+		return -ENOMEM;
+	}
+
+	meta_cluster_init(md, 0);
+	if (!num_threads)
+		return 0;
+
+	md->name_tree.rb_node = NULL;
+	md->num_threads = num_threads;
+	md->threads = calloc(num_threads, sizeof(pthread_t));
+	if (!md->threads) {
+		free(md->cluster);
+		pthread_cond_destroy(&md->cond);
+		pthread_mutex_destroy(&md->mutex);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_create(md->threads + i, NULL, dump_worker, md);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		pthread_mutex_lock(&md->mutex);
+		md->done = 1;
+		pthread_cond_broadcast(&md->cond);
+		pthread_mutex_unlock(&md->mutex);
+
+		for (i--; i >= 0; i--)
+			pthread_join(md->threads[i], NULL);
+
+		pthread_cond_destroy(&md->cond);
+		pthread_mutex_destroy(&md->mutex);
+		free(md->cluster);
+		free(md->threads);
+	}
+
+	return ret;
+}
+
+static void metadump_destroy(struct metadump_struct *md)
+{
+	int i;
+	struct rb_node *n;
+
+	pthread_mutex_lock(&md->mutex);
+	md->done = 1;
 	pthread_cond_broadcast(&md->cond);
 	pthread_mutex_unlock(&md->mutex);
 
@@ -664,6 +1205,8 @@ static void metadump_destroy(struct metadump_struct *md)
 	}
 	free(md->threads);
 	free(md->cluster);
+	free(md->index);
+	free(md->base.entries);
 }
 
 static int write_zero(FILE *out, size_t size)
@@ -677,7 +1220,8 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	struct meta_cluster_header *header = &md->cluster->header;
 	struct meta_cluster_item *item;
 	struct async_work *async;
-	u64 bytenr = 0;
+	struct index_entry *entry;
+	u64 bytenr = le64_to_cpu(header->bytenr);
 	u32 nritems = 0;
 	int ret;
 	int err = 0;
@@ -698,6 +1242,8 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 
 	/* setup and write index block */
 	list_for_each_entry(async, &md->ordered, ordered) {
+		if (async->error)
+			err = -EIO;
 		item = md->cluster->items + nritems;
 		item->bytenr = cpu_to_le64(async->start);
 		item->size = cpu_to_le32(async->bufsize);
@@ -705,6 +1251,11 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	}
 	header->nritems = cpu_to_le32(nritems);
 
+	if (err) {
+		fprintf(stderr, "Error reading or compressing cluster\n");
+		goto free_buffers;
+	}
+
 	ret = fwrite(md->cluster, BLOCK_SIZE, 1, md->out);
 	if (ret != 1) {
 		fprintf(stderr, "Error writing out cluster: %d\n", errno);
@@ -712,21 +1263,42 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	}
 
 	/* write buffers */
-	bytenr += le64_to_cpu(header->bytenr) + BLOCK_SIZE;
+	bytenr += BLOCK_SIZE;
+free_buffers:
 	while (!list_empty(&md->ordered)) {
 		async = list_entry(md->ordered.next, struct async_work,
 				   ordered);
 		list_del_init(&async->ordered);
 
+		if (!err && md->index_nr == md->index_alloc) {
+			size_t nr = max_t(size_t, 1024, md->index_alloc * 2);
+
+			entry = realloc(md->index, nr * sizeof(*entry));
+			if (entry) {
+				md->index = entry;
+				md->index_alloc = nr;
+			} else {
+				fprintf(stderr, "Error growing image index\n");
+				err = -ENOMEM;
+			}
+		}
+		if (!err) {
+			entry = md->index + md->index_nr++;
+			entry->bytenr = async->start;
+			entry->offset = bytenr;
+			entry->size = async->bufsize;
+			entry->len = async->size;
+		}
+
 		bytenr += async->bufsize;
-		if (!err)
+		if (!err) {
 			ret = fwrite(async->buffer, async->bufsize, 1,
 				     md->out);
-		if (ret != 1) {
-			err = -EIO;
-			ret = 0;
-			fprintf(stderr, "Error writing out cluster: %d\n",
-				errno);
+			if (ret != 1) {
+				err = -EIO;
+				fprintf(stderr, "Error writing out cluster: "
+					"%d\n", errno);
+			}
 		}
 
 		free(async->buffer);
@@ -750,68 +1322,10 @@ out:
 	return err;
 }
 
-static int read_data_extent(struct metadump_struct *md,
-			    struct async_work *async)
-{
-	struct btrfs_multi_bio *multi = NULL;
-	struct btrfs_device *device;
-	u64 bytes_left = async->size;
-	u64 logical = async->start;
-	u64 offset = 0;
-	u64 bytenr;
-	u64 read_len;
-	ssize_t done;
-	int fd;
-	int ret;
-
-	while (bytes_left) {
-		read_len = bytes_left;
-		ret = btrfs_map_block(&md->root->fs_info->mapping_tree, READ,
-				      logical, &read_len, &multi, 0, NULL);
-		if (ret) {
-			fprintf(stderr, "Couldn't map data block %d\n", ret);
-			return ret;
-		}
-
-		device = multi->stripes[0].dev;
-
-		if (device->fd == 0) {
-			fprintf(stderr, "Device we need to read from is not "
-				"open\n");
-			free(multi);
-			return -EIO;
-		}
-		fd = device->fd;
-		bytenr = multi->stripes[0].physical;
-		free(multi);
-
-		read_len = min(read_len, bytes_left);
-		done = pread64(fd, async->buffer+offset, read_len, bytenr);
-		if (done < read_len) {
-			if (done < 0)
-				fprintf(stderr, "Error reading extent %d\n",
-					errno);
-			else
-				fprintf(stderr, "Short read\n");
-			return -EIO;
-		}
-
-		bytes_left -= done;
-		offset += done;
-		logical += done;
-	}
-
-	return 0;
-}
-
 static int flush_pending(struct metadump_struct *md, int done)
 {
 	struct async_work *async = NULL;
-	struct extent_buffer *eb;
-	u64 blocksize = md->root->nodesize;
 	u64 start;
-	u64 size;
-	size_t offset;
 	int ret = 0;
 
 	if (md->pending_size) {
@@ -822,17 +1336,15 @@ static int flush_pending(struct metadump_struct *md, int done)
 		async->start = md->pending_start;
 		async->size = md->pending_size;
 		async->bufsize = async->size;
+		async->data = md->data;
 		async->buffer = malloc(async->bufsize);
 		if (!async->buffer) {
 			free(async);
 			return -ENOMEM;
 		}
-		offset = 0;
-		start = async->start;
-		size = async->size;
 
-		if (md->data) {
-			ret = read_data_extent(md, async);
+		if (!md->num_threads) {
+			ret = fill_async_work(md, async);
 			if (ret) {
 				free(async->buffer);
 				free(async);
@@ -840,22 +1352,6 @@ static int flush_pending(struct metadump_struct *md, int done)
 			}
 		}
 
-		while (!md->data && size > 0) {
-			eb = read_tree_block(md->root, start, blocksize, 0);
-			if (!eb) {
-				free(async->buffer);
-				free(async);
-				fprintf(stderr, "Error reading metadata "
-					"block\n");
-				return -EIO;
-			}
-			copy_buffer(md, async->buffer + offset, eb);
-			free_extent_buffer(eb);
-			start += blocksize;
-			offset += blocksize;
-			size -= blocksize;
-		}
-
 		md->pending_start = (u64)-1;
 		md->pending_size = 0;
 	} else if (!done) {
@@ -866,7 +1362,7 @@ static int flush_pending(struct metadump_struct *md, int done)
 	if (async) {
 		list_add_tail(&async->ordered, &md->ordered);
 		md->num_items++;
-		if (md->compress_level > 0) {
+		if (md->num_threads) {
 			list_add_tail(&async->list, &md->list);
 			pthread_cond_signal(&md->cond);
 		} else {
@@ -952,10 +1448,14 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 	int i = 0;
 	int ret;
 
-	ret = add_extent(btrfs_header_bytenr(eb), root->leafsize, metadump, 0);
-	if (ret) {
-		fprintf(stderr, "Error adding metadata block\n");
-		return ret;
+	if (!in_base_image(metadump, btrfs_header_bytenr(eb), root->leafsize,
+			   btrfs_header_generation(eb))) {
+		ret = add_extent(btrfs_header_bytenr(eb), root->leafsize,
+				 metadump, 0);
+		if (ret) {
+			fprintf(stderr, "Error adding metadata block\n");
+			return ret;
+		}
 	}
 
 	if (btrfs_header_level(eb) == 0 && !root_tree)
@@ -1139,8 +1639,10 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 		if (btrfs_item_size_nr(leaf, path->slots[0]) > sizeof(*ei)) {
 			ei = btrfs_item_ptr(leaf, path->slots[0],
 					    struct btrfs_extent_item);
-			if (btrfs_extent_flags(leaf, ei) &
-			    BTRFS_EXTENT_FLAG_TREE_BLOCK) {
+			if ((btrfs_extent_flags(leaf, ei) &
+			     BTRFS_EXTENT_FLAG_TREE_BLOCK) &&
+			    !in_base_image(metadump, bytenr, num_bytes,
+					   btrfs_extent_generation(leaf, ei))) {
 				ret = add_extent(bytenr, num_bytes, metadump,
 						 0);
 				if (ret) {
@@ -1184,7 +1686,9 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 }
 
 static int create_metadump(const char *input, FILE *out, int num_threads,
-			   int compress_level, int sanitize, int walk_trees)
+			   int compress_method, int compress_level,
+			   int sanitize, int walk_trees,
+			   char **bases, int nr_bases)
 {
 	struct btrfs_root *root;
 	struct btrfs_path *path = NULL;
@@ -1201,7 +1705,7 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 	BUG_ON(root->nodesize != root->leafsize);
 
 	ret = metadump_init(&metadump, root, out, num_threads,
-			    compress_level, sanitize);
+			    compress_method, compress_level, sanitize);
 	if (ret) {
 		fprintf(stderr, "Error initing metadump %d\n", ret);
 		close_ctree(root);
@@ -1222,6 +1726,14 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 		goto out;
 	}
 
+	if (nr_bases) {
+		ret = load_base_images(&metadump, bases, nr_bases);
+		if (ret) {
+			err = ret;
+			goto out;
+		}
+	}
+
 	if (walk_trees) {
 		ret = copy_tree_blocks(root, root->fs_info->chunk_root->node,
 				       &metadump, 1);
@@ -1258,6 +1770,11 @@ out:
 			err = ret;
 		fprintf(stderr, "Error flushing pending %d\n", ret);
 	}
+	if (!err) {
+		err = write_index(&metadump);
+		if (err)
+			fprintf(stderr, "Error writing index %d\n", err);
+	}
 
 	metadump_destroy(&metadump);
 
@@ -1516,25 +2033,329 @@ static void write_backup_supers(int fd, u8 *buf)
 	}
 }
 
+static int grow_buffer(u8 **buffer, size_t *buffer_size, size_t size)
+{
+	u8 *tmp;
+
+	if (size <= *buffer_size)
+		return 0;
+	if (size > MAX_DECOMPRESSED_SIZE)
+		return -EIO;
+	tmp = realloc(*buffer, size);
+	if (!tmp)
+		return -ENOMEM;
+	*buffer = tmp;
+	*buffer_size = size;
+	return 0;
+}
+
+/*
+ * decompress an item into *buffer, growing it as needed so the caller can
+ * reuse it for the next item.  *size is set to the decompressed length.
+ */
+static int decompress_item(int method, struct async_work *async,
+			   u8 **buffer, size_t *buffer_size, size_t *size)
+{
+	unsigned long zsize;
+	int ret;
+#ifdef BTRFS_IMAGE_ZSTD
+	unsigned long long content_size;
+	size_t zret;
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+	u32 raw_size;
+	int len;
+#endif
+
+	*size = 0;
+	switch (method) {
+	case COMPRESS_ZLIB:
+		while (1) {
+			zsize = *buffer_size;
+			ret = uncompress(*buffer, &zsize, async->buffer,
+					 async->bufsize);
+			if (ret == Z_OK)
+				break;
+			if (ret != Z_BUF_ERROR ||
+			    grow_buffer(buffer, buffer_size, *buffer_size * 2)) {
+				fprintf(stderr, "Error decompressing %d\n", ret);
+				return -EIO;
+			}
+		}
+		*size = zsize;
+		return 0;
+#ifdef BTRFS_IMAGE_ZSTD
+	case COMPRESS_ZSTD:
+		content_size = ZSTD_getFrameContentSize(async->buffer,
+							async->bufsize);
+		if (content_size == ZSTD_CONTENTSIZE_ERROR ||
+		    content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+		    grow_buffer(buffer, buffer_size, content_size)) {
+			fprintf(stderr, "Error decompressing, bad zstd frame\n");
+			return -EIO;
+		}
+		zret = ZSTD_decompress(*buffer, *buffer_size, async->buffer,
+				       async->bufsize);
+		if (ZSTD_isError(zret)) {
+			fprintf(stderr, "Error decompressing %s\n",
+				ZSTD_getErrorName(zret));
+			return -EIO;
+		}
+		*size = zret;
+		return 0;
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+	case COMPRESS_LZ4:
+		if (async->bufsize < sizeof(__le32))
+			return -EIO;
+		raw_size = le32_to_cpu(*(__le32 *)async->buffer);
+		if (grow_buffer(buffer, buffer_size, raw_size))
+			return -EIO;
+		len = LZ4_decompress_safe((char *)async->buffer + sizeof(__le32),
+					  (char *)*buffer,
+					  async->bufsize - sizeof(__le32),
+					  raw_size);
+		if (len != raw_size) {
+			fprintf(stderr, "Error decompressing %d\n", len);
+			return -EIO;
+		}
+		*size = len;
+		return 0;
+#endif
+	default:
+		fprintf(stderr, "Unsupported compression method %d in image\n",
+			method);
+		return -EOPNOTSUPP;
+	}
+}
+
+/*
+ * write out a run of decompressed items, merging the ones that follow each
+ * other on disk into a single pwritev
+ */
+static int write_restore_batch(int fd, struct async_work **batch,
+			       struct iovec *iov, int nr)
+{
+	ssize_t ret;
+	size_t len;
+	u64 start;
+	int first;
+	int i;
+
+	for (first = 0; first < nr; first = i) {
+		start = batch[first]->start;
+		len = iov[first].iov_len;
+		for (i = first + 1; i < nr; i++) {
+			if (batch[i]->start != start + len)
+				break;
+			len += iov[i].iov_len;
+		}
+
+		ret = pwritev(fd, iov + first, i - first, start);
+		if (ret < 0) {
+			fprintf(stderr, "Error writing to device %d\n", errno);
+			return errno;
+		}
+		if (ret < len) {
+			fprintf(stderr, "Short write\n");
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static void *restore_dev_writer(void *data)
+{
+	struct restore_dev *dev = data;
+	struct restore_write *write;
+	ssize_t ret;
+
+	while (1) {
+		pthread_mutex_lock(&dev->mutex);
+		while (list_empty(&dev->list)) {
+			if (dev->done) {
+				pthread_mutex_unlock(&dev->mutex);
+				return NULL;
+			}
+			pthread_cond_wait(&dev->cond, &dev->mutex);
+		}
+		write = list_entry(dev->list.next, struct restore_write, list);
+		list_del_init(&write->list);
+		dev->queued -= write->len;
+		pthread_cond_broadcast(&dev->cond);
+		pthread_mutex_unlock(&dev->mutex);
+
+		ret = pwrite64(dev->fd, write->data, write->len,
+			       write->physical);
+		if (ret < (ssize_t)write->len) {
+			if (ret < 0)
+				fprintf(stderr, "Error writing to %s %d\n",
+					dev->name, errno);
+			else
+				fprintf(stderr, "Short write to %s\n",
+					dev->name);
+			pthread_mutex_lock(&dev->mutex);
+			if (!dev->error)
+				dev->error = ret < 0 ? -errno : -EIO;
+			pthread_mutex_unlock(&dev->mutex);
+		}
+		free(write);
+	}
+}
+
+/* hand a copy of buf to the writer of a target, waiting if it's behind */
+static int queue_dev_write(struct restore_dev *dev, u64 physical,
+			   u8 *buf, size_t len)
+{
+	struct restore_write *write;
+	int ret;
+
+	write = malloc(sizeof(*write) + len);
+	if (!write)
+		return -ENOMEM;
+	write->physical = physical;
+	write->len = len;
+	memcpy(write->data, buf, len);
+
+	pthread_mutex_lock(&dev->mutex);
+	while (dev->queued > RESTORE_DEV_QUEUE && !dev->error)
+		pthread_cond_wait(&dev->cond, &dev->mutex);
+	ret = dev->error;
+	if (!ret) {
+		list_add_tail(&write->list, &dev->list);
+		dev->queued += len;
+		pthread_cond_broadcast(&dev->cond);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+	if (ret)
+		free(write);
+	return ret;
+}
+
+/*
+ * send a range of logical bytes to every stripe holding it, following the
+ * chunk layout of the original fs
+ */
+static int map_restore_range(struct restore_devs *devs, u64 logical,
+			     u8 *buf, size_t len)
+{
+	struct cache_extent *ce;
+	struct restore_chunk *chunk;
+	u64 offset;
+	u64 stripe_nr;
+	u64 stripe_offset;
+	u64 physical;
+	size_t cur;
+	int first;
+	int nr;
+	int i;
+	int ret;
+
+	while (len) {
+		ce = find_cache_extent(&devs->chunks, logical, 1);
+		if (!ce) {
+			fprintf(stderr, "No chunk maps block %llu\n",
+				(unsigned long long)logical);
+			return -ENOENT;
+		}
+		chunk = container_of(ce, struct restore_chunk, cache);
+		offset = logical - ce->start;
+		cur = min_t(u64, len, ce->start + ce->size - logical);
+
+		if (chunk->type & (BTRFS_BLOCK_GROUP_RAID0 |
+				   BTRFS_BLOCK_GROUP_RAID10)) {
+			int factor = chunk->num_stripes;
+
+			stripe_nr = offset / chunk->stripe_len;
+			stripe_offset = offset % chunk->stripe_len;
+			cur = min_t(u64, cur, chunk->stripe_len - stripe_offset);
+			nr = 1;
+			if (chunk->type & BTRFS_BLOCK_GROUP_RAID10) {
+				nr = chunk->sub_stripes;
+				factor /= nr;
+			}
+			first = (stripe_nr % factor) * nr;
+			stripe_nr /= factor;
+			offset = stripe_nr * chunk->stripe_len + stripe_offset;
+		} else {
+			first = 0;
+			nr = chunk->num_stripes;
+		}
+
+		for (i = first; i < first + nr; i++) {
+			physical = chunk->stripes[i].physical + offset;
+			ret = queue_dev_write(devs->devs + chunk->stripes[i].dev,
+					      physical, buf, cur);
+			if (ret)
+				return ret;
+		}
+		logical += cur;
+		buf += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+/* every target gets the super, with its own dev item */
+static int write_restore_supers(struct restore_devs *devs, u8 *buf)
+{
+	struct btrfs_super_block *super;
+	struct restore_dev *dev;
+	u8 tmp[BTRFS_SUPER_INFO_SIZE];
+	u64 bytenr;
+	int ret;
+	int i;
+	int j;
+
+	super = (struct btrfs_super_block *)tmp;
+	for (i = 0; i < devs->nr_devs; i++) {
+		dev = devs->devs + i;
+		memcpy(tmp, buf, BTRFS_SUPER_INFO_SIZE);
+		memcpy(&super->dev_item, &dev->dev_item,
+		       sizeof(super->dev_item));
+
+		for (j = 0; j < BTRFS_SUPER_MIRROR_MAX; j++) {
+			bytenr = btrfs_sb_offset(j);
+			if (bytenr + BTRFS_SUPER_INFO_SIZE >
+			    btrfs_stack_device_total_bytes(&dev->dev_item))
+				break;
+			btrfs_set_super_bytenr(super, bytenr);
+			csum_block(tmp, BTRFS_SUPER_INFO_SIZE);
+			ret = queue_dev_write(dev, bytenr, tmp,
+					      BTRFS_SUPER_INFO_SIZE);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
 static void *restore_worker(void *data)
 {
 	struct mdrestore_struct *mdres = (struct mdrestore_struct *)data;
-	struct async_work *async;
+	struct async_work *batch[RESTORE_BATCH];
+	struct iovec iov[RESTORE_BATCH];
+	u8 *buffers[RESTORE_BATCH];
+	size_t buffer_sizes[RESTORE_BATCH];
 	size_t size;
-	u8 *buffer;
 	u8 *outbuf;
 	int outfd;
+	int nr;
 	int ret;
+	int i;
 
-	outfd = fileno(mdres->out);
-	buffer = malloc(MAX_PENDING_SIZE * 2);
-	if (!buffer) {
-		fprintf(stderr, "Error allocing buffer\n");
-		pthread_mutex_lock(&mdres->mutex);
-		if (!mdres->error)
-			mdres->error = -ENOMEM;
-		pthread_mutex_unlock(&mdres->mutex);
-		goto out;
+	outfd = mdres->devs ? -1 : fileno(mdres->out);
+	for (i = 0; i < RESTORE_BATCH; i++) {
+		buffer_sizes[i] = MAX_PENDING_SIZE * 2;
+		buffers[i] = malloc(buffer_sizes[i]);
+		if (!buffers[i]) {
+			fprintf(stderr, "Error allocing buffer\n");
+			pthread_mutex_lock(&mdres->mutex);
+			if (!mdres->error)
+				mdres->error = -ENOMEM;
+			pthread_mutex_unlock(&mdres->mutex);
+			goto out;
+		}
 	}
 
 	while (1) {
@@ -1548,65 +2369,90 @@ static void *restore_worker(void *data)
 			}
 			pthread_cond_wait(&mdres->cond, &mdres->mutex);
 		}
-		async = list_entry(mdres->list.next, struct async_work, list);
-		list_del_init(&async->list);
-		pthread_mutex_unlock(&mdres->mutex);
 
-		if (mdres->compress_method == COMPRESS_ZLIB) {
-			size = MAX_PENDING_SIZE * 2;
-			ret = uncompress(buffer, (unsigned long *)&size,
-					 async->buffer, async->bufsize);
-			if (ret != Z_OK) {
-				fprintf(stderr, "Error decompressing %d\n",
-					ret);
-				err = -EIO;
-			}
-			outbuf = buffer;
-		} else {
-			outbuf = async->buffer;
-			size = async->bufsize;
+		/* the super goes out on its own, it needs the backups too */
+		nr = 0;
+		while (nr < RESTORE_BATCH && !list_empty(&mdres->list)) {
+			struct async_work *async;
+
+			async = list_entry(mdres->list.next, struct async_work,
+					   list);
+			if (nr && async->start == BTRFS_SUPER_INFO_OFFSET)
+				break;
+			list_del_init(&async->list);
+			batch[nr++] = async;
+			if (async->start == BTRFS_SUPER_INFO_OFFSET)
+				break;
 		}
+		pthread_mutex_unlock(&mdres->mutex);
 
-		if (async->start == BTRFS_SUPER_INFO_OFFSET) {
-			if (mdres->old_restore) {
-				update_super_old(outbuf);
-			} else {
-				ret = update_super(outbuf);
+		for (i = 0; i < nr; i++) {
+			struct async_work *async = batch[i];
+
+			if (mdres->compress_method != COMPRESS_NONE) {
+				ret = decompress_item(mdres->compress_method,
+						      async, &buffers[i],
+						      &buffer_sizes[i], &size);
 				if (ret)
 					err = ret;
+				outbuf = buffers[i];
+			} else {
+				outbuf = async->buffer;
+				size = async->bufsize;
 			}
-		} else if (!mdres->old_restore) {
-			ret = fixup_chunk_tree_block(mdres, async, outbuf, size);
-			if (ret)
-				err = ret;
-		}
 
-		ret = pwrite64(outfd, outbuf, size, async->start);
-		if (ret < size) {
-			if (ret < 0) {
-				fprintf(stderr, "Error writing to device %d\n",
-					errno);
-				err = errno;
-			} else {
-				fprintf(stderr, "Short write\n");
-				err = -EIO;
+			if (mdres->devs) {
+				/* the chunk layout is kept as it is */
+				if (!err && async->start ==
+				    BTRFS_SUPER_INFO_OFFSET)
+					err = write_restore_supers(mdres->devs,
+								   outbuf);
+				else if (!err)
+					err = map_restore_range(mdres->devs,
+								async->start,
+								outbuf, size);
+			} else if (async->start == BTRFS_SUPER_INFO_OFFSET) {
+				if (mdres->old_restore) {
+					update_super_old(outbuf);
+				} else {
+					ret = update_super(outbuf);
+					if (ret)
+						err = ret;
+				}
+			} else if (!mdres->old_restore) {
+				ret = fixup_chunk_tree_block(mdres, async,
+							     outbuf, size);
+				if (ret)
+					err = ret;
 			}
+			iov[i].iov_base = outbuf;
+			iov[i].iov_len = size;
 		}
 
-		if (async->start == BTRFS_SUPER_INFO_OFFSET)
-			write_backup_supers(outfd, outbuf);
+		if (!mdres->devs) {
+			if (!err)
+				err = write_restore_batch(outfd, batch, iov,
+							  nr);
+			if (batch[0]->start == BTRFS_SUPER_INFO_OFFSET)
+				write_backup_supers(outfd, iov[0].iov_base);
+		}
 
 		pthread_mutex_lock(&mdres->mutex);
 		if (err && !mdres->error)
 			mdres->error = err;
-		mdres->num_items--;
+		mdres->num_items -= nr;
+		if (!mdres->num_items || mdres->error)
+			pthread_cond_broadcast(&mdres->idle);
 		pthread_mutex_unlock(&mdres->mutex);
 
-		free(async->buffer);
-		free(async);
+		for (i = 0; i < nr; i++) {
+			free(batch[i]->buffer);
+			free(batch[i]);
+		}
 	}
 out:
-	free(buffer);
+	for (i = 0; i < RESTORE_BATCH; i++)
+		free(buffers[i]);
 	pthread_exit(NULL);
 }
 
@@ -1622,22 +2468,25 @@ static void mdrestore_destroy(struct mdrestore_struct *mdres)
 		pthread_join(mdres->threads[i], NULL);
 
 	pthread_cond_destroy(&mdres->cond);
+	pthread_cond_destroy(&mdres->idle);
 	pthread_mutex_destroy(&mdres->mutex);
 	free(mdres->threads);
 }
 
 static int mdrestore_init(struct mdrestore_struct *mdres,
-			  FILE *in, FILE *out, int old_restore,
-			  int num_threads)
+			  FILE *in, FILE *out, struct restore_devs *devs,
+			  int old_restore, int num_threads)
 {
 	int i, ret = 0;
 
 	memset(mdres, 0, sizeof(*mdres));
 	pthread_cond_init(&mdres->cond, NULL);
+	pthread_cond_init(&mdres->idle, NULL);
 	pthread_mutex_init(&mdres->mutex, NULL);
 	INIT_LIST_HEAD(&mdres->list);
 	mdres->in = in;
 	mdres->out = out;
+	mdres->devs = devs;
 	mdres->old_restore = old_restore;
 
 	if (!num_threads)
@@ -1662,20 +2511,19 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 			   struct async_work *async)
 {
 	struct btrfs_super_block *super;
+	size_t buffer_size = BTRFS_SUPER_INFO_SIZE;
+	size_t size;
 	u8 *buffer = NULL;
 	u8 *outbuf;
 	int ret;
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
-		size_t size = MAX_PENDING_SIZE * 2;
-
-		buffer = malloc(MAX_PENDING_SIZE * 2);
+	if (mdres->compress_method != COMPRESS_NONE) {
+		buffer = malloc(buffer_size);
 		if (!buffer)
 			return -ENOMEM;
-		ret = uncompress(buffer, (unsigned long *)&size,
-				 async->buffer, async->bufsize);
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error decompressing %d\n", ret);
+		ret = decompress_item(mdres->compress_method, async,
+				      &buffer, &buffer_size, &size);
+		if (ret || size < BTRFS_SUPER_INFO_SIZE) {
 			free(buffer);
 			return -EIO;
 		}
@@ -1771,20 +2619,15 @@ static int wait_for_worker(struct mdrestore_struct *mdres)
 	pthread_mutex_lock(&mdres->mutex);
 	ret = mdres->error;
 	while (!ret && mdres->num_items > 0) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&mdres->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&mdres->mutex);
+		pthread_cond_wait(&mdres->idle, &mdres->mutex);
 		ret = mdres->error;
 	}
 	pthread_mutex_unlock(&mdres->mutex);
 	return ret;
 }
 
-static int restore_metadump(const char *input, FILE *out, int old_restore,
+static int restore_metadump(const char *input, FILE *out,
+			    struct restore_devs *devs, int old_restore,
 			    int num_threads)
 {
 	struct meta_cluster *cluster;
@@ -1812,7 +2655,8 @@ static int restore_metadump(const char *input, FILE *out, int old_restore,
 		return -ENOMEM;
 	}
 
-	ret = mdrestore_init(&mdrestore, in, out, old_restore, num_threads);
+	ret = mdrestore_init(&mdrestore, in, out, devs, old_restore,
+			     num_threads);
 	if (ret) {
 		fprintf(stderr, "Error initing mdrestore %d\n", ret);
 		if (in != stdin)
@@ -1854,11 +2698,651 @@ static int restore_metadump(const char *input, FILE *out, int old_restore,
 	return ret;
 }
 
+static int parse_compress_method(const char *name)
+{
+	if (!strcmp(name, "zlib"))
+		return COMPRESS_ZLIB;
+#ifdef BTRFS_IMAGE_ZSTD
+	if (!strcmp(name, "zstd"))
+		return COMPRESS_ZSTD;
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+	if (!strcmp(name, "lz4"))
+		return COMPRESS_LZ4;
+#endif
+	fprintf(stderr, "unsupported compression method '%s'\n", name);
+	return -1;
+}
+
+static int max_compress_level(int method)
+{
+	switch (method) {
+#ifdef BTRFS_IMAGE_ZSTD
+	case COMPRESS_ZSTD:
+		return ZSTD_maxCLevel();
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+	case COMPRESS_LZ4:
+		return LZ4HC_CLEVEL_MAX;
+#endif
+	default:
+		return 9;
+	}
+}
+
+static int default_compress_level(int method)
+{
+	switch (method) {
+	case COMPRESS_ZSTD:
+		return 3;
+	case COMPRESS_LZ4:
+		return 1;
+	default:
+		return 6;
+	}
+}
+
+/*
+ * load the trailing index of an image, sorted by bytenr.  Returns -ENOENT
+ * for images written before the index existed.  Entries are added to
+ * whatever @mi already holds, so the indexes of a chain of images can be
+ * merged.
+ */
+static int load_metadump_index(FILE *in, struct metadump_index *mi)
+{
+	struct meta_index *index;
+	struct index_entry *entries = mi->entries;
+	struct index_entry *tmp;
+	size_t nr = mi->nr;
+	u64 bytenr;
+	u32 nritems;
+	u32 i;
+	int ret = -ENOENT;
+
+	index = malloc(BLOCK_SIZE);
+	if (!index)
+		return -ENOMEM;
+
+	if (fseeko(in, -BLOCK_SIZE, SEEK_END) ||
+	    fread(index, BLOCK_SIZE, 1, in) != 1)
+		goto out;
+	if (le64_to_cpu(index->header.magic) != HEADER_MAGIC ||
+	    le64_to_cpu(index->index.magic) != INDEX_MAGIC ||
+	    !index->index.last)
+		goto out;
+
+	mi->compress = index->index.compress;
+	mi->base_generation = le64_to_cpu(index->index.base_generation);
+	bytenr = le64_to_cpu(index->index.first);
+	if (fseeko(in, bytenr, SEEK_SET))
+		goto out;
+	while (1) {
+		ret = -EIO;
+		if (fread(index, BLOCK_SIZE, 1, in) != 1 ||
+		    le64_to_cpu(index->header.magic) != HEADER_MAGIC ||
+		    le64_to_cpu(index->header.bytenr) != bytenr ||
+		    le64_to_cpu(index->index.magic) != INDEX_MAGIC) {
+			fprintf(stderr, "bad index block in metadump image\n");
+			goto out;
+		}
+		nritems = le32_to_cpu(index->index.nritems);
+		if (nritems > ITEMS_PER_INDEX)
+			goto out;
+		tmp = realloc(entries, (nr + nritems + 1) * sizeof(*entries));
+		if (!tmp) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		entries = tmp;
+		for (i = 0; i < nritems; i++, nr++) {
+			entries[nr].bytenr = le64_to_cpu(index->items[i].bytenr);
+			entries[nr].offset = le64_to_cpu(index->items[i].offset);
+			entries[nr].size = le32_to_cpu(index->items[i].size);
+			entries[nr].len = le32_to_cpu(index->items[i].len);
+		}
+		bytenr += BLOCK_SIZE;
+		if (index->index.last)
+			break;
+	}
+
+	qsort(entries, nr, sizeof(*entries), cmp_index_entry);
+	ret = 0;
+out:
+	mi->entries = entries;
+	mi->nr = nr;
+	free(index);
+	return ret;
+}
+
+/*
+ * read and decompress one item of an indexed image.  *buffer is grown as
+ * needed and can be reused for the next call.
+ */
+static int read_index_entry(FILE *in, int compress,
+			    struct index_entry *entry,
+			    u8 **buffer, size_t *buffer_size)
+{
+	struct async_work async;
+	size_t size;
+	int ret;
+
+	memset(&async, 0, sizeof(async));
+	async.start = entry->bytenr;
+	async.bufsize = entry->size;
+	async.buffer = malloc(entry->size);
+	if (!async.buffer)
+		return -ENOMEM;
+	if (fseeko(in, entry->offset, SEEK_SET) ||
+	    fread(async.buffer, entry->size, 1, in) != 1) {
+		fprintf(stderr, "Error reading item at %llu\n",
+			(unsigned long long)entry->offset);
+		ret = -EIO;
+		goto out;
+	}
+
+	if (compress != COMPRESS_NONE) {
+		ret = decompress_item(compress, &async, buffer, buffer_size,
+				      &size);
+	} else {
+		size = entry->size;
+		ret = grow_buffer(buffer, buffer_size, size);
+		if (!ret)
+			memcpy(*buffer, async.buffer, size);
+	}
+	if (!ret && size != entry->len)
+		ret = -EIO;
+out:
+	free(async.buffer);
+	return ret;
+}
+
+/*
+ * open an indexed image and copy out its super block.  If @mi is set the
+ * image's index is added to it.
+ */
+static FILE *open_indexed_image(const char *input, struct metadump_index *mi,
+				struct btrfs_super_block *super)
+{
+	struct metadump_index tmp;
+	struct index_entry *entry;
+	size_t buffer_size = BTRFS_SUPER_INFO_SIZE;
+	u8 *buffer;
+	FILE *in;
+	int ret;
+
+	in = fopen(input, "r");
+	if (!in) {
+		fprintf(stderr, "unable to open metadump image %s: %s\n",
+			input, strerror(errno));
+		return NULL;
+	}
+
+	/* the super has to come from this image, not the merged index */
+	memset(&tmp, 0, sizeof(tmp));
+	ret = load_metadump_index(in, &tmp);
+	if (ret) {
+		if (ret == -ENOENT)
+			fprintf(stderr, "metadump image %s has no index\n",
+				input);
+		goto fail;
+	}
+	entry = find_index_entry(&tmp, BTRFS_SUPER_INFO_OFFSET);
+	if (!entry || entry->bytenr != BTRFS_SUPER_INFO_OFFSET) {
+		fprintf(stderr, "metadump image %s has no super block\n",
+			input);
+		goto fail;
+	}
+	buffer = malloc(buffer_size);
+	if (!buffer)
+		goto fail;
+	ret = read_index_entry(in, tmp.compress, entry, &buffer, &buffer_size);
+	if (!ret)
+		memcpy(super, buffer, sizeof(*super));
+	free(buffer);
+	if (ret)
+		goto fail;
+
+	if (mi) {
+		ret = load_metadump_index(in, mi);
+		if (ret)
+			goto fail;
+	}
+	free(tmp.entries);
+	return in;
+fail:
+	free(tmp.entries);
+	fclose(in);
+	return NULL;
+}
+
+/*
+ * load the indexes of a chain of base images, oldest first, for an
+ * incremental dump of @root.  Like check_image_chain() does for a restore,
+ * every base has to be of this filesystem and taken against the one in
+ * front of it.
+ */
+static int load_base_images(struct metadump_struct *md, char **bases,
+			    int nr_bases)
+{
+	struct btrfs_super_block super;
+	u64 prev_generation = 0;
+	FILE *in;
+	int i;
+
+	for (i = 0; i < nr_bases; i++) {
+		in = open_indexed_image(bases[i], &md->base, &super);
+		if (!in)
+			return -EINVAL;
+		fclose(in);
+
+		if (memcmp(super.fsid, md->root->fs_info->fsid,
+			   BTRFS_FSID_SIZE)) {
+			fprintf(stderr, "base image %s is of a different "
+				"filesystem\n", bases[i]);
+			return -EINVAL;
+		}
+		if (md->base.base_generation &&
+		    md->base.base_generation != prev_generation) {
+			fprintf(stderr, "base image %s is a delta against "
+				"generation %llu, list the image it was taken "
+				"against in front of it\n", bases[i],
+				(unsigned long long)md->base.base_generation);
+			return -EINVAL;
+		}
+		prev_generation = btrfs_super_generation(&super);
+	}
+	md->base_generation = prev_generation;
+	return 0;
+}
+
+/*
+ * check that every delta in a chain of images was taken against the image
+ * in front of it.  Images without an index can't be checked.
+ */
+static int check_image_chain(char **images, int nr)
+{
+	struct btrfs_super_block super;
+	struct metadump_index mi;
+	u64 prev_generation = 0;
+	FILE *in;
+	int ret;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!strcmp(images[i], "-"))
+			break;
+		in = fopen(images[i], "r");
+		if (!in)
+			break;
+		memset(&mi, 0, sizeof(mi));
+		ret = load_metadump_index(in, &mi);
+		free(mi.entries);
+		fclose(in);
+		if (ret) {
+			prev_generation = 0;
+			continue;
+		}
+		in = open_indexed_image(images[i], NULL, &super);
+		if (!in)
+			return -EIO;
+		fclose(in);
+		if (mi.base_generation &&
+		    mi.base_generation != prev_generation) {
+			fprintf(stderr, "%s is a delta against generation "
+				"%llu, restore it on top of that image with "
+				"-i\n", images[i],
+				(unsigned long long)mi.base_generation);
+			return -EINVAL;
+		}
+		prev_generation = btrfs_super_generation(&super);
+	}
+	return 0;
+}
+
+/*
+ * allocate the ranges an indexed image is going to fill up front, so a
+ * restore into a file gets them laid out in order instead of as the
+ * workers get to them.  Everything else is left as a hole.
+ */
+static void preallocate_restore(const char *input, FILE *out)
+{
+	struct metadump_index mi;
+	struct stat st;
+	u64 start;
+	u64 end;
+	size_t i;
+	FILE *in;
+
+	if (!strcmp(input, "-") || fstat(fileno(out), &st) ||
+	    !S_ISREG(st.st_mode))
+		return;
+	in = fopen(input, "r");
+	if (!in)
+		return;
+
+	memset(&mi, 0, sizeof(mi));
+	if (load_metadump_index(in, &mi))
+		goto out;
+	for (i = 0; i < mi.nr; ) {
+		start = mi.entries[i].bytenr;
+		end = start + mi.entries[i].len;
+		for (i++; i < mi.nr && mi.entries[i].bytenr == end; i++)
+			end += mi.entries[i].len;
+		if (fallocate(fileno(out), 0, start, end - start))
+			break;
+	}
+out:
+	free(mi.entries);
+	fclose(in);
+}
+
+/*
+ * walk the chunk tree of an indexed image, collecting the devices and the
+ * chunk mappings of the original fs
+ */
+static int read_restore_chunks(FILE *in, struct metadump_index *mi,
+			       struct restore_devs *devs, u64 bytenr,
+			       u32 leafsize)
+{
+	struct extent_buffer *eb;
+	struct index_entry *entry;
+	struct restore_chunk *rc;
+	struct restore_dev *dev;
+	struct btrfs_chunk *chunk;
+	struct btrfs_key key;
+	size_t buffer_size = MAX_PENDING_SIZE;
+	u8 *buffer;
+	u64 devid;
+	int num_stripes;
+	int ret = 0;
+	int i;
+	int j;
+	int k;
+
+	entry = find_index_entry(mi, bytenr);
+	if (!entry || bytenr + leafsize > entry->bytenr + entry->len) {
+		fprintf(stderr, "chunk tree block %llu is not in the image\n",
+			(unsigned long long)bytenr);
+		return -ENOENT;
+	}
+
+	buffer = malloc(buffer_size);
+	eb = alloc_dummy_eb(bytenr, leafsize);
+	if (!buffer || !eb) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = read_index_entry(in, mi->compress, entry, &buffer, &buffer_size);
+	if (ret)
+		goto out;
+	memcpy(eb->data, buffer + (bytenr - entry->bytenr), leafsize);
+	free(buffer);
+	buffer = NULL;
+
+	if (btrfs_header_level(eb)) {
+		for (i = 0; i < btrfs_header_nritems(eb); i++) {
+			ret = read_restore_chunks(in, mi, devs,
+						  btrfs_node_blockptr(eb, i),
+						  leafsize);
+			if (ret)
+				break;
+		}
+		goto out;
+	}
+
+	for (i = 0; i < btrfs_header_nritems(eb); i++) {
+		btrfs_item_key_to_cpu(eb, &key, i);
+		if (key.type == BTRFS_DEV_ITEM_KEY) {
+			dev = realloc(devs->devs,
+				      (devs->nr_devs + 1) * sizeof(*dev));
+			if (!dev) {
+				ret = -ENOMEM;
+				break;
+			}
+			devs->devs = dev;
+			dev += devs->nr_devs++;
+			memset(dev, 0, sizeof(*dev));
+			read_extent_buffer(eb, &dev->dev_item,
+					   btrfs_item_ptr_offset(eb, i),
+					   sizeof(dev->dev_item));
+			continue;
+		}
+		if (key.type != BTRFS_CHUNK_ITEM_KEY)
+			continue;
+
+		chunk = btrfs_item_ptr(eb, i, struct btrfs_chunk);
+		num_stripes = btrfs_chunk_num_stripes(eb, chunk);
+		if (btrfs_chunk_type(eb, chunk) & (BTRFS_BLOCK_GROUP_RAID5 |
+						   BTRFS_BLOCK_GROUP_RAID6)) {
+			fprintf(stderr, "RAID5/6 chunks can't be restored to "
+				"multiple devices\n");
+			ret = -EOPNOTSUPP;
+			break;
+		}
+		rc = calloc(1, sizeof(*rc) +
+			    num_stripes * sizeof(rc->stripes[0]));
+		if (!rc) {
+			ret = -ENOMEM;
+			break;
+		}
+		rc->cache.start = key.offset;
+		rc->cache.size = btrfs_chunk_length(eb, chunk);
+		rc->type = btrfs_chunk_type(eb, chunk);
+		rc->stripe_len = btrfs_chunk_stripe_len(eb, chunk);
+		rc->num_stripes = num_stripes;
+		rc->sub_stripes = btrfs_chunk_sub_stripes(eb, chunk);
+		for (j = 0; j < num_stripes; j++) {
+			devid = btrfs_stripe_devid_nr(eb, chunk, j);
+			for (k = 0; k < devs->nr_devs; k++) {
+				if (btrfs_stack_device_id(
+					&devs->devs[k].dev_item) == devid)
+					break;
+			}
+			if (k == devs->nr_devs) {
+				fprintf(stderr, "chunk %llu is on unknown "
+					"device %llu\n",
+					(unsigned long long)key.offset,
+					(unsigned long long)devid);
+				ret = -ENOENT;
+				break;
+			}
+			rc->stripes[j].dev = k;
+			rc->stripes[j].physical =
+				btrfs_stripe_offset_nr(eb, chunk, j);
+		}
+		if (!ret)
+			ret = insert_existing_cache_extent(&devs->chunks,
+							   &rc->cache);
+		if (ret) {
+			free(rc);
+			break;
+		}
+	}
+out:
+	free(buffer);
+	free(eb);
+	return ret;
+}
+
+/* stop the writers and flush out every target */
+static int close_restore_devs(struct restore_devs *devs)
+{
+	struct cache_extent *ce;
+	struct restore_dev *dev;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < devs->nr_devs; i++) {
+		dev = devs->devs + i;
+		if (!dev->name)
+			continue;
+		pthread_mutex_lock(&dev->mutex);
+		dev->done = 1;
+		pthread_cond_broadcast(&dev->cond);
+		pthread_mutex_unlock(&dev->mutex);
+		if (dev->thread)
+			pthread_join(dev->thread, NULL);
+		if (dev->fd >= 0) {
+			if (fsync(dev->fd) && !dev->error)
+				dev->error = -errno;
+			close(dev->fd);
+		}
+		if (dev->error && !ret)
+			ret = dev->error;
+		pthread_cond_destroy(&dev->cond);
+		pthread_mutex_destroy(&dev->mutex);
+	}
+
+	while ((ce = find_first_cache_extent(&devs->chunks, 0))) {
+		remove_cache_extent(&devs->chunks, ce);
+		free(container_of(ce, struct restore_chunk, cache));
+	}
+	free(devs->devs);
+	return ret;
+}
+
+/*
+ * set up a restore onto one target per device of the original fs, in
+ * devid order, keeping its chunk layout.  The chunk tree is read up front
+ * through the image's index.
+ */
+static int open_restore_devs(const char *input, char **targets, int nr,
+			     struct restore_devs *devs)
+{
+	struct btrfs_super_block super;
+	struct metadump_index mi;
+	struct restore_dev *dev;
+	struct stat st;
+	FILE *in;
+	int ret;
+	int i;
+
+	memset(devs, 0, sizeof(*devs));
+	cache_tree_init(&devs->chunks);
+
+	memset(&mi, 0, sizeof(mi));
+	in = open_indexed_image(input, &mi, &super);
+	if (!in)
+		return -EINVAL;
+	ret = read_restore_chunks(in, &mi, devs, btrfs_super_chunk_root(&super),
+				  btrfs_super_leafsize(&super));
+	free(mi.entries);
+	fclose(in);
+	if (!ret && devs->nr_devs != nr) {
+		fprintf(stderr, "filesystem has %d devices but %d targets "
+			"were given\n", devs->nr_devs, nr);
+		ret = -EINVAL;
+	}
+	if (ret)
+		goto fail;
+
+	for (i = 0; i < nr; i++) {
+		dev = devs->devs + i;
+		dev->name = targets[i];
+		dev->fd = -1;
+		INIT_LIST_HEAD(&dev->list);
+		pthread_mutex_init(&dev->mutex, NULL);
+		pthread_cond_init(&dev->cond, NULL);
+	}
+
+	for (i = 0; i < nr; i++) {
+		dev = devs->devs + i;
+		dev->fd = open(dev->name, O_RDWR | O_CREAT, 0644);
+		if (dev->fd < 0) {
+			fprintf(stderr, "unable to open %s: %s\n", dev->name,
+				strerror(errno));
+			ret = -errno;
+			goto fail;
+		}
+		/* a file target gets the size of the device it stands for */
+		if (!fstat(dev->fd, &st) && S_ISREG(st.st_mode) &&
+		    (ftruncate(dev->fd, 0) ||
+		     ftruncate(dev->fd, btrfs_stack_device_total_bytes(
+						&dev->dev_item)))) {
+			fprintf(stderr, "unable to size %s: %s\n", dev->name,
+				strerror(errno));
+			ret = -errno;
+			goto fail;
+		}
+		ret = pthread_create(&dev->thread, NULL, restore_dev_writer,
+				     dev);
+		if (ret) {
+			dev->thread = 0;
+			goto fail;
+		}
+	}
+	return 0;
+fail:
+	close_restore_devs(devs);
+	return ret;
+}
+
+/*
+ * pull a single tree block out of an image using its index, without
+ * restoring the whole thing
+ */
+static int extract_block(const char *input, FILE *out, u64 bytenr)
+{
+	struct btrfs_super_block super;
+	struct metadump_index mi;
+	struct index_entry *entry;
+	size_t buffer_size = MAX_PENDING_SIZE;
+	u8 *buffer = NULL;
+	u32 leafsize;
+	FILE *in;
+	int ret;
+
+	memset(&mi, 0, sizeof(mi));
+	in = open_indexed_image(input, &mi, &super);
+	if (!in)
+		return 1;
+	leafsize = btrfs_super_leafsize(&super);
+
+	buffer = malloc(buffer_size);
+	if (!buffer) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	entry = find_index_entry(&mi, bytenr);
+	if (!entry || bytenr + leafsize > entry->bytenr + entry->len) {
+		fprintf(stderr, "block %llu is not in the image\n",
+			(unsigned long long)bytenr);
+		ret = -ENOENT;
+		goto out;
+	}
+	ret = read_index_entry(in, mi.compress, entry, &buffer, &buffer_size);
+	if (ret)
+		goto out;
+
+	if (fwrite(buffer + (bytenr - entry->bytenr), leafsize, 1, out) != 1) {
+		fprintf(stderr, "Error writing block %d\n", errno);
+		ret = -EIO;
+	}
+out:
+	free(mi.entries);
+	free(buffer);
+	fclose(in);
+	return ret;
+}
+
 static void print_usage(void)
 {
 	fprintf(stderr, "usage: btrfs-image [options] source target\n");
+	fprintf(stderr, "       btrfs-image -r -m [options] source target...\n");
 	fprintf(stderr, "\t-r      \trestore metadump image\n");
-	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9)\n");
+	fprintf(stderr, "\t-x bytenr\textract the tree block at bytenr from an image\n");
+	fprintf(stderr, "\t-i base \tdump only what changed since the base image, or restore on top of it\n");
+	fprintf(stderr, "\t-m      \trestore to one target per device, keeping the chunk layout\n");
+	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9 for zlib)\n");
+	fprintf(stderr, "\t-C method\tcompression method: zlib"
+#ifdef BTRFS_IMAGE_ZSTD
+		", zstd (1 ~ 19)"
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+		", lz4 (1 ~ 12)"
+#endif
+		"\n");
 	fprintf(stderr, "\t-t value\tnumber of threads (1 ~ 32)\n");
 	fprintf(stderr, "\t-o      \tdon't mess with the chunk tree when restoring\n");
 	fprintf(stderr, "\t-s      \tsanitize file names, use once to just use garbage, use twice if you want crc collisions\n");
@@ -1871,16 +3355,25 @@ int main(int argc, char *argv[])
 	char *source;
 	char *target;
 	int num_threads = 0;
-	int compress_level = 0;
+	int compress_method = COMPRESS_ZLIB;
+	int compress_level = -1;
 	int create = 1;
 	int old_restore = 0;
 	int walk_trees = 0;
+	int extract = 0;
+	u64 extract_bytenr = 0;
+	char *end;
+	char *bases[MAX_BASE_IMAGES + 1];
+	int nr_bases = 0;
+	int multi_devices = 0;
+	struct restore_devs devs;
 	int ret;
+	int i;
 	int sanitize = 0;
 	FILE *out;
 
 	while (1) {
-		int c = getopt(argc, argv, "rc:t:osw");
+		int c = getopt(argc, argv, "rc:C:t:oswx:i:m");
 		if (c < 0)
 			break;
 		switch (c) {
@@ -1894,9 +3387,17 @@ int main(int argc, char *argv[])
 			break;
 		case 'c':
 			compress_level = atoi(optarg);
-			if (compress_level < 0 || compress_level > 9)
+			if (compress_level < 0)
 				print_usage();
 			break;
+		case 'C':
+			compress_method = parse_compress_method(optarg);
+			if (compress_method < 0)
+				print_usage();
+			if (compress_level < 0)
+				compress_level = default_compress_level(
+							compress_method);
+			break;
 		case 'o':
 			old_restore = 1;
 			break;
@@ -1906,6 +3407,22 @@ int main(int argc, char *argv[])
 		case 'w':
 			walk_trees = 1;
 			break;
+		case 'x':
+			errno = 0;
+			extract_bytenr = strtoull(optarg, &end, 10);
+			if (errno || end == optarg || *end)
+				print_usage();
+			extract = 1;
+			create = 0;
+			break;
+		case 'm':
+			multi_devices = 1;
+			break;
+		case 'i':
+			if (nr_bases == MAX_BASE_IMAGES)
+				print_usage();
+			bases[nr_bases++] = optarg;
+			break;
 		default:
 			print_usage();
 		}
@@ -1913,14 +3430,24 @@ int main(int argc, char *argv[])
 
 	if (old_restore && create)
 		print_usage();
+	if (extract && nr_bases)
+		print_usage();
+	if (multi_devices && (create || extract || nr_bases || old_restore))
+		print_usage();
+	if (compress_level < 0)
+		compress_level = 0;
+	if (compress_level > max_compress_level(compress_method))
+		print_usage();
 
 	argc = argc - optind;
-	if (argc != 2)
+	if (multi_devices ? argc < 2 : argc != 2)
 		print_usage();
 	source = argv[optind];
 	target = argv[optind + 1];
 
-	if (create && !strcmp(target, "-")) {
+	if (multi_devices) {
+		out = NULL;
+	} else if ((create || extract) && !strcmp(target, "-")) {
 		out = stdout;
 	} else {
 		out = fopen(target, "w+");
@@ -1936,15 +3463,41 @@ int main(int argc, char *argv[])
 			num_threads = 1;
 	}
 
-	if (create)
+	if (extract)
+		ret = extract_block(source, out, extract_bytenr);
+	else if (multi_devices) {
+		ret = open_restore_devs(source, argv + optind + 1, argc - 1,
+					&devs);
+		if (!ret) {
+			ret = restore_metadump(source, NULL, &devs, 0,
+					       num_threads ? num_threads : 1);
+			i = close_restore_devs(&devs);
+			if (!ret)
+				ret = i;
+		}
+	} else if (create)
 		ret = create_metadump(source, out, num_threads,
-				      compress_level, sanitize, walk_trees);
-	else
-		ret = restore_metadump(source, out, old_restore, 1);
+				      compress_method, compress_level,
+				      sanitize, walk_trees, bases, nr_bases);
+	else {
+		/* replay the base images oldest first, then the delta */
+		bases[nr_bases] = source;
+		ret = check_image_chain(bases, nr_bases + 1);
+		for (i = 0; !ret && i <= nr_bases; i++) {
+			preallocate_restore(bases[i], out);
+			ret = restore_metadump(bases[i], out, NULL, old_restore,
+					       num_threads ? num_threads : 1);
+		}
+		if (!ret && fsync(fileno(out))) {
+			fprintf(stderr, "Error syncing restored image %d\n",
+				errno);
+			ret = -errno;
+		}
+	}
 
 	if (out == stdout)
 		fflush(out);
-	else
+	else if (out)
 		fclose(out);
 
 	return ret;
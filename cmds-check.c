@@ -24,8 +24,10 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
 #include <uuid/uuid.h>
 #include "kerncompat.h"
 #include "ctree.h"
@@ -38,6 +40,7 @@
 #include "version.h"
 #include "utils.h"
 #include "commands.h"
+#include "crc32c.h"
 
 static u64 bytes_used = 0;
 static u64 total_csum_bytes = 0;
@@ -49,6 +52,46 @@ static u64 data_bytes_allocated = 0;
 static u64 data_bytes_referenced = 0;
 static int found_old_backref = 0;
 
+/*
+ * incremental checking state.  A checkpoint is written after a clean
+ * check and records the transid it was taken at, a summary of every fs
+ * root and a digest of the extent accounting.  With --incremental, every
+ * subtree whose pointer generation is not newer than the checkpoint is
+ * trusted and skipped.
+ */
+struct checkpoint_root {
+	struct cache_extent cache;
+	u64 bytenr;
+	u64 generation;
+	u64 inodes;
+	/* the directory entries in this root that point to other roots */
+	struct list_head links;
+};
+
+struct checkpoint_link {
+	struct list_head list;
+	u64 child;
+	u64 dir;
+	u64 index;
+	u8 type;
+	u16 namelen;
+	char name[0];
+};
+
+struct check_checkpoint {
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 generation;
+	u32 extent_digest;
+	struct cache_tree roots;
+};
+
+static struct check_checkpoint *last_checkpoint = NULL;
+static struct cache_tree checkpoint_roots;
+static u64 incremental_gen = 0;
+static u64 skipped_btree_bytes = 0;
+static u64 skipped_fs_roots = 0;
+static u64 root_inodes_seen = 0;
+
 struct extent_backref {
 	struct list_head list;
 	unsigned int is_data:1;
@@ -93,18 +136,20 @@ struct extent_record {
 	unsigned int owner_ref_checked:1;
 	unsigned int is_root:1;
 	unsigned int metadata:1;
+	unsigned int partial:1;
+	unsigned int needs_fix:1;
 };
 
 struct inode_backref {
 	struct list_head list;
+	u64 dir;
+	u64 index;
 	unsigned int found_dir_item:1;
 	unsigned int found_dir_index:1;
 	unsigned int found_inode_ref:1;
 	unsigned int filetype:8;
-	int errors;
-	unsigned int ref_type;
-	u64 dir;
-	u64 index;
+	unsigned int ref_type:8;
+	u16 errors;
 	u16 namelen;
 	char name[0];
 };
@@ -123,6 +168,8 @@ struct inode_backref {
 #define REF_ERR_DUP_ROOT_REF		(1 << 11)
 #define REF_ERR_DUP_ROOT_BACKREF	(1 << 12)
 
+#define INODE_BACKREF_INLINE_NAME	23
+
 struct inode_record {
 	struct list_head backrefs;
 	unsigned int checked:1;
@@ -133,7 +180,9 @@ struct inode_record {
 	unsigned int found_csum_item:1;
 	unsigned int some_csum_missing:1;
 	unsigned int nodatasum:1;
-	int errors;
+	unsigned int first_backref_used:1;
+	unsigned int errors:16;
+	u32 refs;
 
 	u64 ino;
 	u32 nlink;
@@ -147,7 +196,15 @@ struct inode_record {
 	u64 extent_end;
 	u64 first_extent_gap;
 
-	u32 refs;
+	/*
+	 * most inodes have a single link, its backref is kept here when
+	 * the name fits instead of being allocated on its own
+	 */
+	union {
+		struct inode_backref backref;
+		char buf[sizeof(struct inode_backref) +
+			 INODE_BACKREF_INLINE_NAME + 1];
+	} first;
 };
 
 #define I_ERR_NO_INODE_ITEM		(1 << 0)
@@ -188,15 +245,26 @@ struct root_record {
 	u32 found_ref;
 };
 
-struct ptr_node {
-	struct cache_extent cache;
-	void *data;
+/*
+ * inode records of one root or shared node, an open addressing hash
+ * keyed by ino.  A record can be in several tables at once while shared
+ * subtrees are spliced, so records are reference counted.
+ */
+struct inode_table_entry {
+	u64 ino;
+	struct inode_record *rec;
+};
+
+struct inode_table {
+	struct inode_table_entry *entries;
+	u32 size;
+	u32 nr;
 };
 
 struct shared_node {
 	struct cache_extent cache;
-	struct cache_tree root_cache;
-	struct cache_tree inode_cache;
+	struct inode_table root_cache;
+	struct inode_table inode_cache;
 	struct inode_record *current;
 	u32 refs;
 };
@@ -206,8 +274,50 @@ struct block_info {
 	u32 size;
 };
 
+/*
+ * tree blocks waiting to be read during the extent scan, queued per
+ * device and sorted by physical offset
+ */
+struct queued_block {
+	struct cache_extent cache;
+	u64 bytenr;
+	u32 size;
+	unsigned int reada:1;
+};
+
+struct device_queue {
+	struct cache_extent cache;
+	struct cache_tree blocks;
+	struct btrfs_device *dev;
+	u64 head;
+	u32 nr;
+};
+
+struct block_scheduler {
+	struct cache_tree devices;
+	u64 next_devid;
+	u32 nr;
+	int reada_depth;
+};
+
+/*
+ * result of checking one fs tree, keyed by the bytenr of its root node.
+ * Snapshots that were never modified point to the same root node, so
+ * they only have to be walked once.  This only helps identical roots,
+ * a shared block below the root is still spliced into every root that
+ * reaches it.
+ */
+struct checked_tree {
+	struct cache_extent cache;
+	struct inode_table root_refs;
+	u64 objectid;
+	u64 inodes;
+	int ret;
+};
+
 struct walk_control {
 	struct cache_tree shared;
+	struct cache_tree checked;
 	struct shared_node *nodes[BTRFS_MAX_LEVEL];
 	int active_node;
 	int root_level;
@@ -230,6 +340,118 @@ static u8 imode_to_type(u32 imode)
 #undef S_SHIFT
 }
 
+static inline u32 inode_table_hash(u64 ino)
+{
+	return (u32)((ino * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static void inode_table_init(struct inode_table *table)
+{
+	table->entries = NULL;
+	table->size = 0;
+	table->nr = 0;
+}
+
+static inline int inode_table_empty(struct inode_table *table)
+{
+	return table->nr == 0;
+}
+
+/* drop the slots, the records are owned by the caller */
+static void inode_table_release(struct inode_table *table)
+{
+	free(table->entries);
+	inode_table_init(table);
+}
+
+static struct inode_table_entry *inode_table_slot(struct inode_table *table,
+						  u64 ino)
+{
+	u32 mask = table->size - 1;
+	u32 i = inode_table_hash(ino) & mask;
+
+	while (table->entries[i].rec && table->entries[i].ino != ino)
+		i = (i + 1) & mask;
+	return &table->entries[i];
+}
+
+static struct inode_record *inode_table_lookup(struct inode_table *table,
+					       u64 ino)
+{
+	if (!table->nr)
+		return NULL;
+	return inode_table_slot(table, ino)->rec;
+}
+
+static void inode_table_grow(struct inode_table *table)
+{
+	struct inode_table_entry *old = table->entries;
+	struct inode_table_entry *slot;
+	u32 old_size = table->size;
+	u32 i;
+
+	table->size = old_size ? old_size * 2 : 64;
+	table->entries = calloc(table->size, sizeof(*table->entries));
+	BUG_ON(!table->entries);
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].rec)
+			continue;
+		slot = inode_table_slot(table, old[i].ino);
+		*slot = old[i];
+	}
+	free(old);
+}
+
+static int inode_table_insert(struct inode_table *table,
+			      struct inode_record *rec)
+{
+	struct inode_table_entry *slot;
+
+	if ((table->nr + 1) * 4 > table->size * 3)
+		inode_table_grow(table);
+	slot = inode_table_slot(table, rec->ino);
+	if (slot->rec)
+		return -EEXIST;
+	slot->ino = rec->ino;
+	slot->rec = rec;
+	table->nr++;
+	return 0;
+}
+
+/* linear probing, so shift the rest of the cluster back into the hole */
+static void inode_table_remove(struct inode_table *table, u64 ino)
+{
+	struct inode_table_entry *e = table->entries;
+	u32 mask = table->size - 1;
+	u32 i, j, k;
+
+	if (!table->nr)
+		return;
+	i = inode_table_slot(table, ino) - e;
+	if (!e[i].rec)
+		return;
+
+	j = i;
+	while (1) {
+		e[i].rec = NULL;
+		while (1) {
+			j = (j + 1) & mask;
+			if (!e[j].rec)
+				goto out;
+			k = inode_table_hash(e[j].ino) & mask;
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		e[i] = e[j];
+		i = j;
+	}
+out:
+	table->nr--;
+	if (!table->nr)
+		inode_table_release(table);
+}
+
 static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 {
 	struct inode_record *rec;
@@ -243,30 +465,33 @@ static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 	INIT_LIST_HEAD(&rec->backrefs);
 
 	list_for_each_entry(orig, &orig_rec->backrefs, list) {
-		size = sizeof(*orig) + orig->namelen + 1;
-		backref = malloc(size);
-		memcpy(backref, orig, size);
+		if (orig == &orig_rec->first.backref) {
+			/* already copied along with the record */
+			backref = &rec->first.backref;
+		} else {
+			size = sizeof(*orig) + orig->namelen + 1;
+			backref = malloc(size);
+			memcpy(backref, orig, size);
+		}
 		list_add_tail(&backref->list, &rec->backrefs);
 	}
 	return rec;
 }
 
-static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
+static struct inode_record *get_inode_rec(struct inode_table *inode_cache,
 					  u64 ino, int mod)
 {
-	struct ptr_node *node;
-	struct cache_extent *cache;
+	struct inode_table_entry *slot;
 	struct inode_record *rec = NULL;
 	int ret;
 
-	cache = find_cache_extent(inode_cache, ino, 1);
-	if (cache) {
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
+	rec = inode_table_lookup(inode_cache, ino);
+	if (rec) {
 		if (mod && rec->refs > 1) {
-			node->data = clone_inode_rec(rec);
+			slot = inode_table_slot(inode_cache, ino);
+			slot->rec = clone_inode_rec(rec);
 			rec->refs--;
-			rec = node->data;
+			rec = slot->rec;
 		}
 	} else if (mod) {
 		rec = calloc(1, sizeof(*rec));
@@ -276,20 +501,25 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 		rec->refs = 1;
 		INIT_LIST_HEAD(&rec->backrefs);
 
-		node = malloc(sizeof(*node));
-		node->cache.start = ino;
-		node->cache.size = 1;
-		node->data = rec;
-
 		if (ino == BTRFS_FREE_INO_OBJECTID)
 			rec->found_link = 1;
 
-		ret = insert_existing_cache_extent(inode_cache, &node->cache);
+		ret = inode_table_insert(inode_cache, rec);
 		BUG_ON(ret);
 	}
 	return rec;
 }
 
+static void free_inode_backref(struct inode_record *rec,
+			       struct inode_backref *backref)
+{
+	list_del(&backref->list);
+	if (backref == &rec->first.backref)
+		rec->first_backref_used = 0;
+	else
+		free(backref);
+}
+
 static void free_inode_rec(struct inode_record *rec)
 {
 	struct inode_backref *backref;
@@ -300,8 +530,7 @@ static void free_inode_rec(struct inode_record *rec)
 	while (!list_empty(&rec->backrefs)) {
 		backref = list_entry(rec->backrefs.next,
 				     struct inode_backref, list);
-		list_del(&backref->list);
-		free(backref);
+		free_inode_backref(rec, backref);
 	}
 	free(rec);
 }
@@ -314,12 +543,10 @@ static int can_free_inode_rec(struct inode_record *rec)
 	return 0;
 }
 
-static void maybe_free_inode_rec(struct cache_tree *inode_cache,
+static void maybe_free_inode_rec(struct inode_table *inode_cache,
 				 struct inode_record *rec)
 {
-	struct cache_extent *cache;
 	struct inode_backref *tmp, *backref;
-	struct ptr_node *node;
 	unsigned char filetype;
 
 	if (!rec->found_inode_item)
@@ -330,10 +557,8 @@ static void maybe_free_inode_rec(struct cache_tree *inode_cache,
 		if (backref->found_dir_item && backref->found_dir_index) {
 			if (backref->filetype != filetype)
 				backref->errors |= REF_ERR_FILETYPE_UNMATCH;
-			if (!backref->errors && backref->found_inode_ref) {
-				list_del(&backref->list);
-				free(backref);
-			}
+			if (!backref->errors && backref->found_inode_ref)
+				free_inode_backref(rec, backref);
 		}
 	}
 
@@ -366,11 +591,8 @@ static void maybe_free_inode_rec(struct cache_tree *inode_cache,
 
 	BUG_ON(rec->refs != 1);
 	if (can_free_inode_rec(rec)) {
-		cache = find_cache_extent(inode_cache, rec->ino, 1);
-		node = container_of(cache, struct ptr_node, cache);
-		BUG_ON(node->data != rec);
-		remove_cache_extent(inode_cache, &node->cache);
-		free(node);
+		BUG_ON(inode_table_lookup(inode_cache, rec->ino) != rec);
+		inode_table_remove(inode_cache, rec->ino);
 		free_inode_rec(rec);
 	}
 }
@@ -414,6 +636,7 @@ static int process_inode_item(struct extent_buffer *eb,
 	if (btrfs_inode_flags(eb, item) & BTRFS_INODE_NODATASUM)
 		rec->nodatasum = 1;
 	rec->found_inode_item = 1;
+	root_inodes_seen++;
 	if (rec->nlink == 0)
 		rec->errors |= I_ERR_NO_ORPHAN_ITEM;
 	maybe_free_inode_rec(&active_node->inode_cache, rec);
@@ -434,7 +657,13 @@ static struct inode_backref *get_inode_backref(struct inode_record *rec,
 		return backref;
 	}
 
-	backref = malloc(sizeof(*backref) + namelen + 1);
+	if (!rec->first_backref_used &&
+	    namelen <= INODE_BACKREF_INLINE_NAME) {
+		backref = &rec->first.backref;
+		rec->first_backref_used = 1;
+	} else {
+		backref = malloc(sizeof(*backref) + namelen + 1);
+	}
 	memset(backref, 0, sizeof(*backref));
 	backref->dir = dir;
 	backref->namelen = namelen;
@@ -444,7 +673,7 @@ static struct inode_backref *get_inode_backref(struct inode_record *rec,
 	return backref;
 }
 
-static int add_inode_backref(struct cache_tree *inode_cache,
+static int add_inode_backref(struct inode_table *inode_cache,
 			     u64 ino, u64 dir, u64 index,
 			     const char *name, int namelen,
 			     int filetype, int itemtype, int errors)
@@ -495,7 +724,7 @@ static int add_inode_backref(struct cache_tree *inode_cache,
 }
 
 static int merge_inode_recs(struct inode_record *src, struct inode_record *dst,
-			    struct cache_tree *dst_cache)
+			    struct inode_table *dst_cache)
 {
 	struct inode_backref *backref;
 	u32 dir_count = 0;
@@ -570,14 +799,18 @@ static int merge_inode_recs(struct inode_record *src, struct inode_record *dst,
 	return 0;
 }
 
+/*
+ * hands the records left over from a shared block to the node above it.
+ * Each root reaching the block gets the records again, they are shared
+ * by reference and cloned by get_inode_rec() once that root changes them.
+ */
 static int splice_shared_node(struct shared_node *src_node,
 			      struct shared_node *dst_node)
 {
-	struct cache_extent *cache;
-	struct ptr_node *node, *ins;
-	struct cache_tree *src, *dst;
+	struct inode_table *src, *dst;
 	struct inode_record *rec, *conflict;
 	u64 current_ino = 0;
+	u32 i;
 	int splice = 0;
 	int ret;
 
@@ -589,23 +822,14 @@ static int splice_shared_node(struct shared_node *src_node,
 	src = &src_node->root_cache;
 	dst = &dst_node->root_cache;
 again:
-	cache = find_first_cache_extent(src, 0);
-	while (cache) {
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		cache = next_cache_extent(cache);
+	for (i = 0; i < src->size; i++) {
+		rec = src->entries[i].rec;
+		if (!rec)
+			continue;
 
-		if (splice) {
-			remove_cache_extent(src, &node->cache);
-			ins = node;
-		} else {
-			ins = malloc(sizeof(*ins));
-			ins->cache.start = node->cache.start;
-			ins->cache.size = node->cache.size;
-			ins->data = rec;
+		if (!splice)
 			rec->refs++;
-		}
-		ret = insert_existing_cache_extent(dst, &ins->cache);
+		ret = inode_table_insert(dst, rec);
 		if (ret == -EEXIST) {
 			conflict = get_inode_rec(dst, rec->ino, 1);
 			merge_inode_recs(rec, conflict, dst);
@@ -616,11 +840,13 @@ again:
 			}
 			maybe_free_inode_rec(dst, conflict);
 			free_inode_rec(rec);
-			free(ins);
 		} else {
 			BUG_ON(ret);
 		}
 	}
+	/* the records have been handed over to dst */
+	if (splice)
+		inode_table_release(src);
 
 	if (src == &src_node->root_cache) {
 		src = &src_node->inode_cache;
@@ -639,22 +865,15 @@ again:
 	return 0;
 }
 
-static void free_inode_recs(struct cache_tree *inode_cache)
+static void free_inode_recs(struct inode_table *inode_cache)
 {
-	struct cache_extent *cache;
-	struct ptr_node *node;
-	struct inode_record *rec;
+	u32 i;
 
-	while (1) {
-		cache = find_first_cache_extent(inode_cache, 0);
-		if (!cache)
-			break;
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		remove_cache_extent(inode_cache, &node->cache);
-		free(node);
-		free_inode_rec(rec);
+	for (i = 0; i < inode_cache->size; i++) {
+		if (inode_cache->entries[i].rec)
+			free_inode_rec(inode_cache->entries[i].rec);
 	}
+	inode_table_release(inode_cache);
 }
 
 static struct shared_node *find_shared_node(struct cache_tree *shared,
@@ -679,8 +898,8 @@ static int add_shared_node(struct cache_tree *shared, u64 bytenr, u32 refs)
 	node = calloc(1, sizeof(*node));
 	node->cache.start = bytenr;
 	node->cache.size = 1;
-	cache_tree_init(&node->root_cache);
-	cache_tree_init(&node->inode_cache);
+	inode_table_init(&node->root_cache);
+	inode_table_init(&node->inode_cache);
 	node->refs = refs;
 
 	ret = insert_existing_cache_extent(shared, &node->cache);
@@ -832,8 +1051,8 @@ static int process_dir_item(struct btrfs_root *root,
 	int filetype;
 	struct btrfs_dir_item *di;
 	struct inode_record *rec;
-	struct cache_tree *root_cache;
-	struct cache_tree *inode_cache;
+	struct inode_table *root_cache;
+	struct inode_table *inode_cache;
 	struct btrfs_key location;
 	char namebuf[BTRFS_NAME_LEN];
 
@@ -894,7 +1113,7 @@ static int process_inode_ref(struct extent_buffer *eb,
 	u32 name_len;
 	u64 index;
 	int error;
-	struct cache_tree *inode_cache;
+	struct inode_table *inode_cache;
 	struct btrfs_inode_ref *ref;
 	char namebuf[BTRFS_NAME_LEN];
 
@@ -934,7 +1153,7 @@ static int process_inode_extref(struct extent_buffer *eb,
 	u64 index;
 	u64 parent;
 	int error;
-	struct cache_tree *inode_cache;
+	struct inode_table *inode_cache;
 	struct btrfs_inode_extref *extref;
 	char namebuf[BTRFS_NAME_LEN];
 
@@ -1118,7 +1337,7 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 	u32 nritems;
 	int i;
 	int ret = 0;
-	struct cache_tree *inode_cache;
+	struct inode_table *inode_cache;
 	struct shared_node *active_node;
 
 	if (wc->root_level == wc->active_node &&
@@ -1318,19 +1537,30 @@ out:
 	return ret;
 }
 
+static int cmp_inode_rec_ino(const void *a, const void *b)
+{
+	const struct inode_record *ra = *(struct inode_record * const *)a;
+	const struct inode_record *rb = *(struct inode_record * const *)b;
+
+	if (ra->ino < rb->ino)
+		return -1;
+	return ra->ino > rb->ino;
+}
+
 static int check_inode_recs(struct btrfs_root *root,
-			    struct cache_tree *inode_cache)
+			    struct inode_table *inode_cache)
 {
-	struct cache_extent *cache;
-	struct ptr_node *node;
+	struct inode_record **recs;
 	struct inode_record *rec;
 	struct inode_backref *backref;
 	int ret;
+	u32 nr = 0;
+	u32 i;
 	u64 error = 0;
 	u64 root_dirid = btrfs_root_dirid(&root->root_item);
 
 	if (btrfs_root_refs(&root->root_item) == 0) {
-		if (!cache_tree_empty(inode_cache))
+		if (!inode_table_empty(inode_cache))
 			fprintf(stderr, "warning line %d\n", __LINE__);
 		return 0;
 	}
@@ -1350,14 +1580,18 @@ static int check_inode_recs(struct btrfs_root *root,
 			(unsigned long long)root_dirid);
 	}
 
-	while (1) {
-		cache = find_first_cache_extent(inode_cache, 0);
-		if (!cache)
-			break;
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		remove_cache_extent(inode_cache, &node->cache);
-		free(node);
+	/* report in inode number order */
+	recs = malloc(sizeof(*recs) * (inode_cache->nr + 1));
+	BUG_ON(!recs);
+	for (i = 0; i < inode_cache->size; i++) {
+		if (inode_cache->entries[i].rec)
+			recs[nr++] = inode_cache->entries[i].rec;
+	}
+	inode_table_release(inode_cache);
+	qsort(recs, nr, sizeof(*recs), cmp_inode_rec_ino);
+
+	for (i = 0; i < nr; i++) {
+		rec = recs[i];
 		if (rec->ino == root_dirid ||
 		    rec->ino == BTRFS_ORPHAN_OBJECTID) {
 			free_inode_rec(rec);
@@ -1398,6 +1632,7 @@ static int check_inode_recs(struct btrfs_root *root,
 		}
 		free_inode_rec(rec);
 	}
+	free(recs);
 	return (error > 0) ? -1 : 0;
 }
 
@@ -1518,28 +1753,129 @@ static int add_root_backref(struct cache_tree *root_cache,
 	return 0;
 }
 
+static struct checkpoint_root *get_checkpoint_root(struct cache_tree *roots,
+						   u64 objectid)
+{
+	struct cache_extent *cache;
+
+	cache = find_cache_extent(roots, objectid, 1);
+	if (!cache)
+		return NULL;
+	return container_of(cache, struct checkpoint_root, cache);
+}
+
+static struct checkpoint_root *new_checkpoint_root(struct cache_tree *roots,
+						   u64 objectid)
+{
+	struct checkpoint_root *rec;
+	int ret;
+
+	rec = get_checkpoint_root(roots, objectid);
+	if (rec)
+		return rec;
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return NULL;
+	rec->cache.start = objectid;
+	rec->cache.size = 1;
+	INIT_LIST_HEAD(&rec->links);
+	ret = insert_existing_cache_extent(roots, &rec->cache);
+	BUG_ON(ret);
+	return rec;
+}
+
+static int add_checkpoint_root(struct cache_tree *roots, u64 objectid,
+			       u64 bytenr, u64 generation, u64 inodes)
+{
+	struct checkpoint_root *rec;
+
+	rec = new_checkpoint_root(roots, objectid);
+	if (!rec)
+		return -ENOMEM;
+	rec->bytenr = bytenr;
+	rec->generation = generation;
+	rec->inodes = inodes;
+	return 0;
+}
+
+static int add_checkpoint_link(struct cache_tree *roots, u64 objectid,
+			       u64 child, u64 dir, u64 index, u8 type,
+			       const char *name, int namelen)
+{
+	struct checkpoint_root *rec;
+	struct checkpoint_link *link;
+
+	rec = new_checkpoint_root(roots, objectid);
+	if (!rec)
+		return -ENOMEM;
+	link = malloc(sizeof(*link) + namelen);
+	if (!link)
+		return -ENOMEM;
+	link->child = child;
+	link->dir = dir;
+	link->index = index;
+	link->type = type;
+	link->namelen = namelen;
+	memcpy(link->name, name, namelen);
+	list_add_tail(&link->list, &rec->links);
+	return 0;
+}
+
+static void free_checkpoint_roots(struct cache_tree *roots)
+{
+	struct cache_extent *cache;
+	struct checkpoint_root *rec;
+	struct checkpoint_link *link;
+
+	while (1) {
+		cache = find_first_cache_extent(roots, 0);
+		if (!cache)
+			break;
+		remove_cache_extent(roots, cache);
+		rec = container_of(cache, struct checkpoint_root, cache);
+		while (!list_empty(&rec->links)) {
+			link = list_entry(rec->links.next,
+					  struct checkpoint_link, list);
+			list_del(&link->list);
+			free(link);
+		}
+		free(rec);
+	}
+}
+
+/*
+ * an entry in root that points to another root.  It's also kept for the
+ * checkpoint, so the root ref check can use it while root is skipped.
+ */
+static void merge_root_backref(struct btrfs_root *root,
+			       struct cache_tree *dst_cache, u64 child,
+			       struct inode_backref *backref, int type)
+{
+	add_root_backref(dst_cache, child, root->root_key.objectid,
+			 backref->dir, backref->index, backref->name,
+			 backref->namelen, type, backref->errors);
+	add_checkpoint_link(&checkpoint_roots, root->root_key.objectid,
+			    child, backref->dir, backref->index, type,
+			    backref->name, backref->namelen);
+}
+
 static int merge_root_recs(struct btrfs_root *root,
-			   struct cache_tree *src_cache,
+			   struct inode_table *src_cache,
 			   struct cache_tree *dst_cache)
 {
-	struct cache_extent *cache;
-	struct ptr_node *node;
 	struct inode_record *rec;
 	struct inode_backref *backref;
+	u32 i;
 
 	if (root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
 		free_inode_recs(src_cache);
 		return 0;
 	}
 
-	while (1) {
-		cache = find_first_cache_extent(src_cache, 0);
-		if (!cache)
-			break;
-		node = container_of(cache, struct ptr_node, cache);
-		rec = node->data;
-		remove_cache_extent(src_cache, &node->cache);
-		free(node);
+	for (i = 0; i < src_cache->size; i++) {
+		rec = src_cache->entries[i].rec;
+		if (!rec)
+			continue;
 
 		if (!is_child_root(root, root->objectid, rec->ino))
 			goto skip;
@@ -1547,21 +1883,18 @@ static int merge_root_recs(struct btrfs_root *root,
 		list_for_each_entry(backref, &rec->backrefs, list) {
 			BUG_ON(backref->found_inode_ref);
 			if (backref->found_dir_item)
-				add_root_backref(dst_cache, rec->ino,
-					root->root_key.objectid, backref->dir,
-					backref->index, backref->name,
-					backref->namelen, BTRFS_DIR_ITEM_KEY,
-					backref->errors);
+				merge_root_backref(root, dst_cache, rec->ino,
+						   backref,
+						   BTRFS_DIR_ITEM_KEY);
 			if (backref->found_dir_index)
-				add_root_backref(dst_cache, rec->ino,
-					root->root_key.objectid, backref->dir,
-					backref->index, backref->name,
-					backref->namelen, BTRFS_DIR_INDEX_KEY,
-					backref->errors);
+				merge_root_backref(root, dst_cache, rec->ino,
+						   backref,
+						   BTRFS_DIR_INDEX_KEY);
 		}
 skip:
 		free_inode_rec(rec);
 	}
+	inode_table_release(src_cache);
 	return 0;
 }
 
@@ -1706,6 +2039,48 @@ static int process_root_ref(struct extent_buffer *eb, int slot,
 	return 0;
 }
 
+/* share the records of one inode cache with another one */
+static void copy_inode_recs(struct inode_table *src, struct inode_table *dst)
+{
+	struct inode_record *rec;
+	u32 i;
+	int ret;
+
+	for (i = 0; i < src->size; i++) {
+		rec = src->entries[i].rec;
+		if (!rec)
+			continue;
+		rec->refs++;
+		ret = inode_table_insert(dst, rec);
+		BUG_ON(ret);
+	}
+}
+
+static int can_share_check(struct btrfs_root *root)
+{
+	if (root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+		return 0;
+	if (btrfs_root_refs(&root->root_item) == 0)
+		return 0;
+	return 1;
+}
+
+static void free_checked_trees(struct cache_tree *checked)
+{
+	struct cache_extent *cache;
+	struct checked_tree *tree;
+
+	while (1) {
+		cache = find_first_cache_extent(checked, 0);
+		if (!cache)
+			break;
+		tree = container_of(cache, struct checked_tree, cache);
+		remove_cache_extent(checked, cache);
+		free_inode_recs(&tree->root_refs);
+		free(tree);
+	}
+}
+
 static int check_fs_root(struct btrfs_root *root,
 			 struct cache_tree *root_cache,
 			 struct walk_control *wc)
@@ -1717,6 +2092,8 @@ static int check_fs_root(struct btrfs_root *root,
 	struct shared_node root_node;
 	struct root_record *rec;
 	struct btrfs_root_item *root_item = &root->root_item;
+	struct checked_tree *checked = NULL;
+	struct cache_extent *cache;
 
 	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
 		rec = get_root_rec(root_cache, root->root_key.objectid);
@@ -1724,10 +2101,39 @@ static int check_fs_root(struct btrfs_root *root,
 			rec->found_root_item = 1;
 	}
 
+	if (can_share_check(root)) {
+		cache = find_cache_extent(&wc->checked, root->node->start, 1);
+		if (cache) {
+			struct inode_table root_refs;
+
+			checked = container_of(cache, struct checked_tree,
+					       cache);
+			inode_table_init(&root_refs);
+			copy_inode_recs(&checked->root_refs, &root_refs);
+			merge_root_recs(root, &root_refs, root_cache);
+			root_inodes_seen = checked->inodes;
+			if (checked->ret)
+				fprintf(stderr, "root %llu shares its tree "
+					"with root %llu\n",
+					(unsigned long long)
+					root->root_key.objectid,
+					(unsigned long long)checked->objectid);
+			return checked->ret;
+		}
+
+		checked = calloc(1, sizeof(*checked));
+		if (checked) {
+			checked->cache.start = root->node->start;
+			checked->cache.size = 1;
+			checked->objectid = root->root_key.objectid;
+			inode_table_init(&checked->root_refs);
+		}
+	}
+
 	btrfs_init_path(&path);
 	memset(&root_node, 0, sizeof(root_node));
-	cache_tree_init(&root_node.root_cache);
-	cache_tree_init(&root_node.inode_cache);
+	inode_table_init(&root_node.root_cache);
+	inode_table_init(&root_node.inode_cache);
 
 	level = btrfs_header_level(root->node);
 	memset(wc->nodes, 0, sizeof(wc->nodes));
@@ -1770,6 +2176,8 @@ static int check_fs_root(struct btrfs_root *root,
 	}
 	btrfs_release_path(root, &path);
 
+	if (checked)
+		copy_inode_recs(&root_node.root_cache, &checked->root_refs);
 	merge_root_recs(root, &root_node.root_cache, root_cache);
 
 	if (root_node.current) {
@@ -1779,6 +2187,13 @@ static int check_fs_root(struct btrfs_root *root,
 	}
 
 	ret = check_inode_recs(root, &root_node.inode_cache);
+	if (checked) {
+		checked->ret = ret;
+		checked->inodes = root_inodes_seen;
+		wret = insert_existing_cache_extent(&wc->checked,
+						    &checked->cache);
+		BUG_ON(wret);
+	}
 	return ret;
 }
 
@@ -1793,47 +2208,126 @@ static int fs_root_objectid(u64 objectid)
 	return 0;
 }
 
-static int check_fs_roots(struct btrfs_root *root,
-			  struct cache_tree *root_cache)
+/*
+ * in incremental mode, an fs root whose root node is the same one we
+ * checked at the last checkpoint doesn't need to be walked again
+ */
+static int skip_unchanged_fs_root(struct extent_buffer *leaf, int slot,
+				  struct btrfs_key *key,
+				  struct cache_tree *root_cache)
 {
-	struct btrfs_path path;
-	struct btrfs_key key;
-	struct walk_control wc;
-	struct extent_buffer *leaf;
-	struct btrfs_root *tmp_root;
-	struct btrfs_root *tree_root = root->fs_info->tree_root;
-	int ret;
-	int err = 0;
+	struct btrfs_root_item *ri;
+	struct checkpoint_root *ckpt;
+	struct checkpoint_link *link;
+	struct root_record *rec;
+	u64 bytenr;
+	u64 generation;
 
-	memset(&wc, 0, sizeof(wc));
-	cache_tree_init(&wc.shared);
-	btrfs_init_path(&path);
+	if (!last_checkpoint || key->objectid == BTRFS_TREE_RELOC_OBJECTID)
+		return 0;
 
-	key.offset = 0;
-	key.objectid = 0;
-	key.type = BTRFS_ROOT_ITEM_KEY;
-	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
-	BUG_ON(ret < 0);
-	while (1) {
-		leaf = path.nodes[0];
-		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
-			ret = btrfs_next_leaf(tree_root, &path);
-			if (ret != 0)
+	ckpt = get_checkpoint_root(&last_checkpoint->roots, key->objectid);
+	if (!ckpt)
+		return 0;
+
+	ri = btrfs_item_ptr(leaf, slot, struct btrfs_root_item);
+	bytenr = btrfs_disk_root_bytenr(leaf, ri);
+	generation = btrfs_disk_root_generation(leaf, ri);
+	if (bytenr != ckpt->bytenr || generation != ckpt->generation)
+		return 0;
+
+	rec = get_root_rec(root_cache, key->objectid);
+	if (btrfs_disk_root_refs(leaf, ri) > 0)
+		rec->found_root_item = 1;
+
+	/*
+	 * the tree is unchanged, so are its entries for other roots.  They
+	 * go into the root ref check as if they had been found again.
+	 */
+	list_for_each_entry(link, &ckpt->links, list) {
+		add_root_backref(root_cache, link->child, key->objectid,
+				 link->dir, link->index, link->name,
+				 link->namelen, link->type, 0);
+		add_checkpoint_link(&checkpoint_roots, key->objectid,
+				    link->child, link->dir, link->index,
+				    link->type, link->name, link->namelen);
+	}
+
+	add_checkpoint_root(&checkpoint_roots, key->objectid, bytenr,
+			    generation, ckpt->inodes);
+	skipped_fs_roots++;
+	return 1;
+}
+
+static void free_shared_nodes(struct cache_tree *shared)
+{
+	struct cache_extent *cache;
+	struct shared_node *node;
+
+	while (1) {
+		cache = find_first_cache_extent(shared, 0);
+		if (!cache)
+			break;
+		node = container_of(cache, struct shared_node, cache);
+		free_inode_recs(&node->root_cache);
+		free_inode_recs(&node->inode_cache);
+		remove_cache_extent(shared, &node->cache);
+		free(node);
+	}
+}
+
+static int check_fs_roots(struct btrfs_root *root,
+			  struct cache_tree *root_cache)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct walk_control wc;
+	struct extent_buffer *leaf;
+	struct btrfs_root *tmp_root;
+	struct btrfs_root *tree_root = root->fs_info->tree_root;
+	int ret;
+	int err = 0;
+
+	memset(&wc, 0, sizeof(wc));
+	cache_tree_init(&wc.shared);
+	cache_tree_init(&wc.checked);
+	btrfs_init_path(&path);
+
+	key.offset = 0;
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	BUG_ON(ret < 0);
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret != 0)
 				break;
 			leaf = path.nodes[0];
 		}
 		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
+			if (skip_unchanged_fs_root(leaf, path.slots[0], &key,
+						   root_cache))
+				goto next;
 			tmp_root = btrfs_read_fs_root_no_cache(root->fs_info,
 							       &key);
 			if (IS_ERR(tmp_root)) {
 				err = 1;
 				goto next;
 			}
+			root_inodes_seen = 0;
 			ret = check_fs_root(tmp_root, root_cache, &wc);
 			if (ret)
 				err = 1;
+			if (key.objectid != BTRFS_TREE_RELOC_OBJECTID)
+				add_checkpoint_root(&checkpoint_roots,
+					key.objectid,
+					btrfs_root_bytenr(&tmp_root->root_item),
+					btrfs_root_generation(&tmp_root->root_item),
+					root_inodes_seen);
 			btrfs_free_fs_root(root->fs_info, tmp_root);
 		} else if (key.type == BTRFS_ROOT_REF_KEY ||
 			   key.type == BTRFS_ROOT_BACKREF_KEY) {
@@ -1845,8 +2339,16 @@ next:
 	}
 	btrfs_release_path(tree_root, &path);
 
-	if (!cache_tree_empty(&wc.shared))
-		fprintf(stderr, "warning line %d\n", __LINE__);
+	/*
+	 * shared blocks that are also referenced by skipped roots never
+	 * reach a zero ref count
+	 */
+	if (!cache_tree_empty(&wc.shared)) {
+		if (!skipped_fs_roots)
+			fprintf(stderr, "warning line %d\n", __LINE__);
+		free_shared_nodes(&wc.shared);
+	}
+	free_checked_trees(&wc.checked);
 
 	return err;
 }
@@ -2280,6 +2782,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 	rec->content_checked = 0;
 	rec->owner_ref_checked = 0;
 	rec->metadata = metadata;
+	rec->partial = 0;
 	INIT_LIST_HEAD(&rec->backrefs);
 
 	if (is_root)
@@ -2424,23 +2927,13 @@ static int add_pending(struct cache_tree *pending,
 }
 
 static int pick_next_pending(struct cache_tree *pending,
-			struct cache_tree *reada,
 			struct cache_tree *nodes,
-			u64 last, struct block_info *bits, int bits_nr,
-			int *reada_bits)
+			u64 last, struct block_info *bits, int bits_nr)
 {
 	unsigned long node_start = last;
 	struct cache_extent *cache;
 	int ret;
 
-	cache = find_first_cache_extent(reada, 0);
-	if (cache) {
-		bits[0].start = cache->start;
-		bits[1].size = cache->size;
-		*reada_bits = 1;
-		return 1;
-	}
-	*reada_bits = 0;
 	if (node_start > 32768)
 		node_start -= 32768;
 
@@ -2491,6 +2984,188 @@ static int pick_next_pending(struct cache_tree *pending,
 	return ret;
 }
 
+static struct device_queue *get_device_queue(struct block_scheduler *sched,
+					     struct btrfs_device *dev,
+					     u64 devid)
+{
+	struct cache_extent *cache;
+	struct device_queue *dq;
+	int ret;
+
+	cache = find_cache_extent(&sched->devices, devid, 1);
+	if (cache)
+		return container_of(cache, struct device_queue, cache);
+
+	dq = calloc(1, sizeof(*dq));
+	if (!dq)
+		return NULL;
+	dq->cache.start = devid;
+	dq->cache.size = 1;
+	dq->dev = dev;
+	cache_tree_init(&dq->blocks);
+	ret = insert_existing_cache_extent(&sched->devices, &dq->cache);
+	BUG_ON(ret);
+	return dq;
+}
+
+/*
+ * issue readahead for the next reada_depth blocks of the current sweep.
+ * Blocks that couldn't be mapped are read through the normal path.
+ */
+static void device_queue_reada(struct block_scheduler *sched,
+			       struct device_queue *dq)
+{
+	struct cache_extent *cache;
+	struct queued_block *qb;
+	int wrapped = 0;
+	int i;
+
+	if (!dq->dev || dq->dev->fd <= 0)
+		return;
+
+	cache = find_first_cache_extent(&dq->blocks, dq->head);
+	for (i = 0; i < sched->reada_depth; i++) {
+		if (!cache) {
+			if (wrapped++)
+				break;
+			cache = find_first_cache_extent(&dq->blocks, 0);
+			if (!cache)
+				break;
+		}
+		if (wrapped && cache->start >= dq->head)
+			break;
+		qb = container_of(cache, struct queued_block, cache);
+		if (!qb->reada) {
+			readahead(dq->dev->fd, qb->cache.start, qb->size);
+			dq->dev->total_ios++;
+			qb->reada = 1;
+		}
+		cache = next_cache_extent(cache);
+	}
+}
+
+static int sched_add_block(struct btrfs_root *root,
+			   struct block_scheduler *sched, u64 bytenr, u32 size)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *dev = NULL;
+	struct device_queue *dq;
+	struct queued_block *qb;
+	u64 length = size;
+	u64 physical = bytenr;
+	u64 devid = 0;
+	int ret;
+
+	qb = calloc(1, sizeof(*qb));
+	if (!qb)
+		return -ENOMEM;
+	qb->bytenr = bytenr;
+	qb->size = size;
+
+	ret = btrfs_map_block(&root->fs_info->mapping_tree, READ, bytenr,
+			      &length, &multi, 0, NULL);
+	if (!ret) {
+		dev = multi->stripes[0].dev;
+		physical = multi->stripes[0].physical;
+		devid = dev->devid;
+		kfree(multi);
+	}
+
+again:
+	dq = get_device_queue(sched, dev, devid);
+	if (!dq) {
+		free(qb);
+		return -ENOMEM;
+	}
+	qb->cache.start = physical;
+	qb->cache.size = size;
+	ret = insert_existing_cache_extent(&dq->blocks, &qb->cache);
+	if (ret == -EEXIST && devid != 0) {
+		/* overlapping physical ranges, queue it by logical address */
+		dev = NULL;
+		devid = 0;
+		physical = bytenr;
+		goto again;
+	}
+	BUG_ON(ret);
+	dq->nr++;
+	sched->nr++;
+	if (dq->nr <= sched->reada_depth)
+		device_queue_reada(sched, dq);
+	return 0;
+}
+
+/*
+ * pick the next block to process.  Devices are served round robin so
+ * readahead keeps every spindle busy, and each device queue is walked in
+ * ascending physical order, wrapping around at the end.
+ */
+static int sched_next_block(struct block_scheduler *sched,
+			    u64 *bytenr, u32 *size)
+{
+	struct cache_extent *cache;
+	struct device_queue *dq;
+	struct queued_block *qb;
+	int loops = 0;
+
+	if (sched->nr == 0)
+		return 0;
+
+	cache = find_first_cache_extent(&sched->devices, sched->next_devid);
+	while (1) {
+		if (!cache) {
+			BUG_ON(loops++);
+			cache = find_first_cache_extent(&sched->devices, 0);
+			continue;
+		}
+		dq = container_of(cache, struct device_queue, cache);
+		if (dq->nr)
+			break;
+		cache = next_cache_extent(cache);
+	}
+
+	cache = find_first_cache_extent(&dq->blocks, dq->head);
+	if (!cache)
+		cache = find_first_cache_extent(&dq->blocks, 0);
+	BUG_ON(!cache);
+	qb = container_of(cache, struct queued_block, cache);
+	remove_cache_extent(&dq->blocks, cache);
+	dq->head = qb->cache.start + qb->cache.size;
+	dq->nr--;
+	sched->nr--;
+	sched->next_devid = dq->cache.start + 1;
+
+	*bytenr = qb->bytenr;
+	*size = qb->size;
+	free(qb);
+
+	device_queue_reada(sched, dq);
+	return 1;
+}
+
+static void free_block_scheduler(struct block_scheduler *sched)
+{
+	struct cache_extent *cache;
+	struct device_queue *dq;
+
+	while (1) {
+		cache = find_first_cache_extent(&sched->devices, 0);
+		if (!cache)
+			break;
+		dq = container_of(cache, struct device_queue, cache);
+		while (1) {
+			cache = find_first_cache_extent(&dq->blocks, 0);
+			if (!cache)
+				break;
+			remove_cache_extent(&dq->blocks, cache);
+			free(container_of(cache, struct queued_block, cache));
+		}
+		remove_cache_extent(&sched->devices, &dq->cache);
+		free(dq);
+	}
+	sched->nr = 0;
+}
+
 #ifdef BTRFS_COMPAT_EXTENT_TREE_V0
 static int process_extent_ref_v0(struct cache_tree *extent_cache,
 				 struct extent_buffer *leaf, int slot)
@@ -2510,6 +3185,51 @@ static int process_extent_ref_v0(struct cache_tree *extent_cache,
 }
 #endif
 
+/*
+ * keyed backrefs of an extent, returns 0 if the item was one of them
+ */
+static int process_extent_ref(struct btrfs_root *root,
+			      struct cache_tree *extent_cache,
+			      struct extent_buffer *eb, int slot)
+{
+	struct btrfs_key key;
+
+	btrfs_item_key_to_cpu(eb, &key, slot);
+
+	if (key.type == BTRFS_TREE_BLOCK_REF_KEY) {
+		add_tree_backref(extent_cache, key.objectid, 0,
+				 key.offset, 0);
+		return 0;
+	}
+	if (key.type == BTRFS_SHARED_BLOCK_REF_KEY) {
+		add_tree_backref(extent_cache, key.objectid,
+				 key.offset, 0, 0);
+		return 0;
+	}
+	if (key.type == BTRFS_EXTENT_DATA_REF_KEY) {
+		struct btrfs_extent_data_ref *ref;
+		ref = btrfs_item_ptr(eb, slot, struct btrfs_extent_data_ref);
+		add_data_backref(extent_cache,
+			key.objectid, 0,
+			btrfs_extent_data_ref_root(eb, ref),
+			btrfs_extent_data_ref_objectid(eb, ref),
+			btrfs_extent_data_ref_offset(eb, ref),
+			btrfs_extent_data_ref_count(eb, ref),
+			0, root->sectorsize);
+		return 0;
+	}
+	if (key.type == BTRFS_SHARED_DATA_REF_KEY) {
+		struct btrfs_shared_data_ref *ref;
+		ref = btrfs_item_ptr(eb, slot, struct btrfs_shared_data_ref);
+		add_data_backref(extent_cache,
+			key.objectid, key.offset, 0, 0, 0,
+			btrfs_shared_data_ref_count(eb, ref),
+			0, root->sectorsize);
+		return 0;
+	}
+	return 1;
+}
+
 static int process_extent_item(struct btrfs_root *root,
 			       struct cache_tree *extent_cache,
 			       struct extent_buffer *eb, int slot)
@@ -2557,6 +3277,20 @@ static int process_extent_item(struct btrfs_root *root,
 	add_extent_rec(extent_cache, NULL, key.objectid, num_bytes,
 		       refs, 0, 0, 0, metadata, num_bytes);
 
+	/*
+	 * extents older than the checkpoint may be referenced from blocks
+	 * we skipped, we can only verify the references we did find
+	 */
+	if (incremental_gen &&
+	    btrfs_extent_generation(eb, ei) <= incremental_gen) {
+		struct cache_extent *cache;
+
+		cache = find_cache_extent(extent_cache, key.objectid, 1);
+		if (cache)
+			container_of(cache, struct extent_record,
+				     cache)->partial = 1;
+	}
+
 	ptr = (unsigned long)(ei + 1);
 	if (btrfs_extent_flags(eb, ei) & BTRFS_EXTENT_FLAG_TREE_BLOCK &&
 	    key.type == BTRFS_EXTENT_ITEM_KEY)
@@ -2787,13 +3521,45 @@ static int check_csums(struct btrfs_root *root)
 	return errors;
 }
 
+static int queue_pending_blocks(struct btrfs_root *root,
+				struct block_info *bits, int bits_nr,
+				u64 last, struct cache_tree *pending,
+				struct cache_tree *nodes,
+				struct block_scheduler *sched)
+{
+	struct cache_extent *cache;
+	int nr;
+	int i;
+	int ret;
+
+	nr = pick_next_pending(pending, nodes, last, bits, bits_nr);
+	for (i = 0; i < nr; i++) {
+		cache = find_cache_extent(nodes, bits[i].start, bits[i].size);
+		if (cache) {
+			remove_cache_extent(nodes, cache);
+			free(cache);
+		}
+		cache = find_cache_extent(pending, bits[i].start,
+					  bits[i].size);
+		if (cache) {
+			remove_cache_extent(pending, cache);
+			free(cache);
+		}
+		ret = sched_add_block(root, sched, bits[i].start,
+				      bits[i].size);
+		if (ret)
+			return ret;
+	}
+	return nr;
+}
+
 static int run_next_block(struct btrfs_root *root,
 			  struct block_info *bits,
 			  int bits_nr,
 			  u64 *last,
 			  struct cache_tree *pending,
 			  struct cache_tree *seen,
-			  struct cache_tree *reada,
+			  struct block_scheduler *sched,
 			  struct cache_tree *nodes,
 			  struct cache_tree *extent_cache)
 {
@@ -2807,43 +3573,17 @@ static int run_next_block(struct btrfs_root *root,
 	int i;
 	int nritems;
 	struct btrfs_key key;
-	struct cache_extent *cache;
-	int reada_bits;
-
-	ret = pick_next_pending(pending, reada, nodes, *last, bits,
-				bits_nr, &reada_bits);
-	if (ret == 0) {
-		return 1;
-	}
-	if (!reada_bits) {
-		for(i = 0; i < ret; i++) {
-			insert_cache_extent(reada, bits[i].start,
-					    bits[i].size);
-
-			/* fixme, get the parent transid */
-			readahead_tree_block(root, bits[i].start,
-					     bits[i].size, 0);
-		}
-	}
-	*last = bits[0].start;
-	bytenr = bits[0].start;
-	size = bits[0].size;
 
-	cache = find_cache_extent(pending, bytenr, size);
-	if (cache) {
-		remove_cache_extent(pending, cache);
-		free(cache);
-	}
-	cache = find_cache_extent(reada, bytenr, size);
-	if (cache) {
-		remove_cache_extent(reada, cache);
-		free(cache);
-	}
-	cache = find_cache_extent(nodes, bytenr, size);
-	if (cache) {
-		remove_cache_extent(nodes, cache);
-		free(cache);
+	/* keep the device queues topped up */
+	if (sched->nr < bits_nr / 2) {
+		ret = queue_pending_blocks(root, bits, bits_nr - sched->nr,
+					   *last, pending, nodes, sched);
+		if (ret < 0)
+			return ret;
 	}
+	if (!sched_next_block(sched, &bytenr, &size))
+		return 1;
+	*last = bytenr;
 
 	/* fixme, get the real parent transid */
 	buf = read_tree_block(root, bytenr, size, 0);
@@ -2905,40 +3645,8 @@ static int run_next_block(struct btrfs_root *root,
 				continue;
 			}
 
-			if (key.type == BTRFS_TREE_BLOCK_REF_KEY) {
-				add_tree_backref(extent_cache, key.objectid, 0,
-						 key.offset, 0);
-				continue;
-			}
-			if (key.type == BTRFS_SHARED_BLOCK_REF_KEY) {
-				add_tree_backref(extent_cache, key.objectid,
-						 key.offset, 0, 0);
-				continue;
-			}
-			if (key.type == BTRFS_EXTENT_DATA_REF_KEY) {
-				struct btrfs_extent_data_ref *ref;
-				ref = btrfs_item_ptr(buf, i,
-						struct btrfs_extent_data_ref);
-				add_data_backref(extent_cache,
-					key.objectid, 0,
-					btrfs_extent_data_ref_root(buf, ref),
-					btrfs_extent_data_ref_objectid(buf,
-								       ref),
-					btrfs_extent_data_ref_offset(buf, ref),
-					btrfs_extent_data_ref_count(buf, ref),
-					0, root->sectorsize);
+			if (!process_extent_ref(root, extent_cache, buf, i))
 				continue;
-			}
-			if (key.type == BTRFS_SHARED_DATA_REF_KEY) {
-				struct btrfs_shared_data_ref *ref;
-				ref = btrfs_item_ptr(buf, i,
-						struct btrfs_shared_data_ref);
-				add_data_backref(extent_cache,
-					key.objectid, key.offset, 0, 0, 0, 
-					btrfs_shared_data_ref_count(buf, ref),
-					0, root->sectorsize);
-				continue;
-			}
 			if (key.type != BTRFS_EXTENT_DATA_KEY)
 				continue;
 			fi = btrfs_item_ptr(buf, i,
@@ -2980,6 +3688,7 @@ static int run_next_block(struct btrfs_root *root,
 		for (i = 0; i < nritems; i++) {
 			u64 ptr = btrfs_node_blockptr(buf, i);
 			u32 size = btrfs_level_size(root, level - 1);
+
 			btrfs_node_key_to_cpu(buf, &key, i);
 			ret = add_extent_rec(extent_cache, &key,
 					     ptr, size, 0, 0, 1, 0, 1, size);
@@ -2987,6 +3696,16 @@ static int run_next_block(struct btrfs_root *root,
 
 			add_tree_backref(extent_cache, ptr, parent, owner, 1);
 
+			/*
+			 * unchanged blocks are not read, but the reference
+			 * to them is still checked against the extent tree
+			 */
+			if (incremental_gen &&
+			    btrfs_node_ptr_generation(buf, i) <=
+			    incremental_gen) {
+				skipped_btree_bytes += size;
+				continue;
+			}
 			if (level > 1) {
 				add_pending(nodes, seen, ptr, size);
 			} else {
@@ -3018,6 +3737,12 @@ static int add_root_to_pending(struct extent_buffer *buf,
 			       struct cache_tree *nodes,
 			       struct btrfs_key *root_key)
 {
+	if (incremental_gen &&
+	    btrfs_header_generation(buf) <= incremental_gen) {
+		skipped_btree_bytes += buf->len;
+		return 0;
+	}
+
 	if (btrfs_header_level(buf) > 0)
 		add_pending(nodes, seen, buf->start, buf->len);
 	else
@@ -3106,6 +3831,17 @@ out:
 	return 0;
 }
 
+static int is_extent_ref_key(u8 type)
+{
+	return type == BTRFS_EXTENT_ITEM_KEY ||
+	       type == BTRFS_METADATA_ITEM_KEY ||
+	       type == BTRFS_TREE_BLOCK_REF_KEY ||
+	       type == BTRFS_EXTENT_DATA_REF_KEY ||
+	       type == BTRFS_EXTENT_REF_V0_KEY ||
+	       type == BTRFS_SHARED_BLOCK_REF_KEY ||
+	       type == BTRFS_SHARED_DATA_REF_KEY;
+}
+
 static int delete_extent_records(struct btrfs_trans_handle *trans,
 				 struct btrfs_root *root,
 				 struct btrfs_path *path,
@@ -3114,8 +3850,11 @@ static int delete_extent_records(struct btrfs_trans_handle *trans,
 	struct btrfs_key key;
 	struct btrfs_key found_key;
 	struct extent_buffer *leaf;
+	u64 bytes;
 	int ret;
 	int slot;
+	int del_slot;
+	int i;
 
 
 	key.objectid = bytenr;
@@ -3143,13 +3882,7 @@ static int delete_extent_records(struct btrfs_trans_handle *trans,
 		if (found_key.objectid != bytenr)
 			break;
 
-		if (found_key.type != BTRFS_EXTENT_ITEM_KEY &&
-		    found_key.type != BTRFS_METADATA_ITEM_KEY &&
-		    found_key.type != BTRFS_TREE_BLOCK_REF_KEY &&
-		    found_key.type != BTRFS_EXTENT_DATA_REF_KEY &&
-		    found_key.type != BTRFS_EXTENT_REF_V0_KEY &&
-		    found_key.type != BTRFS_SHARED_BLOCK_REF_KEY &&
-		    found_key.type != BTRFS_SHARED_DATA_REF_KEY) {
+		if (!is_extent_ref_key(found_key.type)) {
 			btrfs_release_path(NULL, path);
 			if (found_key.type == 0) {
 				if (found_key.offset == 0)
@@ -3162,25 +3895,42 @@ static int delete_extent_records(struct btrfs_trans_handle *trans,
 			continue;
 		}
 
-		fprintf(stderr, "repair deleting extent record: key %Lu %u %Lu\n",
-			found_key.objectid, found_key.type, found_key.offset);
-
-		ret = btrfs_del_item(trans, root->fs_info->extent_root, path);
-		if (ret)
-			break;
-		btrfs_release_path(NULL, path);
+		/*
+		 * the records for bytenr are adjacent, drop the whole run
+		 * in this leaf with a single delete
+		 */
+		del_slot = slot;
+		while (del_slot > 0) {
+			btrfs_item_key_to_cpu(leaf, &found_key, del_slot - 1);
+			if (found_key.objectid != bytenr ||
+			    !is_extent_ref_key(found_key.type))
+				break;
+			del_slot--;
+		}
 
-		if (found_key.type == BTRFS_EXTENT_ITEM_KEY ||
-		    found_key.type == BTRFS_METADATA_ITEM_KEY) {
-			u64 bytes = (found_key.type == BTRFS_EXTENT_ITEM_KEY) ?
+		for (i = del_slot; i <= slot; i++) {
+			btrfs_item_key_to_cpu(leaf, &found_key, i);
+			fprintf(stderr, "repair deleting extent record: key %Lu %u %Lu\n",
+				found_key.objectid, found_key.type,
+				found_key.offset);
+			if (found_key.type != BTRFS_EXTENT_ITEM_KEY &&
+			    found_key.type != BTRFS_METADATA_ITEM_KEY)
+				continue;
+			bytes = (found_key.type == BTRFS_EXTENT_ITEM_KEY) ?
 				found_key.offset : root->leafsize;
-
 			ret = btrfs_update_block_group(trans, root, bytenr,
 						       bytes, 0, 0);
 			if (ret)
-				break;
+				goto out;
 		}
+
+		ret = btrfs_del_items(trans, root->fs_info->extent_root, path,
+				      del_slot, slot - del_slot + 1);
+		if (ret)
+			break;
+		btrfs_release_path(NULL, path);
 	}
+out:
 
 	btrfs_release_path(NULL, path);
 	return ret;
@@ -3329,10 +4079,10 @@ fail:
  */
 static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 			     struct btrfs_fs_info *info,
+			     struct btrfs_path *path,
 			     struct extent_record *rec)
 {
 	int ret;
-	struct btrfs_path *path;
 	struct list_head *cur = rec->backrefs.next;
 	struct cache_extent *cache;
 	struct extent_backref *back;
@@ -3346,8 +4096,6 @@ static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 	if (ret < 0)
 		flags = BTRFS_BLOCK_FLAG_FULL_BACKREF;
 
-	path = btrfs_alloc_path();
-
 	/* step one, delete all the existing records */
 	ret = delete_extent_records(trans, info->extent_root, path,
 				    rec->start, rec->max_size);
@@ -3381,7 +4129,7 @@ static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 			goto out;
 	}
 out:
-	btrfs_free_path(path);
+	btrfs_release_path(NULL, path);
 	return ret;
 }
 
@@ -3535,15 +4283,227 @@ static int check_block_groups(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
-static int check_extent_refs(struct btrfs_trans_handle *trans,
+/*
+ * in incremental mode the extent item and backrefs of an extent we reached
+ * may live in leaves we skipped.  Read them straight from the extent tree
+ * into a cache of their own.
+ */
+static int load_extent_backrefs(struct btrfs_root *root,
+				struct cache_tree *disk_cache, u64 bytenr)
+{
+	struct btrfs_root *extent_root = root->fs_info->extent_root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	u64 saved_bytes_used = bytes_used;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = bytenr;
+	key.type = 0;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(extent_root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != bytenr)
+			break;
+		if (key.type == BTRFS_EXTENT_ITEM_KEY ||
+		    key.type == BTRFS_METADATA_ITEM_KEY)
+			process_extent_item(root, disk_cache, leaf,
+					    path.slots[0]);
+		else
+			process_extent_ref(root, disk_cache, leaf,
+					   path.slots[0]);
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(extent_root, &path);
+	/* these records are only compared against, they don't count */
+	bytes_used = saved_bytes_used;
+	return ret;
+}
+
+static void free_disk_extent_recs(struct cache_tree *disk_cache)
+{
+	struct cache_extent *cache;
+	struct extent_record *rec;
+
+	while ((cache = find_first_cache_extent(disk_cache, 0))) {
+		rec = container_of(cache, struct extent_record, cache);
+		remove_cache_extent(disk_cache, cache);
+		free_all_extent_backrefs(rec);
+		free(rec);
+	}
+}
+
+/*
+ * checks an extent that is older than the checkpoint.  Every reference we
+ * found must have its backref in the extent tree and there can't be more
+ * references than the extent item counts, but the references from the
+ * blocks we skipped are not expected to show up.
+ *
+ * returns -ENOENT if there is no extent item at all, the caller checks
+ * those like any other record.
+ */
+static int check_partial_extent_rec(struct btrfs_root *root,
+				    struct extent_record *rec)
+{
+	struct cache_tree disk_cache;
+	struct cache_extent *cache;
+	struct extent_record *disk = NULL;
+	struct extent_backref *back;
+	struct tree_backref *tback;
+	struct data_backref *dback;
+	struct data_backref *disk_dback;
+	int err = 0;
+	int ret;
+
+	cache_tree_init(&disk_cache);
+	ret = load_extent_backrefs(root, &disk_cache, rec->start);
+	if (ret < 0) {
+		fprintf(stderr, "failed to read the backrefs of %llu: %s\n",
+			(unsigned long long)rec->start, strerror(-ret));
+		err = 1;
+		goto out;
+	}
+	cache = find_cache_extent(&disk_cache, rec->start, 1);
+	if (cache)
+		disk = container_of(cache, struct extent_record, cache);
+	if (!disk || disk->start != rec->start || !disk->extent_item_refs) {
+		err = -ENOENT;
+		goto out;
+	}
+	rec->extent_item_refs = disk->extent_item_refs;
+	rec->partial = 1;
+
+	if (rec->refs > rec->extent_item_refs) {
+		fprintf(stderr, "ref mismatch on [%llu %llu] ",
+			(unsigned long long)rec->start,
+			(unsigned long long)rec->nr);
+		fprintf(stderr, "extent item %llu, found at least %llu\n",
+			(unsigned long long)rec->extent_item_refs,
+			(unsigned long long)rec->refs);
+		err = 1;
+	}
+
+	list_for_each_entry(back, &rec->backrefs, list) {
+		if (!back->found_ref)
+			continue;
+		if (!back->is_data) {
+			tback = (struct tree_backref *)back;
+			if (find_tree_backref(disk, back->full_backref ?
+					      tback->parent : 0, tback->root))
+				continue;
+			fprintf(stderr, "Backref %llu %s %llu"
+				" not found in extent tree\n",
+				(unsigned long long)rec->start,
+				back->full_backref ? "parent" : "root",
+				(unsigned long long)tback->root);
+			err = 1;
+			continue;
+		}
+		dback = (struct data_backref *)back;
+		disk_dback = find_data_backref(disk, back->full_backref ?
+					       dback->parent : 0, dback->root,
+					       dback->owner, dback->offset);
+		if (!disk_dback) {
+			fprintf(stderr, "Backref %llu %s %llu"
+				" owner %llu offset %llu"
+				" not found in extent tree\n",
+				(unsigned long long)rec->start,
+				back->full_backref ? "parent" : "root",
+				back->full_backref ?
+				(unsigned long long)dback->parent :
+				(unsigned long long)dback->root,
+				(unsigned long long)dback->owner,
+				(unsigned long long)dback->offset);
+			err = 1;
+		} else if (dback->found_ref > disk_dback->num_refs) {
+			fprintf(stderr, "Incorrect local backref count"
+				" on %llu %s %llu owner %llu"
+				" offset %llu found at least %u wanted %u\n",
+				(unsigned long long)rec->start,
+				back->full_backref ? "parent" : "root",
+				back->full_backref ?
+				(unsigned long long)dback->parent :
+				(unsigned long long)dback->root,
+				(unsigned long long)dback->owner,
+				(unsigned long long)dback->offset,
+				dback->found_ref, disk_dback->num_refs);
+			err = 1;
+		}
+	}
+out:
+	free_disk_extent_recs(&disk_cache);
+	return err;
+}
+
+/*
+ * repairs are applied after every record has been checked, in extent
+ * tree order, with a commit every REPAIR_COMMIT_INTERVAL records so a
+ * big repair doesn't pile up into one enormous transaction.
+ */
+#define REPAIR_COMMIT_INTERVAL 512
+
+/*
+ * committing drops all the pinned extents, so the ranges we must not
+ * allocate from during repair are kept in @pins and pinned again after
+ * every commit.
+ */
+static void pin_repair_extents(struct btrfs_fs_info *info,
+			       struct extent_io_tree *pins)
+{
+	u64 start = 0;
+	u64 end;
+
+	while (!find_first_extent_bit(pins, start, &start, &end,
+				      EXTENT_DIRTY)) {
+		btrfs_pin_extent(info, start, end + 1 - start);
+		start = end + 1;
+	}
+}
+
+static int commit_repair(struct btrfs_trans_handle **trans,
+			 struct btrfs_root *root,
+			 struct extent_io_tree *pins)
+{
+	int ret;
+
+	ret = btrfs_commit_transaction(*trans, root);
+	if (ret)
+		return ret;
+	*trans = btrfs_start_transaction(root, 1);
+	pin_repair_extents(root->fs_info, pins);
+	return 0;
+}
+
+static int check_extent_refs(struct btrfs_trans_handle **trans,
 			     struct btrfs_root *root,
 			     struct cache_tree *extent_cache, int repair)
 {
 	struct extent_record *rec;
 	struct cache_extent *cache;
+	struct cache_extent *next;
+	struct extent_io_tree pins;
+	struct btrfs_path *path;
+	struct timeval start;
+	struct timeval end;
+	double elapsed;
+	u64 nr_fixed = 0;
 	int err = 0;
 	int ret = 0;
-	int fixed = 0;
 	int reinit = 0;
 
 	if (repair) {
@@ -3553,33 +4513,49 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		 * In the worst case, this will be all the
 		 * extents in the FS
 		 */
+		extent_io_tree_init(&pins);
 		cache = find_first_cache_extent(extent_cache, 0);
 		while(cache) {
 			rec = container_of(cache, struct extent_record, cache);
-			btrfs_pin_extent(root->fs_info,
-					 rec->start, rec->max_size);
+			if (rec->max_size)
+				set_extent_dirty(&pins, rec->start,
+						 rec->start + rec->max_size - 1,
+						 GFP_NOFS);
 			cache = next_cache_extent(cache);
 		}
 
 		/* pin down all the corrupted blocks too */
 		cache = find_first_cache_extent(root->fs_info->corrupt_blocks, 0);
 		while(cache) {
-			rec = container_of(cache, struct extent_record, cache);
-			btrfs_pin_extent(root->fs_info,
-					 rec->start, rec->max_size);
+			set_extent_dirty(&pins, cache->start,
+					 cache->start + cache->size - 1,
+					 GFP_NOFS);
 			cache = next_cache_extent(cache);
 		}
-		prune_corrupt_blocks(trans, root->fs_info);
-		check_block_groups(trans, root->fs_info, &reinit);
+		pin_repair_extents(root->fs_info, &pins);
+		prune_corrupt_blocks(*trans, root->fs_info);
+		check_block_groups(*trans, root->fs_info, &reinit);
 		if (reinit)
 			btrfs_read_block_groups(root->fs_info->extent_root);
 	}
-	while(1) {
-		fixed = 0;
-		cache = find_first_cache_extent(extent_cache, 0);
-		if (!cache)
-			break;
+
+	/*
+	 * nothing is modified while checking, records that need fixing
+	 * stay in the cache for the repair pass below
+	 */
+	cache = find_first_cache_extent(extent_cache, 0);
+	while(cache) {
+		next = next_cache_extent(cache);
 		rec = container_of(cache, struct extent_record, cache);
+		if (incremental_gen &&
+		    (rec->partial || !rec->extent_item_refs)) {
+			int partial_err = check_partial_extent_rec(root, rec);
+
+			if (partial_err > 0)
+				err = 1;
+			if (partial_err != -ENOENT)
+				goto free_rec;
+		}
 		if (rec->refs != rec->extent_item_refs) {
 			fprintf(stderr, "ref mismatch on [%llu %llu] ",
 				(unsigned long long)rec->start,
@@ -3587,12 +4563,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 			fprintf(stderr, "extent item %llu, found %llu\n",
 				(unsigned long long)rec->extent_item_refs,
 				(unsigned long long)rec->refs);
-			if (!fixed && repair) {
-				ret = fixup_extent_refs(trans, root->fs_info, rec);
-				if (ret)
-					goto repair_abort;
-				fixed = 1;
-			}
+			rec->needs_fix = 1;
 			err = 1;
 
 		}
@@ -3600,55 +4571,84 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 			fprintf(stderr, "backpointer mismatch on [%llu %llu]\n",
 				(unsigned long long)rec->start,
 				(unsigned long long)rec->nr);
-
-			if (!fixed && repair) {
-				ret = fixup_extent_refs(trans, root->fs_info, rec);
-				if (ret)
-					goto repair_abort;
-				fixed = 1;
-			}
-
+			rec->needs_fix = 1;
 			err = 1;
 		}
 		if (!rec->owner_ref_checked) {
 			fprintf(stderr, "owner ref check failed [%llu %llu]\n",
 				(unsigned long long)rec->start,
 				(unsigned long long)rec->nr);
-			if (!fixed && repair) {
-				ret = fixup_extent_refs(trans, root->fs_info, rec);
-				if (ret)
-					goto repair_abort;
-				fixed = 1;
-			}
+			rec->needs_fix = 1;
 			err = 1;
 		}
-
+		if (repair && rec->needs_fix) {
+			cache = next;
+			continue;
+		}
+free_rec:
 		remove_cache_extent(extent_cache, cache);
 		free_all_extent_backrefs(rec);
 		free(rec);
+		cache = next;
 	}
-repair_abort:
-	if (repair) {
-		if (ret) {
-			fprintf(stderr, "failed to repair damaged filesystem, aborting\n");
-			exit(1);
-		} else {
-			btrfs_fix_block_accounting(trans, root);
+	if (!repair)
+		return err;
+
+	/*
+	 * the free extent hook may drop records while we fix others, so
+	 * always restart from the lowest one still in the cache
+	 */
+	path = btrfs_alloc_path();
+	gettimeofday(&start, NULL);
+	while(1) {
+		cache = find_first_cache_extent(extent_cache, 0);
+		if (!cache)
+			break;
+		rec = container_of(cache, struct extent_record, cache);
+		ret = fixup_extent_refs(*trans, root->fs_info, path, rec);
+		if (ret)
+			break;
+		remove_cache_extent(extent_cache, cache);
+		free_all_extent_backrefs(rec);
+		free(rec);
+
+		if (++nr_fixed % REPAIR_COMMIT_INTERVAL == 0) {
+			ret = commit_repair(trans, root, &pins);
+			if (ret)
+				break;
 		}
-		if (err)
-			fprintf(stderr, "repaired damaged extent references\n");
-		return ret;
 	}
-	return err;
+	btrfs_free_path(path);
+
+	if (ret) {
+		fprintf(stderr, "failed to repair damaged filesystem, aborting\n");
+		exit(1);
+	}
+	btrfs_fix_block_accounting(*trans, root);
+	extent_io_tree_cleanup(&pins);
+
+	if (nr_fixed) {
+		gettimeofday(&end, NULL);
+		elapsed = (end.tv_sec - start.tv_sec) +
+			  (end.tv_usec - start.tv_usec) / 1000000.0;
+		fprintf(stderr, "fixed %llu extent records in %.2fs",
+			(unsigned long long)nr_fixed, elapsed);
+		if (elapsed > 0)
+			fprintf(stderr, " (%.0f/s)", nr_fixed / elapsed);
+		fprintf(stderr, "\n");
+	}
+	if (err)
+		fprintf(stderr, "repaired damaged extent references\n");
+	return ret;
 }
 
-static int check_extents(struct btrfs_trans_handle *trans,
+static int check_extents(struct btrfs_trans_handle **trans,
 			 struct btrfs_root *root, int repair)
 {
 	struct cache_tree extent_cache;
 	struct cache_tree seen;
 	struct cache_tree pending;
-	struct cache_tree reada;
+	struct block_scheduler sched;
 	struct cache_tree nodes;
 	struct cache_tree corrupt_blocks;
 	struct btrfs_path path;
@@ -3666,7 +4666,9 @@ static int check_extents(struct btrfs_trans_handle *trans,
 	cache_tree_init(&seen);
 	cache_tree_init(&pending);
 	cache_tree_init(&nodes);
-	cache_tree_init(&reada);
+	memset(&sched, 0, sizeof(sched));
+	cache_tree_init(&sched.devices);
+	sched.reada_depth = 64;
 	cache_tree_init(&corrupt_blocks);
 
 	if (repair) {
@@ -3714,6 +4716,11 @@ static int check_extents(struct btrfs_trans_handle *trans,
 
 			offset = btrfs_item_ptr_offset(leaf, path.slots[0]);
 			read_extent_buffer(leaf, &ri, offset, sizeof(ri));
+			if (incremental_gen &&
+			    btrfs_root_generation(&ri) <= incremental_gen) {
+				path.slots[0]++;
+				continue;
+			}
 			buf = read_tree_block(root->fs_info->tree_root,
 					      btrfs_root_bytenr(&ri),
 					      btrfs_level_size(root,
@@ -3727,12 +4734,20 @@ static int check_extents(struct btrfs_trans_handle *trans,
 	btrfs_release_path(root, &path);
 	while(1) {
 		ret = run_next_block(root, bits, bits_nr, &last, &pending,
-				     &seen, &reada, &nodes, &extent_cache);
+				     &seen, &sched, &nodes, &extent_cache);
 		if (ret != 0)
 			break;
 	}
+	free_block_scheduler(&sched);
+	if (ret < 0) {
+		/* the scan stopped early, what it found proves nothing */
+		fprintf(stderr, "reading the tree blocks failed: %s\n",
+			strerror(-ret));
+		goto out;
+	}
 	ret = check_extent_refs(trans, root, &extent_cache, repair);
 
+out:
 	if (repair) {
 		free_corrupt_blocks(root->fs_info);
 		root->fs_info->fsck_extent_cache = NULL;
@@ -3744,11 +4759,206 @@ static int check_extents(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+/*
+ * digest of the allocation state: bytes used in the super and the used
+ * counters of every block group.  A checkpoint taken at the current
+ * transid has to match it exactly.
+ */
+static u32 extent_accounting_digest(struct btrfs_fs_info *info)
+{
+	struct btrfs_block_group_cache *cache;
+	__le64 objectid;
+	u64 start = 0;
+	u32 crc = ~(u32)0;
+
+	crc = btrfs_crc32c(crc, &info->super_copy.bytes_used,
+			   sizeof(info->super_copy.bytes_used));
+	while (1) {
+		cache = btrfs_lookup_first_block_group(info, start);
+		if (!cache)
+			break;
+		objectid = cpu_to_le64(cache->key.objectid);
+		crc = btrfs_crc32c(crc, &objectid, sizeof(objectid));
+		crc = btrfs_crc32c(crc, &cache->item, sizeof(cache->item));
+		start = cache->key.objectid + cache->key.offset;
+	}
+	return crc;
+}
+
+static int load_checkpoint(const char *filename, struct btrfs_fs_info *info)
+{
+	struct check_checkpoint *ckpt;
+	unsigned long long objectid = 0, bytenr, generation, inodes;
+	unsigned long long child, dir, index;
+	char uuidbuf[37];
+	char line[1024];
+	char hexname[BTRFS_NAME_LEN * 2 + 1];
+	char name[BTRFS_NAME_LEN];
+	unsigned int version;
+	unsigned int digest;
+	unsigned int type;
+	unsigned int byte;
+	int namelen;
+	FILE *f;
+	int ret;
+	int i;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "no checkpoint in %s: %s\n", filename,
+			strerror(errno));
+		return -errno;
+	}
+
+	ckpt = calloc(1, sizeof(*ckpt));
+	if (!ckpt) {
+		fclose(f);
+		return -ENOMEM;
+	}
+	cache_tree_init(&ckpt->roots);
+
+	ret = -EINVAL;
+	if (fscanf(f, "btrfsck-checkpoint %u\n", &version) != 1)
+		goto bad;
+	if (version != 2) {
+		fprintf(stderr, "checkpoint %s is from another version\n",
+			filename);
+		fclose(f);
+		goto out;
+	}
+	if (fscanf(f, "fsid %36s\n", uuidbuf) != 1 ||
+	    uuid_parse(uuidbuf, ckpt->fsid))
+		goto bad;
+	if (fscanf(f, "generation %llu\n", &generation) != 1)
+		goto bad;
+	ckpt->generation = generation;
+	if (fscanf(f, "extent-digest %x\n", &digest) != 1)
+		goto bad;
+	ckpt->extent_digest = digest;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "root %llu %llu %llu %llu", &objectid,
+			   &bytenr, &generation, &inodes) == 4) {
+			add_checkpoint_root(&ckpt->roots, objectid, bytenr,
+					    generation, inodes);
+			continue;
+		}
+		/* links of the root above: child dir index type hex-name */
+		if (sscanf(line, "link %llu %llu %llu %u %510s", &child,
+			   &dir, &index, &type, hexname) != 5 ||
+		    !get_checkpoint_root(&ckpt->roots, objectid) ||
+		    (type != BTRFS_DIR_ITEM_KEY &&
+		     type != BTRFS_DIR_INDEX_KEY))
+			goto bad;
+		namelen = strlen(hexname) / 2;
+		for (i = 0; i < namelen; i++) {
+			if (sscanf(hexname + i * 2, "%2x", &byte) != 1)
+				goto bad;
+			name[i] = byte;
+		}
+		add_checkpoint_link(&ckpt->roots, objectid, child, dir, index,
+				    type, name, namelen);
+	}
+	fclose(f);
+
+	if (memcmp(ckpt->fsid, info->super_copy.fsid, BTRFS_FSID_SIZE)) {
+		fprintf(stderr, "checkpoint %s is for another filesystem\n",
+			filename);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (ckpt->generation > btrfs_super_generation(&info->super_copy) ||
+	    (ckpt->generation == btrfs_super_generation(&info->super_copy) &&
+	     ckpt->extent_digest != extent_accounting_digest(info))) {
+		fprintf(stderr, "checkpoint %s is stale\n", filename);
+		ret = -ESTALE;
+		goto out;
+	}
+
+	last_checkpoint = ckpt;
+	incremental_gen = ckpt->generation;
+	return 0;
+bad:
+	fclose(f);
+	fprintf(stderr, "checkpoint %s is corrupt\n", filename);
+out:
+	free_checkpoint_roots(&ckpt->roots);
+	free(ckpt);
+	return ret;
+}
+
+static int write_checkpoint(const char *filename, struct btrfs_fs_info *info)
+{
+	struct cache_extent *cache;
+	struct checkpoint_root *rec;
+	struct checkpoint_link *link;
+	char tmpname[PATH_MAX];
+	char uuidbuf[37];
+	FILE *f;
+	int ret;
+	int i;
+
+	ret = snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	if (ret >= sizeof(tmpname))
+		return -ENAMETOOLONG;
+
+	f = fopen(tmpname, "w");
+	if (!f) {
+		ret = -errno;
+		fprintf(stderr, "unable to write checkpoint %s: %s\n",
+			tmpname, strerror(-ret));
+		return ret;
+	}
+
+	uuid_unparse(info->super_copy.fsid, uuidbuf);
+	fprintf(f, "btrfsck-checkpoint 2\n");
+	fprintf(f, "fsid %s\n", uuidbuf);
+	fprintf(f, "generation %llu\n",
+		(unsigned long long)btrfs_super_generation(&info->super_copy));
+	fprintf(f, "extent-digest %08x\n", extent_accounting_digest(info));
+
+	cache = find_first_cache_extent(&checkpoint_roots, 0);
+	while (cache) {
+		rec = container_of(cache, struct checkpoint_root, cache);
+		fprintf(f, "root %llu %llu %llu %llu\n",
+			(unsigned long long)rec->cache.start,
+			(unsigned long long)rec->bytenr,
+			(unsigned long long)rec->generation,
+			(unsigned long long)rec->inodes);
+		list_for_each_entry(link, &rec->links, list) {
+			fprintf(f, "link %llu %llu %llu %u ",
+				(unsigned long long)link->child,
+				(unsigned long long)link->dir,
+				(unsigned long long)link->index, link->type);
+			for (i = 0; i < link->namelen; i++)
+				fprintf(f, "%02x", (u8)link->name[i]);
+			fprintf(f, "\n");
+		}
+		cache = next_cache_extent(cache);
+	}
+
+	if (fflush(f) || fsync(fileno(f))) {
+		ret = -errno;
+		fclose(f);
+		unlink(tmpname);
+		return ret;
+	}
+	fclose(f);
+
+	if (rename(tmpname, filename)) {
+		ret = -errno;
+		unlink(tmpname);
+		return ret;
+	}
+	return 0;
+}
+
 static struct option long_options[] = {
 	{ "super", 1, NULL, 's' },
 	{ "repair", 0, NULL, 0 },
 	{ "init-csum-tree", 0, NULL, 0 },
 	{ "init-extent-tree", 0, NULL, 0 },
+	{ "checkpoint", 1, NULL, 0 },
+	{ "incremental", 0, NULL, 0 },
 	{ 0, 0, 0, 0}
 };
 
@@ -3760,6 +4970,9 @@ const char * const cmd_check_usage[] = {
 	"--repair                    try to repair the filesystem",
 	"--init-csum-tree            create a new CRC tree",
 	"--init-extent-tree          create a new extent tree",
+	"--checkpoint <file>         save a checkpoint after a clean check",
+	"--incremental               only check what changed since the",
+	"                            checkpoint given with --checkpoint",
 	NULL
 };
 
@@ -3777,6 +4990,9 @@ int cmd_check(int argc, char **argv)
 	int option_index = 0;
 	int init_csum_tree = 0;
 	int rw = 0;
+	int incremental = 0;
+	int extent_err = 0;
+	char *checkpoint_file = NULL;
 
 	while(1) {
 		int c;
@@ -3796,6 +5012,8 @@ int cmd_check(int argc, char **argv)
 			case 'h':
 				usage(cmd_check_usage);
 		}
+		if (c != 0)
+			continue;
 		if (option_index == 1) {
 			printf("enabling repair mode\n");
 			repair = 1;
@@ -3804,6 +5022,10 @@ int cmd_check(int argc, char **argv)
 			printf("Creating a new CRC tree\n");
 			init_csum_tree = 1;
 			rw = 1;
+		} else if (option_index == 4) {
+			checkpoint_file = optarg;
+		} else if (option_index == 5) {
+			incremental = 1;
 		}
 
 	}
@@ -3812,8 +5034,15 @@ int cmd_check(int argc, char **argv)
 	if (argc != 1)
 		usage(cmd_check_usage);
 
+	if (incremental && (!checkpoint_file || rw)) {
+		fprintf(stderr, "--incremental needs --checkpoint and "
+			"can't be used to repair\n");
+		return 1;
+	}
+
 	radix_tree_init();
 	cache_tree_init(&root_cache);
+	cache_tree_init(&checkpoint_roots);
 
 	if((ret = check_mounted(argv[optind])) < 0) {
 		fprintf(stderr, "Could not check mount status: %s\n", strerror(-ret));
@@ -3845,6 +5074,14 @@ int cmd_check(int argc, char **argv)
 
 	root = info->fs_root;
 
+	if (incremental) {
+		if (load_checkpoint(checkpoint_file, info) == 0)
+			printf("incremental check since transid %llu\n",
+			       (unsigned long long)incremental_gen);
+		else
+			printf("falling back to a full check\n");
+	}
+
 	fprintf(stderr, "checking extents\n");
 	if (rw)
 		trans = btrfs_start_transaction(root, 1);
@@ -3858,9 +5095,11 @@ int cmd_check(int argc, char **argv)
 		}
 		goto out;
 	}
-	ret = check_extents(trans, root, repair);
-	if (ret)
+	ret = check_extents(&trans, root, repair);
+	if (ret) {
 		fprintf(stderr, "Errors found in extent allocation tree\n");
+		extent_err = 1;
+	}
 
 	fprintf(stderr, "checking fs roots\n");
 	ret = check_fs_roots(root, &root_cache);
@@ -3881,6 +5120,18 @@ out:
 		if (ret)
 			exit(1);
 	}
+	if (checkpoint_file && !ret && !extent_err && !init_csum_tree &&
+	    !found_old_backref) {
+		if (write_checkpoint(checkpoint_file, info))
+			fprintf(stderr, "failed to save checkpoint %s\n",
+				checkpoint_file);
+	}
+	free_checkpoint_roots(&checkpoint_roots);
+	if (last_checkpoint) {
+		free_checkpoint_roots(&last_checkpoint->roots);
+		free(last_checkpoint);
+		last_checkpoint = NULL;
+	}
 	close_ctree(root);
 
 	if (found_old_backref) { /*
@@ -3908,6 +5159,10 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
+	if (incremental_gen)
+		printf("unchanged tree bytes skipped: %llu, fs roots %llu\n",
+		       (unsigned long long)skipped_btree_bytes,
+		       (unsigned long long)skipped_fs_roots);
 	printf("%s\n", BTRFS_BUILD_VERSION);
 	return ret;
 }
@@ -20,10 +20,14 @@
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "kerncompat.h"
 #include "ioctl.h"
 #include "utils.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "print-tree.h"
 
 #include "commands.h"
 #include "btrfs-list.h"
@@ -253,12 +257,317 @@ out:
 	return ret;
 }
 
+/*
+ * what changed in the inode tree-diff is looking at, collected until the
+ * walk moves on to the next objectid
+ */
+#define DIFF_INODE	(1 << 0)
+#define DIFF_NAME	(1 << 1)
+#define DIFF_XATTR	(1 << 2)
+#define DIFF_DATA	(1 << 3)
+#define DIFF_DIR	(1 << 4)
+
+struct tree_diff {
+	struct btrfs_root *old_root;
+	struct btrfs_root *new_root;
+	int items;
+	u64 ino;
+	int status;
+	int changes;
+	u64 nr_items;
+	u64 nr_inodes;
+};
+
+/*
+ * build the path of ino inside root from its first inode ref (or extref),
+ * relative to the subvolume.  returns NULL if an inode on the way has no
+ * name, e.g. because it is an orphan.
+ */
+static char *tree_diff_path(struct btrfs_root *root, u64 ino)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	char buf[PATH_MAX];
+	unsigned long name_ptr;
+	u32 name_len;
+	u64 parent;
+	int pos = sizeof(buf) - 1;
+	int ret;
+
+	buf[pos] = '\0';
+	btrfs_init_path(&path);
+	while (ino != BTRFS_FIRST_FREE_OBJECTID) {
+		key.objectid = ino;
+		key.type = BTRFS_INODE_REF_KEY;
+		key.offset = 0;
+		ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+		if (ret < 0)
+			goto fail;
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret)
+				goto fail;
+			leaf = path.nodes[0];
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != ino)
+			goto fail;
+		if (key.type == BTRFS_INODE_REF_KEY) {
+			struct btrfs_inode_ref *ref;
+
+			ref = btrfs_item_ptr(leaf, path.slots[0],
+					     struct btrfs_inode_ref);
+			name_len = btrfs_inode_ref_name_len(leaf, ref);
+			name_ptr = (unsigned long)(ref + 1);
+			parent = key.offset;
+		} else if (key.type == BTRFS_INODE_EXTREF_KEY) {
+			struct btrfs_inode_extref *extref;
+
+			extref = btrfs_item_ptr(leaf, path.slots[0],
+						struct btrfs_inode_extref);
+			name_len = btrfs_inode_extref_name_len(leaf, extref);
+			name_ptr = (unsigned long)&extref->name;
+			parent = btrfs_inode_extref_parent(leaf, extref);
+		} else {
+			goto fail;
+		}
+		if (parent == ino || name_len + 1 > pos)
+			goto fail;
+		pos -= name_len;
+		read_extent_buffer(leaf, buf + pos, name_ptr, name_len);
+		buf[--pos] = '/';
+		btrfs_release_path(root, &path);
+		ino = parent;
+	}
+	return strdup(pos == sizeof(buf) - 1 ? "." : buf + pos + 1);
+
+fail:
+	btrfs_release_path(root, &path);
+	return NULL;
+}
+
+static void tree_diff_flush_inode(struct tree_diff *diff)
+{
+	static const char * const names[] = {
+		"inode", "name", "xattr", "data", "dir"
+	};
+	struct btrfs_root *root;
+	char *path;
+	int first = 1;
+	int i;
+
+	if (!diff->ino)
+		return;
+	root = diff->status == BTRFS_COMPARE_TREE_DELETED ?
+		diff->old_root : diff->new_root;
+	path = tree_diff_path(root, diff->ino);
+
+	if (diff->status == BTRFS_COMPARE_TREE_NEW)
+		printf("added   ");
+	else if (diff->status == BTRFS_COMPARE_TREE_DELETED)
+		printf("removed ");
+	else
+		printf("changed ");
+	printf("%llu %s", (unsigned long long)diff->ino, path ? path : "?");
+	if (diff->status == BTRFS_COMPARE_TREE_CHANGED) {
+		printf(" (");
+		for (i = 0; i < ARRAY_SIZE(names); i++) {
+			if (!(diff->changes & (1 << i)))
+				continue;
+			printf("%s%s", first ? "" : ",", names[i]);
+			first = 0;
+		}
+		printf(")");
+	}
+	printf("\n");
+	free(path);
+	diff->nr_inodes++;
+	diff->ino = 0;
+}
+
+static int tree_diff_changed(struct btrfs_root *left_root,
+			     struct btrfs_root *right_root,
+			     struct btrfs_path *left_path,
+			     struct btrfs_path *right_path,
+			     struct btrfs_key *key,
+			     enum btrfs_compare_tree_result result,
+			     void *ctx)
+{
+	struct tree_diff *diff = ctx;
+	struct btrfs_disk_key disk_key;
+
+	diff->nr_items++;
+	if (diff->items) {
+		if (result == BTRFS_COMPARE_TREE_NEW)
+			printf("added   ");
+		else if (result == BTRFS_COMPARE_TREE_DELETED)
+			printf("removed ");
+		else
+			printf("changed ");
+		btrfs_cpu_key_to_disk(&disk_key, key);
+		btrfs_print_key(&disk_key);
+		printf("\n");
+		return 0;
+	}
+
+	if (key->objectid < BTRFS_FIRST_FREE_OBJECTID ||
+	    key->objectid > BTRFS_LAST_FREE_OBJECTID)
+		return 0;
+	if (key->objectid != diff->ino) {
+		tree_diff_flush_inode(diff);
+		diff->ino = key->objectid;
+		diff->status = BTRFS_COMPARE_TREE_CHANGED;
+		diff->changes = 0;
+	}
+
+	switch (key->type) {
+	case BTRFS_INODE_ITEM_KEY:
+		/* a new or removed inode item decides for the whole inode */
+		diff->status = result;
+		diff->changes |= DIFF_INODE;
+		break;
+	case BTRFS_INODE_REF_KEY:
+	case BTRFS_INODE_EXTREF_KEY:
+		diff->changes |= DIFF_NAME;
+		break;
+	case BTRFS_XATTR_ITEM_KEY:
+		diff->changes |= DIFF_XATTR;
+		break;
+	case BTRFS_EXTENT_DATA_KEY:
+		diff->changes |= DIFF_DATA;
+		break;
+	case BTRFS_DIR_ITEM_KEY:
+	case BTRFS_DIR_INDEX_KEY:
+		diff->changes |= DIFF_DIR;
+		break;
+	}
+	return 0;
+}
+
+static struct btrfs_root *tree_diff_read_root(struct btrfs_fs_info *fs_info,
+					      const char *arg)
+{
+	struct btrfs_root *root;
+	struct btrfs_key key;
+	char *end;
+
+	key.objectid = strtoull(arg, &end, 0);
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = (u64)-1;
+	if (*end || (key.objectid != BTRFS_FS_TREE_OBJECTID &&
+		     (key.objectid < BTRFS_FIRST_FREE_OBJECTID ||
+		      key.objectid > BTRFS_LAST_FREE_OBJECTID))) {
+		fprintf(stderr, "ERROR: '%s' is not a subvolume id\n", arg);
+		return NULL;
+	}
+	root = btrfs_read_fs_root(fs_info, &key);
+	if (IS_ERR(root) || !root) {
+		fprintf(stderr, "ERROR: can't read subvolume %s\n", arg);
+		return NULL;
+	}
+	return root;
+}
+
+static const char * const cmd_tree_diff_usage[] = {
+	"btrfs inspect-internal tree-diff [-iv] <device> <old-id> <new-id>",
+	"List what changed between two subvolumes or snapshots",
+	"Compares the trees of the subvolumes with ids <old-id> and",
+	"<new-id> on the unmounted filesystem <device> and prints one",
+	"line per added, removed or changed inode with its path.",
+	"Blocks both trees share are skipped without reading them, so",
+	"the time taken depends on the size of the change.",
+	"",
+	"-i          print every changed item instead of inodes",
+	"-v          print how many items and inodes differ",
+	NULL
+};
+
+static int cmd_tree_diff(int argc, char **argv)
+{
+	struct btrfs_root *root;
+	struct tree_diff diff;
+	int verbose = 0;
+	int ret;
+
+	memset(&diff, 0, sizeof(diff));
+	optind = 1;
+	while (1) {
+		int c = getopt(argc, argv, "iv");
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'i':
+			diff.items = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(cmd_tree_diff_usage);
+		}
+	}
+
+	if (check_argc_exact(argc - optind, 3))
+		usage(cmd_tree_diff_usage);
+
+	ret = check_mounted(argv[optind]);
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: could not check mount status of %s: "
+			"%s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	if (ret) {
+		fprintf(stderr, "ERROR: %s is currently mounted\n",
+			argv[optind]);
+		return 1;
+	}
+
+	root = open_ctree(argv[optind], 0, 0);
+	if (!root) {
+		fprintf(stderr, "ERROR: can't open '%s'\n", argv[optind]);
+		return 1;
+	}
+
+	ret = 1;
+	diff.old_root = tree_diff_read_root(root->fs_info, argv[optind + 1]);
+	if (!diff.old_root)
+		goto out;
+	diff.new_root = tree_diff_read_root(root->fs_info, argv[optind + 2]);
+	if (!diff.new_root)
+		goto out;
+
+	ret = btrfs_compare_trees(diff.new_root, diff.old_root,
+				  tree_diff_changed, &diff);
+	if (ret) {
+		fprintf(stderr, "ERROR: comparing the trees failed: %s\n",
+			strerror(-ret));
+		ret = 1;
+		goto out;
+	}
+	if (!diff.items)
+		tree_diff_flush_inode(&diff);
+	if (verbose && diff.items)
+		printf("%llu items differ\n",
+		       (unsigned long long)diff.nr_items);
+	else if (verbose)
+		printf("%llu items differ in %llu inodes\n",
+		       (unsigned long long)diff.nr_items,
+		       (unsigned long long)diff.nr_inodes);
+out:
+	close_ctree(root);
+	return ret;
+}
+
 const struct cmd_group inspect_cmd_group = {
 	inspect_cmd_group_usage, NULL, {
 		{ "inode-resolve", cmd_inode_resolve, cmd_inode_resolve_usage,
 			NULL, 0 },
 		{ "logical-resolve", cmd_logical_resolve,
 			cmd_logical_resolve_usage, NULL, 0 },
+		{ "tree-diff", cmd_tree_diff, cmd_tree_diff_usage, NULL, 0 },
 		{ 0, 0, 0, 0, 0 }
 	}
 };
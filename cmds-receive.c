@@ -30,6 +30,7 @@
 #include <pthread.h>
 #include <math.h>
 #include <ftw.h>
+#include <getopt.h>
 #include <wait.h>
 
 #include <sys/stat.h>
@@ -49,18 +50,105 @@
 #include "send.h"
 #include "send-stream.h"
 #include "send-utils.h"
+#include "send-frame.h"
 
 static int g_verbose = 0;
 
+/* contiguous writes to a file are gathered into one buffer this big */
+#define RECEIVE_WRITE_BUF_SIZE	(1024 * 1024)
+/* aligned blocks of zeroes this big are punched out instead of written */
+#define RECEIVE_ZERO_BLOCK	4096
+
+/* the file the last write or clone went to, kept open for the next one */
+struct receive_file {
+	int fd;
+	char *path;
+	/* pending data for [buf_offset, buf_offset + buf_len) */
+	char *buf;
+	u64 buf_offset;
+	size_t buf_len;
+	int no_punch;
+};
+
+enum {
+	APPLY_WRITE,
+	APPLY_CLONE,
+	APPLY_SET_XATTR,
+	APPLY_REMOVE_XATTR,
+	APPLY_TRUNCATE,
+	APPLY_CHMOD,
+	APPLY_CHOWN,
+	APPLY_UTIMES,
+	/* write out and close the worker's file, queued by wait_for_apply */
+	APPLY_FLUSH,
+};
+
+/*
+ * the path of the current run of commands, with the full path built once.
+ * Queued commands share it, refs only change under apply_mutex.
+ */
+struct receive_path {
+	int refs;
+	char *path;
+	char *full_path;
+};
+
+/*
+ * a command that only touches its own path.  These are handed to the
+ * apply workers, everything else waits for them to finish first.
+ */
+struct apply_job {
+	struct list_head list;
+	int op;
+	struct receive_path *rpath;
+	char *path;
+	char *full_path;
+	char *name;
+	char *clone_path;
+	void *data;
+	u64 offset;
+	u64 len;
+	u64 clone_offset;
+	u64 size;
+	u64 mode;
+	u64 uid;
+	u64 gid;
+	struct timespec tv[2];
+};
+
+struct btrfs_receive;
+
+struct apply_worker {
+	pthread_t thread;
+	struct list_head jobs;
+	/* got commands since its last flush */
+	int dirty;
+	struct receive_file file;
+	struct btrfs_receive *r;
+};
+
+#define RECEIVE_MAX_PENDING	256
+
 struct btrfs_receive
 {
 	int mnt_fd;
 
-	int write_fd;
-	char *write_path;
+	struct receive_file file;
+
+	pthread_mutex_t apply_mutex;
+	pthread_cond_t apply_cond;
+	struct apply_worker *workers;
+	int nr_workers;
+	int apply_pending;
+	int apply_error;
+	int apply_done;
+	/* -j, workers to apply commands on, 1 or less applies them inline */
+	int apply_threads;
 
 	char *root_path;
 	char *full_subvol_path;
+	/* the last command's path, reused while it repeats */
+	struct receive_path *cur_path;
 
 	struct subvol_info *cur_subvol;
 	struct subvol_info *parent_subvol;
@@ -68,6 +156,55 @@ struct btrfs_receive
 	struct subvol_uuid_search sus;
 };
 
+static int wait_for_apply(struct btrfs_receive *r);
+
+static void put_receive_path(struct receive_path *rp)
+{
+	if (!rp || --rp->refs > 0)
+		return;
+	free(rp->path);
+	free(rp->full_path);
+	free(rp);
+}
+
+static void forget_cur_path(struct btrfs_receive *r)
+{
+	if (r->nr_workers)
+		pthread_mutex_lock(&r->apply_mutex);
+	put_receive_path(r->cur_path);
+	if (r->nr_workers)
+		pthread_mutex_unlock(&r->apply_mutex);
+	r->cur_path = NULL;
+}
+
+/*
+ * runs of commands usually work on one inode, so build its full path once
+ * instead of for every command.  The result belongs to r, queued commands
+ * take a ref on it.
+ */
+static struct receive_path *cur_receive_path(struct btrfs_receive *r,
+					     const char *path)
+{
+	struct receive_path *rp;
+
+	if (r->cur_path && !strcmp(r->cur_path->path, path))
+		return r->cur_path;
+
+	forget_cur_path(r);
+	rp = calloc(1, sizeof(*rp));
+	if (!rp)
+		return NULL;
+	rp->refs = 1;
+	rp->path = strdup(path);
+	rp->full_path = path_cat(r->full_subvol_path, path);
+	if (!rp->path || !rp->full_path) {
+		put_receive_path(rp);
+		return NULL;
+	}
+	r->cur_path = rp;
+	return rp;
+}
+
 static int finish_subvol(struct btrfs_receive *r)
 {
 	int ret;
@@ -143,6 +280,9 @@ static int process_subvol(const char *path, const u8 *uuid, u64 ctransid,
 	struct btrfs_ioctl_vol_args args_v1;
 	char uuid_str[128];
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
 	ret = finish_subvol(r);
 	if (ret < 0)
 		goto out;
@@ -152,6 +292,7 @@ static int process_subvol(const char *path, const u8 *uuid, u64 ctransid,
 
 	r->cur_subvol->path = strdup(path);
 	r->full_subvol_path = path_cat(r->root_path, path);
+	forget_cur_path(r);
 
 	fprintf(stderr, "At subvol %s\n", path);
 
@@ -188,6 +329,9 @@ static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 	char uuid_str[128];
 	struct btrfs_ioctl_vol_args_v2 args_v2;
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
 	ret = finish_subvol(r);
 	if (ret < 0)
 		goto out;
@@ -197,6 +341,7 @@ static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 
 	r->cur_subvol->path = strdup(path);
 	r->full_subvol_path = path_cat(r->root_path, path);
+	forget_cur_path(r);
 
 	fprintf(stderr, "At snapshot %s\n", path);
 
@@ -263,6 +408,10 @@ static int process_mkfile(const char *path, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "mkfile %s\n", path);
 
@@ -287,6 +436,10 @@ static int process_mkdir(const char *path, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "mkdir %s\n", path);
 
@@ -297,6 +450,7 @@ static int process_mkdir(const char *path, void *user)
 				strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
@@ -307,6 +461,10 @@ static int process_mknod(const char *path, u64 mode, u64 dev, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "mknod %s mode=%llu, dev=%llu\n",
 				path, mode, dev);
@@ -318,6 +476,7 @@ static int process_mknod(const char *path, u64 mode, u64 dev, void *user)
 				strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
@@ -328,6 +487,10 @@ static int process_mkfifo(const char *path, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "mkfifo %s\n", path);
 
@@ -338,6 +501,7 @@ static int process_mkfifo(const char *path, void *user)
 				strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
@@ -348,6 +512,10 @@ static int process_mksock(const char *path, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "mksock %s\n", path);
 
@@ -358,6 +526,7 @@ static int process_mksock(const char *path, void *user)
 				strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
@@ -368,6 +537,10 @@ static int process_symlink(const char *path, const char *lnk, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "symlink %s -> %s\n", path, lnk);
 
@@ -378,6 +551,7 @@ static int process_symlink(const char *path, const char *lnk, void *user)
 				lnk, strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
@@ -389,6 +563,10 @@ static int process_rename(const char *from, const char *to, void *user)
 	char *full_from = path_cat(r->full_subvol_path, from);
 	char *full_to = path_cat(r->full_subvol_path, to);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
@@ -399,6 +577,7 @@ static int process_rename(const char *from, const char *to, void *user)
 				to, strerror(-ret));
 	}
 
+out:
 	free(full_from);
 	free(full_to);
 	return ret;
@@ -411,6 +590,10 @@ static int process_link(const char *path, const char *lnk, void *user)
 	char *full_path = path_cat(r->full_subvol_path, path);
 	char *full_link_path = path_cat(r->full_subvol_path, lnk);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "link %s -> %s\n", path, lnk);
 
@@ -421,6 +604,7 @@ static int process_link(const char *path, const char *lnk, void *user)
 				lnk, strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	free(full_link_path);
 	return ret;
@@ -433,6 +617,10 @@ static int process_unlink(const char *path, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "unlink %s\n", path);
 
@@ -443,6 +631,7 @@ static int process_unlink(const char *path, void *user)
 				strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
@@ -453,6 +642,10 @@ static int process_rmdir(const char *path, void *user)
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
 
+	ret = wait_for_apply(r);
+	if (ret < 0)
+		goto out;
+
 	if (g_verbose >= 1)
 		fprintf(stderr, "rmdir %s\n", path);
 
@@ -463,307 +656,756 @@ static int process_rmdir(const char *path, void *user)
 				strerror(-ret));
 	}
 
+out:
 	free(full_path);
 	return ret;
 }
 
 
-static int open_inode_for_write(struct btrfs_receive *r, const char *path)
+/*
+ * glibc's memcmp is vectorized, comparing the buffer against itself
+ * shifted by one byte scans it at memory speed
+ */
+static int buffer_is_zero(const char *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+static int pwrite_all(struct receive_file *f, const char *buf, size_t len,
+		      u64 offset)
+{
+	ssize_t w;
+
+	while (len) {
+		w = pwrite(f->fd, buf, len, offset);
+		if (w < 0) {
+			w = -errno;
+			fprintf(stderr, "ERROR: writing to %s failed. %s\n",
+					f->path, strerror(-w));
+			return w;
+		}
+		buf += w;
+		len -= w;
+		offset += w;
+	}
+	return 0;
+}
+
+/*
+ * zeroes don't need to be written: punch them out, which also drops
+ * whatever the file had there before.  If the zeroes end the data, the
+ * file still has to grow to cover them.
+ */
+static int punch_zeroes(struct receive_file *f, const char *buf, size_t len,
+			u64 offset, int last)
+{
+	struct stat st;
+	int ret;
+
+	if (f->no_punch)
+		return pwrite_all(f, buf, len, offset);
+
+	ret = fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, len);
+	if (ret < 0) {
+		if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			ret = -errno;
+			fprintf(stderr, "ERROR: punching hole in %s failed. "
+					"%s\n", f->path, strerror(-ret));
+			return ret;
+		}
+		f->no_punch = 1;
+		return pwrite_all(f, buf, len, offset);
+	}
+
+	if (!last)
+		return 0;
+	if (fstat(f->fd, &st) < 0 || st.st_size < offset + len) {
+		ret = ftruncate(f->fd, offset + len);
+		if (ret < 0) {
+			ret = -errno;
+			fprintf(stderr, "ERROR: truncate %s failed. %s\n",
+					f->path, strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* write buf at offset, punching out the aligned blocks that are all zero */
+static int write_file_range(struct receive_file *f, const char *buf,
+			    size_t len, u64 offset)
+{
+	size_t pos = 0;
+	size_t start;
+	size_t blk;
+	int zero;
+	int is_zero;
+	int ret;
+
+	while (pos < len) {
+		start = pos;
+		zero = -1;
+		while (pos < len) {
+			blk = min_t(size_t, len - pos, RECEIVE_ZERO_BLOCK -
+				    (offset + pos) % RECEIVE_ZERO_BLOCK);
+			is_zero = blk == RECEIVE_ZERO_BLOCK &&
+				buffer_is_zero(buf + pos, blk);
+			if (zero != -1 && is_zero != zero)
+				break;
+			zero = is_zero;
+			pos += blk;
+		}
+		if (zero)
+			ret = punch_zeroes(f, buf + start, pos - start,
+					   offset + start, pos == len);
+		else
+			ret = pwrite_all(f, buf + start, pos - start,
+					 offset + start);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int flush_file_writes(struct receive_file *f)
+{
+	int ret;
+
+	if (!f->buf_len)
+		return 0;
+	ret = write_file_range(f, f->buf, f->buf_len, f->buf_offset);
+	f->buf_len = 0;
+	return ret;
+}
+
+static int open_inode_for_write(struct receive_file *f, const char *path)
 {
 	int ret = 0;
 
-	if (r->write_fd != -1) {
-		if (strcmp(r->write_path, path) == 0)
+	if (f->fd != -1) {
+		if (strcmp(f->path, path) == 0)
+			goto out;
+		ret = flush_file_writes(f);
+		close(f->fd);
+		f->fd = -1;
+		if (ret < 0)
 			goto out;
-		close(r->write_fd);
-		r->write_fd = -1;
 	}
 
-	r->write_fd = open(path, O_RDWR);
-	if (r->write_fd < 0) {
+	f->fd = open(path, O_RDWR);
+	if (f->fd < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: open %s failed. %s\n", path,
 				strerror(-ret));
 		goto out;
 	}
-	free(r->write_path);
-	r->write_path = strdup(path);
+	free(f->path);
+	f->path = strdup(path);
 
 out:
 	return ret;
 }
 
-static int close_inode_for_write(struct btrfs_receive *r)
+static int close_inode_for_write(struct receive_file *f)
 {
 	int ret = 0;
 
-	if(r->write_fd == -1)
+	if(f->fd == -1)
 		goto out;
 
-	close(r->write_fd);
-	r->write_fd = -1;
-	r->write_path[0] = 0;
+	ret = flush_file_writes(f);
+	close(f->fd);
+	f->fd = -1;
+	f->path[0] = 0;
 
 out:
 	return ret;
 }
 
-static int process_write(const char *path, const void *data, u64 offset,
-			 u64 len, void *user)
+/* gather contiguous writes, they go out when the run breaks */
+static int apply_write(struct receive_file *f, struct apply_job *job)
 {
 	int ret = 0;
-	struct btrfs_receive *r = user;
-	char *full_path = path_cat(r->full_subvol_path, path);
-	u64 pos = 0;
-	int w;
 
-	ret = open_inode_for_write(r, full_path);
+	ret = open_inode_for_write(f, job->full_path);
 	if (ret < 0)
 		goto out;
 
-	while (pos < len) {
-		w = pwrite(r->write_fd, (char*)data + pos, len - pos,
-				offset + pos);
-		if (w < 0) {
-			ret = -errno;
-			fprintf(stderr, "ERROR: writing to %s failed. %s\n",
-					path, strerror(-ret));
+	if (f->buf_len && (job->offset != f->buf_offset + f->buf_len ||
+			   f->buf_len + job->len > RECEIVE_WRITE_BUF_SIZE)) {
+		ret = flush_file_writes(f);
+		if (ret < 0)
+			goto out;
+	}
+	if (job->len > RECEIVE_WRITE_BUF_SIZE) {
+		ret = write_file_range(f, job->data, job->len, job->offset);
+		goto out;
+	}
+
+	if (!f->buf) {
+		f->buf = malloc(RECEIVE_WRITE_BUF_SIZE);
+		if (!f->buf) {
+			ret = -ENOMEM;
 			goto out;
 		}
-		pos += w;
 	}
+	if (!f->buf_len)
+		f->buf_offset = job->offset;
+	memcpy(f->buf + f->buf_len, job->data, job->len);
+	f->buf_len += job->len;
 
 out:
-	free(full_path);
 	return ret;
 }
 
-static int process_clone(const char *path, u64 offset, u64 len,
-			 const u8 *clone_uuid, u64 clone_ctransid,
-			 const char *clone_path, u64 clone_offset,
-			 void *user)
+static int apply_clone(struct receive_file *f, struct apply_job *job)
 {
 	int ret = 0;
-	struct btrfs_receive *r = user;
 	struct btrfs_ioctl_clone_range_args clone_args;
-	struct subvol_info *si = NULL;
-	char *full_path = path_cat(r->full_subvol_path, path);
-	char *subvol_path = NULL;
-	char *full_clone_path = NULL;
 	int clone_fd = -1;
 
-	ret = open_inode_for_write(r, full_path);
+	ret = open_inode_for_write(f, job->full_path);
 	if (ret < 0)
 		goto out;
 
-	si = subvol_uuid_search(&r->sus, 0, clone_uuid, clone_ctransid, NULL,
-			subvol_search_by_received_uuid);
-	if (!si) {
-		if (memcmp(clone_uuid, r->cur_subvol->received_uuid,
-				BTRFS_FSID_SIZE) == 0) {
-			/* TODO check generation of extent */
-			subvol_path = strdup(r->cur_subvol->path);
-		} else {
-			ret = -ENOENT;
-			fprintf(stderr, "ERROR: did not find source subvol.\n");
-			goto out;
-		}
-	} else {
-		/*if (rs_args.ctransid > rs_args.rtransid) {
-			if (!r->force) {
-				ret = -EINVAL;
-				fprintf(stderr, "ERROR: subvolume %s was "
-						"modified after it was "
-						"received.\n",
-						r->subvol_parent_name);
-				goto out;
-			} else {
-				fprintf(stderr, "WARNING: subvolume %s was "
-						"modified after it was "
-						"received.\n",
-						r->subvol_parent_name);
-			}
-		}*/
-		subvol_path = strdup(si->path);
-	}
-
-	full_clone_path = path_cat3(r->root_path, subvol_path, clone_path);
-
-	clone_fd = open(full_clone_path, O_RDONLY | O_NOATIME);
+	clone_fd = open(job->clone_path, O_RDONLY | O_NOATIME);
 	if (clone_fd < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: failed to open %s. %s\n",
-				full_clone_path, strerror(-ret));
+				job->clone_path, strerror(-ret));
 		goto out;
 	}
 
 	clone_args.src_fd = clone_fd;
-	clone_args.src_offset = clone_offset;
-	clone_args.src_length = len;
-	clone_args.dest_offset = offset;
-	ret = ioctl(r->write_fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
+	clone_args.src_offset = job->clone_offset;
+	clone_args.src_length = job->len;
+	clone_args.dest_offset = job->offset;
+	ret = ioctl(f->fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
 	if (ret) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: failed to clone extents to %s\n%s\n",
-				path, strerror(-ret));
+				job->path, strerror(-ret));
 		goto out;
 	}
 
 out:
-	free(full_path);
-	free(full_clone_path);
-	free(subvol_path);
 	if (clone_fd != -1)
 		close(clone_fd);
 	return ret;
 }
 
-
-static int process_set_xattr(const char *path, const char *name,
-			     const void *data, int len, void *user)
+static int apply_set_xattr(struct apply_job *job)
 {
-	int ret = 0;
-	struct btrfs_receive *r = user;
-	char *full_path = path_cat(r->full_subvol_path, path);
-
-	if (g_verbose >= 1) {
-		fprintf(stderr, "set_xattr %s - name=%s data_len=%d "
-				"data=%.*s\n", path, name, len,
-				len, (char*)data);
-	}
+	int ret;
 
-	ret = lsetxattr(full_path, name, data, len, 0);
+	ret = lsetxattr(job->full_path, job->name, job->data, job->len, 0);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: lsetxattr %s %s=%.*s failed. %s\n",
-				path, name, len, (char*)data, strerror(-ret));
-		goto out;
+				job->path, job->name, (int)job->len,
+				(char*)job->data, strerror(-ret));
 	}
-
-out:
-	free(full_path);
 	return ret;
 }
 
-static int process_remove_xattr(const char *path, const char *name, void *user)
+static int apply_remove_xattr(struct apply_job *job)
 {
-	int ret = 0;
-	struct btrfs_receive *r = user;
-	char *full_path = path_cat(r->full_subvol_path, path);
-
-	if (g_verbose >= 1) {
-		fprintf(stderr, "remove_xattr %s - name=%s\n",
-				path, name);
-	}
+	int ret;
 
-	ret = lremovexattr(full_path, name);
+	ret = lremovexattr(job->full_path, job->name);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: lremovexattr %s %s failed. %s\n",
-				path, name, strerror(-ret));
-		goto out;
+				job->path, job->name, strerror(-ret));
 	}
-
-out:
-	free(full_path);
 	return ret;
 }
 
-static int process_truncate(const char *path, u64 size, void *user)
+static int apply_truncate(struct apply_job *job)
 {
-	int ret = 0;
-	struct btrfs_receive *r = user;
-	char *full_path = path_cat(r->full_subvol_path, path);
-
-	if (g_verbose >= 1)
-		fprintf(stderr, "truncate %s size=%llu\n", path, size);
+	int ret;
 
-	ret = truncate(full_path, size);
+	ret = truncate(job->full_path, job->size);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: truncate %s failed. %s\n",
-				path, strerror(-ret));
-		goto out;
+				job->path, strerror(-ret));
 	}
-
-out:
-	free(full_path);
 	return ret;
 }
 
-static int process_chmod(const char *path, u64 mode, void *user)
+static int apply_chmod(struct apply_job *job)
 {
-	int ret = 0;
-	struct btrfs_receive *r = user;
-	char *full_path = path_cat(r->full_subvol_path, path);
-
-	if (g_verbose >= 1)
-		fprintf(stderr, "chmod %s - mode=0%o\n", path, (int)mode);
+	int ret;
 
-	ret = chmod(full_path, mode);
+	ret = chmod(job->full_path, job->mode);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: chmod %s failed. %s\n",
-				path, strerror(-ret));
-		goto out;
+				job->path, strerror(-ret));
 	}
-
-out:
-	free(full_path);
 	return ret;
 }
 
-static int process_chown(const char *path, u64 uid, u64 gid, void *user)
+static int apply_chown(struct apply_job *job)
 {
-	int ret = 0;
-	struct btrfs_receive *r = user;
-	char *full_path = path_cat(r->full_subvol_path, path);
-
-	if (g_verbose >= 1)
-		fprintf(stderr, "chown %s - uid=%llu, gid=%llu\n", path,
-				uid, gid);
+	int ret;
 
-	ret = lchown(full_path, uid, gid);
+	ret = lchown(job->full_path, job->uid, job->gid);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: chown %s failed. %s\n",
-				path, strerror(-ret));
-		goto out;
+				job->path, strerror(-ret));
 	}
-
-out:
-	free(full_path);
 	return ret;
 }
 
-static int process_utimes(const char *path, struct timespec *at,
-			  struct timespec *mt, struct timespec *ct,
-			  void *user)
+static int apply_utimes(struct apply_job *job)
 {
-	int ret = 0;
-	struct btrfs_receive *r = user;
-	char *full_path = path_cat(r->full_subvol_path, path);
-	struct timespec tv[2];
-
-	if (g_verbose >= 1)
-		fprintf(stderr, "utimes %s\n", path);
+	int ret;
 
-	tv[0] = *at;
-	tv[1] = *mt;
-	ret = utimensat(-1, full_path, tv, AT_SYMLINK_NOFOLLOW);
+	ret = utimensat(-1, job->full_path, job->tv, AT_SYMLINK_NOFOLLOW);
 	if (ret < 0) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: utimes %s failed. %s\n",
-				path, strerror(-ret));
-		goto out;
+				job->path, strerror(-ret));
+	}
+	return ret;
+}
+
+static int apply_job(struct receive_file *f, struct apply_job *job)
+{
+	int ret;
+
+	/* everything else sees the file as written so far */
+	if (job->op != APPLY_WRITE && job->op != APPLY_FLUSH) {
+		ret = flush_file_writes(f);
+		if (ret < 0)
+			return ret;
+	}
+
+	switch (job->op) {
+	case APPLY_WRITE:
+		return apply_write(f, job);
+	case APPLY_CLONE:
+		return apply_clone(f, job);
+	case APPLY_SET_XATTR:
+		return apply_set_xattr(job);
+	case APPLY_REMOVE_XATTR:
+		return apply_remove_xattr(job);
+	case APPLY_TRUNCATE:
+		return apply_truncate(job);
+	case APPLY_CHMOD:
+		return apply_chmod(job);
+	case APPLY_CHOWN:
+		return apply_chown(job);
+	case APPLY_UTIMES:
+		return apply_utimes(job);
+	case APPLY_FLUSH:
+		return close_inode_for_write(f);
+	}
+	return -EINVAL;
+}
+
+/* the path ref is dropped separately, under apply_mutex */
+static void free_apply_job(struct apply_job *job)
+{
+	free(job->name);
+	free(job->clone_path);
+	free(job->data);
+	free(job);
+}
+
+static void *apply_worker(void *arg)
+{
+	struct apply_worker *w = arg;
+	struct btrfs_receive *r = w->r;
+	struct receive_path *rpath;
+	struct apply_job *job;
+	int ret;
+
+	pthread_mutex_lock(&r->apply_mutex);
+	while (1) {
+		while (list_empty(&w->jobs) && !r->apply_done)
+			pthread_cond_wait(&r->apply_cond, &r->apply_mutex);
+		if (list_empty(&w->jobs))
+			break;
+		job = list_entry(w->jobs.next, struct apply_job, list);
+		list_del_init(&job->list);
+		pthread_mutex_unlock(&r->apply_mutex);
+
+		ret = apply_job(&w->file, job);
+		rpath = job->rpath;
+		free_apply_job(job);
+
+		pthread_mutex_lock(&r->apply_mutex);
+		put_receive_path(rpath);
+		if (ret < 0 && !r->apply_error)
+			r->apply_error = ret;
+		r->apply_pending--;
+		pthread_cond_broadcast(&r->apply_cond);
+	}
+	pthread_mutex_unlock(&r->apply_mutex);
+	ret = close_inode_for_write(&w->file);
+	if (ret < 0) {
+		pthread_mutex_lock(&r->apply_mutex);
+		if (!r->apply_error)
+			r->apply_error = ret;
+		pthread_mutex_unlock(&r->apply_mutex);
 	}
+	free(w->file.path);
+	free(w->file.buf);
+	return NULL;
+}
+
+/*
+ * wait until everything handed to the workers has been applied, for
+ * commands that depend on the state of other paths.  Returns the first
+ * error a worker ran into.
+ *
+ * Workers keep their file and gathered writes between commands.  Here
+ * every worker that got commands since the last barrier writes them out
+ * and closes the file, so the barrier sees all the data and no fd
+ * outlives a barrier after which its path could name another inode.
+ * Without workers, writes gathered so far are written out.
+ */
+static int wait_for_apply(struct btrfs_receive *r)
+{
+	struct apply_worker *w;
+	struct apply_job *flush;
+	int ret;
+	int i;
+
+	if (!r->nr_workers)
+		return flush_file_writes(&r->file);
+
+	pthread_mutex_lock(&r->apply_mutex);
+	for (i = 0; i < r->nr_workers; i++) {
+		w = r->workers + i;
+		if (!w->dirty)
+			continue;
+		flush = calloc(1, sizeof(*flush));
+		if (!flush) {
+			if (!r->apply_error)
+				r->apply_error = -ENOMEM;
+			break;
+		}
+		flush->op = APPLY_FLUSH;
+		list_add_tail(&flush->list, &w->jobs);
+		w->dirty = 0;
+		r->apply_pending++;
+	}
+	pthread_cond_broadcast(&r->apply_cond);
+	while (r->apply_pending)
+		pthread_cond_wait(&r->apply_cond, &r->apply_mutex);
+	ret = r->apply_error;
+	pthread_mutex_unlock(&r->apply_mutex);
+	return ret;
+}
+
+static unsigned int apply_hash(const char *path)
+{
+	unsigned int hash = 5381;
+
+	while (*path)
+		hash = hash * 33 + (unsigned char)*path++;
+	return hash;
+}
+
+static char *dup_or_null(const void *data, size_t len)
+{
+	char *p;
+
+	if (!data)
+		return NULL;
+	p = malloc(len);
+	if (p)
+		memcpy(p, data, len);
+	return p;
+}
+
+/*
+ * commands on one path always go to the same worker, so they are applied
+ * in stream order while different paths proceed in parallel.  Without
+ * workers the command is applied right away.
+ */
+static int apply_or_queue(struct btrfs_receive *r, struct apply_job *job)
+{
+	struct receive_path *rp;
+	struct apply_worker *w;
+	struct apply_job *copy;
+	int ret;
+
+	rp = cur_receive_path(r, job->path);
+	if (!rp)
+		return -ENOMEM;
+	job->full_path = rp->full_path;
+	if (!r->nr_workers)
+		return apply_job(&r->file, job);
+
+	copy = calloc(1, sizeof(*copy));
+	if (!copy)
+		return -ENOMEM;
+	*copy = *job;
+	copy->path = rp->path;
+	copy->name = job->name ? strdup(job->name) : NULL;
+	copy->clone_path = job->clone_path ? strdup(job->clone_path) : NULL;
+	copy->data = dup_or_null(job->data, job->len);
+	if ((job->name && !copy->name) ||
+	    (job->clone_path && !copy->clone_path) ||
+	    (job->data && !copy->data)) {
+		free_apply_job(copy);
+		return -ENOMEM;
+	}
+
+	w = r->workers + apply_hash(copy->full_path) % r->nr_workers;
+	pthread_mutex_lock(&r->apply_mutex);
+	while (r->apply_pending >= RECEIVE_MAX_PENDING && !r->apply_error)
+		pthread_cond_wait(&r->apply_cond, &r->apply_mutex);
+	ret = r->apply_error;
+	if (!ret) {
+		rp->refs++;
+		copy->rpath = rp;
+		list_add_tail(&copy->list, &w->jobs);
+		w->dirty = 1;
+		r->apply_pending++;
+		pthread_cond_broadcast(&r->apply_cond);
+	}
+	pthread_mutex_unlock(&r->apply_mutex);
+	if (ret)
+		free_apply_job(copy);
+	return ret;
+}
+
+static int start_apply_workers(struct btrfs_receive *r, int nr)
+{
+	struct apply_worker *w;
+	int ret;
+	int i;
+
+	if (nr <= 1)
+		return 0;
+
+	r->workers = calloc(nr, sizeof(*r->workers));
+	if (!r->workers)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++) {
+		w = r->workers + i;
+		w->r = r;
+		w->file.fd = -1;
+		INIT_LIST_HEAD(&w->jobs);
+		ret = pthread_create(&w->thread, NULL, apply_worker, w);
+		if (ret) {
+			fprintf(stderr, "ERROR: thread setup failed: %s\n",
+					strerror(ret));
+			break;
+		}
+		r->nr_workers++;
+	}
+	return r->nr_workers == nr ? 0 : -ret;
+}
+
+/* workers finish what is queued before they exit */
+static void stop_apply_workers(struct btrfs_receive *r)
+{
+	int i;
+
+	pthread_mutex_lock(&r->apply_mutex);
+	r->apply_done = 1;
+	pthread_cond_broadcast(&r->apply_cond);
+	pthread_mutex_unlock(&r->apply_mutex);
+	for (i = 0; i < r->nr_workers; i++)
+		pthread_join(r->workers[i].thread, NULL);
+	free(r->workers);
+	r->workers = NULL;
+	r->nr_workers = 0;
+}
+
+static int process_write(const char *path, const void *data, u64 offset,
+			 u64 len, void *user)
+{
+	struct btrfs_receive *r = user;
+	struct apply_job job = {
+		.op = APPLY_WRITE,
+		.path = (char *)path,
+		.data = (void *)data,
+		.offset = offset,
+		.len = len,
+	};
+
+	return apply_or_queue(r, &job);
+}
+
+static int process_clone(const char *path, u64 offset, u64 len,
+			 const u8 *clone_uuid, u64 clone_ctransid,
+			 const char *clone_path, u64 clone_offset,
+			 void *user)
+{
+	int ret = 0;
+	struct btrfs_receive *r = user;
+	struct subvol_info *si = NULL;
+	char *subvol_path = NULL;
+	char *full_clone_path = NULL;
+	struct apply_job job = {
+		.op = APPLY_CLONE,
+		.path = (char *)path,
+		.offset = offset,
+		.len = len,
+		.clone_offset = clone_offset,
+	};
+
+	si = subvol_uuid_search(&r->sus, 0, clone_uuid, clone_ctransid, NULL,
+			subvol_search_by_received_uuid);
+	if (!si) {
+		if (memcmp(clone_uuid, r->cur_subvol->received_uuid,
+				BTRFS_FSID_SIZE) == 0) {
+			/* TODO check generation of extent */
+			subvol_path = strdup(r->cur_subvol->path);
+
+			/* the source may still be being written */
+			ret = wait_for_apply(r);
+			if (ret < 0)
+				goto out;
+		} else {
+			ret = -ENOENT;
+			fprintf(stderr, "ERROR: did not find source subvol.\n");
+			goto out;
+		}
+	} else {
+		/*if (rs_args.ctransid > rs_args.rtransid) {
+			if (!r->force) {
+				ret = -EINVAL;
+				fprintf(stderr, "ERROR: subvolume %s was "
+						"modified after it was "
+						"received.\n",
+						r->subvol_parent_name);
+				goto out;
+			} else {
+				fprintf(stderr, "WARNING: subvolume %s was "
+						"modified after it was "
+						"received.\n",
+						r->subvol_parent_name);
+			}
+		}*/
+		subvol_path = strdup(si->path);
+	}
+
+	full_clone_path = path_cat3(r->root_path, subvol_path, clone_path);
+	job.clone_path = full_clone_path;
+	ret = apply_or_queue(r, &job);
 
 out:
-	free(full_path);
+	free(full_clone_path);
+	free(subvol_path);
 	return ret;
 }
 
 
+static int process_set_xattr(const char *path, const char *name,
+			     const void *data, int len, void *user)
+{
+	struct btrfs_receive *r = user;
+	struct apply_job job = {
+		.op = APPLY_SET_XATTR,
+		.path = (char *)path,
+		.name = (char *)name,
+		.data = (void *)data,
+		.len = len,
+	};
+
+	if (g_verbose >= 1) {
+		fprintf(stderr, "set_xattr %s - name=%s data_len=%d "
+				"data=%.*s\n", path, name, len,
+				len, (char*)data);
+	}
+
+	return apply_or_queue(r, &job);
+}
+
+static int process_remove_xattr(const char *path, const char *name, void *user)
+{
+	struct btrfs_receive *r = user;
+	struct apply_job job = {
+		.op = APPLY_REMOVE_XATTR,
+		.path = (char *)path,
+		.name = (char *)name,
+	};
+
+	if (g_verbose >= 1) {
+		fprintf(stderr, "remove_xattr %s - name=%s\n",
+				path, name);
+	}
+
+	return apply_or_queue(r, &job);
+}
+
+static int process_truncate(const char *path, u64 size, void *user)
+{
+	struct btrfs_receive *r = user;
+	struct apply_job job = {
+		.op = APPLY_TRUNCATE,
+		.path = (char *)path,
+		.size = size,
+	};
+
+	if (g_verbose >= 1)
+		fprintf(stderr, "truncate %s size=%llu\n", path, size);
+
+	return apply_or_queue(r, &job);
+}
+
+static int process_chmod(const char *path, u64 mode, void *user)
+{
+	struct btrfs_receive *r = user;
+	struct apply_job job = {
+		.op = APPLY_CHMOD,
+		.path = (char *)path,
+		.mode = mode,
+	};
+
+	if (g_verbose >= 1)
+		fprintf(stderr, "chmod %s - mode=0%o\n", path, (int)mode);
+
+	return apply_or_queue(r, &job);
+}
+
+static int process_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	struct btrfs_receive *r = user;
+	struct apply_job job = {
+		.op = APPLY_CHOWN,
+		.path = (char *)path,
+		.uid = uid,
+		.gid = gid,
+	};
+
+	if (g_verbose >= 1)
+		fprintf(stderr, "chown %s - uid=%llu, gid=%llu\n", path,
+				uid, gid);
+
+	return apply_or_queue(r, &job);
+}
+
+static int process_utimes(const char *path, struct timespec *at,
+			  struct timespec *mt, struct timespec *ct,
+			  void *user)
+{
+	struct btrfs_receive *r = user;
+	struct apply_job job = {
+		.op = APPLY_UTIMES,
+		.path = (char *)path,
+	};
+
+	if (g_verbose >= 1)
+		fprintf(stderr, "utimes %s\n", path);
+
+	job.tv[0] = *at;
+	job.tv[1] = *mt;
+	return apply_or_queue(r, &job);
+}
+
+
 struct btrfs_send_ops send_ops = {
 	.subvol = process_subvol,
 	.snapshot = process_snapshot,
@@ -787,8 +1429,35 @@ struct btrfs_send_ops send_ops = {
 	.utimes = process_utimes,
 };
 
+/*
+ * one reader for all streams, so nothing read ahead gets lost.  Framed
+ * streams from btrfs send -z are recognized and decoded on the way in.
+ */
+static int open_receive_stream(int fd, struct send_frame_reader **frames,
+			       struct btrfs_send_stream **stream)
+{
+	int ret;
+
+	ret = send_frame_reader_open(fd, frames);
+	if (ret < 0)
+		return ret;
+	if (*frames)
+		*stream = btrfs_send_stream_open_reader(send_frame_read,
+							*frames);
+	else
+		*stream = btrfs_send_stream_open(fd);
+	if (!*stream) {
+		send_frame_reader_close(*frames);
+		*frames = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd)
 {
+	struct btrfs_send_stream *stream = NULL;
+	struct send_frame_reader *frames = NULL;
 	int ret;
 	int end = 0;
 
@@ -805,16 +1474,28 @@ int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd)
 	if (ret < 0)
 		return ret;
 
-	r->write_fd = -1;
+	r->file.fd = -1;
+	pthread_mutex_init(&r->apply_mutex, NULL);
+	pthread_cond_init(&r->apply_cond, NULL);
+	ret = start_apply_workers(r, r->apply_threads);
+	if (ret < 0)
+		goto out;
+
+	ret = open_receive_stream(r_fd, &frames, &stream);
+	if (ret < 0)
+		goto out;
 
 	while (!end) {
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops, r);
+		ret = btrfs_send_stream_process(stream, &send_ops, r);
 		if (ret < 0)
 			goto out;
 		if (ret)
 			end = 1;
 
-		ret = close_inode_for_write(r);
+		ret = wait_for_apply(r);
+		if (ret < 0)
+			goto out;
+		ret = close_inode_for_write(&r->file);
 		if (ret < 0)
 			goto out;
 		ret = finish_subvol(r);
@@ -824,6 +1505,404 @@ int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd)
 	ret = 0;
 
 out:
+	stop_apply_workers(r);
+	btrfs_send_stream_close(stream);
+	send_frame_reader_close(frames);
+	return ret;
+}
+
+/*
+ * --dump-stats parses the streams and counts what they contain without
+ * applying anything, to see what makes a stream large or slow to receive.
+ */
+#define STATS_TOP_PATHS		10
+#define STATS_WRITE_BUCKETS	32
+
+struct stats_path {
+	struct rb_node rb_node;
+	u64 bytes;
+	char path[0];
+};
+
+struct stream_stats {
+	struct btrfs_send_stream *stream;
+	u64 cmds[__BTRFS_SEND_C_MAX];
+	u64 cmd_bytes[__BTRFS_SEND_C_MAX];
+	/* writes by size, bucket n holds sizes in [2^n, 2^(n+1)) */
+	u64 write_sizes[STATS_WRITE_BUCKETS];
+	u64 write_bytes;
+	u64 clone_bytes;
+	u64 clone_local_bytes;
+	u8 cur_uuid[BTRFS_UUID_SIZE];
+	int nr_subvols;
+
+	struct rb_root paths;
+	u64 nr_paths;
+	/* writes come in runs on the same file */
+	struct stats_path *last_path;
+};
+
+static const char * const stats_cmd_names[__BTRFS_SEND_C_MAX] = {
+	[BTRFS_SEND_C_SUBVOL] = "subvol",
+	[BTRFS_SEND_C_SNAPSHOT] = "snapshot",
+	[BTRFS_SEND_C_MKFILE] = "mkfile",
+	[BTRFS_SEND_C_MKDIR] = "mkdir",
+	[BTRFS_SEND_C_MKNOD] = "mknod",
+	[BTRFS_SEND_C_MKFIFO] = "mkfifo",
+	[BTRFS_SEND_C_MKSOCK] = "mksock",
+	[BTRFS_SEND_C_SYMLINK] = "symlink",
+	[BTRFS_SEND_C_RENAME] = "rename",
+	[BTRFS_SEND_C_LINK] = "link",
+	[BTRFS_SEND_C_UNLINK] = "unlink",
+	[BTRFS_SEND_C_RMDIR] = "rmdir",
+	[BTRFS_SEND_C_SET_XATTR] = "set_xattr",
+	[BTRFS_SEND_C_REMOVE_XATTR] = "remove_xattr",
+	[BTRFS_SEND_C_WRITE] = "write",
+	[BTRFS_SEND_C_CLONE] = "clone",
+	[BTRFS_SEND_C_TRUNCATE] = "truncate",
+	[BTRFS_SEND_C_CHMOD] = "chmod",
+	[BTRFS_SEND_C_CHOWN] = "chown",
+	[BTRFS_SEND_C_UTIMES] = "utimes",
+	[BTRFS_SEND_C_UPDATE_EXTENT] = "update_extent",
+};
+
+static int stats_cmd(struct stream_stats *st, int cmd)
+{
+	st->cmds[cmd]++;
+	st->cmd_bytes[cmd] += btrfs_send_stream_cmd_len(st->stream);
+	return 0;
+}
+
+static struct stats_path *stats_get_path(struct stream_stats *st,
+					 const char *path)
+{
+	struct rb_node **p = &st->paths.rb_node;
+	struct rb_node *parent = NULL;
+	struct stats_path *entry;
+	int cmp;
+
+	if (st->last_path && !strcmp(st->last_path->path, path))
+		return st->last_path;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct stats_path, rb_node);
+		cmp = strcmp(path, entry->path);
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			goto out;
+	}
+
+	entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
+	if (!entry)
+		return NULL;
+	strcpy(entry->path, path);
+	rb_link_node(&entry->rb_node, parent, p);
+	rb_insert_color(&entry->rb_node, &st->paths);
+	st->nr_paths++;
+out:
+	st->last_path = entry;
+	return entry;
+}
+
+static int stats_subvol(const char *path, const u8 *uuid, u64 ctransid,
+			void *user)
+{
+	struct stream_stats *st = user;
+
+	memcpy(st->cur_uuid, uuid, BTRFS_UUID_SIZE);
+	st->nr_subvols++;
+	return stats_cmd(st, BTRFS_SEND_C_SUBVOL);
+}
+
+static int stats_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			  const u8 *parent_uuid, u64 parent_ctransid,
+			  void *user)
+{
+	struct stream_stats *st = user;
+
+	memcpy(st->cur_uuid, uuid, BTRFS_UUID_SIZE);
+	st->nr_subvols++;
+	return stats_cmd(st, BTRFS_SEND_C_SNAPSHOT);
+}
+
+static int stats_mkfile(const char *path, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_MKFILE);
+}
+
+static int stats_mkdir(const char *path, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_MKDIR);
+}
+
+static int stats_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_MKNOD);
+}
+
+static int stats_mkfifo(const char *path, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_MKFIFO);
+}
+
+static int stats_mksock(const char *path, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_MKSOCK);
+}
+
+static int stats_symlink(const char *path, const char *lnk, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_SYMLINK);
+}
+
+static int stats_rename(const char *from, const char *to, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_RENAME);
+}
+
+static int stats_link(const char *path, const char *lnk, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_LINK);
+}
+
+static int stats_unlink(const char *path, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_UNLINK);
+}
+
+static int stats_rmdir(const char *path, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_RMDIR);
+}
+
+static int stats_write(const char *path, const void *data, u64 offset,
+		       u64 len, void *user)
+{
+	struct stream_stats *st = user;
+	struct stats_path *sp;
+	int bucket = 0;
+
+	while (bucket < STATS_WRITE_BUCKETS - 1 && (len >> (bucket + 1)))
+		bucket++;
+	st->write_sizes[bucket]++;
+	st->write_bytes += len;
+
+	sp = stats_get_path(st, path);
+	if (!sp)
+		return -ENOMEM;
+	sp->bytes += len;
+	return stats_cmd(st, BTRFS_SEND_C_WRITE);
+}
+
+static int stats_clone(const char *path, u64 offset, u64 len,
+		       const u8 *clone_uuid, u64 clone_ctransid,
+		       const char *clone_path, u64 clone_offset,
+		       void *user)
+{
+	struct stream_stats *st = user;
+
+	st->clone_bytes += len;
+	if (!memcmp(clone_uuid, st->cur_uuid, BTRFS_UUID_SIZE))
+		st->clone_local_bytes += len;
+	return stats_cmd(st, BTRFS_SEND_C_CLONE);
+}
+
+static int stats_set_xattr(const char *path, const char *name,
+			   const void *data, int len, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_SET_XATTR);
+}
+
+static int stats_remove_xattr(const char *path, const char *name, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_REMOVE_XATTR);
+}
+
+static int stats_truncate(const char *path, u64 size, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_TRUNCATE);
+}
+
+static int stats_chmod(const char *path, u64 mode, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_CHMOD);
+}
+
+static int stats_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_CHOWN);
+}
+
+static int stats_utimes(const char *path, struct timespec *at,
+			struct timespec *mt, struct timespec *ct,
+			void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_UTIMES);
+}
+
+static int stats_update_extent(const char *path, u64 offset, u64 len,
+			       void *user)
+{
+	return stats_cmd(user, BTRFS_SEND_C_UPDATE_EXTENT);
+}
+
+static struct btrfs_send_ops stats_ops = {
+	.subvol = stats_subvol,
+	.snapshot = stats_snapshot,
+	.mkfile = stats_mkfile,
+	.mkdir = stats_mkdir,
+	.mknod = stats_mknod,
+	.mkfifo = stats_mkfifo,
+	.mksock = stats_mksock,
+	.symlink = stats_symlink,
+	.rename = stats_rename,
+	.link = stats_link,
+	.unlink = stats_unlink,
+	.rmdir = stats_rmdir,
+	.write = stats_write,
+	.clone = stats_clone,
+	.set_xattr = stats_set_xattr,
+	.remove_xattr = stats_remove_xattr,
+	.truncate = stats_truncate,
+	.chmod = stats_chmod,
+	.chown = stats_chown,
+	.utimes = stats_utimes,
+	.update_extent = stats_update_extent,
+};
+
+static void print_stats(struct stream_stats *st, double secs)
+{
+	struct stats_path *top[STATS_TOP_PATHS];
+	struct stats_path *sp;
+	struct rb_node *n;
+	u64 total_cmds = 0;
+	u64 total_bytes = 0;
+	u64 data;
+	int nr_top = 0;
+	int i;
+	int j;
+
+	printf("%-16s %12s %16s\n", "command", "count", "bytes");
+	for (i = 0; i < __BTRFS_SEND_C_MAX; i++) {
+		if (!st->cmds[i])
+			continue;
+		printf("%-16s %12llu %16llu\n", stats_cmd_names[i],
+		       (unsigned long long)st->cmds[i],
+		       (unsigned long long)st->cmd_bytes[i]);
+		total_cmds += st->cmds[i];
+		total_bytes += st->cmd_bytes[i];
+	}
+	printf("%-16s %12llu %16llu\n", "total",
+	       (unsigned long long)total_cmds,
+	       (unsigned long long)total_bytes);
+
+	printf("\n%d subvolume(s), parsed in %.2f seconds", st->nr_subvols,
+	       secs);
+	if (secs > 0)
+		printf(" (%.1f MiB/s)", total_bytes / secs / (1024 * 1024));
+	printf("\n");
+
+	if (st->cmds[BTRFS_SEND_C_WRITE]) {
+		printf("\nwrite sizes:\n");
+		for (i = 0; i < STATS_WRITE_BUCKETS; i++) {
+			if (!st->write_sizes[i])
+				continue;
+			printf("  %10llu - %-10llu %12llu\n",
+			       i ? 1ULL << i : 0ULL, (2ULL << i) - 1,
+			       (unsigned long long)st->write_sizes[i]);
+		}
+	}
+
+	data = st->write_bytes + st->clone_bytes;
+	printf("\ndata: %llu bytes written, %llu bytes cloned",
+	       (unsigned long long)st->write_bytes,
+	       (unsigned long long)st->clone_bytes);
+	if (data)
+		printf(" (%.1f%% cloned)", 100.0 * st->clone_bytes / data);
+	printf("\n");
+	if (st->clone_bytes)
+		printf("%.1f%% of the cloned bytes come from within the "
+		       "subvolume\n",
+		       100.0 * st->clone_local_bytes / st->clone_bytes);
+
+	/* keep the largest few in top[], sorted largest first */
+	for (n = rb_first(&st->paths); n; n = rb_next(n)) {
+		sp = rb_entry(n, struct stats_path, rb_node);
+		if (nr_top == STATS_TOP_PATHS &&
+		    sp->bytes <= top[nr_top - 1]->bytes)
+			continue;
+		if (nr_top < STATS_TOP_PATHS)
+			nr_top++;
+		for (j = nr_top - 1; j > 0 && top[j - 1]->bytes < sp->bytes;
+		     j--)
+			top[j] = top[j - 1];
+		top[j] = sp;
+	}
+	if (nr_top) {
+		printf("\ntop %d of %llu paths by bytes written:\n", nr_top,
+		       (unsigned long long)st->nr_paths);
+		for (i = 0; i < nr_top; i++)
+			printf("  %16llu %s\n",
+			       (unsigned long long)top[i]->bytes,
+			       top[i]->path);
+	}
+}
+
+static int dump_stats(int r_fd)
+{
+	struct stream_stats st;
+	struct send_frame_reader *frames = NULL;
+	struct stats_path *sp;
+	struct rb_node *n;
+	struct timeval start, end;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	gettimeofday(&start, NULL);
+
+	ret = open_receive_stream(r_fd, &frames, &st.stream);
+	if (ret < 0)
+		return ret;
+	while (1) {
+		ret = btrfs_send_stream_process(st.stream, &stats_ops, &st);
+		if (ret < 0)
+			goto out;
+		if (ret)
+			break;
+	}
+	ret = 0;
+
+	gettimeofday(&end, NULL);
+	print_stats(&st, end.tv_sec - start.tv_sec +
+			 (end.tv_usec - start.tv_usec) / 1000000.0);
+
+out:
+	btrfs_send_stream_close(st.stream);
+	send_frame_reader_close(frames);
+	while ((n = rb_first(&st.paths))) {
+		sp = rb_entry(n, struct stats_path, rb_node);
+		rb_erase(n, &st.paths);
+		free(sp);
+	}
+	return ret;
+}
+
+static int do_receive_offline(const char *dev, int r_fd)
+{
+	struct btrfs_send_stream *stream = NULL;
+	struct send_frame_reader *frames = NULL;
+	int ret;
+
+	ret = open_receive_stream(r_fd, &frames, &stream);
+	if (ret < 0)
+		return ret;
+	ret = receive_offline(dev, stream, g_verbose);
+	btrfs_send_stream_close(stream);
+	send_frame_reader_close(frames);
 	return ret;
 }
 
@@ -834,16 +1913,37 @@ static int do_cmd_receive(int argc, char **argv)
 	char *fromfile = NULL;
 	struct btrfs_receive r;
 	int receive_fd = fileno(stdin);
+	int stats = 0;
+	int offline = 0;
+	static struct option long_options[] = {
+		{ "dump-stats", no_argument, NULL, 'S' },
+		{ "offline", no_argument, NULL, 'O' },
+		{ 0, 0, 0, 0 }
+	};
 
 	int ret;
 
 	memset(&r, 0, sizeof(r));
 
-	while ((c = getopt(argc, argv, "vf:")) != -1) {
+	while ((c = getopt_long(argc, argv, "vf:j:", long_options,
+				NULL)) != -1) {
 		switch (c) {
+		case 'S':
+			stats = 1;
+			break;
+		case 'O':
+			offline = 1;
+			break;
 		case 'v':
 			g_verbose++;
 			break;
+		case 'j':
+			r.apply_threads = atoi(optarg);
+			if (r.apply_threads < 0) {
+				fprintf(stderr, "ERROR: invalid -j value\n");
+				return 1;
+			}
+			break;
 		case 'f':
 			fromfile = optarg;
 			break;
@@ -854,13 +1954,24 @@ static int do_cmd_receive(int argc, char **argv)
 		}
 	}
 
-	if (optind + 1 != argc) {
+	if (stats && offline) {
+		fprintf(stderr, "ERROR: --dump-stats and --offline can't be "
+				"used together\n");
+		return 1;
+	}
+	if (stats) {
+		if (optind != argc) {
+			fprintf(stderr, "ERROR: --dump-stats takes no mount "
+					"point\n");
+			return 1;
+		}
+	} else if (optind + 1 != argc) {
 		fprintf(stderr, "ERROR: receive needs path to subvolume\n");
 		return 1;
+	} else {
+		tomnt = argv[optind];
 	}
 
-	tomnt = argv[optind];
-
 	if (fromfile) {
 		receive_fd = open(fromfile, O_RDONLY | O_NOATIME);
 		if (receive_fd < 0) {
@@ -869,7 +1980,12 @@ static int do_cmd_receive(int argc, char **argv)
 		}
 	}
 
-	ret = do_receive(&r, tomnt, receive_fd);
+	if (stats)
+		ret = dump_stats(receive_fd);
+	else if (offline)
+		ret = do_receive_offline(tomnt, receive_fd);
+	else
+		ret = do_receive(&r, tomnt, receive_fd);
 
 	return ret;
 }
@@ -880,7 +1996,7 @@ static const char * const receive_cmd_group_usage[] = {
 };
 
 const char * const cmd_receive_usage[] = {
-	"btrfs receive [-v] [-f <infile>] <mount>",
+	"btrfs receive [-v] [-f <infile>] [-j <num>] <mount> | --offline <device> | --dump-stats",
 	"Receive subvolumes from stdin.",
 	"Receives one or more subvolumes that were previously ",
 	"sent with btrfs send. The received subvolumes are stored",
@@ -889,13 +2005,29 @@ const char * const cmd_receive_usage[] = {
 	"already exists. It will also fail in case a previously",
 	"received subvolume was changed after it was received.",
 	"After receiving a subvolume, it is immediately set to",
-	"read only.\n",
+	"read only.",
+	"Streams framed by btrfs send -z are recognized and checked",
+	"frame by frame.\n",
 	"-v               Enable verbose debug output. Each",
 	"                 occurrence of this option increases the",
 	"                 verbose level more.",
 	"-f <infile>      By default, btrfs receive uses stdin",
 	"                 to receive the subvolumes. Use this",
 	"                 option to specify a file to use instead.",
+	"-j <num>         Apply writes, clones and attribute changes",
+	"                 of different files on <num> threads.",
+	"                 Commands on one path stay in order, and",
+	"                 creating, renaming or removing files waits",
+	"                 for everything before it. Default 1.",
+	"--offline        Receive into the unmounted filesystem on",
+	"                 <device> instead of a mount point. The",
+	"                 subvolumes are created at its top level.",
+	"                 Only full streams, without clones from",
+	"                 other subvolumes, can be received this way.",
+	"--dump-stats     Don't receive anything, print what the",
+	"                 stream contains: commands and bytes per",
+	"                 command, write sizes, how much data is",
+	"                 cloned and the paths with the most data.",
 	NULL
 };
 
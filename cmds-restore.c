@@ -28,6 +28,11 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <zlib.h>
+#include <pthread.h>
+#ifdef BTRFS_RESTORE_LZO
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+#endif
 
 #include "ctree.h"
 #include "disk-io.h"
@@ -45,34 +50,6 @@ static int verbose = 0;
 static int ignore_errors = 0;
 static int overwrite = 0;
 
-static int decompress(char *inbuf, char *outbuf, u64 compress_len,
-		      u64 decompress_len)
-{
-	z_stream strm;
-	int ret;
-
-	memset(&strm, 0, sizeof(strm));
-	ret = inflateInit(&strm);
-	if (ret != Z_OK) {
-		fprintf(stderr, "inflate init returnd %d\n", ret);
-		return -1;
-	}
-
-	strm.avail_in = compress_len;
-	strm.next_in = (unsigned char *)inbuf;
-	strm.avail_out = decompress_len;
-	strm.next_out = (unsigned char *)outbuf;
-	ret = inflate(&strm, Z_NO_FLUSH);
-	if (ret != Z_STREAM_END) {
-		(void)inflateEnd(&strm);
-		fprintf(stderr, "ret is %d\n", ret);
-		return -1;
-	}
-
-	(void)inflateEnd(&strm);
-	return 0;
-}
-
 int next_leaf(struct btrfs_root *root, struct btrfs_path *path)
 {
 	int slot;
@@ -125,171 +102,529 @@ int next_leaf(struct btrfs_root *root, struct btrfs_path *path)
 	return 0;
 }
 
-static int copy_one_inline(int fd, struct btrfs_path *path, u64 pos)
+/*
+ * One file to restore.  The directory walk fills in where its extents live
+ * on disk while it holds the tree, and a worker does the reads and writes
+ * afterwards without touching the btree code, which isn't thread safe.
+ */
+struct restore_stripe {
+	int fd;
+	u64 physical;
+	u64 length;
+};
+
+struct restore_extent {
+	u64 pos;
+	u64 ram_size;
+	u64 disk_size;
+	/* the part of the decompressed extent the file actually uses */
+	u64 offset;
+	u64 num_bytes;
+	int compress;
+	int nr_stripes;
+	struct restore_stripe *stripes;
+	/* inline extents carry their data */
+	char *inline_data;
+	int inline_len;
+};
+
+struct restore_job {
+	struct list_head list;
+	char *path;
+	u64 size;
+	int nr_extents;
+	int alloc_extents;
+	struct restore_extent *extents;
+};
+
+struct restore_buffers {
+	char *inbuf;
+	size_t inbuf_size;
+	char *outbuf;
+	size_t outbuf_size;
+	z_stream strm;
+	int strm_init;
+};
+
+/*
+ * decompressed data and uncompressed extents are written out in chunks of
+ * this size, so a worker's memory doesn't grow with the extent size
+ */
+#define RESTORE_CHUNK_SIZE	(1024 * 1024)
+
+/* btrfs lzo: a le32 total length, then le32 length prefixed segments */
+#define LZO_LEN			4
+#define LZO_SEGMENT_SIZE	4096
+
+/* where the next decompressed bytes of an extent go in the file */
+struct restore_window {
+	int fd;
+	u64 pos;
+	u64 skip;
+	u64 left;
+};
+
+#define RESTORE_MAX_QUEUED	1024
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct list_head jobs;
+	pthread_t *threads;
+	int num_threads;
+	int nr_jobs;
+	int done;
+	int error;
+} restore_queue = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.jobs = LIST_HEAD_INIT(restore_queue.jobs),
+};
+
+static char *grow_restore_buffer(char **buf, size_t *size, u64 len)
+{
+	char *tmp;
+
+	if (len <= *size)
+		return *buf;
+	tmp = realloc(*buf, len);
+	if (!tmp) {
+		fprintf(stderr, "No memory\n");
+		return NULL;
+	}
+	*buf = tmp;
+	*size = len;
+	return tmp;
+}
+
+static void free_restore_buffers(struct restore_buffers *bufs)
+{
+	free(bufs->inbuf);
+	free(bufs->outbuf);
+	if (bufs->strm_init)
+		(void)inflateEnd(&bufs->strm);
+}
+
+static void free_restore_job(struct restore_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->nr_extents; i++) {
+		free(job->extents[i].stripes);
+		free(job->extents[i].inline_data);
+	}
+	free(job->extents);
+	free(job->path);
+	free(job);
+}
+
+static struct restore_extent *add_restore_extent(struct restore_job *job,
+						 u64 pos)
+{
+	struct restore_extent *ext;
+
+	if (job->nr_extents == job->alloc_extents) {
+		int alloc = job->alloc_extents ? job->alloc_extents * 2 : 4;
+
+		ext = realloc(job->extents, alloc * sizeof(*ext));
+		if (!ext) {
+			fprintf(stderr, "No memory\n");
+			return NULL;
+		}
+		job->extents = ext;
+		job->alloc_extents = alloc;
+	}
+	ext = job->extents + job->nr_extents++;
+	memset(ext, 0, sizeof(*ext));
+	ext->pos = pos;
+	return ext;
+}
+
+/*
+ * drop the bytes at the front of the extent the file doesn't reference and
+ * write out what's left of the window
+ */
+static int write_window(struct restore_window *win, char *buf, u64 len)
+{
+	ssize_t done;
+	u64 skip;
+
+	if (win->skip) {
+		skip = min(win->skip, len);
+		win->skip -= skip;
+		buf += skip;
+		len -= skip;
+	}
+	len = min(len, win->left);
+	while (len) {
+		done = pwrite(win->fd, buf, len, win->pos);
+		if (done < 0) {
+			fprintf(stderr, "Error writing: %d %s\n", errno,
+				strerror(errno));
+			return -1;
+		}
+		buf += done;
+		len -= done;
+		win->pos += done;
+		win->left -= done;
+	}
+	return 0;
+}
+
+static int decompress_zlib(struct restore_buffers *bufs, char *inbuf,
+			   u64 len, struct restore_window *win)
+{
+	z_stream *strm = &bufs->strm;
+	u64 out_len;
+	int ret;
+
+	if (!bufs->strm_init) {
+		ret = inflateInit(strm);
+		if (ret != Z_OK) {
+			fprintf(stderr, "inflate init returnd %d\n", ret);
+			return -1;
+		}
+		bufs->strm_init = 1;
+	} else {
+		inflateReset(strm);
+	}
+
+	strm->avail_in = len;
+	strm->next_in = (unsigned char *)inbuf;
+	while (win->left) {
+		strm->avail_out = RESTORE_CHUNK_SIZE;
+		strm->next_out = (unsigned char *)bufs->outbuf;
+		ret = inflate(strm, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			fprintf(stderr, "ret is %d\n", ret);
+			return -1;
+		}
+		out_len = RESTORE_CHUNK_SIZE - strm->avail_out;
+		if (write_window(win, bufs->outbuf, out_len))
+			return -1;
+		if (ret == Z_STREAM_END)
+			break;
+		if (!out_len && !strm->avail_in) {
+			fprintf(stderr, "Truncated zlib extent\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#ifdef BTRFS_RESTORE_LZO
+static inline u32 read_lzo_len(char *buf)
+{
+	__le32 len;
+
+	memcpy(&len, buf, LZO_LEN);
+	return le32_to_cpu(len);
+}
+
+/*
+ * each segment decompresses to at most one page, and a segment header never
+ * straddles a page of the compressed data
+ */
+static int decompress_lzo(struct restore_buffers *bufs, char *inbuf,
+			  u64 len, struct restore_window *win)
+{
+	u64 tot_len;
+	u64 tot_in = LZO_LEN;
+	u64 out_len = 0;
+	u64 seg_len;
+	u64 rem_page;
+	lzo_uint new_len;
+	int ret;
+
+	if (len < LZO_LEN) {
+		fprintf(stderr, "Truncated lzo extent\n");
+		return -1;
+	}
+	tot_len = read_lzo_len(inbuf);
+	if (tot_len > len) {
+		fprintf(stderr, "Bad lzo extent length %Lu\n", tot_len);
+		return -1;
+	}
+
+	while (tot_in + LZO_LEN <= tot_len && win->left) {
+		seg_len = read_lzo_len(inbuf + tot_in);
+		tot_in += LZO_LEN;
+		if (tot_in + seg_len > tot_len) {
+			fprintf(stderr, "Bad lzo segment length %Lu\n",
+				seg_len);
+			return -1;
+		}
+
+		if (out_len + LZO_SEGMENT_SIZE > RESTORE_CHUNK_SIZE) {
+			if (write_window(win, bufs->outbuf, out_len))
+				return -1;
+			out_len = 0;
+		}
+		new_len = LZO_SEGMENT_SIZE;
+		ret = lzo1x_decompress_safe((unsigned char *)inbuf + tot_in,
+				seg_len, (unsigned char *)bufs->outbuf + out_len,
+				&new_len, NULL);
+		if (ret != LZO_E_OK) {
+			fprintf(stderr, "lzo decompress failed %d\n", ret);
+			return -1;
+		}
+		out_len += new_len;
+		tot_in += seg_len;
+
+		rem_page = LZO_SEGMENT_SIZE - (tot_in % LZO_SEGMENT_SIZE);
+		if (rem_page < LZO_LEN)
+			tot_in += rem_page;
+	}
+	return write_window(win, bufs->outbuf, out_len);
+}
+#endif
+
+static int decompress(int compress, struct restore_buffers *bufs,
+		      char *inbuf, u64 len, struct restore_window *win)
+{
+	if (!grow_restore_buffer(&bufs->outbuf, &bufs->outbuf_size,
+				 RESTORE_CHUNK_SIZE))
+		return -1;
+
+	switch (compress) {
+	case BTRFS_COMPRESS_ZLIB:
+		return decompress_zlib(bufs, inbuf, len, win);
+#ifdef BTRFS_RESTORE_LZO
+	case BTRFS_COMPRESS_LZO:
+		return decompress_lzo(bufs, inbuf, len, win);
+#endif
+	default:
+		break;
+	}
+	fprintf(stderr, "Don't support compression yet %d\n", compress);
+	if (compress == BTRFS_COMPRESS_LZO)
+		fprintf(stderr, "btrfs was built without lzo support, "
+			"rebuild with LZO=1\n");
+	return -1;
+}
+
+static int copy_one_inline(int fd, struct restore_extent *ext,
+			   struct restore_buffers *bufs)
+{
+	struct restore_window win = {
+		.fd = fd,
+		.pos = ext->pos,
+	};
+
+	if (ext->compress == BTRFS_COMPRESS_NONE) {
+		win.left = ext->inline_len;
+		return write_window(&win, ext->inline_data, ext->inline_len);
+	}
+
+	win.left = ext->ram_size;
+	return decompress(ext->compress, bufs, ext->inline_data,
+			  ext->inline_len, &win);
+}
+
+static int map_one_inline(struct restore_job *job, struct btrfs_path *path,
+			  u64 pos)
 {
 	struct extent_buffer *leaf = path->nodes[0];
 	struct btrfs_file_extent_item *fi;
-	char buf[4096];
-	char *outbuf;
-	ssize_t done;
+	struct restore_extent *ext;
 	unsigned long ptr;
-	int ret;
 	int len;
-	int ram_size;
-	int compress;
 
 	fi = btrfs_item_ptr(leaf, path->slots[0],
 			    struct btrfs_file_extent_item);
 	ptr = btrfs_file_extent_inline_start(fi);
 	len = btrfs_file_extent_inline_item_len(leaf,
 					btrfs_item_nr(leaf, path->slots[0]));
-	read_extent_buffer(leaf, buf, ptr, len);
 
-	compress = btrfs_file_extent_compression(leaf, fi);
-	if (compress == BTRFS_COMPRESS_NONE) {
-		done = pwrite(fd, buf, len, pos);
-		if (done < len) {
-			fprintf(stderr, "Short inline write, wanted %d, did "
-				"%zd: %d\n", len, done, errno);
+	ext = add_restore_extent(job, pos);
+	if (!ext)
+		return -1;
+	ext->compress = btrfs_file_extent_compression(leaf, fi);
+	ext->ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
+	ext->inline_len = len;
+	ext->inline_data = malloc(len);
+	if (!ext->inline_data) {
+		fprintf(stderr, "No memory\n");
+		return -1;
+	}
+	read_extent_buffer(leaf, ext->inline_data, ptr, len);
+	return 0;
+}
+
+static int copy_one_extent(int fd, struct restore_extent *ext,
+			   struct restore_buffers *bufs)
+{
+	struct restore_window win = {
+		.fd = fd,
+		.pos = ext->pos,
+		.skip = ext->offset,
+		.left = ext->num_bytes,
+	};
+	struct restore_stripe *stripe;
+	char *inbuf;
+	ssize_t done;
+	u64 count = 0;
+	u64 off;
+	u64 len;
+	int i;
+
+	/*
+	 * the stripes of an uncompressed extent only cover the bytes the file
+	 * uses, copy them over a chunk at a time
+	 */
+	if (ext->compress == BTRFS_COMPRESS_NONE) {
+		inbuf = grow_restore_buffer(&bufs->inbuf, &bufs->inbuf_size,
+					    RESTORE_CHUNK_SIZE);
+		if (!inbuf)
 			return -1;
+		win.skip = 0;
+		for (i = 0; i < ext->nr_stripes; i++) {
+			stripe = ext->stripes + i;
+			for (off = 0; off < stripe->length; off += len) {
+				len = min_t(u64, stripe->length - off,
+					    RESTORE_CHUNK_SIZE);
+				done = pread(stripe->fd, inbuf, len,
+					     stripe->physical + off);
+				if (done < (ssize_t)len) {
+					fprintf(stderr, "Short read %d\n",
+						errno);
+					return -1;
+				}
+				if (write_window(&win, inbuf, len))
+					return -1;
+			}
 		}
 		return 0;
 	}
 
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
-	outbuf = malloc(ram_size);
-	if (!outbuf) {
-		fprintf(stderr, "No memory\n");
+	inbuf = grow_restore_buffer(&bufs->inbuf, &bufs->inbuf_size,
+				    ext->disk_size);
+	if (!inbuf)
 		return -1;
+
+	for (i = 0; i < ext->nr_stripes; i++) {
+		stripe = ext->stripes + i;
+		done = pread(stripe->fd, inbuf + count, stripe->length,
+			     stripe->physical);
+		if (done < (ssize_t)stripe->length) {
+			fprintf(stderr, "Short read %d\n", errno);
+			return -1;
+		}
+		count += stripe->length;
 	}
 
-	ret = decompress(buf, outbuf, len, ram_size);
-	if (ret) {
-		free(outbuf);
-		return ret;
+	return decompress(ext->compress, bufs, inbuf, ext->disk_size, &win);
+}
+
+static int add_restore_stripe(struct restore_extent *ext, int fd,
+			      u64 physical, u64 length)
+{
+	struct restore_stripe *stripe;
+
+	/* physically contiguous with the last stripe, read them in one go */
+	if (ext->nr_stripes) {
+		stripe = ext->stripes + ext->nr_stripes - 1;
+		if (stripe->fd == fd &&
+		    stripe->physical + stripe->length == physical) {
+			stripe->length += length;
+			return 0;
+		}
 	}
 
-	done = pwrite(fd, outbuf, ram_size, pos);
-	free(outbuf);
-	if (done < ram_size) {
-		fprintf(stderr, "Short compressed inline write, wanted %d, "
-			"did %zd: %d\n", ram_size, done, errno);
+	stripe = realloc(ext->stripes, (ext->nr_stripes + 1) * sizeof(*stripe));
+	if (!stripe) {
+		fprintf(stderr, "No memory\n");
 		return -1;
 	}
-
+	ext->stripes = stripe;
+	stripe += ext->nr_stripes++;
+	stripe->fd = fd;
+	stripe->physical = physical;
+	stripe->length = length;
 	return 0;
 }
 
-static int copy_one_extent(struct btrfs_root *root, int fd,
-			   struct extent_buffer *leaf,
-			   struct btrfs_file_extent_item *fi, u64 pos)
+/*
+ * look up where on disk an extent lives, so a worker can read it later.
+ * Uncompressed extents that directly follow the previous one in the file
+ * are merged into it, so runs of small extents turn into a few large reads.
+ */
+static int map_one_extent(struct btrfs_root *root, struct restore_job *job,
+			  struct extent_buffer *leaf,
+			  struct btrfs_file_extent_item *fi, u64 pos)
 {
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
-	char *inbuf, *outbuf = NULL;
-	ssize_t done, total = 0;
+	struct restore_extent *ext = NULL;
 	u64 bytenr;
-	u64 ram_size;
-	u64 disk_size;
 	u64 length;
 	u64 size_left;
-	u64 dev_bytenr;
-	u64 count = 0;
+	u64 physical;
 	int compress;
 	int ret;
-	int dev_fd;
-
-	compress = btrfs_file_extent_compression(leaf, fi);
-	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
-	disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
-	size_left = disk_size;
 
 	/* we found a hole */
-	if (disk_size == 0)
+	if (btrfs_file_extent_disk_num_bytes(leaf, fi) == 0)
 		return 0;
 
-	inbuf = malloc(disk_size);
-	if (!inbuf) {
-		fprintf(stderr, "No memory\n");
-		return -1;
+	compress = btrfs_file_extent_compression(leaf, fi);
+	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+
+	if (compress == BTRFS_COMPRESS_NONE && job->nr_extents) {
+		ext = job->extents + job->nr_extents - 1;
+		if (ext->compress != BTRFS_COMPRESS_NONE ||
+		    ext->inline_data || ext->pos + ext->num_bytes != pos)
+			ext = NULL;
 	}
 
-	if (compress != BTRFS_COMPRESS_NONE) {
-		outbuf = malloc(ram_size);
-		if (!outbuf) {
-			fprintf(stderr, "No memory\n");
-			free(inbuf);
+	if (ext) {
+		/* only read the part of the extent the file references */
+		bytenr += btrfs_file_extent_offset(leaf, fi);
+		size_left = btrfs_file_extent_num_bytes(leaf, fi);
+		ext->num_bytes += size_left;
+		ext->disk_size += size_left;
+		ext->ram_size += size_left;
+	} else {
+		ext = add_restore_extent(job, pos);
+		if (!ext)
 			return -1;
+		ext->compress = compress;
+		ext->disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
+		ext->ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
+		ext->offset = btrfs_file_extent_offset(leaf, fi);
+		ext->num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
+		size_left = ext->disk_size;
+
+		if (compress == BTRFS_COMPRESS_NONE) {
+			bytenr += ext->offset;
+			size_left = ext->num_bytes;
+			ext->disk_size = ext->num_bytes;
+			ext->ram_size = ext->num_bytes;
+			ext->offset = 0;
 		}
 	}
-again:
-	length = size_left;
-	ret = btrfs_map_block(&root->fs_info->mapping_tree, READ,
-			      bytenr, &length, &multi, 0, NULL);
-	if (ret) {
-		free(inbuf);
-		free(outbuf);
-		fprintf(stderr, "Error mapping block %d\n", ret);
-		return ret;
-	}
-	device = multi->stripes[0].dev;
-	dev_fd = device->fd;
-	device->total_ios++;
-	dev_bytenr = multi->stripes[0].physical;
-	kfree(multi);
 
-	if (size_left < length)
+	while (size_left) {
 		length = size_left;
-	size_left -= length;
-
-	done = pread(dev_fd, inbuf+count, length, dev_bytenr);
-	if (done < length) {
-		free(inbuf);
-		free(outbuf);
-		fprintf(stderr, "Short read %d\n", errno);
-		return -1;
-	}
-
-	count += length;
-	bytenr += length;
-	if (size_left)
-		goto again;
-
-
-	if (compress == BTRFS_COMPRESS_NONE) {
-		while (total < ram_size) {
-			done = pwrite(fd, inbuf+total, ram_size-total,
-				      pos+total);
-			if (done < 0) {
-				free(inbuf);
-				fprintf(stderr, "Error writing: %d %s\n", errno, strerror(errno));
-				return -1;
-			}
-			total += done;
-		}
-		free(inbuf);
-		return 0;
-	}
-
-	ret = decompress(inbuf, outbuf, disk_size, ram_size);
-	free(inbuf);
-	if (ret) {
-		free(outbuf);
-		return ret;
-	}
-
-	while (total < ram_size) {
-		done = pwrite(fd, outbuf+total, ram_size-total, pos+total);
-		if (done < 0) {
-			free(outbuf);
-			fprintf(stderr, "Error writing: %d %s\n", errno, strerror(errno));
-			return -1;
+		ret = btrfs_map_block(&root->fs_info->mapping_tree, READ,
+				      bytenr, &length, &multi, 0, NULL);
+		if (ret) {
+			fprintf(stderr, "Error mapping block %d\n", ret);
+			return ret;
 		}
-		total += done;
+		device = multi->stripes[0].dev;
+		device->total_ios++;
+		physical = multi->stripes[0].physical;
+		kfree(multi);
+
+		if (size_left < length)
+			length = size_left;
+		ret = add_restore_stripe(ext, device->fd, physical, length);
+		if (ret)
+			return ret;
+		size_left -= length;
+		bytenr += length;
 	}
-	free(outbuf);
-
 	return 0;
 }
 
@@ -313,8 +648,9 @@ again:
 }
 
 
-static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
-		     const char *file)
+/* collect the extents of a file into job */
+static int map_file(struct btrfs_root *root, struct btrfs_key *key,
+		    struct restore_job *job)
 {
 	struct extent_buffer *leaf;
 	struct btrfs_path *path;
@@ -370,7 +706,7 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 
 	while (1) {
 		if (loops++ >= 1024) {
-			ret = ask_to_continue(file);
+			ret = ask_to_continue(job->path);
 			if (ret)
 				break;
 			loops = 0;
@@ -410,14 +746,14 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (extent_type == BTRFS_FILE_EXTENT_PREALLOC)
 			goto next;
 		if (extent_type == BTRFS_FILE_EXTENT_INLINE) {
-			ret = copy_one_inline(fd, path, found_key.offset);
+			ret = map_one_inline(job, path, found_key.offset);
 			if (ret) {
 				btrfs_free_path(path);
 				return -1;
 			}
 		} else if (extent_type == BTRFS_FILE_EXTENT_REG) {
-			ret = copy_one_extent(root, fd, leaf, fi,
-					      found_key.offset);
+			ret = map_one_extent(root, job, leaf, fi,
+					     found_key.offset);
 			if (ret) {
 				btrfs_free_path(path);
 				return ret;
@@ -431,12 +767,166 @@ next:
 
 	btrfs_free_path(path);
 set_size:
-	if (found_size) {
-		ret = ftruncate(fd, (loff_t)found_size);
+	job->size = found_size;
+	return 0;
+}
+
+/*
+ * reserve the ranges the extents will be written to, so the output isn't
+ * fragmented by workers writing many files at once.  Holes are left alone.
+ */
+static void preallocate_file(int fd, struct restore_job *job)
+{
+	struct restore_extent *ext;
+	int i;
+
+	for (i = 0; i < job->nr_extents; i++) {
+		ext = job->extents + i;
+		if (ext->inline_data)
+			continue;
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, ext->pos,
+			      ext->num_bytes))
+			return;
+	}
+}
+
+/* write out a file whose extents have been mapped */
+static int copy_file(struct restore_job *job, struct restore_buffers *bufs)
+{
+	struct restore_extent *ext;
+	int ret = 0;
+	int fd;
+	int i;
+
+	/* truncate, whatever an overwritten file had in its holes must go */
+	fd = open(job->path, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating %s: %d\n", job->path, errno);
+		return -1;
+	}
+
+	preallocate_file(fd, job);
+	for (i = 0; i < job->nr_extents; i++) {
+		ext = job->extents + i;
+		if (ext->inline_data)
+			ret = copy_one_inline(fd, ext, bufs);
+		else
+			ret = copy_one_extent(fd, ext, bufs);
 		if (ret)
-			return ret;
+			goto out;
 	}
-	return 0;
+
+	if (job->size)
+		ret = ftruncate(fd, (loff_t)job->size);
+out:
+	close(fd);
+	return ret;
+}
+
+static void *restore_worker(void *data)
+{
+	struct restore_buffers bufs;
+	struct restore_job *job;
+	int ret;
+
+	memset(&bufs, 0, sizeof(bufs));
+	while (1) {
+		pthread_mutex_lock(&restore_queue.mutex);
+		while (list_empty(&restore_queue.jobs) &&
+		       !restore_queue.done)
+			pthread_cond_wait(&restore_queue.cond,
+					  &restore_queue.mutex);
+		if (list_empty(&restore_queue.jobs)) {
+			pthread_mutex_unlock(&restore_queue.mutex);
+			break;
+		}
+		job = list_entry(restore_queue.jobs.next, struct restore_job,
+				 list);
+		list_del_init(&job->list);
+		restore_queue.nr_jobs--;
+		pthread_cond_broadcast(&restore_queue.cond);
+		pthread_mutex_unlock(&restore_queue.mutex);
+
+		ret = copy_file(job, &bufs);
+		if (ret && !ignore_errors) {
+			pthread_mutex_lock(&restore_queue.mutex);
+			if (!restore_queue.error)
+				restore_queue.error = ret;
+			pthread_mutex_unlock(&restore_queue.mutex);
+		}
+		free_restore_job(job);
+	}
+	free_restore_buffers(&bufs);
+	return NULL;
+}
+
+/*
+ * hand a mapped file to the workers, or restore it right here when running
+ * without any.  Returns the first error a worker ran into.
+ */
+static int queue_restore_job(struct restore_job *job)
+{
+	struct restore_buffers bufs;
+	int ret;
+
+	if (!restore_queue.num_threads) {
+		memset(&bufs, 0, sizeof(bufs));
+		ret = copy_file(job, &bufs);
+		free_restore_buffers(&bufs);
+		free_restore_job(job);
+		return ret;
+	}
+
+	pthread_mutex_lock(&restore_queue.mutex);
+	while (restore_queue.nr_jobs >= RESTORE_MAX_QUEUED &&
+	       !restore_queue.error)
+		pthread_cond_wait(&restore_queue.cond, &restore_queue.mutex);
+	ret = restore_queue.error;
+	if (!ret) {
+		list_add_tail(&job->list, &restore_queue.jobs);
+		restore_queue.nr_jobs++;
+		pthread_cond_broadcast(&restore_queue.cond);
+	}
+	pthread_mutex_unlock(&restore_queue.mutex);
+	if (ret)
+		free_restore_job(job);
+	return ret;
+}
+
+static int start_restore_workers(int num_threads)
+{
+	int ret = 0;
+	int i;
+
+	if (!num_threads)
+		return 0;
+	restore_queue.threads = calloc(num_threads, sizeof(pthread_t));
+	if (!restore_queue.threads)
+		return -ENOMEM;
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_create(restore_queue.threads + i, NULL,
+				     restore_worker, NULL);
+		if (ret)
+			break;
+		restore_queue.num_threads++;
+	}
+	return ret;
+}
+
+/* let the workers finish the queue, returns the first error they hit */
+static int stop_restore_workers(void)
+{
+	int i;
+
+	pthread_mutex_lock(&restore_queue.mutex);
+	restore_queue.done = 1;
+	pthread_cond_broadcast(&restore_queue.cond);
+	pthread_mutex_unlock(&restore_queue.mutex);
+
+	for (i = 0; i < restore_queue.num_threads; i++)
+		pthread_join(restore_queue.threads[i], NULL);
+	free(restore_queue.threads);
+	return restore_queue.error;
 }
 
 static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
@@ -446,11 +936,11 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 	struct extent_buffer *leaf;
 	struct btrfs_dir_item *dir_item;
 	struct btrfs_key found_key, location;
+	struct restore_job *job;
 	char filename[BTRFS_NAME_LEN + 1];
 	unsigned long name_ptr;
 	int name_len;
 	int ret;
-	int fd;
 	int loops = 0;
 	u8 type;
 
@@ -573,18 +1063,21 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 			}
 			if (verbose)
 				printf("Restoring %s\n", path_name);
-			fd = open(path_name, O_CREAT|O_WRONLY, 0644);
-			if (fd < 0) {
-				fprintf(stderr, "Error creating %s: %d\n",
-					path_name, errno);
-				if (ignore_errors)
-					goto next;
+			job = calloc(1, sizeof(*job));
+			if (job)
+				job->path = strdup(path_name);
+			if (!job || !job->path) {
+				free(job);
+				fprintf(stderr, "Ran out of memory\n");
 				btrfs_free_path(path);
 				return -1;
 			}
 			loops = 0;
-			ret = copy_file(root, fd, &location, path_name);
-			close(fd);
+			ret = map_file(root, &location, job);
+			if (ret)
+				free_restore_job(job);
+			else
+				ret = queue_restore_job(job);
 			if (ret) {
 				if (ignore_errors)
 					goto next;
@@ -767,6 +1260,8 @@ const char * const cmd_restore_usage[] = {
 	"-c              ignore case in regular expression",
 	"-m <regexp>     regular expression to match",
 	"-l              list roots",
+	"-j <num>        number of threads restoring files, 0 restores them",
+	"                while walking the directories (default: number of cpus)",
 	NULL
 };
 
@@ -782,8 +1277,10 @@ int cmd_restore(int argc, char **argv)
 	int opt;
 	int super_mirror = 0;
 	int find_dir = 0;
+	int num_threads = -1;
+	int err;
 
-	while ((opt = getopt(argc, argv, "sviot:u:df:")) != -1) {
+	while ((opt = getopt(argc, argv, "sviot:u:df:j:")) != -1) {
 		switch (opt) {
 			case 's':
 				get_snaps = 1;
@@ -826,6 +1323,14 @@ int cmd_restore(int argc, char **argv)
 			case 'd':
 				find_dir = 1;
 				break;
+			case 'j':
+				num_threads = atoi(optarg);
+				if (num_threads < 0 || num_threads > 256) {
+					fprintf(stderr, "Number of threads not "
+						"valid\n");
+					exit(1);
+				}
+				break;
 			default:
 				usage(cmd_restore_usage);
 		}
@@ -877,7 +1382,29 @@ int cmd_restore(int argc, char **argv)
 		key.objectid = BTRFS_FIRST_FREE_OBJECTID;
 	}
 
+#ifdef BTRFS_RESTORE_LZO
+	if (lzo_init() != LZO_E_OK) {
+		fprintf(stderr, "lzo init failed\n");
+		ret = 1;
+		goto out;
+	}
+#endif
+	if (num_threads < 0) {
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (num_threads <= 0)
+			num_threads = 1;
+	}
+	ret = start_restore_workers(num_threads);
+	if (ret) {
+		fprintf(stderr, "Error starting restore threads %d\n", ret);
+		stop_restore_workers();
+		goto out;
+	}
+
 	ret = search_dir(root->fs_info->fs_root, &key, dir_name);
+	err = stop_restore_workers();
+	if (!ret)
+		ret = err;
 
 out:
 	close_ctree(root);
@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 #include <libgen.h>
 #include <mntent.h>
 
@@ -41,13 +42,30 @@
 
 #include "send.h"
 #include "send-utils.h"
+#include "send-frame.h"
 
 static int g_verbose = 0;
 
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ	1031
+#endif
+
+/* the kernel pipe is grown to this, and splice moves up to this at once */
+#define SEND_PIPE_SIZE	(1024 * 1024)
+/* buffer for copying the stream when the output can't be spliced to */
+#define SEND_DUMP_BUF_SIZE	(256 * 1024)
+
 struct btrfs_send {
 	int send_fd;
 	int dump_fd;
 	int mnt_fd;
+	u64 bytes;
+
+	/* -z, frame the output; frame_method is -1 without it */
+	struct send_frame_writer *frames;
+	int frame_method;
+	int frame_level;
+	int frame_threads;
 
 	u64 *clone_sources;
 	u64 clone_sources_count;
@@ -204,15 +222,18 @@ out:
 	return ret;
 }
 
-static void *dump_thread(void *arg_)
+static int dump_copy(struct btrfs_send *s)
 {
-	int ret;
-	struct btrfs_send *s = (struct btrfs_send*)arg_;
-	char buf[4096];
+	char *buf;
 	int readed;
+	int ret;
+
+	buf = malloc(SEND_DUMP_BUF_SIZE);
+	if (!buf)
+		return -ENOMEM;
 
 	while (1) {
-		readed = read(s->send_fd, buf, sizeof(buf));
+		readed = read(s->send_fd, buf, SEND_DUMP_BUF_SIZE);
 		if (readed < 0) {
 			ret = -errno;
 			fprintf(stderr, "ERROR: failed to read stream from "
@@ -223,9 +244,57 @@ static void *dump_thread(void *arg_)
 			ret = 0;
 			goto out;
 		}
-		ret = write_buf(s->dump_fd, buf, readed);
+		if (s->frames)
+			ret = send_frame_write(s->frames, buf, readed);
+		else
+			ret = write_buf(s->dump_fd, buf, readed);
 		if (ret < 0)
 			goto out;
+		s->bytes += readed;
+	}
+
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * move the stream from the kernel's pipe to the output without copying it
+ * through user space.  Outputs splice doesn't support, like terminals or
+ * files opened with O_APPEND, fall back to read/write, and so does a
+ * framed output which has to go through user space anyway.
+ */
+static void *dump_thread(void *arg_)
+{
+	int ret;
+	struct btrfs_send *s = (struct btrfs_send*)arg_;
+	ssize_t moved;
+
+	if (s->frames) {
+		ret = dump_copy(s);
+		goto out;
+	}
+
+	while (1) {
+		moved = splice(s->send_fd, NULL, s->dump_fd, NULL,
+			       SEND_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (moved < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL || errno == ENOSYS) {
+				ret = dump_copy(s);
+				goto out;
+			}
+			ret = -errno;
+			fprintf(stderr, "ERROR: failed to dump stream. %s\n",
+					strerror(-ret));
+			goto out;
+		}
+		if (!moved) {
+			ret = 0;
+			goto out;
+		}
+		s->bytes += moved;
 	}
 
 out:
@@ -246,6 +315,8 @@ static int do_send(struct btrfs_send *send, u64 root_id, u64 parent_root_id)
 	void *t_err = NULL;
 	int subvol_fd = -1;
 	int pipefd[2] = {-1, -1};
+	struct timeval start, end;
+	double secs;
 
 	si = subvol_uuid_search(&send->sus, root_id, NULL, 0, NULL,
 			subvol_search_by_root_id);
@@ -273,9 +344,14 @@ static int do_send(struct btrfs_send *send, u64 root_id, u64 parent_root_id)
 		goto out;
 	}
 
+	/* fewer, larger wakeups of the dump thread; fine if we can't */
+	fcntl(pipefd[1], F_SETPIPE_SZ, SEND_PIPE_SIZE);
+
 	memset(&io_send, 0, sizeof(io_send));
 	io_send.send_fd = pipefd[1];
 	send->send_fd = pipefd[0];
+	send->bytes = 0;
+	gettimeofday(&start, NULL);
 
 	if (!ret)
 		ret = pthread_create(&t_read, &t_attr, dump_thread,
@@ -322,6 +398,18 @@ static int do_send(struct btrfs_send *send, u64 root_id, u64 parent_root_id)
 
 	pthread_attr_destroy(&t_attr);
 
+	if (g_verbose > 0) {
+		gettimeofday(&end, NULL);
+		secs = end.tv_sec - start.tv_sec +
+			(end.tv_usec - start.tv_usec) / 1000000.0;
+		fprintf(stderr, "sent %llu bytes in %.2f seconds",
+			(unsigned long long)send->bytes, secs);
+		if (secs > 0)
+			fprintf(stderr, " (%.1f MiB/s)",
+				send->bytes / secs / (1024 * 1024));
+		fprintf(stderr, "\n");
+	}
+
 	ret = 0;
 
 out:
@@ -414,12 +502,233 @@ out:
 	return ret;
 }
 
+static int open_frames(struct btrfs_send *send)
+{
+	if (send->frame_method < 0)
+		return 0;
+	send->frames = send_frame_writer_open(send->dump_fd,
+					      send->frame_method,
+					      send->frame_level,
+					      send->frame_threads);
+	return send->frames ? 0 : -ENOMEM;
+}
+
+/* end the framed output, if there is one */
+static int close_frames(struct btrfs_send *send)
+{
+	u64 bytes;
+	int ret;
+
+	if (!send->frames)
+		return 0;
+	bytes = send_frame_writer_bytes(send->frames);
+	ret = send_frame_writer_close(send->frames);
+	send->frames = NULL;
+	if (!ret && g_verbose > 0)
+		fprintf(stderr, "framed output is %llu bytes\n",
+			(unsigned long long)bytes);
+	return ret;
+}
+
+/*
+ * a batch of subvolumes sent with -d, each to its own file.  Parents are
+ * chosen before anything is sent, so the streams don't depend on each
+ * other and can be sent concurrently and received in any order.
+ */
+struct send_batch_item {
+	char *subvol;
+	char *outname;
+	u64 root_id;
+	u64 parent_root_id;
+	int ret;
+};
+
+struct send_batch {
+	struct btrfs_send *send;
+	struct send_batch_item *items;
+	int nr_items;
+	int next;
+	pthread_mutex_t mutex;
+};
+
+static int plan_send_batch(struct btrfs_send *send, struct send_batch *b,
+			   char **subvols, int count, const char *outdir,
+			   u64 parent_root_id, int full_send)
+{
+	struct send_batch_item *item;
+	char *name;
+	int ret;
+	int i;
+	int j;
+
+	b->items = calloc(count, sizeof(*b->items));
+	if (!b->items)
+		return -ENOMEM;
+	b->nr_items = count;
+
+	for (i = 0; i < count; i++) {
+		item = &b->items[i];
+		item->subvol = realpath(subvols[i], NULL);
+		if (!item->subvol) {
+			ret = -errno;
+			fprintf(stderr, "ERROR: realpath %s failed. %s\n",
+					subvols[i], strerror(-ret));
+			return ret;
+		}
+
+		ret = get_root_id(send,
+				get_subvol_name(send->root_path, item->subvol),
+				&item->root_id);
+		if (ret < 0) {
+			fprintf(stderr, "ERROR: could not resolve root_id "
+					"for %s\n", item->subvol);
+			return ret;
+		}
+
+		item->parent_root_id = parent_root_id;
+		if (!full_send && !parent_root_id) {
+			ret = find_good_parent(send, item->root_id,
+					       &item->parent_root_id);
+			if (ret < 0) {
+				fprintf(stderr, "ERROR: parent determination "
+						"failed for %llu\n",
+						(unsigned long long)item->root_id);
+				return ret;
+			}
+		}
+
+		name = basename(item->subvol);
+		for (j = 0; j < i; j++) {
+			if (!strcmp(basename(b->items[j].subvol), name)) {
+				fprintf(stderr, "ERROR: %s and %s would both be "
+						"sent to %s/%s\n",
+						b->items[j].subvol,
+						item->subvol, outdir, name);
+				return -EEXIST;
+			}
+		}
+
+		item->outname = malloc(strlen(outdir) + strlen(name) + 2);
+		if (!item->outname)
+			return -ENOMEM;
+		sprintf(item->outname, "%s/%s", outdir, name);
+	}
+	return 0;
+}
+
+static void *send_batch_worker(void *arg)
+{
+	struct send_batch *b = arg;
+	struct send_batch_item *item;
+	struct btrfs_send send;
+
+	while (1) {
+		pthread_mutex_lock(&b->mutex);
+		item = NULL;
+		if (b->next < b->nr_items)
+			item = &b->items[b->next++];
+		pthread_mutex_unlock(&b->mutex);
+		if (!item)
+			break;
+
+		fprintf(stderr, "At subvol %s\n", item->subvol);
+
+		/* everything but the output is shared and only read */
+		send = *b->send;
+		send.dump_fd = creat(item->outname, 0600);
+		if (send.dump_fd < 0) {
+			item->ret = -errno;
+			fprintf(stderr, "ERROR: can't create '%s': %s\n",
+					item->outname, strerror(-item->ret));
+			continue;
+		}
+
+		item->ret = open_frames(&send);
+		if (!item->ret)
+			item->ret = do_send(&send, item->root_id,
+					    item->parent_root_id);
+		if (send.frames) {
+			if (!item->ret)
+				item->ret = close_frames(&send);
+			else
+				send_frame_writer_abort(send.frames);
+		}
+		if (close(send.dump_fd) < 0 && !item->ret)
+			item->ret = -errno;
+		if (item->ret < 0)
+			fprintf(stderr, "ERROR: failed to send %s to %s\n",
+					item->subvol, item->outname);
+	}
+	return NULL;
+}
+
+static int send_batch(struct btrfs_send *send, char **subvols, int count,
+		      const char *outdir, int jobs, u64 parent_root_id,
+		      int full_send)
+{
+	struct send_batch b;
+	pthread_t *threads = NULL;
+	int started = 0;
+	int ret;
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	b.send = send;
+	pthread_mutex_init(&b.mutex, NULL);
+
+	ret = plan_send_batch(send, &b, subvols, count, outdir,
+			      parent_root_id, full_send);
+	if (ret < 0)
+		goto out;
+
+	if (jobs > count)
+		jobs = count;
+	threads = calloc(jobs, sizeof(*threads));
+	if (!threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < jobs; i++) {
+		ret = pthread_create(&threads[i], NULL, send_batch_worker, &b);
+		if (ret) {
+			ret = -ret;
+			fprintf(stderr, "ERROR: thread setup failed: %s\n",
+				strerror(-ret));
+			break;
+		}
+		started++;
+	}
+	/* with no thread at all, nothing would ever be sent */
+	if (!started)
+		goto out;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	ret = 0;
+	for (i = 0; i < count; i++) {
+		if (b.items[i].ret < 0 && !ret)
+			ret = b.items[i].ret;
+	}
+
+out:
+	for (i = 0; i < b.nr_items; i++) {
+		free(b.items[i].subvol);
+		free(b.items[i].outname);
+	}
+	free(b.items);
+	free(threads);
+	pthread_mutex_destroy(&b.mutex);
+	return ret;
+}
+
 int cmd_send_start(int argc, char **argv)
 {
 	char *subvol = NULL;
 	int c;
 	int ret;
 	char *outname = NULL;
+	char *outdir = NULL;
+	int jobs = 1;
 	struct btrfs_send send;
 	u32 i;
 	char *mount_root = NULL;
@@ -430,8 +739,9 @@ int cmd_send_start(int argc, char **argv)
 
 	memset(&send, 0, sizeof(send));
 	send.dump_fd = fileno(stdout);
+	send.frame_method = -1;
 
-	while ((c = getopt(argc, argv, "vc:f:i:p:")) != -1) {
+	while ((c = getopt(argc, argv, "vc:d:f:i:j:p:z:")) != -1) {
 		switch (c) {
 		case 'v':
 			g_verbose++;
@@ -463,6 +773,21 @@ int cmd_send_start(int argc, char **argv)
 		case 'f':
 			outname = optarg;
 			break;
+		case 'd':
+			outdir = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, "ERROR: invalid -j value\n");
+				return 1;
+			}
+			break;
+		case 'z':
+			if (send_frame_parse_compression(optarg,
+					&send.frame_method, &send.frame_level))
+				return 1;
+			break;
 		case 'p':
 			if (snapshot_parent) {
 				fprintf(stderr, "ERROR: you cannot have more than one parent (-p)\n");
@@ -493,6 +818,24 @@ int cmd_send_start(int argc, char **argv)
 		return 1;
 	}
 
+	if (outdir && outname) {
+		fprintf(stderr, "ERROR: -f and -d can't be used together\n");
+		return 1;
+	}
+	if (jobs > 1 && !outdir) {
+		fprintf(stderr, "ERROR: -j needs an output directory (-d)\n");
+		return 1;
+	}
+
+	/* leave the cpus to the sends when several run at once */
+	if (send.frame_method > SEND_FRAME_COMPRESS_NONE) {
+		send.frame_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (outdir)
+			send.frame_threads /= jobs;
+		if (send.frame_threads < 1)
+			send.frame_threads = 1;
+	}
+
 	if (outname != NULL) {
 		send.dump_fd = creat(outname, 0600);
 		if (send.dump_fd == -1) {
@@ -503,7 +846,7 @@ int cmd_send_start(int argc, char **argv)
 		}
 	}
 
-	if (isatty(send.dump_fd)) {
+	if (!outdir && isatty(send.dump_fd)) {
 		fprintf(stderr, 
 			"ERROR: not dumping send stream into a terminal, "
 			"redirect it into a file\n");
@@ -572,6 +915,16 @@ int cmd_send_start(int argc, char **argv)
 		free(subvol);
 	}
 
+	if (outdir) {
+		ret = send_batch(&send, argv + optind, argc - optind, outdir,
+				 jobs, parent_root_id, full_send);
+		goto out;
+	}
+
+	ret = open_frames(&send);
+	if (ret < 0)
+		goto out;
+
 	for (i = optind; i < argc; i++) {
 		subvol = argv[i];
 
@@ -624,9 +977,11 @@ int cmd_send_start(int argc, char **argv)
 		free(subvol);
 	}
 
-	ret = 0;
+	ret = close_frames(&send);
 
 out:
+	if (send.frames)
+		send_frame_writer_abort(send.frames);
 	if (send.mnt_fd >= 0)
 		close(send.mnt_fd);
 	return ret;
@@ -638,7 +993,8 @@ static const char * const send_cmd_group_usage[] = {
 };
 
 const char * const cmd_send_usage[] = {
-	"btrfs send [-v] [-p <parent>] [-c <clone-src>] <subvol>",
+	"btrfs send [-v] [-p <parent>] [-c <clone-src>] [-z <method>[:<level>]] "
+	"[-f <outfile> | -d <outdir> [-j <num>]] <subvol> [<subvol>...]",
 	"Send the subvolume to stdout.",
 	"Sends the subvolume specified by <subvol> to stdout.",
 	"By default, this will send the whole subvolume. To do an incremental",
@@ -660,6 +1016,22 @@ const char * const cmd_send_usage[] = {
 	"-f <outfile>     Output is normally written to stdout. To write to",
 	"                 a file, use this option. An alternative would be to",
 	"                 use pipes.",
+	"-d <outdir>      Send each subvolume to its own file in <outdir>,",
+	"                 named after the subvolume. The parent of each one",
+	"                 is chosen from -p and -c only, so the streams are",
+	"                 independent and can be received in any order.",
+	"-j <num>         With -d, run up to <num> sends at once.",
+	"-z <method>      Write the stream in checksummed frames, each",
+	"                 compressed on its own by one of the cpus.",
+	"                 <method> is none, zlib"
+#ifdef BTRFS_SEND_ZSTD
+	", zstd"
+#endif
+#ifdef BTRFS_SEND_LZ4
+	", lz4"
+#endif
+	", optionally with",
+	"                 a level. btrfs receive reads it as it is.",
 	NULL
 };
 
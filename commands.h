@@ -116,6 +116,11 @@ int cmd_debug_tree(int argc, char **argv);
 /* subvolume exported functions */
 int test_issubvolume(char *path);
 
+/* receive-offline.c */
+struct btrfs_send_stream;
+int receive_offline(const char *dev, struct btrfs_send_stream *stream,
+		    int verbose);
+
 /* send.c */
 int find_mount_root(const char *path, char **mount_root);
 char *get_subvol_name(char *mnt, char *full_path);
@@ -2969,3 +2969,296 @@ int btrfs_previous_item(struct btrfs_root *root,
 	return 1;
 }
 
+
+static int btrfs_comp_cpu_keys(struct btrfs_key *k1, struct btrfs_key *k2)
+{
+	if (k1->objectid > k2->objectid)
+		return 1;
+	if (k1->objectid < k2->objectid)
+		return -1;
+	if (k1->type > k2->type)
+		return 1;
+	if (k1->type < k2->type)
+		return -1;
+	if (k1->offset > k2->offset)
+		return 1;
+	if (k1->offset < k2->offset)
+		return -1;
+	return 0;
+}
+
+/*
+ * The helpers below move one side of btrfs_compare_trees.  Each side is a
+ * path plus the level it is currently at: at level 0 it points to an item,
+ * above that to a block pointer that has not been read yet.
+ */
+static int tree_move_down(struct btrfs_root *root, struct btrfs_path *path,
+			  int *level)
+{
+	struct extent_buffer *eb;
+
+	BUG_ON(*level == 0);
+	eb = read_node_slot(root, path->nodes[*level], path->slots[*level]);
+	if (!eb || !extent_buffer_uptodate(eb)) {
+		free_extent_buffer(eb);
+		return -EIO;
+	}
+	free_extent_buffer(path->nodes[*level - 1]);
+	path->nodes[*level - 1] = eb;
+	path->slots[*level - 1] = 0;
+	(*level)--;
+	return 0;
+}
+
+/*
+ * step to the next slot, going up as long as the current block is used
+ * up.  returns 1 once the whole tree has been walked.
+ */
+static int tree_move_next_or_upnext(struct btrfs_path *path, int *level,
+				    int root_level)
+{
+	while (++path->slots[*level] >=
+	       btrfs_header_nritems(path->nodes[*level])) {
+		if (*level == root_level)
+			return 1;
+		free_extent_buffer(path->nodes[*level]);
+		path->nodes[*level] = NULL;
+		path->slots[*level] = 0;
+		(*level)++;
+	}
+	return 0;
+}
+
+static void tree_key_at(struct btrfs_path *path, int level,
+			struct btrfs_key *key)
+{
+	if (level == 0)
+		btrfs_item_key_to_cpu(path->nodes[0], key, path->slots[0]);
+	else
+		btrfs_node_key_to_cpu(path->nodes[level], key,
+				      path->slots[level]);
+}
+
+/*
+ * go to the next position of one side and return its key.  with
+ * allow_down the block pointer we are at is entered, otherwise it is
+ * skipped as a whole.  returns 1 at the end of the tree.
+ */
+static int tree_advance(struct btrfs_root *root, struct btrfs_path *path,
+			int *level, int root_level, int allow_down,
+			struct btrfs_key *key)
+{
+	int ret;
+
+	if (*level == 0 || !allow_down)
+		ret = tree_move_next_or_upnext(path, level, root_level);
+	else
+		ret = tree_move_down(root, path, level);
+	if (ret)
+		return ret;
+	tree_key_at(path, *level, key);
+	return 0;
+}
+
+/* do both sides point to the same block at this level */
+static int tree_same_block(struct btrfs_path *left_path,
+			   struct btrfs_path *right_path, int level)
+{
+	struct extent_buffer *left = left_path->nodes[level];
+	struct extent_buffer *right = right_path->nodes[level];
+	int left_slot = left_path->slots[level];
+	int right_slot = right_path->slots[level];
+
+	return btrfs_node_blockptr(left, left_slot) ==
+	       btrfs_node_blockptr(right, right_slot) &&
+	       btrfs_node_ptr_generation(left, left_slot) ==
+	       btrfs_node_ptr_generation(right, right_slot);
+}
+
+static int tree_compare_item(struct btrfs_path *left_path,
+			     struct btrfs_path *right_path)
+{
+	struct extent_buffer *left = left_path->nodes[0];
+	struct extent_buffer *right = right_path->nodes[0];
+	int left_slot = left_path->slots[0];
+	int right_slot = right_path->slots[0];
+	u32 len;
+
+	len = btrfs_item_size_nr(left, left_slot);
+	if (len != btrfs_item_size_nr(right, right_slot))
+		return 1;
+	return memcmp_extent_buffer(left,
+			right->data + btrfs_item_ptr_offset(right, right_slot),
+			btrfs_item_ptr_offset(left, left_slot), len);
+}
+
+#define ADVANCE 1
+#define ADVANCE_ONLY_NEXT 2
+
+/*
+ * Compare two trees and call changed_cb for every item that is only in
+ * left_root (NEW), only in right_root (DELETED) or in both with different
+ * contents (CHANGED).  The trees are walked side by side, and when both
+ * sides reach the same block pointer (same bytenr and generation) at the
+ * same key, the subtree below it is skipped without being read.  For two
+ * snapshots that share most of their blocks the cost is therefore in
+ * proportion to what changed between them, not to their size.
+ *
+ * The callback gets both paths, the item is at slots[0] of the path for
+ * the side it was found in.  A non-zero return from it stops the walk and
+ * is returned.
+ */
+int btrfs_compare_trees(struct btrfs_root *left_root,
+			struct btrfs_root *right_root,
+			btrfs_changed_cb_t changed_cb, void *ctx)
+{
+	struct btrfs_path *left_path = NULL;
+	struct btrfs_path *right_path = NULL;
+	struct btrfs_key left_key;
+	struct btrfs_key right_key;
+	int left_level;
+	int right_level;
+	int left_root_level;
+	int right_root_level;
+	int left_end;
+	int right_end;
+	int advance_left;
+	int advance_right;
+	int cmp;
+	int ret = 0;
+
+	/* an untouched snapshot still shares its root block */
+	if (left_root->node->start == right_root->node->start &&
+	    btrfs_header_generation(left_root->node) ==
+	    btrfs_header_generation(right_root->node))
+		return 0;
+
+	left_path = btrfs_alloc_path();
+	right_path = btrfs_alloc_path();
+	if (!left_path || !right_path) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	left_level = left_root_level = btrfs_header_level(left_root->node);
+	extent_buffer_get(left_root->node);
+	left_path->nodes[left_level] = left_root->node;
+	left_end = !btrfs_header_nritems(left_root->node);
+	if (!left_end)
+		tree_key_at(left_path, left_level, &left_key);
+
+	right_level = right_root_level = btrfs_header_level(right_root->node);
+	extent_buffer_get(right_root->node);
+	right_path->nodes[right_level] = right_root->node;
+	right_end = !btrfs_header_nritems(right_root->node);
+	if (!right_end)
+		tree_key_at(right_path, right_level, &right_key);
+
+	while (1) {
+		advance_left = 0;
+		advance_right = 0;
+
+		if (left_end && right_end)
+			break;
+
+		if (left_end || right_end) {
+			/* one tree is done, the rest of the other differs */
+			if (left_end && right_level == 0) {
+				ret = changed_cb(left_root, right_root,
+						 left_path, right_path,
+						 &right_key,
+						 BTRFS_COMPARE_TREE_DELETED,
+						 ctx);
+				if (ret)
+					goto out;
+			} else if (right_end && left_level == 0) {
+				ret = changed_cb(left_root, right_root,
+						 left_path, right_path,
+						 &left_key,
+						 BTRFS_COMPARE_TREE_NEW, ctx);
+				if (ret)
+					goto out;
+			}
+			if (left_end)
+				advance_right = ADVANCE;
+			else
+				advance_left = ADVANCE;
+		} else if (left_level == 0 && right_level == 0) {
+			cmp = btrfs_comp_cpu_keys(&left_key, &right_key);
+			if (cmp < 0) {
+				ret = changed_cb(left_root, right_root,
+						 left_path, right_path,
+						 &left_key,
+						 BTRFS_COMPARE_TREE_NEW, ctx);
+				advance_left = ADVANCE;
+			} else if (cmp > 0) {
+				ret = changed_cb(left_root, right_root,
+						 left_path, right_path,
+						 &right_key,
+						 BTRFS_COMPARE_TREE_DELETED,
+						 ctx);
+				advance_right = ADVANCE;
+			} else {
+				if (tree_compare_item(left_path, right_path))
+					ret = changed_cb(left_root, right_root,
+						 left_path, right_path,
+						 &left_key,
+						 BTRFS_COMPARE_TREE_CHANGED,
+						 ctx);
+				advance_left = ADVANCE;
+				advance_right = ADVANCE;
+			}
+			if (ret)
+				goto out;
+		} else if (left_level == right_level) {
+			cmp = btrfs_comp_cpu_keys(&left_key, &right_key);
+			if (cmp < 0) {
+				advance_left = ADVANCE;
+			} else if (cmp > 0) {
+				advance_right = ADVANCE;
+			} else if (tree_same_block(left_path, right_path,
+						   left_level)) {
+				/* shared subtree, step over it on both sides */
+				advance_left = ADVANCE_ONLY_NEXT;
+				advance_right = ADVANCE_ONLY_NEXT;
+			} else {
+				advance_left = ADVANCE;
+				advance_right = ADVANCE;
+			}
+		} else if (left_level < right_level) {
+			advance_right = ADVANCE;
+		} else {
+			advance_left = ADVANCE;
+		}
+
+		if (advance_left) {
+			ret = tree_advance(left_root, left_path, &left_level,
+					   left_root_level,
+					   advance_left != ADVANCE_ONLY_NEXT,
+					   &left_key);
+			if (ret < 0)
+				goto out;
+			if (ret)
+				left_end = 1;
+			ret = 0;
+		}
+		if (advance_right) {
+			ret = tree_advance(right_root, right_path, &right_level,
+					   right_root_level,
+					   advance_right != ADVANCE_ONLY_NEXT,
+					   &right_key);
+			if (ret < 0)
+				goto out;
+			if (ret)
+				right_end = 1;
+			ret = 0;
+		}
+	}
+
+out:
+	if (left_path)
+		btrfs_free_path(left_path);
+	if (right_path)
+		btrfs_free_path(right_path);
+	return ret;
+}
@@ -1826,9 +1826,15 @@ static struct btrfs_space_info *__find_space_info(struct btrfs_fs_info *info,
 	struct list_head *head = &info->space_info;
 	struct list_head *cur;
 	struct btrfs_space_info *found;
+
+	/*
+	 * match the type only, or a request for DUP metadata finds whichever
+	 * DUP space info comes first
+	 */
+	flags &= BTRFS_BLOCK_GROUP_TYPE_MASK;
 	list_for_each(cur, head) {
 		found = list_entry(cur, struct btrfs_space_info, list);
-		if (found->flags & flags)
+		if ((found->flags & BTRFS_BLOCK_GROUP_TYPE_MASK) == flags)
 			return found;
 	}
 	return NULL;
@@ -1913,8 +1919,11 @@ static int do_chunk_alloc(struct btrfs_trans_handle *trans,
 	    thresh)
 		return 0;
 
-	ret = btrfs_alloc_chunk(trans, extent_root, &start, &num_bytes,
-	                        space_info->flags);
+	/*
+	 * the space info has the profile of whatever block group was read
+	 * first, the new chunk gets the one asked for
+	 */
+	ret = btrfs_alloc_chunk(trans, extent_root, &start, &num_bytes, flags);
 	if (ret == -ENOSPC) {
 		space_info->full = 1;
 		return 0;
@@ -1922,7 +1931,7 @@ static int do_chunk_alloc(struct btrfs_trans_handle *trans,
 
 	BUG_ON(ret);
 
-	ret = btrfs_make_block_group(trans, extent_root, 0, space_info->flags,
+	ret = btrfs_make_block_group(trans, extent_root, 0, flags,
 		     BTRFS_FIRST_CHUNK_TREE_OBJECTID, start, num_bytes);
 	BUG_ON(ret);
 	return 0;
@@ -2692,9 +2701,12 @@ static int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 
 	if (root->ref_cows) {
 		if (!(data & BTRFS_BLOCK_GROUP_METADATA)) {
+			alloc_profile = info->avail_metadata_alloc_bits &
+					info->metadata_alloc_profile;
 			ret = do_chunk_alloc(trans, root->fs_info->extent_root,
 					     num_bytes,
-					     BTRFS_BLOCK_GROUP_METADATA);
+					     BTRFS_BLOCK_GROUP_METADATA |
+					     alloc_profile);
 			BUG_ON(ret);
 		}
 		ret = do_chunk_alloc(trans, root->fs_info->extent_root,
@@ -2715,6 +2727,66 @@ found:
 	return ret;
 }
 
+/*
+ * reserve num_bytes of data space, allocating a new data chunk first if
+ * the existing ones are getting full.  Unlike the tree block allocator
+ * this returns -ENOSPC instead of crashing, so the caller can retry with
+ * a smaller size.
+ */
+int btrfs_reserve_data_extent(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 num_bytes,
+			      u64 hint_byte, struct btrfs_key *ins)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	u64 data;
+	int ret;
+
+	data = BTRFS_BLOCK_GROUP_DATA |
+	       (info->avail_data_alloc_bits & info->data_alloc_profile);
+	ret = do_chunk_alloc(trans, info->extent_root,
+			     num_bytes + 2 * 1024 * 1024, data);
+	if (ret)
+		return ret;
+
+	ret = find_free_extent(trans, root, num_bytes, 0, 0, (u64)-1,
+			       hint_byte, ins, 0, 0, data);
+	if (ret)
+		return ret;
+
+	clear_extent_dirty(&info->free_space_cache, ins->objectid,
+			   ins->objectid + ins->offset - 1, GFP_NOFS);
+	return 0;
+}
+
+/*
+ * tree blocks are allocated without a chance to fail, so callers making
+ * lots of changes check between them that there is room left: allocate
+ * a new metadata chunk if the existing ones are getting full, and return
+ * -ENOSPC if less than num_bytes would be left.
+ */
+int btrfs_check_metadata_space(struct btrfs_trans_handle *trans,
+			       struct btrfs_root *root, u64 num_bytes)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_space_info *space_info;
+	u64 flags;
+	int ret;
+
+	flags = BTRFS_BLOCK_GROUP_METADATA |
+		(info->avail_metadata_alloc_bits &
+		 info->metadata_alloc_profile);
+	ret = do_chunk_alloc(trans, info->extent_root, num_bytes, flags);
+	if (ret)
+		return ret;
+
+	space_info = __find_space_info(info, flags);
+	if (!space_info ||
+	    space_info->bytes_used + space_info->bytes_pinned + num_bytes >
+	    space_info->total_bytes)
+		return -ENOSPC;
+	return 0;
+}
+
 static int alloc_reserved_tree_block(struct btrfs_trans_handle *trans,
 				     struct btrfs_root *root,
 				     u64 root_objectid, u64 generation,
@@ -0,0 +1,351 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * dumps a filesystem with btrfs-image using every compression method it
+ * was built with, restores each dump and checks that every tree in the
+ * root tree came back item for item, apart from the csums and inline
+ * file data btrfs-image leaves out.
+ *
+ *	image-test <filesystem image>
+ *
+ * btrfs-image is run from the directory image-test is in.
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE 1
+
+#include "kerncompat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#include "ctree.h"
+#include "disk-io.h"
+#include "crc32c.h"
+
+struct codec {
+	const char *name;
+	int level;
+};
+
+static struct codec codecs[] = {
+	{ "zlib", 1 },
+	{ "zlib", 9 },
+#ifdef BTRFS_IMAGE_ZSTD
+	{ "zstd", 3 },
+	{ "zstd", 19 },
+#endif
+#ifdef BTRFS_IMAGE_LZ4
+	{ "lz4", 1 },
+	/* above 1 it's lz4hc */
+	{ "lz4", 12 },
+#endif
+};
+
+struct tree_sum {
+	u64 objectid;
+	u64 offset;
+	u64 nr_items;
+	u32 crc;
+};
+
+struct fs_sum {
+	struct tree_sum *trees;
+	int nr;
+};
+
+/*
+ * btrfs-image zeroes csums and inline file data, only the rest of those
+ * items comes back
+ */
+static u32 dumped_size(struct extent_buffer *leaf, int slot)
+{
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key key;
+
+	btrfs_item_key_to_cpu(leaf, &key, slot);
+	if (key.type == BTRFS_CSUM_ITEM_KEY)
+		return 0;
+	if (key.type != BTRFS_EXTENT_DATA_KEY)
+		return btrfs_item_size_nr(leaf, slot);
+
+	fi = btrfs_item_ptr(leaf, slot, struct btrfs_file_extent_item);
+	if (btrfs_file_extent_type(leaf, fi) != BTRFS_FILE_EXTENT_INLINE)
+		return btrfs_item_size_nr(leaf, slot);
+	return btrfs_file_extent_inline_start(fi) - (unsigned long)fi;
+}
+
+/* crc of every key and item in the tree */
+static int sum_tree(struct btrfs_root *root, struct tree_sum *sum)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct btrfs_disk_key disk_key;
+	struct extent_buffer *leaf;
+	__le32 item_size;
+	char *buf = NULL;
+	u32 size;
+	int ret;
+
+	sum->nr_items = 0;
+	sum->crc = ~(u32)0;
+
+	btrfs_init_path(&path);
+	key.objectid = 0;
+	key.type = 0;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret) {
+				if (ret > 0)
+					ret = 0;
+				break;
+			}
+			continue;
+		}
+		btrfs_item_key(leaf, &disk_key, path.slots[0]);
+		item_size = cpu_to_le32(btrfs_item_size_nr(leaf,
+							   path.slots[0]));
+		size = dumped_size(leaf, path.slots[0]);
+		buf = realloc(buf, size ? size : 1);
+		if (!buf) {
+			ret = -ENOMEM;
+			break;
+		}
+		read_extent_buffer(leaf, buf,
+				   btrfs_item_ptr_offset(leaf, path.slots[0]),
+				   size);
+		sum->crc = crc32c(sum->crc, &disk_key, sizeof(disk_key));
+		sum->crc = crc32c(sum->crc, &item_size, sizeof(item_size));
+		sum->crc = crc32c(sum->crc, buf, size);
+		sum->nr_items++;
+		path.slots[0]++;
+	}
+out:
+	free(buf);
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+static int add_tree(struct fs_sum *fs, struct btrfs_root *root,
+		    struct btrfs_key *key)
+{
+	struct tree_sum *sum;
+	int ret;
+
+	fs->trees = realloc(fs->trees, (fs->nr + 1) * sizeof(*fs->trees));
+	if (!fs->trees)
+		return -ENOMEM;
+	sum = &fs->trees[fs->nr++];
+	sum->objectid = key->objectid;
+	sum->offset = key->offset;
+	ret = sum_tree(root, sum);
+	if (ret)
+		fprintf(stderr, "reading tree %llu failed\n",
+			(unsigned long long)key->objectid);
+	return ret;
+}
+
+/*
+ * sum up the root tree and every tree it points to.  The chunk and dev
+ * trees are left out, restore puts a new device layout in them.
+ */
+static int sum_fs(const char *path, struct fs_sum *fs)
+{
+	struct btrfs_root *tree_root;
+	struct btrfs_root *root;
+	struct btrfs_path btrfs_path;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	int ret;
+
+	fs->trees = NULL;
+	fs->nr = 0;
+
+	tree_root = open_ctree(path, 0, 0);
+	if (!tree_root) {
+		fprintf(stderr, "Open ctree %s failed\n", path);
+		return -EIO;
+	}
+	tree_root = tree_root->fs_info->tree_root;
+
+	key.objectid = BTRFS_ROOT_TREE_OBJECTID;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = add_tree(fs, tree_root, &key);
+	if (ret)
+		goto out;
+
+	btrfs_init_path(&btrfs_path);
+	key.objectid = 0;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &btrfs_path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		leaf = btrfs_path.nodes[0];
+		if (btrfs_path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &btrfs_path);
+			if (ret) {
+				if (ret > 0)
+					ret = 0;
+				break;
+			}
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, btrfs_path.slots[0]);
+		btrfs_path.slots[0]++;
+		if (key.type != BTRFS_ROOT_ITEM_KEY ||
+		    key.objectid == BTRFS_DEV_TREE_OBJECTID)
+			continue;
+
+		root = btrfs_read_fs_root_no_cache(tree_root->fs_info, &key);
+		if (IS_ERR(root)) {
+			ret = PTR_ERR(root);
+			fprintf(stderr, "reading root %llu failed\n",
+				(unsigned long long)key.objectid);
+			break;
+		}
+		ret = add_tree(fs, root, &key);
+		free_extent_buffer(root->node);
+		free(root);
+		if (ret)
+			break;
+	}
+	btrfs_release_path(tree_root, &btrfs_path);
+out:
+	close_ctree(tree_root);
+	return ret;
+}
+
+static int compare_fs(struct fs_sum *a, struct fs_sum *b)
+{
+	int i;
+
+	if (a->nr != b->nr) {
+		fprintf(stderr, "%d trees, %d after the restore\n", a->nr,
+			b->nr);
+		return -EINVAL;
+	}
+	for (i = 0; i < a->nr; i++) {
+		if (a->trees[i].objectid != b->trees[i].objectid ||
+		    a->trees[i].offset != b->trees[i].offset ||
+		    a->trees[i].nr_items != b->trees[i].nr_items ||
+		    a->trees[i].crc != b->trees[i].crc) {
+			fprintf(stderr, "tree %llu differs after the restore\n",
+				(unsigned long long)a->trees[i].objectid);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int run_image(const char *prog, const char *args)
+{
+	char cmd[4096];
+	int ret;
+
+	snprintf(cmd, sizeof(cmd), "%s %s", prog, args);
+	ret = system(cmd);
+	if (ret) {
+		fprintf(stderr, "%s failed\n", cmd);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int make_temp(char *name)
+{
+	int fd;
+
+	fd = mkstemp(name);
+	if (fd < 0) {
+		fprintf(stderr, "can't create %s\n", name);
+		return -errno;
+	}
+	close(fd);
+	return 0;
+}
+
+int main(int ac, char **av)
+{
+	struct fs_sum orig;
+	struct fs_sum restored;
+	char dump[] = "/tmp/image-test-dump.XXXXXX";
+	char fs[] = "/tmp/image-test-fs.XXXXXX";
+	char prog[4096];
+	char args[4096];
+	char *dir;
+	int ret;
+	int i;
+
+	if (ac != 2) {
+		fprintf(stderr, "usage: image-test <filesystem image>\n");
+		return 1;
+	}
+
+	radix_tree_init();
+
+	dir = strdup(av[0]);
+	if (!dir)
+		return 1;
+	snprintf(prog, sizeof(prog), "%s/btrfs-image", dirname(dir));
+	free(dir);
+
+	ret = sum_fs(av[1], &orig);
+	if (ret)
+		return 1;
+	if (make_temp(dump) || make_temp(fs))
+		return 1;
+
+	for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+		snprintf(args, sizeof(args), "-t 4 -C %s -c %d %s %s",
+			 codecs[i].name, codecs[i].level, av[1], dump);
+		ret = run_image(prog, args);
+		if (ret)
+			break;
+		snprintf(args, sizeof(args), "-r %s %s", dump, fs);
+		ret = run_image(prog, args);
+		if (ret)
+			break;
+
+		ret = sum_fs(fs, &restored);
+		if (!ret)
+			ret = compare_fs(&orig, &restored);
+		free(restored.trees);
+		if (ret) {
+			fprintf(stderr, "%s level %d didn't round trip\n",
+				codecs[i].name, codecs[i].level);
+			break;
+		}
+		printf("%s level %d: %d trees restored\n", codecs[i].name,
+		       codecs[i].level, orig.nr);
+	}
+
+	unlink(dump);
+	unlink(fs);
+	free(orig.trees);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * receives a stream of small files offline, more metadata than the first
+ * metadata chunk of a fresh filesystem holds, and reads every file back.
+ *
+ *	mkfs.btrfs <1G image> && receive-offline-test <1G image>
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE 1
+
+#include "kerncompat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ctree.h"
+#include "disk-io.h"
+#include "crc32c.h"
+#include "commands.h"
+#include "send.h"
+#include "send-stream.h"
+
+#define NR_DIRS		16
+#define NR_FILES	30000
+#define FILE_SIZE	2000
+
+static const char *subvol = "received";
+
+static char cmd_buf[BTRFS_SEND_BUF_SIZE];
+static int cmd_len;
+
+static void file_path(char *buf, int i)
+{
+	sprintf(buf, "d%d/file-%d", i % NR_DIRS, i);
+}
+
+static void file_data(char *buf, int i)
+{
+	memset(buf, 'a' + i % 26, FILE_SIZE);
+	memcpy(buf, &i, sizeof(i));
+}
+
+static void begin_cmd(int cmd)
+{
+	struct btrfs_cmd_header *hdr = (struct btrfs_cmd_header *)cmd_buf;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->cmd = cpu_to_le16(cmd);
+	cmd_len = sizeof(*hdr);
+}
+
+static void put_attr(int type, const void *data, int len)
+{
+	struct btrfs_tlv_header *tlv;
+
+	tlv = (struct btrfs_tlv_header *)(cmd_buf + cmd_len);
+	tlv->tlv_type = cpu_to_le16(type);
+	tlv->tlv_len = cpu_to_le16(len);
+	memcpy(tlv + 1, data, len);
+	cmd_len += sizeof(*tlv) + len;
+}
+
+static void put_u64(int type, u64 val)
+{
+	__le64 v = cpu_to_le64(val);
+
+	put_attr(type, &v, sizeof(v));
+}
+
+static int end_cmd(int fd)
+{
+	struct btrfs_cmd_header *hdr = (struct btrfs_cmd_header *)cmd_buf;
+	u32 crc;
+
+	hdr->len = cpu_to_le32(cmd_len - sizeof(*hdr));
+	crc = crc32c(0, (unsigned char *)cmd_buf, cmd_len);
+	hdr->crc = cpu_to_le32(crc);
+	if (write(fd, cmd_buf, cmd_len) != cmd_len)
+		return -errno;
+	return 0;
+}
+
+static int write_stream(int fd)
+{
+	struct btrfs_stream_header sh;
+	char path[64];
+	char data[FILE_SIZE];
+	u8 uuid[BTRFS_UUID_SIZE];
+	int ret;
+	int i;
+
+	memset(&sh, 0, sizeof(sh));
+	strcpy(sh.magic, BTRFS_SEND_STREAM_MAGIC);
+	sh.version = cpu_to_le32(BTRFS_SEND_STREAM_VERSION);
+	if (write(fd, &sh, sizeof(sh)) != sizeof(sh))
+		return -errno;
+
+	memset(uuid, 0x5a, sizeof(uuid));
+	begin_cmd(BTRFS_SEND_C_SUBVOL);
+	put_attr(BTRFS_SEND_A_PATH, subvol, strlen(subvol));
+	put_attr(BTRFS_SEND_A_UUID, uuid, sizeof(uuid));
+	put_u64(BTRFS_SEND_A_CTRANSID, 5);
+	ret = end_cmd(fd);
+
+	for (i = 0; !ret && i < NR_DIRS; i++) {
+		sprintf(path, "d%d", i);
+		begin_cmd(BTRFS_SEND_C_MKDIR);
+		put_attr(BTRFS_SEND_A_PATH, path, strlen(path));
+		ret = end_cmd(fd);
+	}
+
+	for (i = 0; !ret && i < NR_FILES; i++) {
+		file_path(path, i);
+		file_data(data, i);
+		begin_cmd(BTRFS_SEND_C_MKFILE);
+		put_attr(BTRFS_SEND_A_PATH, path, strlen(path));
+		ret = end_cmd(fd);
+		if (ret)
+			break;
+		begin_cmd(BTRFS_SEND_C_WRITE);
+		put_attr(BTRFS_SEND_A_PATH, path, strlen(path));
+		put_u64(BTRFS_SEND_A_FILE_OFFSET, 0);
+		put_attr(BTRFS_SEND_A_DATA, data, FILE_SIZE);
+		ret = end_cmd(fd);
+	}
+
+	if (!ret) {
+		begin_cmd(BTRFS_SEND_C_END);
+		ret = end_cmd(fd);
+	}
+	return ret;
+}
+
+static int lookup_name(struct btrfs_root *root, u64 dir, const char *name,
+		       struct btrfs_key *location)
+{
+	struct btrfs_dir_item *di;
+	struct btrfs_path path;
+
+	btrfs_init_path(&path);
+	di = btrfs_lookup_dir_item(NULL, root, &path, dir, name, strlen(name),
+				   0);
+	if (!di || IS_ERR(di)) {
+		btrfs_release_path(root, &path);
+		return -ENOENT;
+	}
+	btrfs_dir_item_key_to_cpu(path.nodes[0], di, location);
+	btrfs_release_path(root, &path);
+	return 0;
+}
+
+static int check_file(struct btrfs_root *root, int i)
+{
+	struct btrfs_file_extent_item *fi;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	char name[64];
+	char data[FILE_SIZE];
+	char found[FILE_SIZE];
+	int ret;
+
+	sprintf(name, "d%d", i % NR_DIRS);
+	ret = lookup_name(root, BTRFS_FIRST_FREE_OBJECTID, name, &key);
+	if (ret)
+		return ret;
+	sprintf(name, "file-%d", i);
+	ret = lookup_name(root, key.objectid, name, &key);
+	if (ret)
+		return ret;
+
+	btrfs_init_path(&path);
+	ret = btrfs_lookup_file_extent(NULL, root, &path, key.objectid, 0, 0);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret)
+		goto out;
+	leaf = path.nodes[0];
+	fi = btrfs_item_ptr(leaf, path.slots[0],
+			    struct btrfs_file_extent_item);
+	if (btrfs_file_extent_type(leaf, fi) != BTRFS_FILE_EXTENT_INLINE ||
+	    btrfs_file_extent_inline_len(leaf, fi) != FILE_SIZE) {
+		ret = -EINVAL;
+		goto out;
+	}
+	read_extent_buffer(leaf, found, btrfs_file_extent_inline_start(fi),
+			   FILE_SIZE);
+	file_data(data, i);
+	if (memcmp(data, found, FILE_SIZE))
+		ret = -EIO;
+out:
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+int main(int ac, char **av)
+{
+	struct btrfs_send_stream *stream;
+	struct btrfs_root *root;
+	struct btrfs_root *subvol_root;
+	struct btrfs_key key;
+	FILE *tmp;
+	int ret;
+	int i;
+
+	if (ac != 2) {
+		fprintf(stderr, "usage: receive-offline-test <image>\n");
+		return 1;
+	}
+
+	radix_tree_init();
+
+	tmp = tmpfile();
+	if (!tmp) {
+		fprintf(stderr, "can't create the stream file\n");
+		return 1;
+	}
+	ret = write_stream(fileno(tmp));
+	if (ret) {
+		fprintf(stderr, "writing the stream failed: %s\n",
+			strerror(-ret));
+		return 1;
+	}
+	lseek(fileno(tmp), 0, SEEK_SET);
+
+	stream = btrfs_send_stream_open(fileno(tmp));
+	if (!stream)
+		return 1;
+	ret = receive_offline(av[1], stream, 0);
+	btrfs_send_stream_close(stream);
+	fclose(tmp);
+	if (ret) {
+		fprintf(stderr, "receive failed: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	root = open_ctree(av[1], 0, 0);
+	if (!root) {
+		fprintf(stderr, "Open ctree failed\n");
+		return 1;
+	}
+	ret = lookup_name(root, BTRFS_FIRST_FREE_OBJECTID, subvol, &key);
+	if (ret) {
+		fprintf(stderr, "subvolume %s not found\n", subvol);
+		goto out;
+	}
+	key.offset = (u64)-1;
+	subvol_root = btrfs_read_fs_root(root->fs_info, &key);
+	if (IS_ERR(subvol_root)) {
+		ret = PTR_ERR(subvol_root);
+		fprintf(stderr, "can't read subvolume %s\n", subvol);
+		goto out;
+	}
+
+	for (i = 0; i < NR_FILES; i++) {
+		ret = check_file(subvol_root, i);
+		if (ret) {
+			fprintf(stderr, "file %d is wrong: %s\n", i,
+				strerror(-ret));
+			goto out;
+		}
+	}
+	printf("received and checked %d files\n", NR_FILES);
+out:
+	close_ctree(root);
+	return ret ? 1 : 0;
+}
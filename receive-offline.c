@@ -0,0 +1,2071 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE 1
+
+#include "kerncompat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <uuid/uuid.h>
+
+#include "ctree.h"
+#include "disk-io.h"
+#include "transaction.h"
+#include "volumes.h"
+#include "extent-cache.h"
+#include "utils.h"
+#include "commands.h"
+#include "send-stream.h"
+
+/*
+ * btrfs receive --offline applies a send stream straight to the trees of
+ * an unmounted filesystem.  File data is gathered per inode and written
+ * as big extents with one csum item per run of blocks, inode items are
+ * kept in memory while they're being changed, and the transaction is
+ * only committed every so often, between files, so that an interrupted
+ * receive leaves a consistent filesystem behind.
+ *
+ * Only full streams can be received this way, and data is only ever
+ * appended: no snapshots, no clones from other subvolumes and no writes
+ * over data that was already written.
+ */
+
+/* data gathered for one inode before it's written out as extents */
+#define OFFLINE_DATA_BUF	(8 * 1024 * 1024)
+/* commit after this much data or this many commands */
+#define OFFLINE_COMMIT_BYTES	(64 * 1024 * 1024)
+#define OFFLINE_COMMIT_CMDS	20000
+/* metadata that has to be left over after each command */
+#define OFFLINE_METADATA_RESERVE	(1024 * 1024)
+
+/* next free dir index of a directory */
+struct offline_dir {
+	struct cache_extent cache;
+	u64 next_index;
+};
+
+struct offline_clone {
+	u64 file_pos;
+	u64 disk_bytenr;
+	u64 disk_num_bytes;
+	u64 offset;
+	u64 num_bytes;
+};
+
+struct offline_receive {
+	struct btrfs_root *fs_root;
+	struct btrfs_root *root;
+	struct btrfs_trans_handle *trans;
+	int verbose;
+
+	char *name;
+	u8 uuid[BTRFS_UUID_SIZE];
+	u64 stransid;
+	u64 next_ino;
+	struct cache_tree dirs;
+
+	/* the inode being changed, written back when we move on */
+	u64 ino;
+	struct btrfs_inode_item inode;
+	int inode_dirty;
+	/* end of the file extents already in the tree */
+	u64 extent_end;
+
+	/* data written to it and not in the tree yet */
+	char *data;
+	u64 data_start;
+	u64 data_len;
+	u64 alloc_hint;
+
+	/* last paths looked up */
+	char *cur_path;
+	u64 cur_ino;
+	u8 cur_type;
+	char *dir_path;
+	u64 dir_ino;
+
+	u64 commit_bytes;
+	u64 commit_cmds;
+	u64 total_bytes;
+	u64 total_extents;
+};
+
+static u8 mode_to_type(u32 mode)
+{
+	if (S_ISREG(mode))
+		return BTRFS_FT_REG_FILE;
+	if (S_ISDIR(mode))
+		return BTRFS_FT_DIR;
+	if (S_ISCHR(mode))
+		return BTRFS_FT_CHRDEV;
+	if (S_ISBLK(mode))
+		return BTRFS_FT_BLKDEV;
+	if (S_ISFIFO(mode))
+		return BTRFS_FT_FIFO;
+	if (S_ISSOCK(mode))
+		return BTRFS_FT_SOCK;
+	if (S_ISLNK(mode))
+		return BTRFS_FT_SYMLINK;
+	return BTRFS_FT_UNKNOWN;
+}
+
+static void forget_paths(struct offline_receive *r)
+{
+	free(r->cur_path);
+	r->cur_path = NULL;
+	free(r->dir_path);
+	r->dir_path = NULL;
+}
+
+static int last_dir_index(struct btrfs_root *root, u64 dir, u64 *index)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = dir;
+	key.type = BTRFS_DIR_INDEX_KEY;
+	key.offset = (u64)-1;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	*index = 2;
+	if (path.slots[0] > 0) {
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0] - 1);
+		if (key.objectid == dir && key.type == BTRFS_DIR_INDEX_KEY)
+			*index = key.offset + 1;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+static struct offline_dir *add_dir(struct offline_receive *r, u64 dir,
+				   u64 next_index)
+{
+	struct offline_dir *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->cache.start = dir;
+	d->cache.size = 1;
+	d->next_index = next_index;
+	insert_existing_cache_extent(&r->dirs, &d->cache);
+	return d;
+}
+
+static int next_dir_index(struct offline_receive *r, u64 dir, u64 *index)
+{
+	struct cache_extent *ce;
+	struct offline_dir *d;
+	u64 next;
+	int ret;
+
+	ce = find_cache_extent(&r->dirs, dir, 1);
+	if (ce) {
+		d = container_of(ce, struct offline_dir, cache);
+	} else {
+		ret = last_dir_index(r->root, dir, &next);
+		if (ret < 0)
+			return ret;
+		d = add_dir(r, dir, next);
+		if (!d)
+			return -ENOMEM;
+	}
+	*index = d->next_index++;
+	return 0;
+}
+
+static void free_dirs(struct offline_receive *r)
+{
+	struct cache_extent *ce;
+
+	while ((ce = find_first_cache_extent(&r->dirs, 0))) {
+		remove_cache_extent(&r->dirs, ce);
+		free(container_of(ce, struct offline_dir, cache));
+	}
+}
+
+/*
+ * extents of regular files
+ */
+static int write_data(struct offline_receive *r, u64 bytenr,
+		      const char *buf, u64 len)
+{
+	struct btrfs_fs_info *info = r->root->fs_info;
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 this_len;
+	ssize_t done;
+	u64 pos;
+	int i;
+	int ret;
+
+	while (len > 0) {
+		this_len = len;
+		ret = btrfs_map_block(&info->mapping_tree, WRITE, bytenr,
+				      &this_len, &multi, 0, &raid_map);
+		if (ret) {
+			fprintf(stderr, "ERROR: unable to map %llu\n",
+				(unsigned long long)bytenr);
+			return ret;
+		}
+		if (raid_map) {
+			fprintf(stderr, "ERROR: RAID5/6 data isn't supported "
+				"offline\n");
+			kfree(multi);
+			kfree(raid_map);
+			return -EOPNOTSUPP;
+		}
+		this_len = min(this_len, len);
+
+		for (i = 0; i < multi->num_stripes; i++) {
+			for (pos = 0; pos < this_len; pos += done) {
+				done = pwrite64(multi->stripes[i].dev->fd,
+					buf + pos, this_len - pos,
+					multi->stripes[i].physical + pos);
+				if (done <= 0) {
+					ret = done < 0 ? -errno : -EIO;
+					fprintf(stderr, "ERROR: writing data "
+						"failed. %s\n", strerror(-ret));
+					kfree(multi);
+					return ret;
+				}
+			}
+		}
+		kfree(multi);
+		multi = NULL;
+
+		bytenr += this_len;
+		buf += this_len;
+		len -= this_len;
+	}
+	return 0;
+}
+
+/* one csum item for as many blocks as fit in a leaf */
+static int csum_data(struct offline_receive *r, u64 bytenr, char *buf,
+		     u64 len)
+{
+	struct btrfs_root *csum_root = r->root->fs_info->csum_root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	u32 sectorsize = r->root->sectorsize;
+	u16 csum_size = btrfs_super_csum_size(&r->root->fs_info->super_copy);
+	u64 max_blocks;
+	u64 nr;
+	u64 i;
+	unsigned long ptr;
+	u32 csum;
+	int ret;
+
+	max_blocks = (BTRFS_LEAF_DATA_SIZE(csum_root) -
+		      sizeof(struct btrfs_item) * 2) / csum_size - 1;
+
+	btrfs_init_path(&path);
+	while (len > 0) {
+		nr = min(len / sectorsize, max_blocks);
+
+		key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = bytenr;
+		ret = btrfs_insert_empty_item(r->trans, csum_root, &path, &key,
+					      nr * csum_size);
+		if (ret)
+			return ret;
+
+		leaf = path.nodes[0];
+		ptr = btrfs_item_ptr_offset(leaf, path.slots[0]);
+		for (i = 0; i < nr; i++) {
+			csum = btrfs_csum_data(r->root, buf, ~(u32)0,
+					       sectorsize);
+			btrfs_csum_final(csum, (char *)&csum);
+			write_extent_buffer(leaf, &csum, ptr, csum_size);
+			ptr += csum_size;
+			buf += sectorsize;
+		}
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(csum_root, &path);
+
+		bytenr += nr * sectorsize;
+		len -= nr * sectorsize;
+	}
+	return 0;
+}
+
+/*
+ * add a file extent to the current inode.  New extents also get their
+ * extent item, extents shared by a clone only another reference.
+ */
+static int record_extent(struct offline_receive *r, u64 file_pos,
+			 u64 disk_bytenr, u64 disk_num_bytes, u64 offset,
+			 u64 num_bytes, int new_extent)
+{
+	struct btrfs_root *root = r->root;
+	struct btrfs_root *extent_root = root->fs_info->extent_root;
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_extent_item *ei;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = r->ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = file_pos;
+	ret = btrfs_insert_empty_item(r->trans, root, &path, &key,
+				      sizeof(*fi));
+	if (ret)
+		goto out;
+
+	leaf = path.nodes[0];
+	fi = btrfs_item_ptr(leaf, path.slots[0],
+			    struct btrfs_file_extent_item);
+	btrfs_set_file_extent_generation(leaf, fi, r->trans->transid);
+	btrfs_set_file_extent_type(leaf, fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_file_extent_disk_bytenr(leaf, fi, disk_bytenr);
+	btrfs_set_file_extent_disk_num_bytes(leaf, fi, disk_num_bytes);
+	btrfs_set_file_extent_offset(leaf, fi, offset);
+	btrfs_set_file_extent_num_bytes(leaf, fi, num_bytes);
+	btrfs_set_file_extent_ram_bytes(leaf, fi,
+			disk_bytenr ? disk_num_bytes : num_bytes);
+	btrfs_set_file_extent_compression(leaf, fi, 0);
+	btrfs_set_file_extent_encryption(leaf, fi, 0);
+	btrfs_set_file_extent_other_encoding(leaf, fi, 0);
+	btrfs_mark_buffer_dirty(leaf);
+	btrfs_release_path(root, &path);
+
+	r->extent_end = file_pos + num_bytes;
+	if (!disk_bytenr)
+		return 0;
+
+	if (new_extent) {
+		key.objectid = disk_bytenr;
+		key.type = BTRFS_EXTENT_ITEM_KEY;
+		key.offset = disk_num_bytes;
+		ret = btrfs_insert_empty_item(r->trans, extent_root, &path,
+					      &key, sizeof(*ei));
+		if (ret)
+			goto out;
+		leaf = path.nodes[0];
+		ei = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_extent_item);
+		btrfs_set_extent_refs(leaf, ei, 0);
+		btrfs_set_extent_generation(leaf, ei, r->trans->transid);
+		btrfs_set_extent_flags(leaf, ei, BTRFS_EXTENT_FLAG_DATA);
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(extent_root, &path);
+
+		ret = btrfs_update_block_group(r->trans, root, disk_bytenr,
+					       disk_num_bytes, 1, 0);
+		if (ret)
+			goto out;
+		r->total_extents++;
+	}
+
+	ret = btrfs_inc_extent_ref(r->trans, root, disk_bytenr,
+				   disk_num_bytes, 0, root->root_key.objectid,
+				   r->ino, file_pos - offset);
+	if (ret)
+		goto out;
+
+	btrfs_set_stack_inode_nbytes(&r->inode,
+			btrfs_stack_inode_nbytes(&r->inode) + num_bytes);
+	r->inode_dirty = 1;
+out:
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+/* files without the no-holes feature have explicit holes up to i_size */
+static int fill_hole(struct offline_receive *r, u64 end)
+{
+	if (end <= r->extent_end)
+		return 0;
+	return record_extent(r, r->extent_end, 0, 0, 0, end - r->extent_end,
+			     0);
+}
+
+static int find_extent_end(struct offline_receive *r)
+{
+	struct btrfs_root *root = r->root;
+	struct btrfs_file_extent_item *fi;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	r->extent_end = 0;
+	btrfs_init_path(&path);
+	key.objectid = r->ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = (u64)-1;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	ret = 0;
+	if (path.slots[0] == 0)
+		goto out;
+
+	leaf = path.nodes[0];
+	btrfs_item_key_to_cpu(leaf, &key, path.slots[0] - 1);
+	if (key.objectid != r->ino || key.type != BTRFS_EXTENT_DATA_KEY)
+		goto out;
+	fi = btrfs_item_ptr(leaf, path.slots[0] - 1,
+			    struct btrfs_file_extent_item);
+	if (btrfs_file_extent_type(leaf, fi) == BTRFS_FILE_EXTENT_INLINE)
+		r->extent_end = round_up(key.offset +
+				btrfs_file_extent_inline_len(leaf, fi),
+				root->sectorsize);
+	else
+		r->extent_end = key.offset +
+				btrfs_file_extent_num_bytes(leaf, fi);
+out:
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+/*
+ * write out the gathered data.  Unless this is the last of it only whole
+ * blocks are written, the rest stays for the writes that follow.
+ */
+static int flush_data(struct offline_receive *r, int final)
+{
+	struct btrfs_root *root = r->root;
+	struct btrfs_key ins;
+	u32 sectorsize = root->sectorsize;
+	u64 len = r->data_len;
+	u64 pos;
+	u64 num;
+	int ret;
+
+	if (!final)
+		len = round_down(len, sectorsize);
+	if (!len)
+		return 0;
+
+	ret = fill_hole(r, r->data_start);
+	if (ret)
+		return ret;
+
+	/* small files are stored in the leaf like the kernel does */
+	if (final && r->data_start == 0 && r->extent_end == 0 &&
+	    len < sectorsize && len <= BTRFS_MAX_INLINE_DATA_SIZE(root) &&
+	    btrfs_stack_inode_size(&r->inode) <= len) {
+		ret = btrfs_insert_inline_extent(r->trans, root, r->ino, 0,
+						 r->data, len);
+		if (ret)
+			return ret;
+		btrfs_set_stack_inode_nbytes(&r->inode,
+			btrfs_stack_inode_nbytes(&r->inode) + len);
+		r->inode_dirty = 1;
+		r->extent_end = sectorsize;
+		goto done;
+	}
+
+	memset(r->data + len, 0, round_up(len, sectorsize) - len);
+	for (pos = 0; pos < len; pos += num) {
+		num = round_up(len - pos, sectorsize);
+		while (1) {
+			ret = btrfs_reserve_data_extent(r->trans, root, num,
+							r->alloc_hint, &ins);
+			if (ret != -ENOSPC || num == sectorsize)
+				break;
+			num = round_up(num / 2, sectorsize);
+		}
+		if (ret) {
+			fprintf(stderr, "ERROR: no space for data\n");
+			return ret;
+		}
+		r->alloc_hint = ins.objectid + num;
+
+		ret = write_data(r, ins.objectid, r->data + pos, num);
+		if (ret)
+			return ret;
+		ret = csum_data(r, ins.objectid, r->data + pos, num);
+		if (ret)
+			return ret;
+		ret = record_extent(r, r->data_start + pos, ins.objectid,
+				    num, 0, num, 1);
+		if (ret)
+			return ret;
+	}
+
+done:
+	r->commit_bytes += len;
+	r->total_bytes += len;
+	r->data_len -= len;
+	r->data_start += len;
+	if (r->data_len)
+		memmove(r->data, r->data + len, r->data_len);
+	return 0;
+}
+
+/*
+ * the current inode
+ */
+static int writeback_inode(struct offline_receive *r)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	if (!r->inode_dirty)
+		return 0;
+
+	btrfs_init_path(&path);
+	key.objectid = r->ino;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_lookup_inode(r->trans, r->root, &path, &key, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret)
+		goto out;
+	write_extent_buffer(path.nodes[0], &r->inode,
+			    btrfs_item_ptr_offset(path.nodes[0],
+						  path.slots[0]),
+			    sizeof(r->inode));
+	btrfs_mark_buffer_dirty(path.nodes[0]);
+	r->inode_dirty = 0;
+out:
+	btrfs_release_path(r->root, &path);
+	return ret;
+}
+
+static int release_inode(struct offline_receive *r)
+{
+	int ret;
+
+	if (!r->ino)
+		return 0;
+
+	if (S_ISREG(btrfs_stack_inode_mode(&r->inode))) {
+		ret = flush_data(r, 1);
+		if (ret)
+			return ret;
+		ret = fill_hole(r, round_up(btrfs_stack_inode_size(&r->inode),
+					    r->root->sectorsize));
+		if (ret)
+			return ret;
+	}
+	ret = writeback_inode(r);
+	if (ret)
+		return ret;
+	r->ino = 0;
+	return 0;
+}
+
+static int load_inode(struct offline_receive *r, u64 ino)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	if (r->ino == ino)
+		return 0;
+	ret = release_inode(r);
+	if (ret)
+		return ret;
+
+	btrfs_init_path(&path);
+	key.objectid = ino;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_lookup_inode(NULL, r->root, &path, &key, 0);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret)
+		goto out;
+	read_extent_buffer(path.nodes[0], &r->inode,
+			   btrfs_item_ptr_offset(path.nodes[0],
+						 path.slots[0]),
+			   sizeof(r->inode));
+	btrfs_release_path(r->root, &path);
+
+	r->ino = ino;
+	r->inode_dirty = 0;
+	r->extent_end = 0;
+	r->data_len = 0;
+	if (S_ISREG(btrfs_stack_inode_mode(&r->inode)))
+		ret = find_extent_end(r);
+out:
+	btrfs_release_path(r->root, &path);
+	return ret;
+}
+
+/* drop an inode that lost its last link, with all its items and data */
+static int drop_inode(struct offline_receive *r, u64 ino)
+{
+	struct btrfs_root *root = r->root;
+	struct btrfs_file_extent_item *fi;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 bytenr;
+	u64 num_bytes;
+	u64 offset;
+	int ret;
+
+	if (r->ino == ino) {
+		r->ino = 0;
+		r->inode_dirty = 0;
+		r->data_len = 0;
+	}
+
+	btrfs_init_path(&path);
+	while (1) {
+		key.objectid = ino;
+		key.type = (u8)-1;
+		key.offset = (u64)-1;
+		ret = btrfs_search_slot(r->trans, root, &key, &path, -1, 1);
+		if (ret < 0)
+			break;
+		ret = 0;
+		if (path.slots[0] == 0)
+			break;
+		path.slots[0]--;
+		leaf = path.nodes[0];
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != ino)
+			break;
+
+		bytenr = 0;
+		if (key.type == BTRFS_EXTENT_DATA_KEY) {
+			fi = btrfs_item_ptr(leaf, path.slots[0],
+					    struct btrfs_file_extent_item);
+			if (btrfs_file_extent_type(leaf, fi) !=
+			    BTRFS_FILE_EXTENT_INLINE) {
+				bytenr = btrfs_file_extent_disk_bytenr(leaf,
+								       fi);
+				num_bytes = btrfs_file_extent_disk_num_bytes(
+								leaf, fi);
+				offset = key.offset -
+					 btrfs_file_extent_offset(leaf, fi);
+			}
+		}
+		ret = btrfs_del_item(r->trans, root, &path);
+		if (ret)
+			break;
+		btrfs_release_path(root, &path);
+
+		if (bytenr) {
+			ret = btrfs_free_extent(r->trans, root, bytenr,
+						num_bytes, 0,
+						root->root_key.objectid,
+						ino, offset);
+			if (ret)
+				break;
+		}
+	}
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+/*
+ * paths and directory entries
+ */
+static int lookup_name(struct offline_receive *r, u64 dir, const char *name,
+		       int name_len, u64 *ino, u8 *type)
+{
+	struct btrfs_dir_item *di;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret = 0;
+
+	btrfs_init_path(&path);
+	di = btrfs_lookup_dir_item(NULL, r->root, &path, dir, name, name_len,
+				   0);
+	if (IS_ERR(di)) {
+		ret = PTR_ERR(di);
+		goto out;
+	}
+	if (!di) {
+		ret = -ENOENT;
+		goto out;
+	}
+	btrfs_dir_item_key_to_cpu(path.nodes[0], di, &key);
+	*ino = key.objectid;
+	if (type)
+		*type = btrfs_dir_type(path.nodes[0], di);
+out:
+	btrfs_release_path(r->root, &path);
+	return ret;
+}
+
+/* split path into the directory it's in and the name in there */
+static int lookup_parent(struct offline_receive *r, const char *path,
+			 u64 *dir, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+	const char *p;
+	const char *end;
+	u64 ino = BTRFS_FIRST_FREE_OBJECTID;
+	u8 type;
+	int ret;
+
+	*name = slash ? slash + 1 : path;
+	if (!slash) {
+		*dir = ino;
+		return 0;
+	}
+	if (r->dir_path && strlen(r->dir_path) == slash - path &&
+	    !memcmp(r->dir_path, path, slash - path)) {
+		*dir = r->dir_ino;
+		return 0;
+	}
+
+	for (p = path; p < slash; p = end + 1) {
+		end = memchr(p, '/', slash - p);
+		if (!end)
+			end = slash;
+		if (end == p)
+			continue;
+		ret = lookup_name(r, ino, p, end - p, &ino, &type);
+		if (ret)
+			return ret;
+		if (type != BTRFS_FT_DIR)
+			return -ENOTDIR;
+	}
+
+	free(r->dir_path);
+	r->dir_path = strndup(path, slash - path);
+	r->dir_ino = ino;
+	*dir = ino;
+	return 0;
+}
+
+static int lookup_path(struct offline_receive *r, const char *path,
+		       u64 *ino, u8 *type)
+{
+	const char *name;
+	u64 dir;
+	int ret;
+
+	if (!*path) {
+		*ino = BTRFS_FIRST_FREE_OBJECTID;
+		if (type)
+			*type = BTRFS_FT_DIR;
+		return 0;
+	}
+	if (r->cur_path && !strcmp(r->cur_path, path)) {
+		*ino = r->cur_ino;
+		if (type)
+			*type = r->cur_type;
+		return 0;
+	}
+
+	ret = lookup_parent(r, path, &dir, &name);
+	if (ret)
+		return ret;
+	ret = lookup_name(r, dir, name, strlen(name), &r->cur_ino,
+			  &r->cur_type);
+	if (ret) {
+		free(r->cur_path);
+		r->cur_path = NULL;
+		return ret;
+	}
+	free(r->cur_path);
+	r->cur_path = strdup(path);
+	*ino = r->cur_ino;
+	if (type)
+		*type = r->cur_type;
+	return 0;
+}
+
+static int add_dir_size(struct offline_receive *r, u64 dir, int diff)
+{
+	int ret;
+
+	ret = load_inode(r, dir);
+	if (ret)
+		return ret;
+	btrfs_set_stack_inode_size(&r->inode,
+			btrfs_stack_inode_size(&r->inode) + diff);
+	r->inode_dirty = 1;
+	return 0;
+}
+
+static int add_entry(struct offline_receive *r, u64 dir, const char *name,
+		     u64 ino, u8 type)
+{
+	struct btrfs_key location;
+	int name_len = strlen(name);
+	u64 index;
+	int ret;
+
+	ret = next_dir_index(r, dir, &index);
+	if (ret)
+		return ret;
+
+	location.objectid = ino;
+	location.type = BTRFS_INODE_ITEM_KEY;
+	location.offset = 0;
+	ret = btrfs_insert_dir_item(r->trans, r->root, name, name_len, dir,
+				    &location, type, index);
+	if (ret)
+		return ret;
+	ret = btrfs_insert_inode_ref(r->trans, r->root, name, name_len, ino,
+				     dir, index);
+	if (ret)
+		return ret;
+	return add_dir_size(r, dir, name_len * 2);
+}
+
+/*
+ * the inode item of a new inode and its first ref are next to each other,
+ * insert both with one search
+ */
+static int insert_new_inode(struct offline_receive *r, u64 ino, u64 dir,
+			    const char *name, u64 index)
+{
+	struct btrfs_inode_ref *ref;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key keys[2];
+	u32 sizes[2];
+	int name_len = strlen(name);
+	int ret;
+
+	keys[0].objectid = ino;
+	keys[0].type = BTRFS_INODE_ITEM_KEY;
+	keys[0].offset = 0;
+	sizes[0] = sizeof(r->inode);
+	keys[1].objectid = ino;
+	keys[1].type = BTRFS_INODE_REF_KEY;
+	keys[1].offset = dir;
+	sizes[1] = sizeof(*ref) + name_len;
+
+	btrfs_init_path(&path);
+	ret = btrfs_insert_empty_items(r->trans, r->root, &path, keys, sizes,
+				       2);
+	if (ret)
+		goto out;
+
+	leaf = path.nodes[0];
+	write_extent_buffer(leaf, &r->inode,
+			    btrfs_item_ptr_offset(leaf, path.slots[0]),
+			    sizeof(r->inode));
+	ref = btrfs_item_ptr(leaf, path.slots[0] + 1, struct btrfs_inode_ref);
+	btrfs_set_inode_ref_name_len(leaf, ref, name_len);
+	btrfs_set_inode_ref_index(leaf, ref, index);
+	write_extent_buffer(leaf, name, (unsigned long)(ref + 1), name_len);
+	btrfs_mark_buffer_dirty(leaf);
+out:
+	btrfs_release_path(r->root, &path);
+	return ret;
+}
+
+static int remove_entry(struct offline_receive *r, u64 dir, const char *name,
+			u64 ino)
+{
+	struct btrfs_root *root = r->root;
+	struct btrfs_inode_ref *ref;
+	struct btrfs_dir_item *di;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int name_len = strlen(name);
+	u64 index;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = ino;
+	key.type = BTRFS_INODE_REF_KEY;
+	key.offset = dir;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret > 0 || (!ret && !find_name_in_backref(&path, name, name_len,
+						      &ref)))
+		ret = -ENOENT;
+	if (ret)
+		goto out;
+	index = btrfs_inode_ref_index(path.nodes[0], ref);
+	btrfs_release_path(root, &path);
+
+	di = btrfs_lookup_dir_item(r->trans, root, &path, dir, name, name_len,
+				   -1);
+	if (!di || IS_ERR(di)) {
+		ret = di ? PTR_ERR(di) : -ENOENT;
+		goto out;
+	}
+	ret = btrfs_delete_one_dir_name(r->trans, root, &path, di);
+	if (ret)
+		goto out;
+	btrfs_release_path(root, &path);
+
+	di = btrfs_lookup_dir_index_item(r->trans, root, &path, dir, index,
+					 name, name_len, -1);
+	if (!di || IS_ERR(di)) {
+		ret = di ? PTR_ERR(di) : -ENOENT;
+		goto out;
+	}
+	ret = btrfs_delete_one_dir_name(r->trans, root, &path, di);
+	if (ret)
+		goto out;
+	btrfs_release_path(root, &path);
+
+	ret = btrfs_del_inode_ref(r->trans, root, name, name_len, ino, dir);
+	if (ret)
+		goto out;
+	ret = add_dir_size(r, dir, -name_len * 2);
+out:
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+static int create_inode(struct offline_receive *r, const char *path,
+			u32 mode, u64 rdev, u64 *ino_ret)
+{
+	struct btrfs_inode_item *item = &r->inode;
+	struct btrfs_key location;
+	const char *name;
+	time_t now = time(NULL);
+	u64 index;
+	u64 dir;
+	u64 ino;
+	int ret;
+
+	ret = lookup_parent(r, path, &dir, &name);
+	if (ret)
+		return ret;
+	ret = release_inode(r);
+	if (ret)
+		return ret;
+
+	ino = r->next_ino++;
+	memset(item, 0, sizeof(*item));
+	btrfs_set_stack_inode_generation(item, r->trans->transid);
+	btrfs_set_stack_inode_nlink(item, 1);
+	btrfs_set_stack_inode_mode(item, mode);
+	btrfs_set_stack_inode_rdev(item, rdev);
+	btrfs_set_stack_timespec_sec(&item->atime, now);
+	btrfs_set_stack_timespec_sec(&item->ctime, now);
+	btrfs_set_stack_timespec_sec(&item->mtime, now);
+	btrfs_set_stack_timespec_sec(&item->otime, now);
+	ret = next_dir_index(r, dir, &index);
+	if (ret)
+		return ret;
+	ret = insert_new_inode(r, ino, dir, name, index);
+	if (ret)
+		return ret;
+
+	location.objectid = ino;
+	location.type = BTRFS_INODE_ITEM_KEY;
+	location.offset = 0;
+	ret = btrfs_insert_dir_item(r->trans, r->root, name, strlen(name), dir,
+				    &location, mode_to_type(mode), index);
+	if (ret == -EEXIST)
+		fprintf(stderr, "ERROR: %s already exists\n", path);
+	if (ret)
+		return ret;
+	ret = add_dir_size(r, dir, strlen(name) * 2);
+	if (ret)
+		return ret;
+	if (S_ISDIR(mode) && !add_dir(r, ino, 2))
+		return -ENOMEM;
+	if (ino_ret)
+		*ino_ret = ino;
+	return 0;
+}
+
+static int unlink_inode(struct offline_receive *r, u64 dir, const char *name,
+			u64 ino, u8 type)
+{
+	struct cache_extent *ce;
+	u32 nlink;
+	int ret;
+
+	ret = load_inode(r, ino);
+	if (ret)
+		return ret;
+	if (type == BTRFS_FT_DIR && btrfs_stack_inode_size(&r->inode))
+		return -ENOTEMPTY;
+
+	ret = remove_entry(r, dir, name, ino);
+	if (ret)
+		return ret;
+	ret = load_inode(r, ino);
+	if (ret)
+		return ret;
+	nlink = btrfs_stack_inode_nlink(&r->inode);
+	if (type != BTRFS_FT_DIR && nlink > 1) {
+		btrfs_set_stack_inode_nlink(&r->inode, nlink - 1);
+		r->inode_dirty = 1;
+		return 0;
+	}
+
+	if (type == BTRFS_FT_DIR) {
+		ce = find_cache_extent(&r->dirs, ino, 1);
+		if (ce) {
+			remove_cache_extent(&r->dirs, ce);
+			free(container_of(ce, struct offline_dir, cache));
+		}
+	}
+	return drop_inode(r, ino);
+}
+
+/*
+ * the stream
+ */
+/*
+ * commit every so often, but only between files: a file whose size is
+ * ahead of its extents would be a broken file after the commit.
+ */
+static int maybe_commit(struct offline_receive *r)
+{
+	int ret;
+
+	ret = btrfs_check_metadata_space(r->trans, r->root,
+					 OFFLINE_METADATA_RESERVE);
+	if (ret) {
+		fprintf(stderr, "ERROR: no space for metadata\n");
+		return ret;
+	}
+
+	if (++r->commit_cmds < OFFLINE_COMMIT_CMDS &&
+	    r->commit_bytes < OFFLINE_COMMIT_BYTES)
+		return 0;
+
+	ret = flush_data(r, 0);
+	if (ret)
+		return ret;
+	if (r->ino && S_ISREG(btrfs_stack_inode_mode(&r->inode)) &&
+	    (r->data_len ||
+	     btrfs_stack_inode_size(&r->inode) > r->extent_end))
+		return 0;
+	ret = writeback_inode(r);
+	if (ret)
+		return ret;
+	ret = btrfs_commit_transaction(r->trans, r->root);
+	if (ret)
+		return ret;
+	r->trans = btrfs_start_transaction(r->root, 1);
+	r->commit_cmds = 0;
+	r->commit_bytes = 0;
+	return 0;
+}
+
+static int find_free_root_id(struct btrfs_root *tree_root, u64 *objectid)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = BTRFS_LAST_FREE_OBJECTID;
+	key.type = (u8)-1;
+	key.offset = (u64)-1;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	*objectid = BTRFS_FIRST_FREE_OBJECTID;
+	if (path.slots[0] > 0) {
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0] - 1);
+		*objectid = max(*objectid, key.objectid + 1);
+	}
+	ret = 0;
+out:
+	btrfs_release_path(tree_root, &path);
+	return ret;
+}
+
+/* an empty subvolume linked into the top level directory */
+static int create_subvol(struct offline_receive *r, const char *name,
+			 struct btrfs_root **root_ret)
+{
+	struct btrfs_root *fs_root = r->fs_root;
+	struct btrfs_fs_info *info = fs_root->fs_info;
+	struct btrfs_root *tree_root = info->tree_root;
+	struct btrfs_trans_handle *trans;
+	struct btrfs_disk_key disk_key;
+	struct btrfs_root_item root_item;
+	struct btrfs_inode_item *inode_item;
+	struct extent_buffer *leaf;
+	struct btrfs_root *root;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 dirid = btrfs_root_dirid(&fs_root->root_item);
+	int name_len = strlen(name);
+	time_t now = time(NULL);
+	u64 objectid;
+	u64 index;
+	int ret;
+
+	btrfs_init_path(&path);
+	if (btrfs_lookup_dir_item(NULL, fs_root, &path, dirid, name,
+				  name_len, 0)) {
+		btrfs_release_path(fs_root, &path);
+		fprintf(stderr, "ERROR: %s already exists\n", name);
+		return -EEXIST;
+	}
+	btrfs_release_path(fs_root, &path);
+
+	ret = find_free_root_id(tree_root, &objectid);
+	if (ret)
+		return ret;
+	ret = last_dir_index(fs_root, dirid, &index);
+	if (ret)
+		return ret;
+
+	trans = btrfs_start_transaction(fs_root, 1);
+	r->trans = trans;
+
+	memset(&disk_key, 0, sizeof(disk_key));
+	leaf = btrfs_alloc_free_block(trans, fs_root, fs_root->leafsize,
+				      objectid, &disk_key, 0, 0, 0);
+	if (IS_ERR(leaf))
+		return PTR_ERR(leaf);
+	memset_extent_buffer(leaf, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_bytenr(leaf, leaf->start);
+	btrfs_set_header_generation(leaf, trans->transid);
+	btrfs_set_header_backref_rev(leaf, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(leaf, objectid);
+	write_extent_buffer(leaf, info->fsid,
+			    (unsigned long)btrfs_header_fsid(leaf),
+			    BTRFS_FSID_SIZE);
+	write_extent_buffer(leaf, info->chunk_tree_uuid,
+			    (unsigned long)btrfs_header_chunk_tree_uuid(leaf),
+			    BTRFS_UUID_SIZE);
+	btrfs_mark_buffer_dirty(leaf);
+
+	memcpy(&root_item, &fs_root->root_item, sizeof(root_item));
+	btrfs_set_root_bytenr(&root_item, leaf->start);
+	btrfs_set_root_level(&root_item, 0);
+	btrfs_set_root_generation(&root_item, trans->transid);
+	btrfs_set_root_generation_v2(&root_item, trans->transid);
+	btrfs_set_root_refs(&root_item, 1);
+	btrfs_set_root_flags(&root_item, 0);
+	btrfs_set_root_last_snapshot(&root_item, 0);
+	btrfs_set_root_dirid(&root_item, BTRFS_FIRST_FREE_OBJECTID);
+	btrfs_set_root_ctransid(&root_item, trans->transid);
+	btrfs_set_root_otransid(&root_item, trans->transid);
+	btrfs_set_root_stransid(&root_item, 0);
+	btrfs_set_root_rtransid(&root_item, 0);
+	memset(&root_item.drop_progress, 0, sizeof(root_item.drop_progress));
+	root_item.drop_level = 0;
+	uuid_generate(root_item.uuid);
+	memset(root_item.parent_uuid, 0, BTRFS_UUID_SIZE);
+	memset(root_item.received_uuid, 0, BTRFS_UUID_SIZE);
+	memset(&root_item.stime, 0, sizeof(root_item.stime));
+	memset(&root_item.rtime, 0, sizeof(root_item.rtime));
+	btrfs_set_stack_timespec_sec(&root_item.ctime, now);
+	btrfs_set_stack_timespec_nsec(&root_item.ctime, 0);
+	btrfs_set_stack_timespec_sec(&root_item.otime, now);
+	btrfs_set_stack_timespec_nsec(&root_item.otime, 0);
+	free_extent_buffer(leaf);
+
+	key.objectid = objectid;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_insert_root(trans, tree_root, &key, &root_item);
+	if (ret)
+		return ret;
+
+	key.offset = (u64)-1;
+	root = btrfs_read_fs_root(info, &key);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	ret = btrfs_make_root_dir(trans, root, BTRFS_FIRST_FREE_OBJECTID);
+	if (ret)
+		return ret;
+
+	ret = btrfs_insert_dir_item(trans, fs_root, name, name_len, dirid,
+				    &key, BTRFS_FT_DIR, index);
+	if (ret)
+		return ret;
+
+	key.objectid = dirid;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_lookup_inode(trans, fs_root, &path, &key, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret)
+		return ret;
+	leaf = path.nodes[0];
+	inode_item = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_inode_item);
+	btrfs_set_inode_size(leaf, inode_item,
+			     btrfs_inode_size(leaf, inode_item) +
+			     name_len * 2);
+	btrfs_mark_buffer_dirty(leaf);
+	btrfs_release_path(fs_root, &path);
+
+	ret = btrfs_add_root_ref(trans, tree_root, objectid,
+				 BTRFS_ROOT_BACKREF_KEY,
+				 fs_root->root_key.objectid, dirid, index,
+				 name, name_len);
+	if (ret)
+		return ret;
+	ret = btrfs_add_root_ref(trans, tree_root,
+				 fs_root->root_key.objectid,
+				 BTRFS_ROOT_REF_KEY, objectid, dirid, index,
+				 name, name_len);
+	if (ret)
+		return ret;
+
+	ret = btrfs_commit_transaction(trans, fs_root);
+	if (ret)
+		return ret;
+	r->trans = NULL;
+	*root_ret = root;
+	return 0;
+}
+
+static int offline_subvol(const char *path, const u8 *uuid, u64 ctransid,
+			  void *user)
+{
+	struct offline_receive *r = user;
+	struct btrfs_root *root;
+	int ret;
+
+	if (r->root) {
+		fprintf(stderr, "ERROR: stream starts another subvolume "
+			"before ending %s\n", r->name);
+		return -EINVAL;
+	}
+	if (!*path || strchr(path, '/')) {
+		fprintf(stderr, "ERROR: invalid subvolume name '%s'\n", path);
+		return -EINVAL;
+	}
+
+	if (r->verbose)
+		fprintf(stderr, "At subvol %s\n", path);
+
+	r->name = strdup(path);
+	ret = create_subvol(r, path, &root);
+	if (ret) {
+		fprintf(stderr, "ERROR: creating subvolume %s failed. %s\n",
+			path, strerror(-ret));
+		return ret;
+	}
+
+	r->root = root;
+	memcpy(r->uuid, uuid, BTRFS_UUID_SIZE);
+	r->stransid = ctransid;
+	r->next_ino = BTRFS_FIRST_FREE_OBJECTID + 1;
+	r->ino = 0;
+	r->data_len = 0;
+	r->alloc_hint = 0;
+	cache_tree_init(&r->dirs);
+	if (!add_dir(r, BTRFS_FIRST_FREE_OBJECTID, 2))
+		return -ENOMEM;
+	r->trans = btrfs_start_transaction(root, 1);
+	return 0;
+}
+
+/* mark the subvolume received and read-only, and commit it */
+static int finish_subvol(struct offline_receive *r)
+{
+	struct btrfs_root *root = r->root;
+	struct btrfs_root_item *item;
+	u64 transid;
+	int ret;
+
+	if (!root)
+		return 0;
+
+	ret = release_inode(r);
+	if (ret)
+		return ret;
+
+	transid = r->trans->transid;
+	item = &root->root_item;
+	btrfs_set_root_bytenr(item, root->node->start);
+	btrfs_set_root_level(item, btrfs_header_level(root->node));
+	btrfs_set_root_generation(item, transid);
+	btrfs_set_root_generation_v2(item, transid);
+	btrfs_set_root_ctransid(item, transid);
+	memcpy(item->received_uuid, r->uuid, BTRFS_UUID_SIZE);
+	btrfs_set_root_stransid(item, r->stransid);
+	btrfs_set_root_rtransid(item, transid);
+	btrfs_set_stack_timespec_sec(&item->rtime, time(NULL));
+	btrfs_set_stack_timespec_nsec(&item->rtime, 0);
+	btrfs_set_root_flags(item, btrfs_root_flags(item) |
+			     BTRFS_ROOT_SUBVOL_RDONLY);
+	ret = btrfs_update_root(r->trans, root->fs_info->tree_root,
+				&root->root_key, item);
+	if (ret)
+		return ret;
+
+	ret = btrfs_commit_transaction(r->trans, root);
+	if (ret)
+		return ret;
+	r->trans = NULL;
+	r->root = NULL;
+
+	free_dirs(r);
+	forget_paths(r);
+	free(r->name);
+	r->name = NULL;
+	r->commit_cmds = 0;
+	r->commit_bytes = 0;
+	return 0;
+}
+
+static int offline_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			    const u8 *parent_uuid, u64 parent_ctransid,
+			    void *user)
+{
+	fprintf(stderr, "ERROR: %s is an incremental stream, only full "
+		"streams can be received offline\n", path);
+	return -EOPNOTSUPP;
+}
+
+static int offline_create(struct offline_receive *r, const char *path,
+			  u32 mode, u64 rdev)
+{
+	int ret;
+
+	ret = create_inode(r, path, mode, rdev, NULL);
+	if (ret) {
+		fprintf(stderr, "ERROR: creating %s failed. %s\n", path,
+			strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_mkfile(const char *path, void *user)
+{
+	return offline_create(user, path, S_IFREG | 0600, 0);
+}
+
+static int offline_mkdir(const char *path, void *user)
+{
+	return offline_create(user, path, S_IFDIR | 0700, 0);
+}
+
+static int offline_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	/* the stream has the user space encoding, inodes the kernel's */
+	u64 rdev = (((dev & 0xfff00) >> 8) << 20) |
+		   (dev & 0xff) | ((dev >> 12) & 0xfff00);
+
+	return offline_create(user, path, mode, rdev);
+}
+
+static int offline_mkfifo(const char *path, void *user)
+{
+	return offline_create(user, path, S_IFIFO | 0600, 0);
+}
+
+static int offline_mksock(const char *path, void *user)
+{
+	return offline_create(user, path, S_IFSOCK | 0600, 0);
+}
+
+static int offline_symlink(const char *path, const char *lnk, void *user)
+{
+	struct offline_receive *r = user;
+	size_t len = strlen(lnk);
+	u64 ino;
+	int ret;
+
+	if (!len || len >= r->root->sectorsize ||
+	    len > BTRFS_MAX_INLINE_DATA_SIZE(r->root)) {
+		fprintf(stderr, "ERROR: symlink %s is too long\n", path);
+		return -ENAMETOOLONG;
+	}
+
+	ret = create_inode(r, path, S_IFLNK | 0777, 0, &ino);
+	if (ret)
+		goto out;
+	ret = btrfs_insert_inline_extent(r->trans, r->root, ino, 0,
+					 (char *)lnk, len);
+	if (ret)
+		goto out;
+	ret = load_inode(r, ino);
+	if (ret)
+		goto out;
+	btrfs_set_stack_inode_size(&r->inode, len);
+	btrfs_set_stack_inode_nbytes(&r->inode, len);
+	r->inode_dirty = 1;
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: symlink %s -> %s failed. %s\n", path,
+			lnk, strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_rename(const char *from, const char *to, void *user)
+{
+	struct offline_receive *r = user;
+	const char *from_name;
+	const char *to_name;
+	u64 from_dir;
+	u64 to_dir;
+	u64 ino;
+	u64 old;
+	u8 type;
+	u8 old_type;
+	int ret;
+
+	ret = lookup_parent(r, from, &from_dir, &from_name);
+	if (ret)
+		goto out;
+	ret = lookup_name(r, from_dir, from_name, strlen(from_name), &ino,
+			  &type);
+	if (ret)
+		goto out;
+	ret = lookup_parent(r, to, &to_dir, &to_name);
+	if (ret)
+		goto out;
+	forget_paths(r);
+
+	ret = lookup_name(r, to_dir, to_name, strlen(to_name), &old,
+			  &old_type);
+	if (!ret && old == ino)
+		goto out;
+	if (!ret)
+		ret = unlink_inode(r, to_dir, to_name, old, old_type);
+	else if (ret == -ENOENT)
+		ret = 0;
+	if (ret)
+		goto out;
+
+	ret = remove_entry(r, from_dir, from_name, ino);
+	if (ret)
+		goto out;
+	ret = add_entry(r, to_dir, to_name, ino, type);
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: rename %s -> %s failed. %s\n", from,
+			to, strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_link(const char *path, const char *lnk, void *user)
+{
+	struct offline_receive *r = user;
+	const char *name;
+	u64 dir;
+	u64 ino;
+	u8 type;
+	int ret;
+
+	ret = lookup_path(r, lnk, &ino, &type);
+	if (ret)
+		goto out;
+	if (type == BTRFS_FT_DIR) {
+		ret = -EPERM;
+		goto out;
+	}
+	ret = lookup_parent(r, path, &dir, &name);
+	if (ret)
+		goto out;
+	ret = add_entry(r, dir, name, ino, type);
+	if (ret)
+		goto out;
+	ret = load_inode(r, ino);
+	if (ret)
+		goto out;
+	btrfs_set_stack_inode_nlink(&r->inode,
+				    btrfs_stack_inode_nlink(&r->inode) + 1);
+	r->inode_dirty = 1;
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: link %s -> %s failed. %s\n", path,
+			lnk, strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_remove(struct offline_receive *r, const char *path,
+			  int is_dir)
+{
+	const char *name;
+	u64 dir;
+	u64 ino;
+	u8 type;
+	int ret;
+
+	ret = lookup_parent(r, path, &dir, &name);
+	if (ret)
+		goto out;
+	ret = lookup_name(r, dir, name, strlen(name), &ino, &type);
+	if (ret)
+		goto out;
+	forget_paths(r);
+	if (is_dir != (type == BTRFS_FT_DIR)) {
+		ret = is_dir ? -ENOTDIR : -EISDIR;
+		goto out;
+	}
+	ret = unlink_inode(r, dir, name, ino, type);
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: removing %s failed. %s\n", path,
+			strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_unlink(const char *path, void *user)
+{
+	return offline_remove(user, path, 0);
+}
+
+static int offline_rmdir(const char *path, void *user)
+{
+	return offline_remove(user, path, 1);
+}
+
+static int overwrite_error(const char *path, u64 offset)
+{
+	fprintf(stderr, "ERROR: %s is written at %llu again, only appending "
+		"writes can be received offline\n", path,
+		(unsigned long long)offset);
+	return -EOPNOTSUPP;
+}
+
+static int offline_write(const char *path, const void *data, u64 offset,
+			 u64 len, void *user)
+{
+	struct offline_receive *r = user;
+	u64 pend;
+	u64 ino;
+	u64 n;
+	u8 type;
+	int ret;
+
+	ret = lookup_path(r, path, &ino, &type);
+	if (ret)
+		goto out;
+	if (type != BTRFS_FT_REG_FILE) {
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = load_inode(r, ino);
+	if (ret)
+		goto out;
+
+	/* rewriting data that's still gathered is fine */
+	if (r->data_len && offset >= r->data_start &&
+	    offset < r->data_start + r->data_len) {
+		n = min(len, r->data_start + r->data_len - offset);
+		memcpy(r->data + offset - r->data_start, data, n);
+		data = (const char *)data + n;
+		offset += n;
+		len -= n;
+	}
+	/* a gap that ends in the last block can't be a hole */
+	pend = r->data_start + r->data_len;
+	if (len && r->data_len && offset > pend &&
+	    offset < round_up(pend, r->root->sectorsize)) {
+		memset(r->data + r->data_len, 0, offset - pend);
+		r->data_len += offset - pend;
+		if (r->data_len >= OFFLINE_DATA_BUF) {
+			ret = flush_data(r, 0);
+			if (ret)
+				goto out;
+		}
+	}
+	if (len && r->data_len && offset != r->data_start + r->data_len) {
+		ret = flush_data(r, 1);
+		if (ret)
+			goto out;
+	}
+	if (len && !r->data_len) {
+		if (offset < r->extent_end)
+			return overwrite_error(path, offset);
+		/* extents start on a block, zero the start of this one */
+		r->data_start = max(r->extent_end,
+				    round_down(offset, r->root->sectorsize));
+		r->data_len = offset - r->data_start;
+		memset(r->data, 0, r->data_len);
+	}
+
+	while (len > 0) {
+		n = min(len, OFFLINE_DATA_BUF - r->data_len);
+		memcpy(r->data + r->data_len, data, n);
+		r->data_len += n;
+		data = (const char *)data + n;
+		offset += n;
+		len -= n;
+		if (r->data_len == OFFLINE_DATA_BUF) {
+			ret = flush_data(r, 0);
+			if (ret)
+				goto out;
+		}
+	}
+	if (offset > btrfs_stack_inode_size(&r->inode)) {
+		btrfs_set_stack_inode_size(&r->inode, offset);
+		r->inode_dirty = 1;
+	}
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: writing to %s failed. %s\n", path,
+			strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+/* the extents of src in [offset, offset + len) */
+static int find_clone_extents(struct offline_receive *r, u64 src,
+			      u64 offset, u64 len,
+			      struct offline_clone **ret_clones, int *nr_ret)
+{
+	struct btrfs_root *root = r->root;
+	struct btrfs_file_extent_item *fi;
+	struct offline_clone *clones = NULL;
+	struct offline_clone *tmp;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 end = offset + len;
+	u64 start;
+	u64 num;
+	int nr = 0;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = src;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = offset;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	if (ret > 0 && path.slots[0] > 0) {
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0] - 1);
+		if (key.objectid == src && key.type == BTRFS_EXTENT_DATA_KEY)
+			path.slots[0]--;
+	}
+
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != src || key.type != BTRFS_EXTENT_DATA_KEY ||
+		    key.offset >= end)
+			break;
+
+		fi = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_file_extent_item);
+		if (btrfs_file_extent_type(leaf, fi) !=
+		    BTRFS_FILE_EXTENT_REG ||
+		    btrfs_file_extent_compression(leaf, fi)) {
+			ret = -EOPNOTSUPP;
+			goto out;
+		}
+		num = btrfs_file_extent_num_bytes(leaf, fi);
+		if (key.offset + num <= offset ||
+		    !btrfs_file_extent_disk_bytenr(leaf, fi)) {
+			path.slots[0]++;
+			continue;
+		}
+
+		tmp = realloc(clones, (nr + 1) * sizeof(*clones));
+		if (!tmp) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		clones = tmp;
+		start = max(key.offset, offset);
+		clones[nr].file_pos = start;
+		clones[nr].disk_bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+		clones[nr].disk_num_bytes =
+			btrfs_file_extent_disk_num_bytes(leaf, fi);
+		clones[nr].offset = btrfs_file_extent_offset(leaf, fi) +
+				    start - key.offset;
+		clones[nr].num_bytes = min(key.offset + num, end) - start;
+		nr++;
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(root, &path);
+	if (ret) {
+		free(clones);
+		return ret;
+	}
+	*ret_clones = clones;
+	*nr_ret = nr;
+	return 0;
+}
+
+static int offline_clone(const char *path, u64 offset, u64 len,
+			 const u8 *clone_uuid, u64 clone_ctransid,
+			 const char *clone_path, u64 clone_offset,
+			 void *user)
+{
+	struct offline_receive *r = user;
+	struct offline_clone *clones = NULL;
+	u32 sectorsize = r->root->sectorsize;
+	u64 src;
+	u64 ino;
+	u64 pos;
+	int nr = 0;
+	int i;
+	int ret;
+
+	if (memcmp(clone_uuid, r->uuid, BTRFS_UUID_SIZE)) {
+		fprintf(stderr, "ERROR: %s clones from another subvolume, "
+			"send it without -c to receive it offline\n", path);
+		return -EOPNOTSUPP;
+	}
+	if ((offset | clone_offset) & (sectorsize - 1)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = lookup_path(r, clone_path, &src, NULL);
+	if (ret)
+		goto out;
+	ret = lookup_path(r, path, &ino, NULL);
+	if (ret)
+		goto out;
+
+	/* everything to clone from has to be in the tree */
+	if (r->ino == src) {
+		ret = flush_data(r, 1);
+		if (ret)
+			goto out;
+	}
+	ret = load_inode(r, ino);
+	if (ret)
+		goto out;
+	ret = flush_data(r, 1);
+	if (ret)
+		goto out;
+	if (offset < r->extent_end)
+		return overwrite_error(path, offset);
+
+	ret = find_clone_extents(r, src, clone_offset,
+				 round_up(len, sectorsize), &clones, &nr);
+	if (ret)
+		goto out;
+	for (i = 0; i < nr; i++) {
+		pos = offset + clones[i].file_pos - clone_offset;
+		ret = fill_hole(r, pos);
+		if (ret)
+			goto out;
+		ret = record_extent(r, pos, clones[i].disk_bytenr,
+				    clones[i].disk_num_bytes, clones[i].offset,
+				    clones[i].num_bytes, 0);
+		if (ret)
+			goto out;
+	}
+	ret = fill_hole(r, offset + round_up(len, sectorsize));
+	if (ret)
+		goto out;
+
+	if (offset + len > btrfs_stack_inode_size(&r->inode)) {
+		btrfs_set_stack_inode_size(&r->inode, offset + len);
+		r->inode_dirty = 1;
+	}
+out:
+	free(clones);
+	if (ret) {
+		fprintf(stderr, "ERROR: clone %s -> %s failed. %s\n",
+			clone_path, path, strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_set_xattr(const char *path, const char *name,
+			     const void *data, int len, void *user)
+{
+	struct offline_receive *r = user;
+	struct btrfs_dir_item *di;
+	struct btrfs_path bpath;
+	int name_len = strlen(name);
+	u64 ino;
+	int ret;
+
+	ret = lookup_path(r, path, &ino, NULL);
+	if (ret)
+		goto out;
+	ret = btrfs_insert_xattr_item(r->trans, r->root, name, name_len,
+				      data, len, ino);
+	if (ret != -EEXIST)
+		goto out;
+
+	btrfs_init_path(&bpath);
+	di = btrfs_lookup_xattr(r->trans, r->root, &bpath, ino, name,
+				name_len, -1);
+	if (!di || IS_ERR(di))
+		ret = di ? PTR_ERR(di) : -ENOENT;
+	else
+		ret = btrfs_delete_one_dir_name(r->trans, r->root, &bpath, di);
+	btrfs_release_path(r->root, &bpath);
+	if (ret)
+		goto out;
+	ret = btrfs_insert_xattr_item(r->trans, r->root, name, name_len,
+				      data, len, ino);
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: set_xattr %s %s failed. %s\n", path,
+			name, strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_remove_xattr(const char *path, const char *name,
+				void *user)
+{
+	struct offline_receive *r = user;
+	struct btrfs_dir_item *di;
+	struct btrfs_path bpath;
+	u64 ino;
+	int ret;
+
+	ret = lookup_path(r, path, &ino, NULL);
+	if (ret)
+		goto out;
+	btrfs_init_path(&bpath);
+	di = btrfs_lookup_xattr(r->trans, r->root, &bpath, ino, name,
+				strlen(name), -1);
+	if (!di || IS_ERR(di))
+		ret = di ? PTR_ERR(di) : -ENODATA;
+	else
+		ret = btrfs_delete_one_dir_name(r->trans, r->root, &bpath, di);
+	btrfs_release_path(r->root, &bpath);
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: remove_xattr %s %s failed. %s\n",
+			path, name, strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_truncate(const char *path, u64 size, void *user)
+{
+	struct offline_receive *r = user;
+	u64 ino;
+	int ret;
+
+	ret = lookup_path(r, path, &ino, NULL);
+	if (ret)
+		goto out;
+	ret = load_inode(r, ino);
+	if (ret)
+		goto out;
+
+	if (size < r->data_start + r->data_len) {
+		if (size < r->data_start)
+			r->data_len = 0;
+		else
+			r->data_len = size - r->data_start;
+	}
+	if (size < r->extent_end &&
+	    round_up(size, r->root->sectorsize) != r->extent_end) {
+		fprintf(stderr, "ERROR: %s is truncated below its data, "
+			"that can't be received offline\n", path);
+		return -EOPNOTSUPP;
+	}
+	btrfs_set_stack_inode_size(&r->inode, size);
+	r->inode_dirty = 1;
+out:
+	if (ret) {
+		fprintf(stderr, "ERROR: truncate %s failed. %s\n", path,
+			strerror(-ret));
+		return ret;
+	}
+	return maybe_commit(r);
+}
+
+static int offline_chmod(const char *path, u64 mode, void *user)
+{
+	struct offline_receive *r = user;
+	u64 ino;
+	int ret;
+
+	ret = lookup_path(r, path, &ino, NULL);
+	if (!ret)
+		ret = load_inode(r, ino);
+	if (ret) {
+		fprintf(stderr, "ERROR: chmod %s failed. %s\n", path,
+			strerror(-ret));
+		return ret;
+	}
+	btrfs_set_stack_inode_mode(&r->inode,
+			(btrfs_stack_inode_mode(&r->inode) & S_IFMT) |
+			(mode & 07777));
+	r->inode_dirty = 1;
+	return maybe_commit(r);
+}
+
+static int offline_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	struct offline_receive *r = user;
+	u64 ino;
+	int ret;
+
+	ret = lookup_path(r, path, &ino, NULL);
+	if (!ret)
+		ret = load_inode(r, ino);
+	if (ret) {
+		fprintf(stderr, "ERROR: chown %s failed. %s\n", path,
+			strerror(-ret));
+		return ret;
+	}
+	btrfs_set_stack_inode_uid(&r->inode, uid);
+	btrfs_set_stack_inode_gid(&r->inode, gid);
+	r->inode_dirty = 1;
+	return maybe_commit(r);
+}
+
+static void set_time(struct btrfs_timespec *bt, struct timespec *t)
+{
+	btrfs_set_stack_timespec_sec(bt, t->tv_sec);
+	btrfs_set_stack_timespec_nsec(bt, t->tv_nsec);
+}
+
+static int offline_utimes(const char *path, struct timespec *at,
+			  struct timespec *mt, struct timespec *ct,
+			  void *user)
+{
+	struct offline_receive *r = user;
+	u64 ino;
+	int ret;
+
+	ret = lookup_path(r, path, &ino, NULL);
+	if (!ret)
+		ret = load_inode(r, ino);
+	if (ret) {
+		fprintf(stderr, "ERROR: utimes %s failed. %s\n", path,
+			strerror(-ret));
+		return ret;
+	}
+	set_time(&r->inode.atime, at);
+	set_time(&r->inode.mtime, mt);
+	set_time(&r->inode.ctime, ct);
+	r->inode_dirty = 1;
+	return maybe_commit(r);
+}
+
+static int offline_update_extent(const char *path, u64 offset, u64 len,
+				 void *user)
+{
+	fprintf(stderr, "ERROR: streams without data can't be received "
+		"offline\n");
+	return -EOPNOTSUPP;
+}
+
+static struct btrfs_send_ops offline_ops = {
+	.subvol = offline_subvol,
+	.snapshot = offline_snapshot,
+	.mkfile = offline_mkfile,
+	.mkdir = offline_mkdir,
+	.mknod = offline_mknod,
+	.mkfifo = offline_mkfifo,
+	.mksock = offline_mksock,
+	.symlink = offline_symlink,
+	.rename = offline_rename,
+	.link = offline_link,
+	.unlink = offline_unlink,
+	.rmdir = offline_rmdir,
+	.write = offline_write,
+	.clone = offline_clone,
+	.set_xattr = offline_set_xattr,
+	.remove_xattr = offline_remove_xattr,
+	.truncate = offline_truncate,
+	.chmod = offline_chmod,
+	.chown = offline_chown,
+	.utimes = offline_utimes,
+	.update_extent = offline_update_extent,
+};
+
+int receive_offline(const char *dev, struct btrfs_send_stream *stream,
+		    int verbose)
+{
+	struct offline_receive r;
+	struct btrfs_root *root;
+	int end = 0;
+	int ret;
+
+	ret = check_mounted(dev);
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: could not check mount status of %s. "
+			"%s\n", dev, strerror(-ret));
+		return ret;
+	}
+	if (ret) {
+		fprintf(stderr, "ERROR: %s is mounted, receive into the "
+			"mount point instead\n", dev);
+		return -EBUSY;
+	}
+
+	root = open_ctree(dev, 0, 1);
+	if (!root) {
+		fprintf(stderr, "ERROR: unable to open %s\n", dev);
+		return -EIO;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.fs_root = root;
+	r.verbose = verbose;
+	r.data = malloc(OFFLINE_DATA_BUF + root->sectorsize);
+	if (!r.data) {
+		close_ctree(root);
+		return -ENOMEM;
+	}
+
+	while (!end) {
+		ret = btrfs_send_stream_process(stream, &offline_ops, &r);
+		if (ret < 0)
+			break;
+		if (ret)
+			end = 1;
+		ret = finish_subvol(&r);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret < 0 && r.trans) {
+		/* nothing after the last commit made it to the disk */
+		fprintf(stderr, "ERROR: %s is left as of the last commit, "
+			"subvolume %s is incomplete\n", dev, r.name);
+	} else {
+		if (verbose)
+			fprintf(stderr, "received %llu bytes of data in %llu "
+				"extents\n", (unsigned long long)r.total_bytes,
+				(unsigned long long)r.total_extents);
+		close_ctree(root);
+	}
+	free(r.data);
+	free(r.name);
+	forget_paths(&r);
+	return ret < 0 ? ret : 0;
+}
@@ -0,0 +1,661 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * receives a few files offline, rewrites their extents compressed the way
+ * the kernel lays them out, zlib and (built with LZO=1) lzo, restores the
+ * filesystem with btrfs restore and checks every file came back.  The
+ * split files have their first extent referenced by two file extent items,
+ * so restore has to drop the front of the second one, and one lzo file has
+ * a segment length pushed past the end of a page.
+ *
+ *	mkfs.btrfs <256M image> && restore-test <256M image>
+ *
+ * btrfs is run from the directory restore-test is in.
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE 1
+
+#include "kerncompat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef BTRFS_RESTORE_LZO
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+#endif
+
+#include "ctree.h"
+#include "disk-io.h"
+#include "transaction.h"
+#include "volumes.h"
+#include "crc32c.h"
+#include "commands.h"
+#include "send.h"
+#include "send-stream.h"
+
+#define WRITE_SIZE	(32 * 1024)
+
+/* kernel lzo framing, see decompress_lzo in cmds-restore.c */
+#define LZO_LEN			4
+#define LZO_SEGMENT_SIZE	4096
+
+struct test_file {
+	const char *name;
+	u64 size;
+	int compress;
+	int split;
+	/* lzo pads the end of a page at least once */
+	int pad;
+	char *data;
+};
+
+/* the big ones cross restore's 1MB chunks and end in a partial block */
+static struct test_file files[] = {
+	{ "zlib", 2 * 1024 * 1024 + 10000, BTRFS_COMPRESS_ZLIB, 0, 0 },
+	{ "zlib-split", 256 * 1024, BTRFS_COMPRESS_ZLIB, 1, 0 },
+#ifdef BTRFS_RESTORE_LZO
+	{ "lzo", 2 * 1024 * 1024 + 10000, BTRFS_COMPRESS_LZO, 0, 0 },
+	{ "lzo-split", 256 * 1024, BTRFS_COMPRESS_LZO, 1, 0 },
+	{ "lzo-padded", 256 * 1024, BTRFS_COMPRESS_LZO, 0, 1 },
+#endif
+};
+
+static const char *subvol = "received";
+
+#ifdef BTRFS_RESTORE_LZO
+static int lzo_padded;
+#endif
+
+static char cmd_buf[BTRFS_SEND_BUF_SIZE];
+static int cmd_len;
+
+/* words picked at random, compressible but not all matches */
+static void fill_data(struct test_file *f, unsigned int seed)
+{
+	static const char * const words[] = {
+		"extent ", "leaf ", "node ", "chunk ", "stripe ", "inode ",
+		"csum ", "root ", "tree ", "block group ", "subvolume ",
+		"snapshot ", "transaction ", "backref ", "device ", "super ",
+	};
+	u64 pos = 0;
+	int len;
+
+	while (pos < f->size) {
+		seed = seed * 1103515245 + 12345;
+		len = strlen(words[(seed >> 16) % ARRAY_SIZE(words)]);
+		len = min_t(u64, len, f->size - pos);
+		memcpy(f->data + pos, words[(seed >> 16) % ARRAY_SIZE(words)],
+		       len);
+		pos += len;
+	}
+}
+
+static void begin_cmd(int cmd)
+{
+	struct btrfs_cmd_header *hdr = (struct btrfs_cmd_header *)cmd_buf;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->cmd = cpu_to_le16(cmd);
+	cmd_len = sizeof(*hdr);
+}
+
+static void put_attr(int type, const void *data, int len)
+{
+	struct btrfs_tlv_header *tlv;
+
+	tlv = (struct btrfs_tlv_header *)(cmd_buf + cmd_len);
+	tlv->tlv_type = cpu_to_le16(type);
+	tlv->tlv_len = cpu_to_le16(len);
+	memcpy(tlv + 1, data, len);
+	cmd_len += sizeof(*tlv) + len;
+}
+
+static void put_u64(int type, u64 val)
+{
+	__le64 v = cpu_to_le64(val);
+
+	put_attr(type, &v, sizeof(v));
+}
+
+static int end_cmd(int fd)
+{
+	struct btrfs_cmd_header *hdr = (struct btrfs_cmd_header *)cmd_buf;
+	u32 crc;
+
+	hdr->len = cpu_to_le32(cmd_len - sizeof(*hdr));
+	crc = crc32c(0, (unsigned char *)cmd_buf, cmd_len);
+	hdr->crc = cpu_to_le32(crc);
+	if (write(fd, cmd_buf, cmd_len) != cmd_len)
+		return -errno;
+	return 0;
+}
+
+static int write_stream(int fd)
+{
+	struct btrfs_stream_header sh;
+	struct test_file *f;
+	u8 uuid[BTRFS_UUID_SIZE];
+	u64 pos;
+	int ret;
+	int i;
+
+	memset(&sh, 0, sizeof(sh));
+	strcpy(sh.magic, BTRFS_SEND_STREAM_MAGIC);
+	sh.version = cpu_to_le32(BTRFS_SEND_STREAM_VERSION);
+	if (write(fd, &sh, sizeof(sh)) != sizeof(sh))
+		return -errno;
+
+	memset(uuid, 0xa5, sizeof(uuid));
+	begin_cmd(BTRFS_SEND_C_SUBVOL);
+	put_attr(BTRFS_SEND_A_PATH, subvol, strlen(subvol));
+	put_attr(BTRFS_SEND_A_UUID, uuid, sizeof(uuid));
+	put_u64(BTRFS_SEND_A_CTRANSID, 5);
+	ret = end_cmd(fd);
+
+	for (i = 0; !ret && i < ARRAY_SIZE(files); i++) {
+		f = files + i;
+		begin_cmd(BTRFS_SEND_C_MKFILE);
+		put_attr(BTRFS_SEND_A_PATH, f->name, strlen(f->name));
+		ret = end_cmd(fd);
+		for (pos = 0; !ret && pos < f->size; pos += WRITE_SIZE) {
+			begin_cmd(BTRFS_SEND_C_WRITE);
+			put_attr(BTRFS_SEND_A_PATH, f->name, strlen(f->name));
+			put_u64(BTRFS_SEND_A_FILE_OFFSET, pos);
+			put_attr(BTRFS_SEND_A_DATA, f->data + pos,
+				 min_t(u64, WRITE_SIZE, f->size - pos));
+			ret = end_cmd(fd);
+		}
+	}
+
+	if (!ret) {
+		begin_cmd(BTRFS_SEND_C_END);
+		ret = end_cmd(fd);
+	}
+	return ret;
+}
+
+static int lookup_name(struct btrfs_root *root, u64 dir, const char *name,
+		       struct btrfs_key *location)
+{
+	struct btrfs_dir_item *di;
+	struct btrfs_path path;
+
+	btrfs_init_path(&path);
+	di = btrfs_lookup_dir_item(NULL, root, &path, dir, name, strlen(name),
+				   0);
+	if (!di || IS_ERR(di)) {
+		btrfs_release_path(root, &path);
+		return -ENOENT;
+	}
+	btrfs_dir_item_key_to_cpu(path.nodes[0], di, location);
+	btrfs_release_path(root, &path);
+	return 0;
+}
+
+static int compress_zlib(char *in, u64 len, char *out, u64 *out_len)
+{
+	uLongf dest_len = *out_len;
+
+	if (compress2((Bytef *)out, &dest_len, (Bytef *)in, len,
+		      Z_DEFAULT_COMPRESSION) != Z_OK)
+		return -EIO;
+	*out_len = dest_len;
+	return 0;
+}
+
+#ifdef BTRFS_RESTORE_LZO
+static void put_lzo_len(char *buf, u32 len)
+{
+	__le32 v = cpu_to_le32(len);
+
+	memcpy(buf, &v, LZO_LEN);
+}
+
+/*
+ * a le32 total length, then each page compressed on its own behind its
+ * le32 length.  A length never straddles a page, the rest of the page is
+ * padded instead.
+ */
+static int compress_lzo(char *in, u64 len, char *out, u64 *out_len)
+{
+	static char wrkmem[LZO1X_1_MEM_COMPRESS];
+	lzo_uint seg_len;
+	u64 tot_out = LZO_LEN;
+	u64 rem_page;
+	u64 pos;
+	int ret;
+
+	for (pos = 0; pos < len; pos += LZO_SEGMENT_SIZE) {
+		/* room for the worst case of a page that won't compress */
+		if (tot_out + LZO_SEGMENT_SIZE * 2 > *out_len)
+			return -ENOSPC;
+		rem_page = LZO_SEGMENT_SIZE - (tot_out % LZO_SEGMENT_SIZE);
+		if (rem_page < LZO_LEN) {
+			memset(out + tot_out, 0, rem_page);
+			tot_out += rem_page;
+			lzo_padded++;
+		}
+		ret = lzo1x_1_compress((unsigned char *)in + pos,
+				min_t(u64, len - pos, LZO_SEGMENT_SIZE),
+				(unsigned char *)out + tot_out + LZO_LEN,
+				&seg_len, wrkmem);
+		if (ret != LZO_E_OK)
+			return -EIO;
+		put_lzo_len(out + tot_out, seg_len);
+		tot_out += LZO_LEN + seg_len;
+	}
+	put_lzo_len(out, tot_out);
+	*out_len = tot_out;
+	return 0;
+}
+
+/*
+ * whether a segment length lands at the end of a page depends on how the
+ * data compresses, try seeds until it does
+ */
+static int fill_padded_data(struct test_file *f)
+{
+	u64 out_len = f->size * 2 + LZO_SEGMENT_SIZE * 2;
+	unsigned int seed;
+	char *out;
+	int ret = -ENOENT;
+
+	out = malloc(out_len);
+	if (!out)
+		return -ENOMEM;
+	for (seed = 0; seed < 1000; seed++) {
+		fill_data(f, seed);
+		lzo_padded = 0;
+		ret = compress_lzo(f->data, f->size, out, &out_len);
+		if (ret || lzo_padded)
+			break;
+		out_len = f->size * 2 + LZO_SEGMENT_SIZE * 2;
+	}
+	if (!ret && !lzo_padded)
+		ret = -ENOENT;
+	free(out);
+	return ret;
+}
+#endif
+
+static int write_data(struct btrfs_fs_info *info, u64 bytenr, char *buf,
+		      u64 len)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 this_len;
+	int ret;
+	int i;
+
+	while (len > 0) {
+		this_len = len;
+		ret = btrfs_map_block(&info->mapping_tree, WRITE, bytenr,
+				      &this_len, &multi, 0, &raid_map);
+		if (ret)
+			return ret;
+		kfree(raid_map);
+		this_len = min(this_len, len);
+		for (i = 0; i < multi->num_stripes; i++) {
+			if (pwrite64(multi->stripes[i].dev->fd, buf, this_len,
+				     multi->stripes[i].physical) !=
+			    (ssize_t)this_len) {
+				kfree(multi);
+				return -EIO;
+			}
+		}
+		kfree(multi);
+		multi = NULL;
+		bytenr += this_len;
+		buf += this_len;
+		len -= this_len;
+	}
+	return 0;
+}
+
+/*
+ * overwrite the uncompressed extent at pos with its data compressed, in
+ * the same disk extent so the extent tree stays as it is.  restore doesn't
+ * look at csums, the old ones are left alone.
+ */
+static int compress_extent(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, struct test_file *f,
+			   u64 ino, u64 pos, u64 *num_bytes)
+{
+	struct btrfs_file_extent_item *fi;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	char *in = NULL;
+	char *out = NULL;
+	u64 disk_bytenr;
+	u64 disk_num_bytes;
+	u64 out_len;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = pos;
+	ret = btrfs_search_slot(trans, root, &key, &path, 0, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret)
+		goto out;
+	leaf = path.nodes[0];
+	fi = btrfs_item_ptr(leaf, path.slots[0],
+			    struct btrfs_file_extent_item);
+	if (btrfs_file_extent_type(leaf, fi) != BTRFS_FILE_EXTENT_REG ||
+	    btrfs_file_extent_offset(leaf, fi) != 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+	disk_bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+	disk_num_bytes = btrfs_file_extent_disk_num_bytes(leaf, fi);
+	*num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
+
+	/* the tail of the last block is zeroes, like the page cache has */
+	in = calloc(1, *num_bytes);
+	out_len = *num_bytes * 2 + LZO_SEGMENT_SIZE * 2;
+	out = calloc(1, out_len);
+	if (!in || !out) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(in, f->data + pos, min(*num_bytes, f->size - pos));
+
+	if (f->compress == BTRFS_COMPRESS_ZLIB)
+		ret = compress_zlib(in, *num_bytes, out, &out_len);
+#ifdef BTRFS_RESTORE_LZO
+	else
+		ret = compress_lzo(in, *num_bytes, out, &out_len);
+#endif
+	if (ret)
+		goto out;
+	if (out_len > disk_num_bytes) {
+		fprintf(stderr, "%s doesn't compress\n", f->name);
+		ret = -ENOSPC;
+		goto out;
+	}
+	ret = write_data(root->fs_info, disk_bytenr, out, out_len);
+	if (ret)
+		goto out;
+
+	btrfs_set_file_extent_compression(leaf, fi, f->compress);
+	btrfs_set_file_extent_ram_bytes(leaf, fi, *num_bytes);
+	btrfs_mark_buffer_dirty(leaf);
+out:
+	free(in);
+	free(out);
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+/*
+ * make the first half of the first extent one file extent item and the
+ * second half another, both pointing at the whole compressed extent
+ */
+static int split_extent(struct btrfs_trans_handle *trans,
+			struct btrfs_root *root, u64 ino)
+{
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_file_extent_item item;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 disk_bytenr;
+	u64 disk_num_bytes;
+	u64 num_bytes;
+	u64 half;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(trans, root, &key, &path, 0, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret)
+		goto out;
+	leaf = path.nodes[0];
+	fi = btrfs_item_ptr(leaf, path.slots[0],
+			    struct btrfs_file_extent_item);
+	disk_bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+	disk_num_bytes = btrfs_file_extent_disk_num_bytes(leaf, fi);
+	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
+	half = round_down(num_bytes / 2, root->sectorsize);
+	if (!half) {
+		ret = -EINVAL;
+		goto out;
+	}
+	btrfs_set_file_extent_num_bytes(leaf, fi, half);
+	btrfs_mark_buffer_dirty(leaf);
+	read_extent_buffer(leaf, &item, (unsigned long)fi, sizeof(item));
+	btrfs_release_path(root, &path);
+
+	btrfs_set_stack_file_extent_offset(&item, half);
+	btrfs_set_stack_file_extent_num_bytes(&item, num_bytes - half);
+	key.offset = half;
+	ret = btrfs_insert_item(trans, root, &key, &item, sizeof(item));
+	if (ret)
+		goto out;
+
+	ret = btrfs_inc_extent_ref(trans, root, disk_bytenr, disk_num_bytes, 0,
+				   root->root_key.objectid, ino, 0);
+out:
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
+static int compress_file(struct btrfs_trans_handle *trans,
+			 struct btrfs_root *root, struct test_file *f)
+{
+	struct btrfs_key key;
+	u64 num_bytes;
+	u64 pos;
+	int ret;
+
+	ret = lookup_name(root, BTRFS_FIRST_FREE_OBJECTID, f->name, &key);
+	if (ret)
+		return ret;
+	for (pos = 0; pos < f->size; pos += num_bytes) {
+		ret = compress_extent(trans, root, f, key.objectid, pos,
+				      &num_bytes);
+		if (ret)
+			return ret;
+	}
+	if (f->split)
+		ret = split_extent(trans, root, key.objectid);
+	return ret;
+}
+
+static int compress_files(const char *image)
+{
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root;
+	struct btrfs_root *subvol_root;
+	struct btrfs_key key;
+	int ret;
+	int i;
+
+	root = open_ctree(image, 0, 1);
+	if (!root) {
+		fprintf(stderr, "Open ctree failed\n");
+		return -EIO;
+	}
+	ret = lookup_name(root, BTRFS_FIRST_FREE_OBJECTID, subvol, &key);
+	if (ret) {
+		fprintf(stderr, "subvolume %s not found\n", subvol);
+		goto out;
+	}
+	key.offset = (u64)-1;
+	subvol_root = btrfs_read_fs_root(root->fs_info, &key);
+	if (IS_ERR(subvol_root)) {
+		ret = PTR_ERR(subvol_root);
+		fprintf(stderr, "can't read subvolume %s\n", subvol);
+		goto out;
+	}
+
+	trans = btrfs_start_transaction(subvol_root, 1);
+	for (i = 0; i < ARRAY_SIZE(files); i++) {
+		ret = compress_file(trans, subvol_root, files + i);
+		if (ret) {
+			fprintf(stderr, "compressing %s failed: %s\n",
+				files[i].name, strerror(-ret));
+			goto out;
+		}
+	}
+	ret = btrfs_commit_transaction(trans, subvol_root);
+out:
+	close_ctree(root);
+	return ret;
+}
+
+static int check_file(const char *dir, struct test_file *f)
+{
+	char path[4096];
+	char *buf;
+	ssize_t done;
+	struct stat st;
+	int fd;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", dir, subvol, f->name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) || st.st_size != f->size) {
+		close(fd);
+		return -EINVAL;
+	}
+	buf = malloc(f->size);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+	done = pread(fd, buf, f->size, 0);
+	if (done != (ssize_t)f->size || memcmp(buf, f->data, f->size))
+		ret = -EIO;
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+int main(int ac, char **av)
+{
+	struct btrfs_send_stream *stream;
+	char out_dir[] = "/tmp/restore-test.XXXXXX";
+	char cmd[4096];
+	char *dir;
+	FILE *tmp;
+	int ret;
+	int i;
+
+	if (ac != 2) {
+		fprintf(stderr, "usage: restore-test <image>\n");
+		return 1;
+	}
+
+	radix_tree_init();
+#ifdef BTRFS_RESTORE_LZO
+	if (lzo_init() != LZO_E_OK) {
+		fprintf(stderr, "lzo init failed\n");
+		return 1;
+	}
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(files); i++) {
+		files[i].data = malloc(files[i].size);
+		if (!files[i].data) {
+			fprintf(stderr, "No memory\n");
+			return 1;
+		}
+		fill_data(files + i, i);
+#ifdef BTRFS_RESTORE_LZO
+		if (files[i].pad && fill_padded_data(files + i)) {
+			fprintf(stderr, "no data pads an lzo page\n");
+			return 1;
+		}
+#endif
+	}
+
+	tmp = tmpfile();
+	if (!tmp) {
+		fprintf(stderr, "can't create the stream file\n");
+		return 1;
+	}
+	ret = write_stream(fileno(tmp));
+	if (ret) {
+		fprintf(stderr, "writing the stream failed: %s\n",
+			strerror(-ret));
+		return 1;
+	}
+	lseek(fileno(tmp), 0, SEEK_SET);
+
+	stream = btrfs_send_stream_open(fileno(tmp));
+	if (!stream)
+		return 1;
+	ret = receive_offline(av[1], stream, 0);
+	btrfs_send_stream_close(stream);
+	fclose(tmp);
+	if (ret) {
+		fprintf(stderr, "receive failed: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	ret = compress_files(av[1]);
+	if (ret)
+		return 1;
+
+	if (!mkdtemp(out_dir)) {
+		fprintf(stderr, "can't create %s\n", out_dir);
+		return 1;
+	}
+	dir = strdup(av[0]);
+	if (!dir)
+		return 1;
+	snprintf(cmd, sizeof(cmd), "%s/btrfs restore %s %s", dirname(dir),
+		 av[1], out_dir);
+	free(dir);
+	ret = system(cmd);
+	if (ret) {
+		fprintf(stderr, "%s failed\n", cmd);
+		ret = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(files); i++) {
+		ret = check_file(out_dir, files + i);
+		if (ret) {
+			fprintf(stderr, "%s is wrong after the restore: %s\n",
+				files[i].name, strerror(-ret));
+			goto out;
+		}
+		printf("%s restored\n", files[i].name);
+	}
+out:
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", out_dir);
+	if (system(cmd))
+		fprintf(stderr, "can't remove %s\n", out_dir);
+	return ret ? 1 : 0;
+}
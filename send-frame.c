@@ -0,0 +1,772 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef BTRFS_SEND_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BTRFS_SEND_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "kerncompat.h"
+#include "crc32c.h"
+#include "send-frame.h"
+
+/* frames being filled, compressed or waiting to be written, per thread */
+#define FRAME_SLOTS_PER_THREAD	2
+
+enum {
+	SLOT_FREE,
+	SLOT_FULL,
+	SLOT_BUSY,
+	SLOT_DONE,
+};
+
+struct frame_slot {
+	char *raw;
+	char *out;
+	size_t out_size;
+	size_t len;
+	struct send_frame_header hdr;
+	/* what gets written after hdr, raw or out */
+	char *payload;
+	int state;
+	int ret;
+};
+
+/*
+ * The writer fills slots in order, worker threads compress and checksum
+ * any full slot and the writer puts them out in order again.
+ */
+struct send_frame_writer {
+	int fd;
+	int method;
+	int level;
+	u64 offset;
+	u64 disk_bytes;
+
+	struct frame_slot *slots;
+	int nr_slots;
+	/* slot being filled */
+	int head;
+	/* oldest slot not written yet */
+	int tail;
+
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+};
+
+struct send_frame_reader {
+	int fd;
+	/* not framed, hand out the peeked header and then read fd */
+	int passthrough;
+	char peek[sizeof(struct send_frames_header)];
+	size_t peek_pos;
+	size_t peek_len;
+
+	char *in;
+	char *out;
+	size_t out_pos;
+	size_t out_len;
+	/* stream offset the next frame has to start at */
+	u64 offset;
+	int eof;
+};
+
+int send_frame_parse_compression(const char *arg, int *method, int *level)
+{
+	const char *sep = strchr(arg, ':');
+	size_t len = sep ? sep - arg : strlen(arg);
+	int max_level = 0;
+
+	*level = 0;
+	if (len == 4 && !strncmp(arg, "none", len)) {
+		*method = SEND_FRAME_COMPRESS_NONE;
+	} else if (len == 4 && !strncmp(arg, "zlib", len)) {
+		*method = SEND_FRAME_COMPRESS_ZLIB;
+		*level = 6;
+		max_level = 9;
+#ifdef BTRFS_SEND_ZSTD
+	} else if (len == 4 && !strncmp(arg, "zstd", len)) {
+		*method = SEND_FRAME_COMPRESS_ZSTD;
+		*level = 3;
+		max_level = ZSTD_maxCLevel();
+#endif
+#ifdef BTRFS_SEND_LZ4
+	} else if (len == 3 && !strncmp(arg, "lz4", len)) {
+		*method = SEND_FRAME_COMPRESS_LZ4;
+		*level = 1;
+		max_level = LZ4HC_CLEVEL_MAX;
+#endif
+	} else {
+		fprintf(stderr, "ERROR: unknown compression '%.*s'\n",
+			(int)len, arg);
+		return -EINVAL;
+	}
+
+	if (sep) {
+		*level = atoi(sep + 1);
+		if (*level < 1 || *level > max_level) {
+			fprintf(stderr, "ERROR: compression level must be "
+				"1 ~ %d for %.*s\n", max_level, (int)len, arg);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* returns the number of bytes read, short only at EOF */
+static ssize_t read_all(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < len) {
+		ret = read(fd, (char *)buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static size_t compress_bound(int method, size_t len)
+{
+	switch (method) {
+	case SEND_FRAME_COMPRESS_ZLIB:
+		return compressBound(len);
+#ifdef BTRFS_SEND_ZSTD
+	case SEND_FRAME_COMPRESS_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+#ifdef BTRFS_SEND_LZ4
+	case SEND_FRAME_COMPRESS_LZ4:
+		return LZ4_compressBound(len);
+#endif
+	}
+	return 0;
+}
+
+/*
+ * compress the slot and build its header.  Data that doesn't get smaller
+ * is stored as it is, so a payload is never larger than the frame.
+ */
+static void compress_slot(struct send_frame_writer *w,
+			  struct frame_slot *slot)
+{
+	unsigned long zlen;
+	size_t out_len = 0;
+	int compression = w->method;
+	u32 crc;
+#ifdef BTRFS_SEND_ZSTD
+	size_t zret;
+#endif
+#ifdef BTRFS_SEND_LZ4
+	int len;
+#endif
+
+	switch (w->method) {
+	case SEND_FRAME_COMPRESS_ZLIB:
+		zlen = slot->out_size;
+		if (compress2((Bytef *)slot->out, &zlen, (Bytef *)slot->raw,
+			      slot->len, w->level) == Z_OK)
+			out_len = zlen;
+		break;
+#ifdef BTRFS_SEND_ZSTD
+	case SEND_FRAME_COMPRESS_ZSTD:
+		zret = ZSTD_compress(slot->out, slot->out_size, slot->raw,
+				     slot->len, w->level);
+		if (!ZSTD_isError(zret))
+			out_len = zret;
+		break;
+#endif
+#ifdef BTRFS_SEND_LZ4
+	case SEND_FRAME_COMPRESS_LZ4:
+		if (w->level > 1)
+			len = LZ4_compress_HC(slot->raw, slot->out, slot->len,
+					      slot->out_size, w->level);
+		else
+			len = LZ4_compress_default(slot->raw, slot->out,
+						   slot->len, slot->out_size);
+		if (len > 0)
+			out_len = len;
+		break;
+#endif
+	}
+
+	if (out_len && out_len < slot->len) {
+		slot->payload = slot->out;
+	} else {
+		compression = SEND_FRAME_COMPRESS_NONE;
+		slot->payload = slot->raw;
+		out_len = slot->len;
+	}
+
+	slot->hdr.len = cpu_to_le32(slot->len);
+	slot->hdr.disk_len = cpu_to_le32(out_len);
+	slot->hdr.compression = compression;
+	slot->hdr.crc = 0;
+	crc = crc32c(0, &slot->hdr, sizeof(slot->hdr));
+	crc = crc32c(crc, slot->payload, out_len);
+	slot->hdr.crc = cpu_to_le32(crc);
+	slot->ret = 0;
+}
+
+static void *frame_worker(void *arg)
+{
+	struct send_frame_writer *w = arg;
+	struct frame_slot *slot;
+	int i;
+
+	pthread_mutex_lock(&w->mutex);
+	while (1) {
+		slot = NULL;
+		for (i = 0; i < w->nr_slots; i++) {
+			if (w->slots[(w->tail + i) % w->nr_slots].state ==
+			    SLOT_FULL) {
+				slot = &w->slots[(w->tail + i) % w->nr_slots];
+				break;
+			}
+		}
+		if (!slot) {
+			if (w->stop)
+				break;
+			pthread_cond_wait(&w->cond, &w->mutex);
+			continue;
+		}
+
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&w->mutex);
+		compress_slot(w, slot);
+		pthread_mutex_lock(&w->mutex);
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+static int write_frame(struct send_frame_writer *w, struct frame_slot *slot)
+{
+	int ret;
+
+	if (slot->ret)
+		return slot->ret;
+	ret = write_all(w->fd, &slot->hdr, sizeof(slot->hdr));
+	if (!ret)
+		ret = write_all(w->fd, slot->payload,
+				le32_to_cpu(slot->hdr.disk_len));
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: failed to write frame. %s\n",
+			strerror(-ret));
+		return ret;
+	}
+	w->disk_bytes += sizeof(slot->hdr) + le32_to_cpu(slot->hdr.disk_len);
+	return 0;
+}
+
+/*
+ * write out finished frames in order.  Waits for as many as it takes to
+ * free the slot at head, or for all of them when all is set.
+ */
+static int write_done_frames(struct send_frame_writer *w, int all)
+{
+	struct frame_slot *slot;
+	int ret = 0;
+
+	pthread_mutex_lock(&w->mutex);
+	while (1) {
+		slot = &w->slots[w->tail];
+		if (slot->state == SLOT_FREE)
+			break;
+		if (slot->state != SLOT_DONE) {
+			if (!all && w->slots[w->head].state == SLOT_FREE)
+				break;
+			pthread_cond_wait(&w->cond, &w->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&w->mutex);
+		ret = write_frame(w, slot);
+		pthread_mutex_lock(&w->mutex);
+		slot->state = SLOT_FREE;
+		slot->len = 0;
+		w->tail = (w->tail + 1) % w->nr_slots;
+		if (ret)
+			break;
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return ret;
+}
+
+static int submit_slot(struct send_frame_writer *w)
+{
+	struct frame_slot *slot = &w->slots[w->head];
+
+	slot->hdr.offset = cpu_to_le64(w->offset);
+	w->offset += slot->len;
+
+	if (!w->nr_threads) {
+		compress_slot(w, slot);
+		slot->state = SLOT_DONE;
+	} else {
+		pthread_mutex_lock(&w->mutex);
+		slot->state = SLOT_FULL;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+	}
+	w->head = (w->head + 1) % w->nr_slots;
+	return write_done_frames(w, 0);
+}
+
+static void free_frame_writer(struct send_frame_writer *w)
+{
+	int i;
+
+	for (i = 0; i < w->nr_slots; i++) {
+		free(w->slots[i].raw);
+		free(w->slots[i].out);
+	}
+	free(w->slots);
+	free(w->threads);
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->cond);
+	free(w);
+}
+
+/* threads compress frames, with no threads they are compressed inline */
+struct send_frame_writer *send_frame_writer_open(int fd, int method,
+						 int level, int threads)
+{
+	struct send_frame_writer *w;
+	struct send_frames_header hdr;
+	struct frame_slot *slot;
+	int ret;
+	int i;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->fd = fd;
+	w->method = method;
+	w->level = level;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	w->nr_slots = threads ? threads * FRAME_SLOTS_PER_THREAD : 1;
+	w->slots = calloc(w->nr_slots, sizeof(*w->slots));
+	w->threads = calloc(threads ? threads : 1, sizeof(*w->threads));
+	if (!w->slots || !w->threads)
+		goto fail;
+	for (i = 0; i < w->nr_slots; i++) {
+		slot = &w->slots[i];
+		slot->raw = malloc(BTRFS_SEND_FRAME_SIZE);
+		slot->out_size = compress_bound(method, BTRFS_SEND_FRAME_SIZE);
+		if (slot->out_size)
+			slot->out = malloc(slot->out_size);
+		if (!slot->raw || (slot->out_size && !slot->out))
+			goto fail;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, BTRFS_SEND_FRAMES_MAGIC);
+	hdr.version = cpu_to_le32(BTRFS_SEND_FRAMES_VERSION);
+	ret = write_all(fd, &hdr, sizeof(hdr));
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: failed to write frame header. %s\n",
+			strerror(-ret));
+		goto fail;
+	}
+	w->disk_bytes = sizeof(hdr);
+
+	for (i = 0; i < threads; i++) {
+		ret = pthread_create(&w->threads[i], NULL, frame_worker, w);
+		if (ret) {
+			fprintf(stderr, "ERROR: thread setup failed: %s\n",
+				strerror(ret));
+			break;
+		}
+		w->nr_threads++;
+	}
+	/* slots are only used as a ring when someone else compresses */
+	if (!w->nr_threads)
+		w->nr_slots = 1;
+	return w;
+
+fail:
+	free_frame_writer(w);
+	return NULL;
+}
+
+int send_frame_write(struct send_frame_writer *w, const void *buf,
+		     size_t len)
+{
+	struct frame_slot *slot;
+	size_t n;
+	int ret;
+
+	while (len) {
+		slot = &w->slots[w->head];
+		n = min_t(size_t, len, BTRFS_SEND_FRAME_SIZE - slot->len);
+		memcpy(slot->raw + slot->len, buf, n);
+		slot->len += n;
+		buf = (char *)buf + n;
+		len -= n;
+
+		if (slot->len == BTRFS_SEND_FRAME_SIZE) {
+			ret = submit_slot(w);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* bytes written to the output so far, headers included */
+u64 send_frame_writer_bytes(struct send_frame_writer *w)
+{
+	return w->disk_bytes;
+}
+
+/* stop the workers, with discard they skip the frames still queued */
+static void stop_frame_writer(struct send_frame_writer *w, int discard)
+{
+	int i;
+
+	pthread_mutex_lock(&w->mutex);
+	for (i = 0; discard && i < w->nr_slots; i++) {
+		if (w->slots[i].state == SLOT_FULL)
+			w->slots[i].state = SLOT_FREE;
+	}
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	for (i = 0; i < w->nr_threads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	free_frame_writer(w);
+}
+
+/* flush what's left and end the container */
+int send_frame_writer_close(struct send_frame_writer *w)
+{
+	struct send_frame_header hdr;
+	int ret = 0;
+
+	if (w->slots[w->head].len)
+		ret = submit_slot(w);
+	if (!ret)
+		ret = write_done_frames(w, 1);
+	if (!ret) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.offset = cpu_to_le64(w->offset);
+		hdr.crc = cpu_to_le32(crc32c(0, &hdr, sizeof(hdr)));
+		ret = write_all(w->fd, &hdr, sizeof(hdr));
+		if (ret < 0)
+			fprintf(stderr, "ERROR: failed to write frame. %s\n",
+				strerror(-ret));
+		else
+			w->disk_bytes += sizeof(hdr);
+	}
+
+	stop_frame_writer(w, 0);
+	return ret;
+}
+
+/*
+ * throw away a writer after a failed send.  Nothing more is written, so
+ * the output has no end frame and a receiver won't take it as complete.
+ */
+void send_frame_writer_abort(struct send_frame_writer *w)
+{
+	stop_frame_writer(w, 1);
+}
+
+static int is_frames_header(struct send_frames_header *hdr)
+{
+	return !memcmp(hdr->magic, BTRFS_SEND_FRAMES_MAGIC,
+		       sizeof(hdr->magic));
+}
+
+static int check_frames_header(struct send_frames_header *hdr)
+{
+	if (le32_to_cpu(hdr->version) > BTRFS_SEND_FRAMES_VERSION) {
+		fprintf(stderr, "ERROR: framed stream version %u not "
+			"supported. Please upgrade btrfs-progs\n",
+			le32_to_cpu(hdr->version));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * look at the start of the stream.  When it's framed, *reader decodes
+ * it.  A plain stream in a file is left alone and *reader is NULL, the
+ * caller reads fd itself.  From a pipe the header can't be given back,
+ * so *reader hands it out before the rest of fd.
+ */
+int send_frame_reader_open(int fd, struct send_frame_reader **reader)
+{
+	struct send_frame_reader *r;
+	struct send_frames_header *hdr;
+	off_t off;
+	ssize_t ret;
+
+	*reader = NULL;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	r->fd = fd;
+	hdr = (struct send_frames_header *)r->peek;
+
+	off = lseek(fd, 0, SEEK_CUR);
+	if (off >= 0) {
+		ret = pread(fd, hdr, sizeof(*hdr), off);
+		if (ret < (ssize_t)sizeof(*hdr) || !is_frames_header(hdr)) {
+			free(r);
+			return 0;
+		}
+		lseek(fd, off + sizeof(*hdr), SEEK_SET);
+	} else {
+		ret = read_all(fd, hdr, sizeof(*hdr));
+		if (ret < 0) {
+			fprintf(stderr, "ERROR: read from stream failed. "
+				"%s\n", strerror(-ret));
+			free(r);
+			return ret;
+		}
+		if (ret < sizeof(*hdr) || !is_frames_header(hdr)) {
+			r->passthrough = 1;
+			r->peek_len = ret;
+			*reader = r;
+			return 0;
+		}
+	}
+
+	ret = check_frames_header(hdr);
+	if (ret < 0) {
+		free(r);
+		return ret;
+	}
+	r->in = malloc(BTRFS_SEND_FRAME_SIZE);
+	r->out = malloc(BTRFS_SEND_FRAME_SIZE);
+	if (!r->in || !r->out) {
+		send_frame_reader_close(r);
+		return -ENOMEM;
+	}
+	*reader = r;
+	return 0;
+}
+
+void send_frame_reader_close(struct send_frame_reader *r)
+{
+	if (!r)
+		return;
+	free(r->in);
+	free(r->out);
+	free(r);
+}
+
+static int decompress_frame(struct send_frame_reader *r, int compression,
+			    u32 len, u32 disk_len)
+{
+	unsigned long zlen;
+#ifdef BTRFS_SEND_ZSTD
+	size_t zret;
+#endif
+#ifdef BTRFS_SEND_LZ4
+	int ret;
+#endif
+
+	switch (compression) {
+	case SEND_FRAME_COMPRESS_NONE:
+		if (disk_len != len)
+			return -EINVAL;
+		memcpy(r->out, r->in, len);
+		return 0;
+	case SEND_FRAME_COMPRESS_ZLIB:
+		zlen = len;
+		if (uncompress((Bytef *)r->out, &zlen, (Bytef *)r->in,
+			       disk_len) != Z_OK || zlen != len)
+			return -EINVAL;
+		return 0;
+#ifdef BTRFS_SEND_ZSTD
+	case SEND_FRAME_COMPRESS_ZSTD:
+		zret = ZSTD_decompress(r->out, len, r->in, disk_len);
+		if (ZSTD_isError(zret) || zret != len)
+			return -EINVAL;
+		return 0;
+#endif
+#ifdef BTRFS_SEND_LZ4
+	case SEND_FRAME_COMPRESS_LZ4:
+		ret = LZ4_decompress_safe(r->in, r->out, disk_len, len);
+		if (ret < 0 || ret != len)
+			return -EINVAL;
+		return 0;
+#endif
+	}
+	fprintf(stderr, "ERROR: frame compression %d not supported, "
+		"rebuild with ZSTD=1 or LZ4=1\n", compression);
+	return -EOPNOTSUPP;
+}
+
+/*
+ * decode the next frame into r->out.  Errors name the stream offset the
+ * frame starts at, everything before it arrived intact.
+ */
+static int read_frame(struct send_frame_reader *r)
+{
+	struct send_frame_header hdr;
+	struct send_frames_header fhdr;
+	u32 crc;
+	u32 len;
+	u32 disk_len;
+	ssize_t ret;
+
+again:
+	ret = read_all(r->fd, &hdr, sizeof(hdr));
+	if (ret < 0)
+		goto fail_read;
+	if (ret < sizeof(hdr))
+		goto truncated;
+
+	len = le32_to_cpu(hdr.len);
+	disk_len = le32_to_cpu(hdr.disk_len);
+	if (len > BTRFS_SEND_FRAME_SIZE || disk_len > BTRFS_SEND_FRAME_SIZE ||
+	    le64_to_cpu(hdr.offset) != r->offset) {
+		fprintf(stderr, "ERROR: bad frame at stream offset %llu\n",
+			(unsigned long long)r->offset);
+		return -EINVAL;
+	}
+
+	ret = read_all(r->fd, r->in, disk_len);
+	if (ret < 0)
+		goto fail_read;
+	if (ret < disk_len)
+		goto truncated;
+
+	crc = le32_to_cpu(hdr.crc);
+	hdr.crc = 0;
+	if (crc != crc32c(crc32c(0, &hdr, sizeof(hdr)), r->in, disk_len)) {
+		fprintf(stderr, "ERROR: crc32 mismatch in frame at stream "
+			"offset %llu\n", (unsigned long long)r->offset);
+		return -EINVAL;
+	}
+
+	if (!len) {
+		/* end of this container, another one may follow */
+		ret = read_all(r->fd, &fhdr, sizeof(fhdr));
+		if (ret < 0)
+			goto fail_read;
+		if (!ret) {
+			r->eof = 1;
+			return 0;
+		}
+		if (ret < sizeof(fhdr) || !is_frames_header(&fhdr)) {
+			fprintf(stderr, "ERROR: garbage after framed stream\n");
+			return -EINVAL;
+		}
+		ret = check_frames_header(&fhdr);
+		if (ret < 0)
+			return ret;
+		r->offset = 0;
+		goto again;
+	}
+
+	ret = decompress_frame(r, hdr.compression, len, disk_len);
+	if (ret < 0) {
+		if (ret == -EINVAL)
+			fprintf(stderr, "ERROR: failed to decompress frame at "
+				"stream offset %llu\n",
+				(unsigned long long)r->offset);
+		return ret;
+	}
+	r->out_pos = 0;
+	r->out_len = len;
+	r->offset += len;
+	return 0;
+
+fail_read:
+	fprintf(stderr, "ERROR: read from stream failed. %s\n",
+		strerror(-ret));
+	return ret;
+truncated:
+	fprintf(stderr, "ERROR: framed stream ends within the frame at "
+		"stream offset %llu\n", (unsigned long long)r->offset);
+	return -EINVAL;
+}
+
+/* a btrfs_send_read_fn for btrfs_send_stream_open_reader */
+ssize_t send_frame_read(void *reader, void *buf, size_t len)
+{
+	struct send_frame_reader *r = reader;
+	size_t n;
+	int ret;
+
+	if (r->passthrough) {
+		if (r->peek_pos == r->peek_len)
+			return read(r->fd, buf, len);
+		n = min_t(size_t, len, r->peek_len - r->peek_pos);
+		memcpy(buf, r->peek + r->peek_pos, n);
+		r->peek_pos += n;
+		return n;
+	}
+
+	while (r->out_pos == r->out_len) {
+		if (r->eof)
+			return 0;
+		ret = read_frame(r);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+	}
+	n = min_t(size_t, len, r->out_len - r->out_pos);
+	memcpy(buf, r->out + r->out_pos, n);
+	r->out_pos += n;
+	return n;
+}
@@ -0,0 +1,83 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+#ifndef SEND_FRAME_H_
+#define SEND_FRAME_H_
+
+#include "kerncompat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An optional container around send streams for moving them between
+ * machines: the stream is cut into frames that are compressed on their
+ * own and checksummed, so they can be compressed in parallel and damage
+ * is found at the frame it happened in.
+ */
+#define BTRFS_SEND_FRAMES_MAGIC "btrfs-frames"
+#define BTRFS_SEND_FRAMES_VERSION 1
+
+/* stream bytes carried by one frame */
+#define BTRFS_SEND_FRAME_SIZE (1024 * 1024)
+
+enum {
+	SEND_FRAME_COMPRESS_NONE,
+	SEND_FRAME_COMPRESS_ZLIB,
+	SEND_FRAME_COMPRESS_ZSTD,
+	SEND_FRAME_COMPRESS_LZ4,
+};
+
+struct send_frames_header {
+	char magic[sizeof(BTRFS_SEND_FRAMES_MAGIC)];
+	__le32 version;
+} __attribute__ ((__packed__));
+
+/*
+ * len bytes of the stream, starting at offset, stored in the disk_len
+ * bytes that follow.  A frame with no data ends the container.
+ */
+struct send_frame_header {
+	__le64 offset;
+	__le32 len;
+	__le32 disk_len;
+	/* crc32c of the header with a zero crc field and the payload */
+	__le32 crc;
+	u8 compression;
+} __attribute__ ((__packed__));
+
+struct send_frame_writer;
+struct send_frame_reader;
+
+int send_frame_parse_compression(const char *arg, int *method, int *level);
+
+struct send_frame_writer *send_frame_writer_open(int fd, int method,
+						 int level, int threads);
+int send_frame_write(struct send_frame_writer *w, const void *buf,
+		     size_t len);
+u64 send_frame_writer_bytes(struct send_frame_writer *w);
+int send_frame_writer_close(struct send_frame_writer *w);
+void send_frame_writer_abort(struct send_frame_writer *w);
+
+int send_frame_reader_open(int fd, struct send_frame_reader **reader);
+ssize_t send_frame_read(void *reader, void *buf, size_t len);
+void send_frame_reader_close(struct send_frame_reader *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SEND_FRAME_H_ */
@@ -18,16 +18,36 @@
 
 #include <uuid/uuid.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "send.h"
 #include "send-stream.h"
 #include "crc32c.h"
 
+/*
+ * the stream is read in large chunks and commands are parsed in place, so
+ * there are no per command syscalls.  A command never exceeds
+ * BTRFS_SEND_BUF_SIZE, the extra room lets one always fit after the
+ * buffer is compacted.
+ */
+#define BTRFS_STREAM_READ_SIZE	(1024 * 1024)
+
 struct btrfs_send_stream {
 	int fd;
-	char read_buf[BTRFS_SEND_BUF_SIZE];
+	/* when set, the stream is read through this instead of from fd */
+	btrfs_send_read_fn read;
+	void *src;
+	char *buf;
+	size_t buf_size;
+	/* unparsed data is buf[buf_pos, buf_end) */
+	size_t buf_pos;
+	size_t buf_end;
+	/* buf is a read-only mapping of the whole stream file */
+	int mapped;
 
 	int cmd;
+	u32 cmd_len;
 	struct btrfs_cmd_header *cmd_hdr;
 	struct btrfs_tlv_header *cmd_attrs[BTRFS_SEND_A_MAX + 1];
 	u32 version;
@@ -36,52 +56,80 @@ struct btrfs_send_stream {
 	void *user;
 };
 
-static int read_buf(struct btrfs_send_stream *s, void *buf, int len)
+/*
+ * make sure len bytes of the stream are buffered at s->buf_pos.  Returns 1
+ * on EOF, with whatever was left still buffered.
+ */
+static int fill_buf(struct btrfs_send_stream *s, size_t len)
 {
-	int ret;
-	int pos = 0;
+	ssize_t ret;
 
-	while (pos < len) {
-		ret = read(s->fd, (char*)buf + pos, len - pos);
+	if (s->buf_end - s->buf_pos >= len)
+		return 0;
+	if (s->mapped)
+		return 1;
+
+	if (s->buf_pos + len > s->buf_size) {
+		memmove(s->buf, s->buf + s->buf_pos, s->buf_end - s->buf_pos);
+		s->buf_end -= s->buf_pos;
+		s->buf_pos = 0;
+	}
+
+	while (s->buf_end - s->buf_pos < len) {
+		if (s->read)
+			ret = s->read(s->src, s->buf + s->buf_end,
+				      s->buf_size - s->buf_end);
+		else
+			ret = read(s->fd, s->buf + s->buf_end,
+				   s->buf_size - s->buf_end);
 		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 			ret = -errno;
 			fprintf(stderr, "ERROR: read from stream failed. %s\n",
 					strerror(-ret));
-			goto out;
-		}
-		if (ret == 0) {
-			ret = 1;
-			goto out;
+			return ret;
 		}
-		pos += ret;
+		if (ret == 0)
+			return 1;
+		s->buf_end += ret;
 	}
+	return 0;
+}
 
-	ret = 0;
+static int read_buf(struct btrfs_send_stream *s, void *buf, int len)
+{
+	int ret;
 
-out:
-	return ret;
+	ret = fill_buf(s, len);
+	if (ret)
+		return ret;
+	memcpy(buf, s->buf + s->buf_pos, len);
+	s->buf_pos += len;
+	return 0;
 }
 
 /*
- * Reads a single command from kernel space and decodes the TLV's into
- * s->cmd_attrs
+ * Decodes a single command from the stream buffer into s->cmd_attrs.  The
+ * attributes point into the buffer and stay valid until the next read_cmd.
  */
 static int read_cmd(struct btrfs_send_stream *s)
 {
 	int ret;
 	int cmd;
-	int cmd_len;
+	u32 cmd_len;
 	int tlv_type;
 	int tlv_len;
 	char *data;
-	int pos;
+	u32 pos;
 	struct btrfs_tlv_header *tlv_hdr;
+	struct btrfs_cmd_header hdr;
 	u32 crc;
 	u32 crc2;
 
 	memset(s->cmd_attrs, 0, sizeof(s->cmd_attrs));
 
-	ret = read_buf(s, s->read_buf, sizeof(*s->cmd_hdr));
+	ret = fill_buf(s, sizeof(*s->cmd_hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -90,12 +138,18 @@ static int read_cmd(struct btrfs_send_stream *s)
 		goto out;
 	}
 
-	s->cmd_hdr = (struct btrfs_cmd_header *)s->read_buf;
+	s->cmd_hdr = (struct btrfs_cmd_header *)(s->buf + s->buf_pos);
 	cmd = le16_to_cpu(s->cmd_hdr->cmd);
 	cmd_len = le32_to_cpu(s->cmd_hdr->len);
 
-	data = s->read_buf + sizeof(*s->cmd_hdr);
-	ret = read_buf(s, data, cmd_len);
+	if (cmd_len > BTRFS_SEND_BUF_SIZE - sizeof(*s->cmd_hdr)) {
+		ret = -EINVAL;
+		fprintf(stderr, "ERROR: command too long. len = %u\n",
+				cmd_len);
+		goto out;
+	}
+
+	ret = fill_buf(s, sizeof(*s->cmd_hdr) + cmd_len);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -103,12 +157,18 @@ static int read_cmd(struct btrfs_send_stream *s)
 		fprintf(stderr, "ERROR: unexpected EOF in stream.\n");
 		goto out;
 	}
+	/* filling may have moved the buffered data */
+	s->cmd_hdr = (struct btrfs_cmd_header *)(s->buf + s->buf_pos);
+	data = (char *)(s->cmd_hdr + 1);
+	s->buf_pos += sizeof(*s->cmd_hdr) + cmd_len;
 
-	crc = le32_to_cpu(s->cmd_hdr->crc);
-	s->cmd_hdr->crc = 0;
+	/* the crc covers the header with a zeroed crc field */
+	memcpy(&hdr, s->cmd_hdr, sizeof(hdr));
+	crc = le32_to_cpu(hdr.crc);
+	hdr.crc = 0;
 
-	crc2 = crc32c(0, (unsigned char*)s->read_buf,
-			sizeof(*s->cmd_hdr) + cmd_len);
+	crc2 = crc32c(0, (unsigned char *)&hdr, sizeof(hdr));
+	crc2 = crc32c(crc2, (unsigned char *)data, cmd_len);
 
 	if (crc != crc2) {
 		ret = -EINVAL;
@@ -118,12 +178,18 @@ static int read_cmd(struct btrfs_send_stream *s)
 
 	pos = 0;
 	while (pos < cmd_len) {
+		if (cmd_len - pos < sizeof(*tlv_hdr)) {
+			fprintf(stderr, "ERROR: truncated tlv in cmd.\n");
+			ret = -EINVAL;
+			goto out;
+		}
 		tlv_hdr = (struct btrfs_tlv_header *)data;
 		tlv_type = le16_to_cpu(tlv_hdr->tlv_type);
 		tlv_len = le16_to_cpu(tlv_hdr->tlv_len);
 
 		if (tlv_type <= 0 || tlv_type > BTRFS_SEND_A_MAX ||
-		    tlv_len < 0 || tlv_len > BTRFS_SEND_BUF_SIZE) {
+		    tlv_len < 0 ||
+		    tlv_len > cmd_len - pos - sizeof(*tlv_hdr)) {
 			fprintf(stderr, "ERROR: invalid tlv in cmd. "
 					"tlv_type = %d, tlv_len = %d\n",
 					tlv_type, tlv_len);
@@ -138,6 +204,7 @@ static int read_cmd(struct btrfs_send_stream *s)
 	}
 
 	s->cmd = cmd;
+	s->cmd_len = sizeof(*s->cmd_hdr) + cmd_len;
 	ret = 0;
 
 out:
@@ -438,18 +505,111 @@ out:
 	return ret;
 }
 
-int btrfs_read_and_process_send_stream(int fd,
-				       struct btrfs_send_ops *ops, void *user)
+/*
+ * regular files are mapped, everything else goes through the read buffer.
+ * The stream starts at the current file position.
+ */
+struct btrfs_send_stream *btrfs_send_stream_open(int fd)
+{
+	struct btrfs_send_stream *s;
+	struct stat st;
+	off_t off;
+	void *map;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->fd = fd;
+
+	off = lseek(fd, 0, SEEK_CUR);
+	if (off >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	    st.st_size > off) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			s->buf = map;
+			s->buf_size = st.st_size;
+			s->buf_pos = off;
+			s->buf_end = st.st_size;
+			s->mapped = 1;
+			return s;
+		}
+	}
+
+	s->buf_size = BTRFS_STREAM_READ_SIZE + BTRFS_SEND_BUF_SIZE;
+	s->buf = malloc(s->buf_size);
+	if (!s->buf) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/*
+ * read the stream through read_fn, which behaves like read(2) on src.  For
+ * streams that need decoding before they can be parsed.
+ */
+struct btrfs_send_stream *btrfs_send_stream_open_reader(btrfs_send_read_fn
+							read_fn, void *src)
+{
+	struct btrfs_send_stream *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->fd = -1;
+	s->read = read_fn;
+	s->src = src;
+
+	s->buf_size = BTRFS_STREAM_READ_SIZE + BTRFS_SEND_BUF_SIZE;
+	s->buf = malloc(s->buf_size);
+	if (!s->buf) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/*
+ * leave a seekable fd positioned right after the data that was processed,
+ * whatever was read ahead of that is given back
+ */
+void btrfs_send_stream_close(struct btrfs_send_stream *s)
+{
+	if (!s)
+		return;
+	if (s->mapped) {
+		lseek(s->fd, s->buf_pos, SEEK_SET);
+		munmap(s->buf, s->buf_size);
+	} else {
+		if (!s->read)
+			lseek(s->fd, -(off_t)(s->buf_end - s->buf_pos),
+			      SEEK_CUR);
+		free(s->buf);
+	}
+	free(s);
+}
+
+/* size in the stream of the command whose callback is running */
+u32 btrfs_send_stream_cmd_len(struct btrfs_send_stream *s)
+{
+	return s->cmd_len;
+}
+
+/*
+ * process one stream, up to its end command.  Returns 1 when there are no
+ * more streams, the next call picks up the one that follows.
+ */
+int btrfs_send_stream_process(struct btrfs_send_stream *s,
+			      struct btrfs_send_ops *ops, void *user)
 {
 	int ret;
-	struct btrfs_send_stream s;
 	struct btrfs_stream_header hdr;
 
-	s.fd = fd;
-	s.ops = ops;
-	s.user = user;
+	s->ops = ops;
+	s->user = user;
 
-	ret = read_buf(&s, &hdr, sizeof(hdr));
+	ret = read_buf(s, &hdr, sizeof(hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -463,16 +623,16 @@ int btrfs_read_and_process_send_stream(int fd,
 		goto out;
 	}
 
-	s.version = le32_to_cpu(hdr.version);
-	if (s.version > BTRFS_SEND_STREAM_VERSION) {
+	s->version = le32_to_cpu(hdr.version);
+	if (s->version > BTRFS_SEND_STREAM_VERSION) {
 		ret = -EINVAL;
 		fprintf(stderr, "ERROR: Stream version %d not supported. "
-				"Please upgrade btrfs-progs\n", s.version);
+				"Please upgrade btrfs-progs\n", s->version);
 		goto out;
 	}
 
 	while (1) {
-		ret = read_and_process_cmd(&s);
+		ret = read_and_process_cmd(s);
 		if (ret < 0)
 			goto out;
 		if (ret) {
@@ -484,3 +644,17 @@ int btrfs_read_and_process_send_stream(int fd,
 out:
 	return ret;
 }
+
+int btrfs_read_and_process_send_stream(int fd,
+				       struct btrfs_send_ops *ops, void *user)
+{
+	struct btrfs_send_stream *s;
+	int ret;
+
+	s = btrfs_send_stream_open(fd);
+	if (!s)
+		return -ENOMEM;
+	ret = btrfs_send_stream_process(s, ops, user);
+	btrfs_send_stream_close(s);
+	return ret;
+}
@@ -56,6 +56,17 @@ struct btrfs_send_ops {
 	int (*update_extent)(const char *path, u64 offset, u64 len, void *user);
 };
 
+struct btrfs_send_stream;
+
+typedef ssize_t (*btrfs_send_read_fn)(void *src, void *buf, size_t len);
+
+struct btrfs_send_stream *btrfs_send_stream_open(int fd);
+struct btrfs_send_stream *btrfs_send_stream_open_reader(btrfs_send_read_fn
+							read_fn, void *src);
+void btrfs_send_stream_close(struct btrfs_send_stream *s);
+int btrfs_send_stream_process(struct btrfs_send_stream *s,
+			      struct btrfs_send_ops *ops, void *user);
+u32 btrfs_send_stream_cmd_len(struct btrfs_send_stream *s);
 int btrfs_read_and_process_send_stream(int fd,
 				       struct btrfs_send_ops *ops, void *user);
 
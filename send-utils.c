@@ -150,7 +150,8 @@ void subvol_uuid_search_add(struct subvol_uuid_search *s,
 	int cnt;
 
 	tree_insert(&s->root_id_subvols, si, subvol_search_by_root_id);
-	tree_insert(&s->path_subvols, si, subvol_search_by_path);
+	if (si->path)
+		tree_insert(&s->path_subvols, si, subvol_search_by_path);
 
 	cnt = count_bytes(si->uuid, BTRFS_UUID_SIZE, 0);
 	if (cnt != BTRFS_UUID_SIZE)
@@ -161,12 +162,107 @@ void subvol_uuid_search_add(struct subvol_uuid_search *s,
 				subvol_search_by_received_uuid);
 }
 
+/*
+ * the path of a subvolume's directory inside the root it is linked from,
+ * with a trailing '/' when it isn't the top of that root
+ */
+static char *lookup_dir_path(int mnt_fd, u64 treeid, u64 dirid)
+{
+	struct btrfs_ioctl_ino_lookup_args args;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	args.treeid = treeid;
+	args.objectid = dirid;
+
+	ret = ioctl(mnt_fd, BTRFS_IOC_INO_LOOKUP, &args);
+	if (ret < 0) {
+		if (errno != ENOENT)
+			fprintf(stderr, "ERROR: Failed to lookup path for "
+					"root %llu - %s\n",
+					(unsigned long long)treeid,
+					strerror(errno));
+		return NULL;
+	}
+	return strdup(args.name);
+}
+
+/*
+ * build the path of a subvolume relative to the mounted one, from its
+ * back reference and the paths of the subvolumes above it, which are
+ * resolved and remembered along the way.  Subvolumes that can't be
+ * reached get an empty path.
+ */
+static const char *resolve_subvol_path(struct subvol_uuid_search *s,
+				       struct subvol_info *si)
+{
+	struct subvol_info *parent;
+	const char *parent_path = NULL;
+	char *dir = NULL;
+	char *path = NULL;
+
+	if (si->path)
+		return si->path;
+	if (!si->ref_tree || !si->name)
+		goto out;
+
+	if (si->ref_tree != s->top_id &&
+	    si->ref_tree != BTRFS_FS_TREE_OBJECTID) {
+		parent = tree_search(&s->root_id_subvols, si->ref_tree, NULL,
+				     0, NULL, subvol_search_by_root_id);
+		if (!parent)
+			goto out;
+		parent_path = resolve_subvol_path(s, parent);
+		if (!parent_path[0])
+			goto out;
+	}
+
+	dir = lookup_dir_path(s->mnt_fd, si->ref_tree, si->dir_id);
+	if (!dir)
+		goto out;
+
+	path = malloc((parent_path ? strlen(parent_path) + 1 : 0) +
+		      strlen(dir) + strlen(si->name) + 1);
+	if (!path)
+		goto out;
+	sprintf(path, "%s%s%s%s", parent_path ? parent_path : "",
+		parent_path ? "/" : "", dir, si->name);
+
+out:
+	free(dir);
+	si->path = path ? path : strdup("");
+	if (si->path)
+		tree_insert(&s->path_subvols, si, subvol_search_by_path);
+	return si->path ? si->path : "";
+}
+
+/* searching by path needs the paths of all subvolumes */
+static void resolve_all_paths(struct subvol_uuid_search *s)
+{
+	struct rb_node *n;
+	struct subvol_info *si;
+
+	if (s->all_paths)
+		return;
+	for (n = rb_first(&s->root_id_subvols); n; n = rb_next(n)) {
+		si = rb_entry(n, struct subvol_info, rb_root_id_node);
+		resolve_subvol_path(s, si);
+	}
+	s->all_paths = 1;
+}
+
+/*
+ * subvolumes found by the initial scan get their path resolved the first
+ * time they are looked up
+ */
 struct subvol_info *subvol_uuid_search(struct subvol_uuid_search *s,
 				       u64 root_id, const u8 *uuid, u64 transid,
 				       const char *path,
 				       enum subvol_search_type type)
 {
 	struct rb_root *root;
+	struct subvol_info *si;
+
 	if (type == subvol_search_by_received_uuid)
 		root = &s->received_subvols;
 	else if (type == subvol_search_by_uuid)
@@ -177,9 +273,20 @@ struct subvol_info *subvol_uuid_search(struct subvol_uuid_search *s,
 		root = &s->path_subvols;
 	else
 		return NULL;
-	return tree_search(root, root_id, uuid, transid, path, type);
+
+	if (type == subvol_search_by_path)
+		resolve_all_paths(s);
+	si = tree_search(root, root_id, uuid, transid, path, type);
+	if (si)
+		resolve_subvol_path(s, si);
+	return si;
 }
 
+/*
+ * read the root items and back references of all subvolumes.  That's a
+ * single pass over the root tree; paths cost a few ioctls per subvolume
+ * and are only resolved for the subvolumes that are looked up.
+ */
 int subvol_uuid_search_init(int mnt_fd, struct subvol_uuid_search *s)
 {
 	int ret;
@@ -188,12 +295,15 @@ int subvol_uuid_search_init(int mnt_fd, struct subvol_uuid_search *s)
 	struct btrfs_ioctl_search_header *sh;
 	struct btrfs_root_item *root_item_ptr;
 	struct btrfs_root_item root_item;
+	struct btrfs_root_ref *ref;
 	struct subvol_info *si = NULL;
-	int root_item_valid = 0;
 	unsigned long off = 0;
+	int name_len;
 	int i;
 	int e;
-	char *path;
+
+	s->mnt_fd = mnt_fd;
+	s->top_id = btrfs_list_get_path_rootid(mnt_fd);
 
 	memset(&args, 0, sizeof(args));
 
@@ -230,35 +340,18 @@ int subvol_uuid_search_init(int mnt_fd, struct subvol_uuid_search *s)
 				goto skip;
 
 			if (sh->type == BTRFS_ROOT_ITEM_KEY) {
+				si = NULL;
 				/* older kernels don't have uuids+times */
-				if (sh->len < sizeof(root_item)) {
-					root_item_valid = 0;
+				if (sh->len < sizeof(root_item))
 					goto skip;
-				}
 				root_item_ptr = (struct btrfs_root_item *)
 						(args.buf + off);
 				memcpy(&root_item, root_item_ptr,
 						sizeof(root_item));
-				root_item_valid = 1;
-			} else if (sh->type == BTRFS_ROOT_BACKREF_KEY ||
-				   root_item_valid) {
-				if (!root_item_valid)
-					goto skip;
-
-				path = btrfs_list_path_for_root(mnt_fd,
-								sh->objectid);
-				if (!path)
-					path = strdup("");
-				if (IS_ERR(path)) {
-					ret = PTR_ERR(path);
-					fprintf(stderr, "ERROR: unable to "
-							"resolve path "
-							"for root %llu\n",
-							sh->objectid);
-					goto out;
-				}
 
 				si = calloc(1, sizeof(*si));
+				if (!si)
+					return -ENOMEM;
 				si->root_id = sh->objectid;
 				memcpy(si->uuid, root_item.uuid,
 						BTRFS_UUID_SIZE);
@@ -271,11 +364,19 @@ int subvol_uuid_search_init(int mnt_fd, struct subvol_uuid_search *s)
 				si->otransid = btrfs_root_otransid(&root_item);
 				si->stransid = btrfs_root_stransid(&root_item);
 				si->rtransid = btrfs_root_rtransid(&root_item);
-				si->path = path;
 				subvol_uuid_search_add(s, si);
-				root_item_valid = 0;
-			} else {
-				goto skip;
+			} else if (sh->type == BTRFS_ROOT_BACKREF_KEY &&
+				   si && si->root_id == sh->objectid &&
+				   !si->name) {
+				ref = (struct btrfs_root_ref *)(args.buf + off);
+				name_len = btrfs_stack_root_ref_name_len(ref);
+				si->name = malloc(name_len + 1);
+				if (!si->name)
+					return -ENOMEM;
+				memcpy(si->name, ref + 1, name_len);
+				si->name[name_len] = 0;
+				si->ref_tree = sh->offset;
+				si->dir_id = btrfs_stack_root_ref_dirid(ref);
 			}
 
 skip:
@@ -300,8 +401,7 @@ skip:
 			break;
 	}
 
-out:
-	return ret;
+	return 0;
 }
 
 
@@ -47,6 +47,11 @@ struct subvol_info {
 	u64 rtransid;
 
 	char *path;
+
+	/* where the subvolume is linked, for resolving path on demand */
+	u64 ref_tree;
+	u64 dir_id;
+	char *name;
 };
 
 struct subvol_uuid_search {
@@ -54,6 +59,11 @@ struct subvol_uuid_search {
 	struct rb_root local_subvols;
 	struct rb_root received_subvols;
 	struct rb_root path_subvols;
+
+	int mnt_fd;
+	u64 top_id;
+	/* every subvolume's path has been resolved */
+	int all_paths;
 };
 
 int subvol_uuid_search_init(int mnt_fd, struct subvol_uuid_search *s);
@@ -0,0 +1,4 @@
+#ifndef __BUILD_VERSION
+#define __BUILD_VERSION
+#define BTRFS_BUILD_VERSION "Btrfs v0.20-rc1-dirty"
+#endif